@@ -0,0 +1,113 @@
+#ifndef ANALYSISSERVICE_H
+#define ANALYSISSERVICE_H
+
+#include "tonatiuhreader.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+class WorkStealingPool;
+
+// Settings of a long-running AnalysisService (the sttd daemon)
+struct ServiceOptions
+{
+    unsigned      threads       = 0;            // worker pool shared by all queries; 0 = all hardware threads
+    std::uint64_t memoryBytes   = 1ull << 30;   // budget for the surface tables, datasets and results kept
+    fs::path      datasetDirectory;             // where photon caches of folders are built (empty = none are built)
+    ReaderBackend readerBackend = ReaderBackend::Mmap;
+    std::uint64_t chunkBytes    = 64ull << 20;
+};
+
+// Answers matrix and flux queries on photon folders and keeps what it read for
+// the next ones, in one least-recently-used list bounded by
+// ServiceOptions::memoryBytes:
+//  - surface tables: the parsed photons_parameters.txt and SurfaceMap of a
+//    folder, re-read when the file changes;
+//  - datasets: a mapped photon cache of a folder (its photons_cache.sttc, or
+//    one built in ServiceOptions::datasetDirectory the second time the folder
+//    is read from the beginning, removed when evicted), read instead of the
+//    photon files by queries that have no result for the folder yet;
+//  - results: a PhotonProcessor per folder and query settings. A repeated query
+//    only reads the photons added since the last one.
+//
+// Requests, one per line; FOLDER is the rest of the line and may hold spaces:
+//   matrix [--standard-errors] FOLDER
+//   flux --flux-range U0:U1,V0:V1 [--flux-plane xy|xz|yz] [--flux-bins NUxNV]
+//        [--flux-per-heliostat] [--binary] FOLDER
+//   status                 entries kept and memory used
+//   forget FOLDER          drops everything kept for the folder
+// A matrix reply is the matrix CSV; a flux reply the flux map CSV, or the flux
+// map file of FluxMap::write() with --binary.
+class AnalysisService
+{
+public:
+    struct Reply
+    {
+        bool        ok = false;
+        std::string body;     // the result, or the error message
+    };
+
+    explicit AnalysisService(const ServiceOptions& options);
+    ~AnalysisService();
+
+    AnalysisService(const AnalysisService&) = delete;
+    AnalysisService& operator=(const AnalysisService&) = delete;
+
+    // Answers requests that arrived together, in order. The photons they need are
+    // read in one pass over the service's pool, once per distinct query. Not
+    // thread-safe: call from one thread.
+    std::vector<Reply> answer(const std::vector<std::string>& requests);
+
+    std::uint64_t memoryUsed() const { return m_bytes; }
+
+private:
+    struct Query;
+    struct Surfaces;
+    struct Dataset;
+    struct Result;
+
+    // One kept item; exactly one of the pointers is set
+    struct Entry
+    {
+        std::string               key;
+        std::string               folder;
+        std::uint64_t             bytes = 0;
+        std::uint64_t             hits  = 0;
+        std::shared_ptr<Surfaces> surfaces;
+        std::shared_ptr<Dataset>  dataset;
+        std::shared_ptr<Result>   result;
+    };
+    using EntryList = std::list<Entry>;
+
+    std::shared_ptr<Surfaces> surfacesFor(const std::string& folder);
+    std::shared_ptr<Result>   resultFor(const Query& query, const std::shared_ptr<Surfaces>& surfaces);
+    std::shared_ptr<Dataset>  datasetFor(const Surfaces& surfaces, bool build);
+    void run(const std::vector<Result*>& results, std::vector<std::string>& errors);
+    std::string render(const Query& query, const Result& result) const;
+    std::string status() const;
+
+    // The entry of `key`, moved to the front (null if none)
+    Entry* find(const std::string& key);
+    Entry& insert(Entry entry);
+    std::size_t forget(const std::string& folder);
+    void erase(EntryList::iterator it);
+    void evict();
+
+    ServiceOptions m_options;
+    std::unique_ptr<WorkStealingPool> m_pool;   // its threads wait between requests
+    EntryList      m_entries;   // most recently used first
+    std::unordered_map<std::string, EntryList::iterator> m_index;
+    std::uint64_t  m_bytes = 0;
+    std::uint64_t  m_queries = 0;
+    std::uint64_t  m_evictions = 0;
+};
+
+#endif // ANALYSISSERVICE_H
@@ -0,0 +1,132 @@
+#ifndef ANALYZER_H
+#define ANALYZER_H
+
+#include "PhotonBlock.h"
+#include "RayFragment.h"
+#include "SurfaceMap.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct ProcessingOptions;
+
+// Rays that end inside one decoded block (and started inside the same worker's
+// range), as found by the ray loop. Entry k describes the ray whose last photon
+// is block->photon(last[k]).
+struct RayEnds
+{
+    const PhotonBlock*   block = nullptr;
+    std::size_t          count = 0;
+    const std::uint32_t* last = nullptr;                // index of the last photon in block
+    const std::uint32_t* length = nullptr;              // photons in the ray
+    const std::uint64_t* penultimateSurface = nullptr;  // surface_id of the photon before the last (length >= 2)
+};
+
+// Per-worker state of an analysis module. The ray loop feeds it every decoded
+// block and the rays completed in it; rays cut by range edges are stitched after
+// the worker states have been merged and reach only the merged state.
+class AnalyzerState
+{
+public:
+    virtual ~AnalyzerState() = default;
+
+    // Every decoded block, in stream order, before its onRayEnds().
+    virtual void onBlock(const PhotonBlock& /*block*/) {}
+
+    // Rays that end in the last block passed to onBlock().
+    virtual void onRayEnds(const RayEnds& /*ends*/) {}
+
+    // The photons of a complete ray, in order (only for modules whose
+    // Analyzer::needsRays() is true).
+    virtual void onRay(const PhotonInfo* /*photons*/, std::size_t /*length*/) {}
+
+    // A ray stitched across range edges. photons holds all of its photons when
+    // Analyzer::needsRays() is true, and is null otherwise.
+    virtual void onStitchedRay(const RayFragment& /*ray*/, const PhotonInfo* /*photons*/) {}
+
+    // Called on each worker state after its last block and on the merged state
+    // after the stitched rays (may be called more than once).
+    virtual void finish() {}
+
+    // Adds the (finished) result of another worker of the same module.
+    virtual void merge(const AnalyzerState& other) = 0;
+
+    // Checkpoints: save() writes the finished state, load() restores it into a
+    // fresh state of the same module and settings. false when the module cannot
+    // be checkpointed or the saved state does not fit (e.g. other flux bins).
+    virtual bool save(std::ostream& /*out*/) const { return false; }
+    virtual bool load(std::istream& /*in*/) { return false; }
+};
+
+// Everything a module may need to know about the run.
+struct AnalyzerContext
+{
+    const SurfaceMap&        surfaceMap;
+    double                   powerPerPhoton;
+    const ProcessingOptions& options;
+    std::string              outputPath;   // where write() puts the result
+};
+
+// An analysis over the photon stream. All enabled modules share one pass over
+// the data; each worker owns one state per module.
+class Analyzer
+{
+public:
+    explicit Analyzer(const AnalyzerContext& context) : m_context(context) {}
+    virtual ~Analyzer() = default;
+
+    virtual const char* name() const = 0;
+
+    // PhotonBlock fields the module reads besides side, next_id and surface_id
+    // (sources that can skip columns, like the photon cache, load only these).
+    virtual unsigned requiredFields() const { return 0; }
+
+    // True to receive fully assembled rays through onRay()/onStitchedRay().
+    virtual bool needsRays() const { return false; }
+
+    virtual std::unique_ptr<AnalyzerState> createState() const = 0;
+
+    // Writes the merged result to outputPath(); false if it cannot be written.
+    virtual bool write(const AnalyzerState& merged) const = 0;
+
+    const std::string& outputPath() const { return m_context.outputPath; }
+
+protected:
+    AnalyzerContext m_context;
+};
+
+// Modules by name. The built-in ones ("matrix", "flux", "bounces", "images",
+// "export") are registered on first use; add() more before processing starts.
+class AnalyzerRegistry
+{
+public:
+    using Factory = std::function<std::unique_ptr<Analyzer>(const AnalyzerContext&)>;
+
+    static AnalyzerRegistry& instance();
+
+    void add(const std::string& name, const std::string& description, Factory factory);
+
+    // nullptr when no module has that name
+    std::unique_ptr<Analyzer> create(const std::string& name, const AnalyzerContext& context) const;
+
+    // (name, description) pairs in name order
+    std::vector<std::pair<std::string, std::string>> list() const;
+
+private:
+    AnalyzerRegistry();
+
+    struct Entry
+    {
+        std::string description;
+        Factory     factory;
+    };
+    std::map<std::string, Entry> m_entries;
+};
+
+#endif // ANALYZER_H
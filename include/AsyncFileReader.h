@@ -0,0 +1,112 @@
+#ifndef ASYNCFILEREADER_H
+#define ASYNCFILEREADER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct PhotonFileChunk;
+
+struct AsyncReadOptions
+{
+    unsigned    queueDepth  = 8;          // reads kept in flight (= buffers in the pool)
+    std::size_t bufferBytes = 4u << 20;   // bytes per read; rounded to whole records and pages
+    bool        directIo    = false;      // O_DIRECT where supported (bypasses the page cache)
+};
+
+// Reads a sequence of file ranges into a fixed ring of aligned buffers while the
+// caller decodes earlier ones. Uses io_uring when built with liburing, otherwise
+// a small set of pread threads. Buffers are delivered strictly in range order.
+// More ranges can be appended as earlier ones are read, keeping the buffers and
+// I/O threads (e.g. one reader per worker for all its chunks).
+class AsyncFileReader
+{
+public:
+    struct Buffer
+    {
+        const unsigned char* data = nullptr;
+        std::size_t size = 0;
+        std::size_t range = 0;        // index into the ranges given so far
+        bool lastOfRange = false;
+    };
+
+    // A reader given no ranges keeps options.queueDepth buffers for append()
+    AsyncFileReader(const std::vector<PhotonFileChunk>& ranges, const AsyncReadOptions& options);
+    ~AsyncFileReader();
+
+    AsyncFileReader(const AsyncFileReader&) = delete;
+    AsyncFileReader& operator=(const AsyncFileReader&) = delete;
+
+    // Queues ranges after those given so far; returns the index of the first.
+    std::size_t append(const std::vector<PhotonFileChunk>& ranges);
+
+    // Drops the reads not delivered yet (waiting for those in flight) and the
+    // buffer the caller holds.
+    void cancel();
+
+    // Returns the next filled buffer (recycling the previous one); false at the
+    // end, or when the next buffer is of range endRange or later (it is kept).
+    // Throws std::runtime_error on I/O errors.
+    bool next(Buffer& out, std::size_t endRange = ~std::size_t{0});
+
+    // Name of the I/O engine in use ("io_uring" or "pread")
+    const char* engine() const;
+
+private:
+    struct Request
+    {
+        std::size_t   range;
+        std::uint64_t offset;   // logical file offset of the first byte wanted
+        std::size_t   length;   // bytes wanted
+        bool          lastOfRange;
+    };
+
+    struct Slot;
+
+    struct OpenFile
+    {
+        std::intptr_t handle = -1;     // fd, or HANDLE on Windows
+        bool          opened = false;
+    };
+
+    void planRequests(const std::vector<PhotonFileChunk>& ranges);
+    void prepare(Slot& slot, std::uint64_t seq);   // under m_mutex: the read of request seq
+    int  fileFor(std::size_t range);
+    void releaseFile(std::size_t range);
+    void releaseHeld();
+    void readInto(Slot& slot, std::size_t alreadyRead);  // blocking positional read
+    void ioThread();
+    bool initRing();
+    void submitPending();                          // io_uring: fill free slots
+    void reapUntilReady(Slot& slot);               // io_uring: wait for completions
+
+    AsyncReadOptions m_options;
+    std::size_t m_alignment = 1;
+    std::vector<fs::path> m_paths;                 // per range
+    std::vector<Request> m_requests;
+    std::vector<std::unique_ptr<Slot>> m_slots;
+    std::vector<OpenFile> m_files;                 // per range, opened lazily
+
+    // Requests, ranges and files are appended under m_mutex; reads outside it
+    // only use what prepare() put in their slot
+    std::uint64_t m_next_submit = 0;   // next request to start reading
+    std::uint64_t m_next_deliver = 0;  // next request to hand to the caller
+    bool m_holding = false;            // caller holds slot of m_next_deliver - 1
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_stop = false;
+    std::vector<std::thread> m_threads;
+
+    struct Ring;
+    std::unique_ptr<Ring> m_ring;      // io_uring state (liburing builds only)
+};
+
+#endif // ASYNCFILEREADER_H
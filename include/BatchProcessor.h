@@ -0,0 +1,50 @@
+#ifndef BATCHPROCESSOR_H
+#define BATCHPROCESSOR_H
+
+#include "ProcessingOptions.h"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// One photon folder of a batch (e.g. one sun position of an annual study) and
+// its weight in the annual sum (e.g. DNI x hours).
+struct Scenario
+{
+    std::string name;     // unique within the batch; names its CSV
+    fs::path    folder;
+    double      weight = 1.0;
+};
+
+// Reads a batch manifest: one scenario per line, "<folder> [weight]", with
+// blank lines and '#' comments ignored. A trailing number is the weight
+// (default 1); relative folders are relative to the manifest. Scenarios are
+// named after their folder, with a numeric suffix when two folders share a name.
+// Throws std::runtime_error, with the line number, on a bad line.
+std::vector<Scenario> readManifest(const fs::path& manifest);
+
+// Processes the folders of a batch in one run: parameters are read once per
+// folder, folders with identical surface lists share one SurfaceMap, and the
+// photon files of all folders are scheduled on a single worker pool.
+class BatchProcessor
+{
+public:
+    static constexpr const char* kAnnualCsv = "annual_matrix.csv";
+
+    // Options apply to every folder (analysis modules are not supported)
+    BatchProcessor(std::vector<Scenario> scenarios, const ProcessingOptions& options);
+
+    // Writes <outputFolder>/<scenario name>.csv for every scenario and
+    // <outputFolder>/annual_matrix.csv, the weighted sum of their power matrices.
+    // Throws std::runtime_error if a folder cannot be read; returns false if an
+    // output could not be written.
+    bool run(const fs::path& outputFolder);
+
+private:
+    std::vector<Scenario> m_scenarios;
+    ProcessingOptions m_options;
+};
+
+#endif // BATCHPROCESSOR_H
\ No newline at end of file
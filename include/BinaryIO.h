@@ -0,0 +1,122 @@
+#ifndef BINARYIO_H
+#define BINARYIO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Little-endian scalars, strings and arrays for the binary files written by the
+// tool (flux maps, checkpoints). Readers return false on a short read.
+
+// File names: the output format (and compression) goes by the extension
+inline bool endsWith(const std::string& s, const std::string& suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+template <typename T>
+void putLittleEndian(std::ostream& out, T value)
+{
+    static_assert(std::is_integral<T>::value, "integers only");
+    const auto bits = static_cast<std::make_unsigned_t<T>>(value);
+    unsigned char bytes[sizeof(T)];
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        bytes[i] = static_cast<unsigned char>(bits >> (8 * i));
+    out.write(reinterpret_cast<const char*>(bytes), sizeof(T));
+}
+
+template <typename T>
+bool getLittleEndian(std::istream& in, T& value)
+{
+    static_assert(std::is_integral<T>::value, "integers only");
+    unsigned char bytes[sizeof(T)];
+    if (!in.read(reinterpret_cast<char*>(bytes), sizeof(T))) return false;
+    std::make_unsigned_t<T> bits = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        bits |= static_cast<std::make_unsigned_t<T>>(static_cast<std::make_unsigned_t<T>>(bytes[i]) << (8 * i));
+    value = static_cast<T>(bits);
+    return true;
+}
+
+inline void putDouble(std::ostream& out, double value)
+{
+    std::uint64_t bits;
+    static_assert(sizeof bits == sizeof value, "64-bit doubles expected");
+    std::memcpy(&bits, &value, sizeof bits);
+    putLittleEndian(out, bits);
+}
+
+inline bool getDouble(std::istream& in, double& value)
+{
+    std::uint64_t bits;
+    if (!getLittleEndian(in, bits)) return false;
+    std::memcpy(&value, &bits, sizeof value);
+    return true;
+}
+
+// The same scalars stored into a byte buffer (record writers)
+template <typename T>
+void storeLittleEndian(unsigned char* out, T value)
+{
+    static_assert(std::is_integral<T>::value, "integers only");
+    const auto bits = static_cast<std::make_unsigned_t<T>>(value);
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        out[i] = static_cast<unsigned char>(bits >> (8 * i));
+}
+
+inline void storeDouble(unsigned char* out, double value)
+{
+    std::uint64_t bits;
+    std::memcpy(&bits, &value, sizeof bits);
+    storeLittleEndian(out, bits);
+}
+
+// u16 length + bytes (longer strings are cut)
+inline void putString(std::ostream& out, const std::string& s)
+{
+    const std::uint16_t n = static_cast<std::uint16_t>(s.size() < 0xFFFF ? s.size() : 0xFFFF);
+    putLittleEndian(out, n);
+    out.write(s.data(), n);
+}
+
+inline bool getString(std::istream& in, std::string& s)
+{
+    std::uint16_t n;
+    if (!getLittleEndian(in, n)) return false;
+    s.resize(n);
+    return n == 0 || static_cast<bool>(in.read(&s[0], n));
+}
+
+// u64 count + values
+inline void putCounts(std::ostream& out, const std::uint64_t* values, std::size_t count)
+{
+    putLittleEndian(out, static_cast<std::uint64_t>(count));
+    std::vector<unsigned char> bytes(count * sizeof(std::uint64_t));
+    for (std::size_t i = 0; i < count; ++i)
+        for (std::size_t b = 0; b < sizeof(std::uint64_t); ++b)
+            bytes[i * sizeof(std::uint64_t) + b] = static_cast<unsigned char>(values[i] >> (8 * b));
+    out.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+}
+
+// Reads what putCounts wrote; false unless exactly `count` values are stored.
+inline bool getCounts(std::istream& in, std::uint64_t* values, std::size_t count)
+{
+    std::uint64_t stored;
+    if (!getLittleEndian(in, stored) || stored != count) return false;
+    std::vector<unsigned char> bytes(count * sizeof(std::uint64_t));
+    if (!in.read(reinterpret_cast<char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()))) return false;
+    for (std::size_t i = 0; i < count; ++i) {
+        std::uint64_t v = 0;
+        for (std::size_t b = 0; b < sizeof(std::uint64_t); ++b)
+            v |= static_cast<std::uint64_t>(bytes[i * sizeof(std::uint64_t) + b]) << (8 * b);
+        values[i] = v;
+    }
+    return true;
+}
+
+#endif // BINARYIO_H
@@ -0,0 +1,47 @@
+#ifndef BOUNCEANALYZER_H
+#define BOUNCEANALYZER_H
+
+#include "Analyzer.h"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// Rays by number of heliostat reflections and by where they end: the state of
+// the "bounces" module. Works on fully assembled rays.
+struct BounceCounts : AnalyzerState
+{
+    enum Outcome { ReceiverFront, ReceiverBack, Heliostat, Other, kOutcomeCount };
+    static constexpr std::size_t kMaxReflections = 16; // last row collects 16 and more
+
+    explicit BounceCounts(const SurfaceMap& surfaceMap_) : surfaceMap(&surfaceMap_), rows(kMaxReflections + 1) {}
+
+    const SurfaceMap* surfaceMap;
+    std::vector<std::array<std::uint64_t, kOutcomeCount>> rows; // [reflections][outcome]
+
+    void onRay(const PhotonInfo* photons, std::size_t length) override;
+    void onStitchedRay(const RayFragment& ray, const PhotonInfo* photons) override
+    {
+        if (photons) onRay(photons, ray.length);
+    }
+    void merge(const AnalyzerState& other) override;
+    bool save(std::ostream& out) const override;
+    bool load(std::istream& in) override;
+};
+
+// The "bounces" module: CSV of ray counts per reflection count and outcome
+class BounceAnalyzer : public Analyzer
+{
+public:
+    using Analyzer::Analyzer;
+
+    const char* name() const override { return "bounces"; }
+    bool needsRays() const override { return true; }
+    std::unique_ptr<AnalyzerState> createState() const override
+    {
+        return std::make_unique<BounceCounts>(m_context.surfaceMap);
+    }
+    bool write(const AnalyzerState& merged) const override;
+};
+
+#endif // BOUNCEANALYZER_H
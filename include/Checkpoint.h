@@ -0,0 +1,54 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// A photon file as it was when (part of) it was consumed.
+struct ConsumedFile
+{
+    std::string   name;      // file name within the folder
+    std::uint64_t size  = 0;
+    std::int64_t  mtime = 0; // last_write_time ticks
+
+    // The file as it is now
+    static ConsumedFile describe(const fs::directory_entry& entry);
+};
+
+// How far an incremental run got through a folder, and the module states at that
+// point (see PhotonProcessor::update()). Every file in `files` but the last was
+// consumed completely; the last one up to `offset`, the byte after the last ray
+// end (uncompressed bytes for a compressed file; ~0 when it was read to its end).
+// Photons past that point belong to a ray that was still open and are read again
+// on resume.
+struct StreamPosition
+{
+    std::vector<ConsumedFile> files;  // in stream order
+    std::uint64_t             offset = 0;
+
+    bool empty() const { return files.empty(); }
+};
+
+// Checkpoint file (little-endian binary, written atomically):
+//   char[8] "STTCKPT1", u64 parameters fingerprint,
+//   u32 file count, per file: u16 + name, u64 size, i64 mtime; u64 offset,
+//   u32 module count, per module: u16 + name, u64 + bytes of AnalyzerState::save()
+struct Checkpoint
+{
+    std::uint64_t  fingerprint = 0;
+    StreamPosition position;
+    std::vector<std::pair<std::string, std::string>> states; // module name, saved state
+
+    // false if the file cannot be written
+    bool save(const fs::path& path) const;
+
+    // false if the file is missing, truncated or not a checkpoint
+    bool load(const fs::path& path);
+};
+
+#endif // CHECKPOINT_H
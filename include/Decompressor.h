@@ -0,0 +1,76 @@
+#ifndef DECOMPRESSOR_H
+#define DECOMPRESSOR_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// How a photon file is stored, from its name: photons_N.dat, photons_N.dat.gz
+// or photons_N.dat.zst.
+enum class Compression { None, Gzip, Zstd };
+
+Compression compressionOf(const fs::path& path);
+const char* compressionName(Compression compression);
+
+// Whether this build can read the format (zlib / libzstd found at configure time)
+bool compressionSupported(Compression compression);
+
+// Inflates one compressed photon file on a background thread into a small ring
+// of buffers, so decompression overlaps with decoding on the calling thread;
+// workers reading different files decompress in parallel. Concatenated gzip
+// members and multi-frame zstd files are read as one stream.
+class Decompressor
+{
+public:
+    struct Buffer
+    {
+        const unsigned char* data = nullptr;
+        std::size_t size = 0;     // a whole number of photon records, except in the last buffer
+    };
+
+    // Delivers the uncompressed bytes from `skip` to the end of the file, in
+    // buffers of whole records of recordBytes.
+    Decompressor(const fs::path& path, Compression compression, std::uint64_t skip = 0,
+                 std::size_t bufferBytes = 1u << 20, unsigned depth = 3,
+                 std::size_t recordBytes = 8 * sizeof(double));
+    ~Decompressor();
+
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+
+    // Returns the next buffer (recycling the previous one); false at the end.
+    // Throws std::runtime_error if the file cannot be read or is corrupt.
+    bool next(Buffer& out);
+
+private:
+    void run();
+
+    fs::path      m_path;
+    Compression   m_compression;
+    std::uint64_t m_skip;
+
+    std::vector<std::unique_ptr<unsigned char[]>> m_slots;
+    std::size_t              m_slotBytes = 0;
+    std::vector<std::size_t> m_sizes;   // bytes filled, per slot
+
+    std::uint64_t m_produced  = 0;      // buffers filled by the thread
+    std::uint64_t m_delivered = 0;      // buffers handed to the caller
+    bool m_holding = false;             // caller holds slot m_delivered - 1
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_done = false;
+    bool m_stop = false;
+    std::exception_ptr m_error;
+    std::thread m_thread;
+};
+
+#endif // DECOMPRESSOR_H
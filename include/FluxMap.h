@@ -0,0 +1,120 @@
+#ifndef FLUXMAP_H
+#define FLUXMAP_H
+
+#include "Analyzer.h"
+#include "SurfaceMap.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Plane the receiver hits are projected on: the two kept coordinates are (u, v).
+enum class FluxPlane { XY, XZ, YZ };
+
+struct FluxMapOptions
+{
+    FluxPlane   plane = FluxPlane::XZ;
+    std::size_t binsU = 100;
+    std::size_t binsV = 100;
+    double      minU = 0.0, maxU = 0.0;   // grid extent; hits outside are only counted
+    double      minV = 0.0, maxV = 0.0;
+    bool        perHeliostat = false;     // one map per heliostat x receiver instead of per receiver
+};
+
+// 2D histograms of the hits counted in the heliostat x receiver matrix (last
+// photon of the ray, side == 1), one per receiver label or per heliostat x
+// receiver pair: the state of the "flux" module. Each worker owns a FluxMap;
+// hits are staged and binned in batches (a branch-free index pass followed by
+// the increments), and tiles are merged at the end like RayAccumulator.
+class FluxMap : public AnalyzerState
+{
+public:
+    FluxMap(const SurfaceMap& surfaceMap, const FluxMapOptions& options);
+
+    // Records the arrival of a ray from heliostat surface heliostatID on receiver
+    // surface receiverID at (x, y, z) if the pair is classified and side == 1.
+    void addRay(std::size_t length, std::uint64_t heliostatID, std::uint64_t receiverID, int arrivalSide,
+                double x, double y, double z)
+    {
+        if (length < 2 || arrivalSide != 1) return;
+        const std::int32_t h = m_surfaceMap->heliostatIndex(heliostatID);
+        const std::int32_t r = m_surfaceMap->receiverIndex(receiverID);
+        if (h == SurfaceMap::kNoIndex || r == SurfaceMap::kNoIndex) return;
+
+        std::size_t map = static_cast<std::size_t>(r);
+        if (m_options.perHeliostat) map += static_cast<std::size_t>(h) * m_receiverCount;
+
+        const double coords[3] = { x, y, z };
+        m_stagedU[m_staged]   = coords[m_axisU];
+        m_stagedV[m_staged]   = coords[m_axisV];
+        m_stagedMap[m_staged] = map;
+        if (++m_staged == kStageSize) flush();
+    }
+
+    void onRayEnds(const RayEnds& ends) override;
+    void onStitchedRay(const RayFragment& ray, const PhotonInfo* photons) override;
+
+    // Bins the staged hits
+    void finish() override { flush(); }
+    void flush();
+
+    // Adds another (finished) tile with the same layout.
+    void merge(const AnalyzerState& other) override;
+
+    // The grid settings are saved too; load() fails unless they match.
+    bool save(std::ostream& out) const override;
+    bool load(std::istream& in) override;
+
+    // Writes the maps scaled by powerPerPhoton: a CSV grid per map when the file
+    // name ends in ".csv", otherwise a flux map file (little-endian binary):
+    //   char[8] "STTFLUX1", u32 plane (0 = xy, 1 = xz, 2 = yz), u32 binsU, binsV,
+    //   u32 map count, f64 minU, maxU, minV, maxV, f64 power per photon,
+    //   per map: u16 + receiver label, u16 + heliostat label ("" = all),
+    //   u64 hits outside the grid, u64 counts[binsV][binsU]
+    // whose counts are photons (times the power per photon for power per bin).
+    // Returns false if the file cannot be written.
+    bool write(const std::string& path, double powerPerPhoton) const;
+
+    // The same formats, to a stream
+    void writeCsv(std::ostream& out, double powerPerPhoton) const;
+    void writeBinary(std::ostream& out, double powerPerPhoton) const;
+
+    static bool parsePlane(const std::string& text, FluxPlane& plane);
+    static const char* planeName(FluxPlane plane);
+
+private:
+    static constexpr std::size_t kStageSize = 1024;
+
+    std::string heliostatLabel(std::size_t map) const;
+
+    const SurfaceMap* m_surfaceMap;
+    FluxMapOptions m_options;
+    std::size_t m_receiverCount;
+    std::size_t m_mapCount;
+    int m_axisU, m_axisV;
+    double m_scaleU, m_scaleV;            // bins per unit length
+
+    std::vector<std::uint64_t> m_counts;  // [map][v][u]
+    std::vector<std::uint64_t> m_outside; // per map: hits outside the grid
+
+    std::size_t m_staged = 0;
+    std::vector<double> m_stagedU, m_stagedV;
+    std::vector<std::size_t> m_stagedMap;
+    std::vector<std::int64_t> m_stagedBin;
+};
+
+// The "flux" module (grid from ProcessingOptions::fluxMap)
+class FluxAnalyzer : public Analyzer
+{
+public:
+    using Analyzer::Analyzer;
+
+    const char* name() const override { return "flux"; }
+    unsigned requiredFields() const override { return kFieldX | kFieldY | kFieldZ; }
+    std::unique_ptr<AnalyzerState> createState() const override;
+    bool write(const AnalyzerState& merged) const override;
+};
+
+#endif // FLUXMAP_H
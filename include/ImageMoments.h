@@ -0,0 +1,106 @@
+#ifndef IMAGEMOMENTS_H
+#define IMAGEMOMENTS_H
+
+#include "Analyzer.h"
+#include "SurfaceMap.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Centroid and spread of the image each heliostat casts on each receiver: per
+// heliostat x receiver cell, the number of counted rays and the mean and
+// co-moments (sums of products of deviations from the mean) of their last
+// photon's x, y, z. The state of the "images" module.
+//
+// Cells are updated one photon at a time with Welford's formulas and tiles are
+// combined with the pairwise formulas of Chan et al., so no large sums of
+// squares are ever subtracted. The counts are exact for any thread count; the
+// moments may differ in the last bits, as the tiles are merged in another order.
+class ImageMoments : public AnalyzerState
+{
+public:
+    // Co-moment components, in storage order
+    enum Component { XX, YY, ZZ, XY, XZ, YZ, kComponentCount };
+
+    struct Cell
+    {
+        std::uint64_t count = 0;
+        double mean[3] = { 0.0, 0.0, 0.0 };
+        double m2[kComponentCount] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+    };
+
+    explicit ImageMoments(const SurfaceMap& surfaceMap);
+
+    // Records the arrival of a ray from heliostat surface heliostatID on receiver
+    // surface receiverID at (x, y, z) if the pair is classified and side == 1.
+    void addRay(std::size_t length, std::uint64_t heliostatID, std::uint64_t receiverID, int arrivalSide,
+                double x, double y, double z)
+    {
+        if (length < 2 || arrivalSide != 1) return;
+        const std::int32_t h = m_surfaceMap->heliostatIndex(heliostatID);
+        const std::int32_t r = m_surfaceMap->receiverIndex(receiverID);
+        if (h == SurfaceMap::kNoIndex || r == SurfaceMap::kNoIndex) return;
+
+        Cell& cell = m_cells[static_cast<std::size_t>(h) * m_receiverCount + static_cast<std::size_t>(r)];
+        const double inverse = 1.0 / static_cast<double>(++cell.count);
+        const double d[3] = { x - cell.mean[0], y - cell.mean[1], z - cell.mean[2] };
+        cell.mean[0] += d[0] * inverse;
+        cell.mean[1] += d[1] * inverse;
+        cell.mean[2] += d[2] * inverse;
+        const double e[3] = { x - cell.mean[0], y - cell.mean[1], z - cell.mean[2] };
+        cell.m2[XX] += d[0] * e[0];
+        cell.m2[YY] += d[1] * e[1];
+        cell.m2[ZZ] += d[2] * e[2];
+        cell.m2[XY] += d[0] * e[1];
+        cell.m2[XZ] += d[0] * e[2];
+        cell.m2[YZ] += d[1] * e[2];
+    }
+
+    void onRayEnds(const RayEnds& ends) override;
+    void onStitchedRay(const RayFragment& ray, const PhotonInfo* photons) override;
+
+    // Adds another tile with the same surfaces.
+    void merge(const AnalyzerState& other) override;
+
+    bool save(std::ostream& out) const override;
+    bool load(std::istream& in) override;
+
+    // Writes one row per cell that received rays, with the power scaled by
+    // powerPerPhoton: CSV when the file name ends in ".csv", otherwise an image
+    // moments file (little-endian binary):
+    //   char[8] "STTIMGS1", u32 heliostat count, receiver count, row count,
+    //   f64 power per photon,
+    //   per row: u16 + heliostat label, u16 + receiver label, u64 rays,
+    //   f64 centroid x, y, z, f64 covariance xx, yy, zz, xy, xz, yz
+    // whose covariances are those of the hit positions (divided by the rays) and
+    // whose rays times the power per photon give the power of the image.
+    // Returns false if the file cannot be written.
+    bool write(const std::string& path, double powerPerPhoton) const;
+
+    const std::vector<Cell>& cells() const { return m_cells; }
+
+private:
+    bool writeCsv(const std::string& path, double powerPerPhoton) const;
+    bool writeBinary(const std::string& path, double powerPerPhoton) const;
+
+    const SurfaceMap* m_surfaceMap;
+    std::size_t m_receiverCount;
+    std::vector<Cell> m_cells;   // [heliostat][receiver]
+};
+
+// The "images" module: per heliostat x receiver centroid and covariance of the
+// counted hits
+class ImageAnalyzer : public Analyzer
+{
+public:
+    using Analyzer::Analyzer;
+
+    const char* name() const override { return "images"; }
+    unsigned requiredFields() const override { return kFieldX | kFieldY | kFieldZ; }
+    std::unique_ptr<AnalyzerState> createState() const override;
+    bool write(const AnalyzerState& merged) const override;
+};
+
+#endif // IMAGEMOMENTS_H
@@ -0,0 +1,49 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+// Read-only memory mapping of a whole file. Move-only; unmaps on destruction.
+// Empty files are "mapped" with data() == nullptr and size() == 0.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+
+    // Maps the file; returns false (and leaves the object closed) on failure.
+    bool open(const fs::path& path);
+
+    // Maps only [offset, offset + length) of the file, clipped to its size;
+    // data() points at `offset`.
+    bool open(const fs::path& path, std::uint64_t offset, std::uint64_t length);
+    void close();
+
+    bool is_open() const { return m_open; }
+    const unsigned char* data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+
+    // Hint the kernel that the mapping will be read front to back (no-op where unsupported).
+    void adviseSequential() const;
+
+private:
+    const unsigned char* m_data = nullptr;
+    std::size_t m_size = 0;
+    std::size_t m_view_offset = 0; // m_data - start of the mapped view (page alignment)
+    bool m_open = false;
+#ifdef _WIN32
+    void* m_file = nullptr;     // HANDLE
+    void* m_mapping = nullptr;  // HANDLE
+#endif
+};
+
+#endif // MAPPEDFILE_H
@@ -1,36 +1,87 @@
 #ifndef PARAMETERSFILEREADER_H
 #define PARAMETERSFILEREADER_H
 
+#include "PhotonLayout.h"
+#include "SurfaceMap.h"
+
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 #include <string>
-#include <unordered_map>
-#include <fstream>  // needed for std::ifstream in declarations
+#include <string_view>
 
 class ParametersFileReader
 {
 public:
-    explicit ParametersFileReader(const std::string& folderPath);
+    // path: a photon folder, or the parameters file itself (e.g. when the
+    // photons arrive through a pipe)
+    explicit ParametersFileReader(const std::string& path);
 
+    // Reads photons_parameters.txt in one go and parses it in place.
     void read();
 
-    const std::unordered_map<uint64_t, std::string>& getSurfaceMap() const;
+    // SURFACES block entries in ascending id order (the last line wins for a
+    // repeated id). The paths view the file text held by the reader: they are
+    // valid until the next read() or the reader's destruction.
+    const std::vector<SurfacePath>& getSurfaces() const;
     double getPowerPerPhoton() const;
 
+    // Fields of a photon record, from the PARAMETERS block (the full eight-field
+    // record when there is none). The byte order is Unknown: it is not written
+    // in the file, see TonatiuhReader::DetectByteOrder.
+    const PhotonLayout& getLayout() const { return m_layout; }
+
+    // 64-bit FNV-1a hash of the parsed parameters (field list, surfaces, power);
+    // identifies which parameters file derived data was built against.
+    uint64_t getFingerprint() const;
+
+    // The same over the surfaces alone: equal for folders whose surface lists
+    // match, which can then share one SurfaceMap.
+    uint64_t getSurfacesFingerprint() const;
+
+    // A parameter name lowercased, without spaces and underscores, for comparing
+    // names written with other formatting ("previous ID", "previous_id", ...)
+    static std::string normalizeId(std::string_view s);
+
 private:
-    std::string m_folderPath;
-    std::unordered_map<uint64_t, std::string> m_surfaceMap;
+    std::string m_path;
+    std::string m_text;                   // whole parameters file
+    std::vector<SurfacePath> m_surfaces;
+    std::vector<std::string> m_parameterNames;
+    PhotonLayout m_layout;
     double m_powerPerPhoton = 0.0;
 
-    void parseParameterBlock(std::ifstream& file);
-    void parseSurfaceBlock(std::ifstream& file);
-    void parsePowerAfterSurfaces(std::ifstream& file);
+    // Each consumes lines from the front of `text`
+    void parseParameterBlock(std::string_view& text);
+    void parseSurfaceBlock(std::string_view& text);
+    void parsePowerAfterSurfaces(std::string_view& text);
+
+    // 64-bit FNV-1a
+    struct Fnv1a
+    {
+        uint64_t value = 14695981039346656037ull;
+
+        void mix(const void* data, std::size_t size)
+        {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            for (std::size_t i = 0; i < size; ++i) {
+                value ^= bytes[i];
+                value *= 1099511628211ull;
+            }
+        }
 
-    static bool matchesExpectedParameterList(const std::vector<std::string>& actual);
+        // u64 length + bytes
+        void mixString(std::string_view s)
+        {
+            const uint64_t size = s.size();
+            mix(&size, sizeof(size));
+            mix(s.data(), s.size());
+        }
+    };
+    void mixSurfaces(Fnv1a& hash) const;
 
     // helpers
-    static std::string trim(const std::string& s);
-    static std::string normalizeId(const std::string& s); // for parameter-name comparison
+    static std::string_view trim(std::string_view s);
 };
 
 #endif // PARAMETERSFILEREADER_H
\ No newline at end of file
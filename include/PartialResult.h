@@ -0,0 +1,34 @@
+#ifndef PARTIALRESULT_H
+#define PARTIALRESULT_H
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+// The matrix of one shard of a folder (STTAnalytics --shard), to be reduced with
+// the other shards' by sttmerge. The fingerprints tie it to the parameters file
+// and the surface table it was counted with.
+//
+// Partial result file (little-endian binary, written atomically):
+//   char[8] "STTPART1", u64 parameters fingerprint, u64 surfaces fingerprint,
+//   u32 shard index (0-based), u32 shard count, u8 standard errors,
+//   u64 + bytes of the matrix's AnalyzerState::save()
+struct PartialResult
+{
+    std::uint64_t parametersFingerprint = 0;
+    std::uint64_t surfacesFingerprint   = 0;
+    std::uint32_t shard      = 0;
+    std::uint32_t shardCount = 1;
+    bool          standardErrors = false; // the matrix keeps batch statistics
+    std::string   matrix;                 // saved RayAccumulator
+
+    // false if the file cannot be written
+    bool save(const fs::path& path) const;
+
+    // false if the file is missing, truncated or not a partial result
+    bool load(const fs::path& path);
+};
+
+#endif // PARTIALRESULT_H
@@ -0,0 +1,76 @@
+#ifndef PHOTONBLOCK_H
+#define PHOTONBLOCK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct PhotonInfo
+{
+    std::uint64_t id;          // integer-like fields as integers
+    double        x;
+    double        y;
+    double        z;
+    int           side;        // arrival side
+    std::uint64_t previous_id;
+    std::uint64_t next_id;
+    std::uint64_t surface_id;
+};
+
+// Bit mask selecting PhotonBlock fields, for sources that can skip columns
+enum PhotonField : unsigned
+{
+    kFieldId         = 1u << 0,
+    kFieldX          = 1u << 1,
+    kFieldY          = 1u << 2,
+    kFieldZ          = 1u << 3,
+    kFieldSide       = 1u << 4,
+    kFieldPreviousId = 1u << 5,
+    kFieldNextId     = 1u << 6,
+    kFieldSurfaceId  = 1u << 7,
+    kAllPhotonFields = 0xFFu
+};
+
+// Structure-of-arrays batch of decoded photons. Arrays are sized to capacity()
+// once; only the first size() entries are valid after a read.
+struct PhotonBlock
+{
+    static constexpr std::size_t kDefaultCapacity = 4096;
+
+    explicit PhotonBlock(std::size_t capacity = kDefaultCapacity) { reserve(capacity); }
+
+    std::vector<std::uint64_t> id;
+    std::vector<double>        x;
+    std::vector<double>        y;
+    std::vector<double>        z;
+    std::vector<int>           side;
+    std::vector<std::uint64_t> previous_id;
+    std::vector<std::uint64_t> next_id;
+    std::vector<std::uint64_t> surface_id;
+
+    std::size_t count = 0;
+
+    std::size_t size() const { return count; }
+    std::size_t capacity() const { return id.size(); }
+    bool empty() const { return count == 0; }
+    void clear() { count = 0; }
+
+    void reserve(std::size_t n)
+    {
+        id.resize(n);
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+        side.resize(n);
+        previous_id.resize(n);
+        next_id.resize(n);
+        surface_id.resize(n);
+    }
+
+    PhotonInfo photon(std::size_t i) const
+    {
+        return PhotonInfo{ id[i], x[i], y[i], z[i], side[i], previous_id[i], next_id[i], surface_id[i] };
+    }
+};
+
+#endif // PHOTONBLOCK_H
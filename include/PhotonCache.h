@@ -0,0 +1,88 @@
+#ifndef PHOTONCACHE_H
+#define PHOTONCACHE_H
+
+#include "MappedFile.h"
+#include "PhotonBlock.h"
+#include "PhotonLayout.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Columnar little-endian cache of a photon folder (photons_cache.sttc, next to
+// the .dat files). Holds id (u64), x/y/z (f64), side (i8), surface_id (u32),
+// an index of ray start positions and, only when they cannot be rebuilt from
+// the ray index, explicit previous/next id columns. The header records the
+// parameters fingerprint and the size/mtime/photon count of every source file,
+// so a stale cache is detected and ignored.
+class PhotonCache
+{
+public:
+    static fs::path cachePath(const fs::path& folder);
+
+    // Converts all photons_N.dat[.gz|.zst] of `folder` (in CompareFilename order), records
+    // of `layout`, into a cache; an Unknown byte order is detected from the files.
+    // The cache goes to cacheFile, or to cachePath(folder) if that is empty.
+    // Throws std::runtime_error on failure.
+    static void build(const fs::path& folder, std::uint64_t fingerprint, PhotonLayout layout = PhotonLayout(),
+                      const fs::path& cacheFile = {});
+
+    // Maps the cache of `folder` (cacheFile, or cachePath(folder) if empty);
+    // false if missing, unreadable or stale. fingerprint == 0 skips the
+    // parameters check.
+    bool open(const fs::path& folder, std::uint64_t fingerprint, const fs::path& cacheFile = {});
+    bool is_open() const { return m_map.is_open(); }
+
+    // Whether the photon files of `folder` are still the ones the cache was
+    // built from (same names, sizes and modification times)
+    bool isFresh(const fs::path& folder) const;
+
+    std::size_t mappedBytes() const { return m_map.size(); }
+
+    std::uint64_t photonCount() const { return m_photons; }
+    std::uint64_t rayCount() const { return m_rays; }
+
+    // Photons of each source file, in stream order
+    const std::vector<std::uint64_t>& sourcePhotons() const { return m_source_photons; }
+
+    // Photon index ranges of about photons_per_range photons that start and end on ray
+    // boundaries; the last range also holds any trailing unterminated photons.
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> splitByRays(std::uint64_t photons_per_range) const;
+
+    // Copies photons [first, first + count) into block (appending at block.size()).
+    // Only the requested fields are filled; the others are left untouched.
+    void read(std::uint64_t first, std::size_t count, PhotonBlock& block,
+              unsigned fields = kAllPhotonFields) const;
+
+private:
+    MappedFile m_map;
+    std::uint64_t m_photons = 0;
+    std::uint64_t m_rays = 0;
+    bool m_has_links = false;
+    std::vector<std::uint64_t> m_source_photons;
+
+    // Name, size and modification time of each source file
+    struct Source
+    {
+        std::string   name;
+        std::uint64_t size;
+        std::int64_t  mtime;
+    };
+    std::vector<Source> m_sources;
+
+    const std::uint64_t* m_id = nullptr;
+    const double*        m_x = nullptr;
+    const double*        m_y = nullptr;
+    const double*        m_z = nullptr;
+    const std::int8_t*   m_side = nullptr;
+    const std::uint32_t* m_surface = nullptr;
+    const std::uint64_t* m_prev = nullptr;
+    const std::uint64_t* m_next = nullptr;
+    const std::uint64_t* m_ray_starts = nullptr; // m_rays + 1 entries (last = end of last ray)
+};
+
+#endif // PHOTONCACHE_H
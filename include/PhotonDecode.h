@@ -0,0 +1,51 @@
+#ifndef PHOTONDECODE_H
+#define PHOTONDECODE_H
+
+#include "PhotonBlock.h"
+#include "PhotonLayout.h"
+
+#include <cstddef>
+
+// Decoding of raw Tonatiuh++ photon records (one double per field of a
+// PhotonLayout, in either byte order) into host photons. Integer-like fields
+// follow the historical conversion: llround for ids, lrint for side.
+
+// Portable reference for the full big-endian record (PhotonLayout()): decodes
+// `count` consecutive records into block arrays starting at index `offset`.
+// PhotonDecoder gives bit-identical results for that layout.
+void decodePhotonRecordsScalar(const unsigned char* records, std::size_t count,
+                               PhotonBlock& block, std::size_t offset);
+
+// Decodes the records of one PhotonLayout; fields the layout lacks are zero.
+// Common layouts have decoders specialised at compile time (the full record
+// also a SIMD one), in both byte orders: records already in host order are not
+// swapped at all. Other layouts go through a generic loop over the fields.
+// An Unknown byte order is read as big-endian.
+class PhotonDecoder
+{
+public:
+    explicit PhotonDecoder(const PhotonLayout& layout = PhotonLayout());
+
+    void decode(const unsigned char* records, std::size_t count, PhotonBlock& block, std::size_t offset) const;
+    void decode(const unsigned char* record, PhotonInfo& photon) const;
+
+    const PhotonLayout& layout() const { return m_layout; }
+    std::size_t recordBytes() const { return m_layout.recordBytes(); }
+
+    // False when the generic decoder is used
+    bool isSpecialised() const { return m_batch != nullptr; }
+    // True when the specialised decoder uses the SIMD path of the running CPU
+    bool isVectorized() const { return m_vectorized; }
+
+private:
+    using BatchFn = void (*)(const unsigned char*, std::size_t, PhotonBlock&, std::size_t);
+
+    void decodeGeneric(const unsigned char* records, std::size_t count, PhotonBlock& block, std::size_t offset) const;
+
+    PhotonLayout m_layout;
+    bool         m_swap = false;
+    BatchFn      m_batch = nullptr;
+    bool         m_vectorized = false;
+};
+
+#endif // PHOTONDECODE_H
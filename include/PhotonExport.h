@@ -0,0 +1,114 @@
+#ifndef PHOTONEXPORT_H
+#define PHOTONEXPORT_H
+
+#include "Analyzer.h"
+#include "SurfaceMap.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Arrival sides of the rays to export
+enum class ExportSide { Front, Back, Any };
+
+struct ExportOptions
+{
+    std::vector<std::string> heliostats;   // labels to keep ("H01*" matches a prefix); empty = all
+    std::vector<std::string> receivers;    // likewise
+    ExportSide    side        = ExportSide::Front;   // Front = side == 1, as counted in the matrix
+    std::uint64_t sampleEvery = 1;                   // keep 1 ray in this many per heliostat x receiver
+    std::uint64_t chunkBytes  = 256ull << 20;        // start a new chunk file after about this many bytes
+};
+
+struct ExportTarget;
+
+// The rays from a heliostat to a receiver that pass the filters of
+// ExportOptions, written as one fixed-size record per ray (its last photon) to
+// the chunk files of an export directory: the state of the "export" module.
+//
+// Each worker writes its own chunk files through its own buffer, so workers
+// never wait for each other. The sample is stratified: within every heliostat x
+// receiver cell each worker keeps the first ray and then every sampleEvery-th
+// one. The index written at the end lists, per cell, the rays that passed the
+// filters and those exported, so that each exported ray stands for the power of
+// its cell divided by its exported rays, and the exported power of every cell
+// equals its power in the matrix. Which rays are picked depends on how the
+// chunks fell to the workers; the counts and weights do not.
+class PhotonExport : public AnalyzerState
+{
+public:
+    static constexpr std::size_t kRecordBytes = 48;
+
+    // A finished chunk file (name relative to the export directory)
+    struct Chunk
+    {
+        std::string   name;
+        std::uint64_t records = 0;
+    };
+
+    PhotonExport(const SurfaceMap& surfaceMap, std::shared_ptr<ExportTarget> target);
+
+    void addRay(std::size_t length, std::uint64_t heliostatID, std::uint64_t receiverID, int arrivalSide,
+                std::uint64_t id, double x, double y, double z);
+
+    void onRayEnds(const RayEnds& ends) override;
+    void onStitchedRay(const RayFragment& ray, const PhotonInfo* photons) override;
+
+    // Writes out the buffer and closes the open chunk file; later rays go to a new one.
+    void finish() override;
+
+    // Takes over the counts and chunk list of another (finished) worker.
+    void merge(const AnalyzerState& other) override;
+
+    // The counts and chunk list; the chunk files themselves stay where they are.
+    bool save(std::ostream& out) const override;
+    bool load(std::istream& in) override;
+
+    // Writes the index (format in PhotonExport.cpp) to the export directory;
+    // false if it cannot be written.
+    bool writeIndex(double powerPerPhoton) const;
+
+    const std::vector<Chunk>& chunks() const { return m_chunks; }
+
+private:
+    void startChunk();
+    void writeBuffer();
+
+    const SurfaceMap* m_surfaceMap;
+    std::size_t m_receiverCount;
+    std::shared_ptr<ExportTarget> m_target;
+    std::vector<std::uint64_t> m_rays;       // [heliostat][receiver]: rays that passed the filters
+    std::vector<std::uint64_t> m_exported;   // [heliostat][receiver]: rays written
+    std::vector<Chunk> m_chunks;             // closed chunk files
+
+    std::ofstream m_file;                    // open chunk file, if any
+    Chunk m_open;
+    std::uint64_t m_openBytes = 0;
+    std::vector<unsigned char> m_buffer;
+    std::size_t m_buffered = 0;
+};
+
+// The "export" module: the output path is a directory that receives the chunk
+// files and index.sttx, replacing those of an earlier export unless it resumes
+// from a checkpoint. Throws std::invalid_argument for a heliostat or receiver
+// filter that matches no label.
+class ExportAnalyzer : public Analyzer
+{
+public:
+    explicit ExportAnalyzer(const AnalyzerContext& context);
+
+    const char* name() const override { return "export"; }
+    unsigned requiredFields() const override;
+    std::unique_ptr<AnalyzerState> createState() const override;
+    bool write(const AnalyzerState& merged) const override;
+
+    static bool parseSide(const std::string& text, ExportSide& side);
+
+private:
+    std::shared_ptr<ExportTarget> m_target;
+};
+
+#endif // PHOTONEXPORT_H
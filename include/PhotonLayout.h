@@ -0,0 +1,65 @@
+#ifndef PHOTONLAYOUT_H
+#define PHOTONLAYOUT_H
+
+#include "PhotonBlock.h"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Byte order of the doubles of a photon record
+enum class ByteOrder { Unknown, Big, Little };
+
+const char* byteOrderName(ByteOrder order);
+
+// Byte order of the running machine
+ByteOrder hostByteOrder();
+
+// What one photon record holds: the fields listed between START PARAMETERS and
+// END PARAMETERS, in that order, one double each. Tonatiuh++ can leave fields
+// out; those are zero in decoded photons.
+class PhotonLayout
+{
+public:
+    // The full Tonatiuh++ record: id, x, y, z, side, previous ID, next ID,
+    // surface ID, big-endian
+    PhotonLayout();
+    PhotonLayout(std::vector<PhotonField> fields, ByteOrder order);
+
+    // From the names of the parameters file ("previous ID", "surface_id", ...:
+    // compared without case, spaces and underscores). The byte order is Unknown.
+    // Throws std::runtime_error on an unknown or repeated name, or an empty list.
+    static PhotonLayout fromParameterNames(const std::vector<std::string>& names);
+
+    static const char* fieldName(PhotonField field);
+
+    const std::vector<PhotonField>& fields() const { return m_fields; }
+    unsigned fieldMask() const { return m_mask; }
+    std::size_t fieldCount() const { return m_fields.size(); }
+    std::size_t recordBytes() const { return m_fields.size() * sizeof(double); }
+
+    ByteOrder byteOrder() const { return m_order; }
+    void setByteOrder(ByteOrder order) { m_order = order; }
+
+    // The eight fields in the standard order (in either byte order)
+    bool hasStandardFields() const;
+
+    // "id, side, previous ID, next ID, surface ID (40 bytes, big-endian)"
+    std::string describe() const;
+
+    // The byte order under which `count` raw records hold fewer implausible
+    // values (ids that are not whole numbers, coordinates that are huge, tiny
+    // or not finite); Big on a tie, Unknown without records.
+    ByteOrder detectByteOrder(const unsigned char* records, std::size_t count) const;
+
+    bool operator==(const PhotonLayout& other) const { return m_fields == other.m_fields && m_order == other.m_order; }
+    bool operator!=(const PhotonLayout& other) const { return !(*this == other); }
+
+private:
+    std::vector<PhotonField> m_fields;
+    unsigned  m_mask  = 0;
+    ByteOrder m_order = ByteOrder::Big;
+};
+
+#endif // PHOTONLAYOUT_H
@@ -1,24 +1,125 @@
 #ifndef PHOTONPROCESSOR_H
 #define PHOTONPROCESSOR_H
 
+#include "Analyzer.h"
+#include "Checkpoint.h"
+#include "PartialResult.h"
+#include "ProcessingOptions.h"
+#include "RayAccumulator.h"
+#include "RayPipeline.h"
+#include "RunStats.h"
 #include "SurfaceMap.h"
-#include "tonatiuhreader.h"
 
 #include <cstdint>
+#include <memory>
 #include <string>
-#include <map>
+#include <vector>
 
+class PhotonCache;
+class PhotonStream;
+class WorkStealingPool;
+
+// Streams the photons of a folder once through the heliostat x receiver matrix
+// and the analysis modules requested in ProcessingOptions::analyzers.
 class PhotonProcessor
 {
 public:
-    PhotonProcessor(const std::string& folderPath, const SurfaceMap& surfaceMap, double powerPerPhoton);
+    // Throws std::invalid_argument for an analyzer name that is not registered.
+    PhotonProcessor(const std::string& folderPath, const SurfaceMap& surfaceMap, double powerPerPhoton,
+                    const ProcessingOptions& options = {});
+
+    // run() and writeOutputs()
     void processPhotons(const std::string& outputCsvFile);
 
+    // Streams all photons through every module.
+    void run();
+
+    // Streams the records of `input` instead of the folder's files (the folder
+    // path only names the source in messages and statistics). The records are
+    // processed in rounds of one ring segment per thread while the next ones are
+    // read; a ray the input ends in the middle of is dropped with a warning.
+    void run(PhotonStream& input);
+
+    // Streams the photons added to the folder since the last run(), update() or
+    // restore() (new files and whole records appended to the last ones) and adds
+    // them to the results; the first call reads everything. Starts over, with a
+    // warning, if files that were already read have changed. Returns false when
+    // there was nothing new to read.
+    // With ProcessingOptions::targetRelativeError, reads chunks in random order
+    // instead and stops once every heliostat total is known that precisely.
+    bool update();
+
+    // update() on several processors at once, with the reads of all of them
+    // scheduled together on one pool of `threads` workers (0 = all hardware
+    // threads), so that many small folders keep every thread busy. Returns, per
+    // processor, whether it read new photons.
+    static std::vector<bool> updateAll(const std::vector<PhotonProcessor*>& processors, unsigned threads);
+
+    // The same on a pool the caller keeps between updates
+    static std::vector<bool> updateAll(const std::vector<PhotonProcessor*>& processors, const WorkStealingPool& pool);
+
+    // The position and module states after the last run()/update(), to continue
+    // in a later process; false if a module cannot be checkpointed.
+    bool checkpoint(Checkpoint& out) const;
+
+    // Continues from a checkpoint taken with the same parameters and modules (the
+    // next update() reads what was added since). false, with nothing changed, if
+    // it does not fit.
+    bool restore(const Checkpoint& checkpoint);
+
+    // The matrix of the last run() as a shard's partial result (all but the
+    // surfaces fingerprint, which the caller adds); false if it cannot be saved.
+    bool partialResult(PartialResult& out) const;
+
+    // writeCsv() and writeAnalyzerOutputs(), reported on stdout/stderr and timed
+    // as the Write stage
+    void writeOutputs(const std::string& outputCsvFile);
+
+    // Files (and bytes of the last one) whose rays are in the results
+    const StreamPosition& consumed() const { return position; }
+
+    // Writes the matrix of the last run() as CSV; false if the file cannot be written.
+    bool writeCsv(const std::string& outputCsvFile) const;
+
+    // Writes the result of each requested module to its output path; false if any failed.
+    bool writeAnalyzerOutputs() const;
+
+    // Accumulated counts of the last run() (null before the first one)
+    const RayAccumulator* result() const;
+
+    // Merged state of the requested module `name` after the last run() (null
+    // before the first one, or if it was not requested)
+    const AnalyzerState* moduleResult(const std::string& name) const;
+
+    // Reads a pass that starts from the beginning of the folder from this open
+    // cache of it instead of its files or photons_cache.sttc, while the cache is
+    // up to date. The cache may be shared by processors running concurrently.
+    void useCache(std::shared_ptr<const PhotonCache> cache);
+
+    // Timings and totals of the last run()/update() (and of the CSV write in
+    // writeOutputs()); bytes and photons count what that call read.
+    // Per-block stage timings are only filled with ProcessingOptions::collectStats.
+    const RunStats& stats() const { return runStats; }
+
 private:
+    struct Pass;
+    std::unique_ptr<Pass> preparePass(unsigned workerCount);
+    std::unique_ptr<Pass> beginPass(unsigned workerCount);
+    void runTask(Pass& pass, std::size_t task, unsigned worker, ProgressCounter& progress) const;
+    bool finishPass(Pass& pass);
+    bool sampleUntilConverged();
+    void assembleLinkedRays(Pass& pass);
+
     std::string folderPath;
     const SurfaceMap& surfaceMap;
     double powerPerPhoton;
+    ProcessingOptions options;
     std::uint64_t totalPhotons = 0;
+    std::vector<std::unique_ptr<Analyzer>> analyzers;     // [0] = matrix
+    std::vector<std::unique_ptr<AnalyzerState>> results; // merged state per analyzer, after run()
+    StreamPosition position;                              // end of the last complete ray read
+    std::shared_ptr<const PhotonCache> sharedCache;       // see useCache()
+    RunStats runStats;
 };
 
 #endif // PHOTONPROCESSOR_H
\ No newline at end of file
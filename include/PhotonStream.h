@@ -0,0 +1,78 @@
+#ifndef PHOTONSTREAM_H
+#define PHOTONSTREAM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Photon records read front to back from standard input, a named pipe or any
+// file that is not listed in a folder, e.g. a ray tracer writing straight into
+// the analysis. A reader thread keeps a ring buffer filled while the records
+// before it are processed. Reads may return any number of bytes; the ring hands
+// out whole records only, and holds a whole number of them, so no record is ever
+// cut by its end. Rays run across segments like across file chunks.
+class PhotonStream
+{
+public:
+    // Whole records, in at most two parts (the second one from the start of the
+    // ring, after it wrapped)
+    struct Segment
+    {
+        const unsigned char* data[2]  = { nullptr, nullptr };
+        std::size_t          bytes[2] = { 0, 0 };
+
+        std::size_t size() const { return bytes[0] + bytes[1]; }
+    };
+
+    // source "-" reads standard input; anything else is opened for reading (a
+    // FIFO waits for its writer). bufferBytes is the ring size, rounded down to
+    // whole records. Throws std::runtime_error if the source cannot be opened.
+    PhotonStream(const std::string& source, std::size_t recordBytes, std::size_t bufferBytes);
+    ~PhotonStream();
+
+    PhotonStream(const PhotonStream&) = delete;
+    PhotonStream& operator=(const PhotonStream&) = delete;
+
+    // The next segment after the ones handed out, of maxBytes (rounded down to
+    // whole records, at least one) or whatever is left at the end of the input,
+    // or less when the ring is full. With wait it blocks until then; without it,
+    // returns an empty segment unless one is ready. An empty segment after a
+    // wait means the input has ended. Throws std::runtime_error on a read error.
+    Segment next(std::size_t maxBytes, bool wait);
+
+    // Returns the space of every segment handed out so far to the reader; their
+    // data must no longer be used.
+    void release();
+
+    // Bytes of a partial record the input ended with (ignored), once it ended
+    std::size_t trailingBytes() const;
+
+    std::size_t capacity() const { return m_ring.size(); }
+    const std::string& name() const { return m_name; }
+
+private:
+    void readLoop();
+
+    std::string   m_name;
+    std::intptr_t m_fd = -1;
+    bool          m_ownsFd = false;
+    std::size_t   m_recordBytes;
+    std::vector<unsigned char> m_ring;
+
+    mutable std::mutex      m_mutex;
+    std::condition_variable m_changed;
+    std::uint64_t m_written  = 0;   // bytes read into the ring, since the start of the input
+    std::uint64_t m_handed   = 0;   // end of the segments handed out
+    std::uint64_t m_released = 0;   // end of the space given back
+    bool          m_ended    = false;
+    std::string   m_error;
+    std::atomic<bool> m_stop{ false };
+    std::thread   m_reader;
+};
+
+#endif // PHOTONSTREAM_H
@@ -0,0 +1,50 @@
+#ifndef PROCESSINGOPTIONS_H
+#define PROCESSINGOPTIONS_H
+
+#include "AsyncFileReader.h"
+#include "FluxMap.h"
+#include "PhotonExport.h"
+#include "tonatiuhreader.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// An analysis module to run in the processing pass, by registered name
+struct AnalyzerRequest
+{
+    std::string name;
+    std::string outputPath;
+};
+
+// Run-time knobs for PhotonProcessor (filled from the command line in main.cpp)
+struct ProcessingOptions
+{
+    ReaderBackend    readerBackend = ReaderBackend::Mmap;
+    AsyncReadOptions asyncRead;                  // used with ReaderBackend::Async
+    PhotonLayout     layout;                     // record fields (parameters file); an Unknown byte order is detected
+    unsigned         threads       = 1;          // worker threads; 0 = all hardware threads
+    std::uint64_t    chunkBytes    = 64ull << 20; // split files into chunks of about this size; 0 = whole files
+    bool             useCache      = true;       // read photons_cache.sttc when present and up to date
+    std::uint64_t    parametersFingerprint = 0;  // expected cache fingerprint; 0 = do not check
+    bool             collectStats  = false;      // time read/decode/accumulate per block (--stats-json)
+    bool             linkRays      = false;      // follow rays through photon ids (interleaved or per-thread files)
+    std::uint64_t    linkMemoryBytes = 1ull << 30; // with linkRays: memory for unlinked segments before they spill to disk
+    std::string      spillDirectory;             // with linkRays: where they spill (empty = system temporary directory)
+    unsigned         shardIndex    = 0;          // with shardCount > 1: the part of the folder to process (0-based)
+    unsigned         shardCount    = 1;          // split the folder's files into this many parts by size
+    bool             verbose       = true;       // progress lines and run summaries on stdout (warnings always go to stderr)
+
+    // Monte Carlo errors: every chunk is a batch of the batch-means estimator, and
+    // chunks are made smaller than chunkBytes when needed for 32 batches or more
+    bool             standardErrors = false;     // per-cell standard errors in the matrix CSV
+    double           targetRelativeError = 0;    // > 0: read chunks in random order until every heliostat total is this precise
+    std::uint64_t    sampleSeed    = 1;          // chunk order with targetRelativeError
+
+    // Modules run next to the heliostat x receiver matrix, which is always computed
+    std::vector<AnalyzerRequest> analyzers;
+    FluxMapOptions   fluxMap;                    // settings of the "flux" module
+    ExportOptions    exportRays;                 // settings of the "export" module
+};
+
+#endif // PROCESSINGOPTIONS_H
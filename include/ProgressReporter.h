@@ -0,0 +1,56 @@
+#ifndef PROGRESSREPORTER_H
+#define PROGRESSREPORTER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Photon and ray totals shared by all workers. Workers add once per block with
+// relaxed atomics; nothing is printed from the processing threads.
+class ProgressCounter
+{
+public:
+    void add(std::uint64_t photons, std::uint64_t rays)
+    {
+        m_photons.fetch_add(photons, std::memory_order_relaxed);
+        m_rays.fetch_add(rays, std::memory_order_relaxed);
+    }
+
+    std::uint64_t photons() const { return m_photons.load(std::memory_order_relaxed); }
+    std::uint64_t rays()    const { return m_rays.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::uint64_t> m_photons{0};
+    std::atomic<std::uint64_t> m_rays{0};
+};
+
+// Prints "Processed N rays..." lines from a background thread that samples a
+// ProgressCounter at a fixed interval. Stops (without a final line) on destruction.
+class ProgressReporter
+{
+public:
+    // totalPhotons (0 = unknown) is used for a percentage
+    ProgressReporter(const ProgressCounter& counter, std::uint64_t totalPhotons,
+                     std::chrono::milliseconds interval = std::chrono::seconds(1));
+    ~ProgressReporter();
+
+    ProgressReporter(const ProgressReporter&) = delete;
+    ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+private:
+    void loop();
+
+    const ProgressCounter& m_counter;
+    std::uint64_t m_totalPhotons;
+    std::chrono::milliseconds m_interval;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_stop = false;
+    std::thread m_thread;
+};
+
+#endif // PROGRESSREPORTER_H
@@ -0,0 +1,187 @@
+#ifndef RAYACCUMULATOR_H
+#define RAYACCUMULATOR_H
+
+#include "Analyzer.h"
+#include "PhotonBlock.h"
+#include "RayFragment.h"
+#include "SurfaceMap.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Heliostat x receiver photon counts plus ray statistics: the state of the
+// "matrix" module. Counts are integers so that per-thread partial results merge
+// exactly, in any order; power is applied when the CSV is written.
+struct RayAccumulator : AnalyzerState
+{
+    // batchStatistics: also keep the batch-means sums behind the standard errors
+    explicit RayAccumulator(const SurfaceMap& surfaceMap_, bool batchStatistics_ = false)
+        : surfaceMap(&surfaceMap_),
+          receiverCount(surfaceMap_.getReceiverLabels().size()),
+          photonCounts(surfaceMap_.getHeliostatLabels().size() * receiverCount, 0),
+          batchStatistics(batchStatistics_)
+    {
+        if (batchStatistics) {
+            cellSquares.assign(photonCounts.size(), 0);
+            cellCross.assign(photonCounts.size(), 0);
+            rowSquares.assign(surfaceMap_.getHeliostatLabels().size(), 0);
+            rowCross.assign(rowSquares.size(), 0);
+        }
+    }
+
+    const SurfaceMap* surfaceMap;
+    std::size_t receiverCount;
+
+    // Flat [heliostatIndex * receiverCount + receiverIndex] matrix of photon counts
+    std::vector<std::uint64_t> photonCounts;
+
+    std::uint64_t photons = 0;
+    std::uint64_t rays    = 0;
+    std::uint64_t counted = 0;
+    std::uint64_t skipped = 0;
+
+    // Why rays were skipped (first failing test, in this order)
+    std::uint64_t skippedMissedReceiver   = 0; // last photon not on a receiver
+    std::uint64_t skippedNotFromHeliostat = 0; // penultimate photon not on a heliostat
+    std::uint64_t skippedBackSide         = 0; // receiver hit with side != 1
+
+    // Batch-means statistics, when enabled: every chunk of the stream is a batch
+    // b with n_b photons and c_b counts in a cell (see addBatch()). Per cell and
+    // per heliostat row (the sum over receivers) they hold sum(c_b^2) and
+    // sum(c_b * n_b). Rays stitched across chunk edges count in the totals only.
+    bool batchStatistics;
+    std::vector<std::uint64_t> cellSquares, cellCross;
+    std::vector<std::uint64_t> rowSquares, rowCross;
+    std::uint64_t batches = 0;
+    std::uint64_t batchPhotonSquares = 0;          // sum(n_b^2)
+
+    // Photons of the whole stream when only a sample of its chunks was read
+    // (0 = everything was read); counts are scaled up to it on output.
+    std::uint64_t populationPhotons = 0;
+
+    // Counts -> estimated counts of the whole stream
+    double scale() const
+    {
+        return (populationPhotons != 0 && photons != 0) ? static_cast<double>(populationPhotons) / photons : 1.0;
+    }
+
+    // Folds `batch`, a state without statistics that saw exactly one chunk, into
+    // this one as one batch, and clears it for the next chunk.
+    void addBatch(RayAccumulator& batch);
+
+    // Standard errors of scale() * count, for a cell [heliostat * receiverCount +
+    // receiver] or a heliostat's total; NaN with fewer than two batches.
+    double cellStandardError(std::size_t cell) const;
+    double rowStandardError(std::size_t heliostat) const;
+
+    std::uint64_t rowCount(std::size_t heliostat) const
+    {
+        std::uint64_t total = 0;
+        for (std::size_t r = 0; r < receiverCount; ++r) total += photonCounts[heliostat * receiverCount + r];
+        return total;
+    }
+
+    // Classifies a finished ray from its length and its last two photons.
+    // Returns true when the ray was counted in the matrix.
+    bool addRay(std::size_t length, std::uint64_t heliostatID, std::uint64_t receiverID, int arrivalSide)
+    {
+        ++rays;
+        if (length < 2) return false;
+
+        const std::int32_t h = surfaceMap->heliostatIndex(heliostatID);
+        const std::int32_t r = surfaceMap->receiverIndex(receiverID);
+        if (arrivalSide == 1 && h != SurfaceMap::kNoIndex && r != SurfaceMap::kNoIndex)
+        {
+            ++photonCounts[static_cast<std::size_t>(h) * receiverCount + static_cast<std::size_t>(r)];
+            ++counted;
+            return true;
+        }
+        else
+        {
+            ++skipped;
+            if (r == SurfaceMap::kNoIndex)      ++skippedMissedReceiver;
+            else if (h == SurfaceMap::kNoIndex) ++skippedNotFromHeliostat;
+            else                                ++skippedBackSide;
+            return false;
+        }
+    }
+
+    bool addRay(const RayFragment& ray)
+    {
+        return addRay(ray.length, ray.penultimate.surface_id, ray.last.surface_id, ray.last.side);
+    }
+
+    void onBlock(const PhotonBlock& block) override { photons += block.size(); }
+
+    void onRayEnds(const RayEnds& ends) override
+    {
+        const std::uint64_t* surfaces = ends.block->surface_id.data();
+        const int*           sides    = ends.block->side.data();
+        for (std::size_t k = 0; k < ends.count; ++k)
+            addRay(ends.length[k], ends.penultimateSurface[k], surfaces[ends.last[k]], sides[ends.last[k]]);
+    }
+
+    void onStitchedRay(const RayFragment& ray, const PhotonInfo* /*photons*/) override { addRay(ray); }
+
+    void merge(const AnalyzerState& state) override { merge(static_cast<const RayAccumulator&>(state)); }
+
+    bool save(std::ostream& out) const override;
+    bool load(std::istream& in) override;
+
+    void merge(const RayAccumulator& other)
+    {
+        for (std::size_t i = 0; i < photonCounts.size(); ++i)
+            photonCounts[i] += other.photonCounts[i];
+        if (batchStatistics && other.batchStatistics) {
+            for (std::size_t i = 0; i < cellSquares.size(); ++i) {
+                cellSquares[i] += other.cellSquares[i];
+                cellCross[i]   += other.cellCross[i];
+            }
+            for (std::size_t h = 0; h < rowSquares.size(); ++h) {
+                rowSquares[h] += other.rowSquares[h];
+                rowCross[h]   += other.rowCross[h];
+            }
+            batches            += other.batches;
+            batchPhotonSquares += other.batchPhotonSquares;
+        }
+        photons += other.photons;
+        rays    += other.rays;
+        counted += other.counted;
+        skipped += other.skipped;
+        skippedMissedReceiver   += other.skippedMissedReceiver;
+        skippedNotFromHeliostat += other.skippedNotFromHeliostat;
+        skippedBackSide         += other.skippedBackSide;
+    }
+};
+
+// Column order of the CSVs: receiver names by trailing number (Receiver1,
+// Receiver2, ...), numbered before unnumbered, the rest by name
+bool receiverColumnBefore(const std::string& a, const std::string& b);
+
+// Writes the matrix as CSV: one row per heliostat with counted rays (ascending
+// name), one column per receiver surface (by trailing number), plus a total.
+// With batch statistics every value is followed by its standard error.
+// Returns false if the file cannot be written.
+bool writeMatrixCsv(const RayAccumulator& acc, double powerPerPhoton, const std::string& outputCsvFile);
+void writeMatrixCsv(const RayAccumulator& acc, double powerPerPhoton, std::ostream& out);
+
+// The "matrix" module
+class MatrixAnalyzer : public Analyzer
+{
+public:
+    using Analyzer::Analyzer;
+
+    const char* name() const override { return "matrix"; }
+
+    std::unique_ptr<AnalyzerState> createState() const override;
+
+    bool write(const AnalyzerState& merged) const override
+    {
+        return writeMatrixCsv(static_cast<const RayAccumulator&>(merged), m_context.powerPerPhoton, outputPath());
+    }
+};
+
+#endif // RAYACCUMULATOR_H
@@ -0,0 +1,109 @@
+#ifndef RAYASSEMBLER_H
+#define RAYASSEMBLER_H
+
+#include "PhotonBlock.h"
+#include "RayFragment.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+class WorkStealingPool;
+
+// A run of linked photons (each one's next_id is the id of the one after it)
+// that is not a whole ray: cut by a chunk or file edge, or interleaved with the
+// photons of other rays in a tracer's per-thread output.
+struct RaySegment
+{
+    std::uint64_t headId       = 0;
+    std::uint64_t headPrevious = 0; // previous_id of the first photon; 0 = the ray starts here
+    std::uint64_t tailId       = 0;
+    std::uint64_t tailNext     = 0; // next_id of the last photon; 0 = the ray ends here
+    RayFragment   ray;
+};
+
+// Joins the segments found by the workers of a pass into rays through their
+// photon ids, for photon files whose rays are not stored contiguously.
+//
+// Workers add segments to buffers of their own; a buffer over its share of the
+// memory budget is appended to a spill file. assemble() hash-partitions the
+// segments by the id of their last photon and finds, for every segment, the
+// first photon of its ray and its place in it by pointer jumping: in each round
+// every partition answers, as one pool task, the lookups of segments whose
+// predecessor ends in it, so a ray of n segments takes about log2(n) rounds.
+// The segments are then partitioned again by the id of their ray's first
+// photon, and each partition checks and puts together its rays as one task.
+// Partitions are held in memory, or in files sized by the budget when anything
+// was spilled, so that only a few of them are in memory at once.
+class RayAssembler
+{
+public:
+    struct Totals
+    {
+        std::uint64_t segments        = 0;
+        std::uint64_t rays            = 0; // complete rays put together
+        std::uint64_t droppedSegments = 0; // unlinked: a photon of their ray is missing, or ids repeat
+        std::uint64_t droppedPhotons  = 0;
+        std::uint64_t spilledBytes    = 0;
+    };
+
+    // keepPhotons: also store the photons of every segment, for modules that take
+    // whole rays. Spill files go to spillDirectory (the system temporary
+    // directory if empty) and are removed with the assembler.
+    RayAssembler(unsigned workers, std::uint64_t memoryBytes, bool keepPhotons, fs::path spillDirectory = {});
+    ~RayAssembler();
+
+    RayAssembler(const RayAssembler&) = delete;
+    RayAssembler& operator=(const RayAssembler&) = delete;
+
+    bool keepsPhotons() const { return m_keepPhotons; }
+
+    // Called by `worker` only, so workers never wait for each other. `photons`
+    // (segment.ray.length of them) is only read with keepsPhotons().
+    // Throws std::runtime_error if a spill file cannot be written.
+    void add(unsigned worker, const RaySegment& segment, const PhotonInfo* photons);
+
+    // Hands every complete ray, its photons in order (null without
+    // keepsPhotons()), to emit on the pool's threads (`worker` as in
+    // WorkStealingPool::run()). Call once, after all add() calls.
+    Totals assemble(const WorkStealingPool& pool,
+                    const std::function<void(const RayFragment&, const PhotonInfo*, unsigned)>& emit);
+
+private:
+    // A segment as stored: the segment, where its photons are, and (once
+    // linked) its ray and place in it
+    struct Record
+    {
+        RaySegment    segment;
+        std::uint64_t photonOffset = 0;   // into the photons stored with it
+        std::uint64_t ray  = 0;           // id of the ray's first photon
+        std::uint64_t rank = 0;           // position within the ray
+    };
+
+    struct Buffer
+    {
+        std::vector<Record>     records;
+        std::vector<PhotonInfo> photons;
+        std::uint64_t           bytes() const;
+    };
+
+    struct Worker;
+
+    // Calls visit(record, photons) for every stored segment, in a fixed order
+    void forEachRecord(const std::function<void(const Record&, const PhotonInfo*)>& visit) const;
+
+    void spill(Worker& worker);
+
+    unsigned      m_workerCount;
+    std::uint64_t m_memoryBytes;
+    bool          m_keepPhotons;
+    fs::path      m_spillDirectory;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::uint64_t m_spilledBytes = 0;   // updated after the workers are done
+};
+
+#endif // RAYASSEMBLER_H
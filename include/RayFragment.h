@@ -0,0 +1,32 @@
+#ifndef RAYFRAGMENT_H
+#define RAYFRAGMENT_H
+
+#include "PhotonBlock.h"
+
+#include <cstddef>
+
+// A run of consecutive photons of one ray, reduced to what is needed to
+// classify the ray: its length and its last two photons. Fragments are
+// concatenated in stream order to stitch rays cut by file or chunk edges.
+struct RayFragment
+{
+    std::size_t length = 0;
+    PhotonInfo  penultimate{};  // valid when length >= 2
+    PhotonInfo  last{};         // valid when length >= 1
+
+    bool empty() const { return length == 0; }
+
+    void clear() { length = 0; }
+
+    // Appends `next`, which directly follows this fragment in the photon stream.
+    void append(const RayFragment& next)
+    {
+        if (next.length == 0) return;
+        if (next.length >= 2)      penultimate = next.penultimate;
+        else if (length >= 1)      penultimate = last;
+        last = next.last;
+        length += next.length;
+    }
+};
+
+#endif // RAYFRAGMENT_H
@@ -0,0 +1,63 @@
+#ifndef RAYPIPELINE_H
+#define RAYPIPELINE_H
+
+#include "Analyzer.h"
+#include "PhotonBlock.h"
+#include "ProgressReporter.h"
+#include "RayAccumulator.h"
+#include "RayAssembler.h"
+#include "RayFragment.h"
+#include "RunStats.h"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// What one chunk contributes to rays that cross its edges. Complete rays that
+// start inside the chunk go straight to the worker's module states; the photons
+// before the first ray end belong to a ray owned by an earlier chunk and are
+// handed back, as is the unfinished ray at the end.
+struct ChunkEdges
+{
+    bool        terminated = false; // chunk contains at least one ray end
+    RayFragment head;               // photons up to and including the first ray end
+                                    // (the whole chunk when !terminated)
+    RayFragment tail;               // photons after the last ray end
+
+    // All photons of head and tail, when rays are assembled
+    std::vector<PhotonInfo> headPhotons;
+    std::vector<PhotonInfo> tailPhotons;
+
+    std::uint64_t photons = 0;      // photons read from the chunk
+};
+
+// Runs the ray loop over the blocks produced by nextBlock (which returns false at
+// the end): the rays that start and end inside the stream are added to matrix
+// (inline, since it is always computed), and every block and those rays are fed
+// to each of the other modules; the edge fragments are returned for stitching
+// with the neighbouring streams. The first complete ray starts right after the
+// first next_id == 0 (where a well-formed stream has previous_id == 0).
+// When rayModules (a subset of modules) is not empty, the photons of every ray
+// are collected and passed to them through onRay().
+// When times is given, the time spent in nextBlock and in the loop is added to
+// times->fetch and times->accumulate.
+ChunkEdges streamRays(const std::function<bool(PhotonBlock&)>& nextBlock,
+                      RayAccumulator& matrix,
+                      const std::vector<AnalyzerState*>& modules,
+                      const std::vector<AnalyzerState*>& rayModules,
+                      ProgressCounter& progress, PipelineTimes* times = nullptr);
+
+// streamRays() for photon files whose rays are not stored contiguously: a ray is
+// followed through ids (each photon's next_id is the id of the photon after it)
+// instead of being cut at next_id == 0. Rays linked from their first photon
+// (previous_id == 0) to their last within the stream are handled as above;
+// every other run of linked photons goes to assembler as a segment of worker
+// `worker`. The returned edges only count the photons.
+ChunkEdges streamLinkedRays(const std::function<bool(PhotonBlock&)>& nextBlock,
+                            RayAccumulator& matrix,
+                            const std::vector<AnalyzerState*>& modules,
+                            const std::vector<AnalyzerState*>& rayModules,
+                            RayAssembler& assembler, unsigned worker,
+                            ProgressCounter& progress, PipelineTimes* times = nullptr);
+
+#endif // RAYPIPELINE_H
@@ -0,0 +1,99 @@
+#ifndef RUNSTATS_H
+#define RUNSTATS_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Wall and CPU seconds spent in a stage. For stages that run on several worker
+// threads both are summed over the workers (thread-seconds).
+struct StageTime
+{
+    double wallSeconds = 0.0;
+    double cpuSeconds  = 0.0;
+
+    void add(const StageTime& other)
+    {
+        wallSeconds += other.wallSeconds;
+        cpuSeconds  += other.cpuSeconds;
+    }
+};
+
+// A reading of the wall clock and of the calling thread's CPU clock.
+struct StageStamp
+{
+    std::chrono::steady_clock::time_point wall{};
+    double cpu = 0.0;
+
+    static StageStamp now();
+
+    // Time from `start` to this stamp (both taken on the same thread)
+    StageTime operator-(const StageStamp& start) const
+    {
+        return StageTime{ std::chrono::duration<double>(wall - start.wall).count(), cpu - start.cpu };
+    }
+};
+
+// Per-worker split of the streaming loop. `fetch` covers producing a block
+// (read + decode); the reader adds its decode share to `decode` separately.
+struct PipelineTimes
+{
+    StageTime fetch;
+    StageTime decode;
+    StageTime accumulate;
+
+    void add(const PipelineTimes& other)
+    {
+        fetch.add(other.fetch);
+        decode.add(other.decode);
+        accumulate.add(other.accumulate);
+    }
+};
+
+// Statistics of one run, written by --stats-json.
+struct RunStats
+{
+    enum Stage { Parameters, SurfaceMapBuild, DirectoryScan, Read, Decode, Accumulate, Write, kStageCount };
+    static const char* stageName(Stage stage);
+
+    struct FileStats
+    {
+        std::string   path;
+        std::uint64_t bytes   = 0;
+        std::uint64_t photons = 0;
+        StageTime     time;      // summed over the file's chunks
+    };
+
+    std::string   folder;
+    std::string   source;        // "files" or "cache"
+    std::string   readerBackend;
+    unsigned      threads = 1;
+
+    std::array<StageTime, kStageCount> stages{};
+    StageTime     processing;    // wall/CPU of PhotonProcessor::run on the calling thread
+
+    std::uint64_t bytes   = 0;
+    std::uint64_t photons = 0;
+    std::uint64_t rays    = 0;
+    std::uint64_t counted = 0;
+    std::uint64_t skipped = 0;
+    std::uint64_t skippedMissedReceiver   = 0;
+    std::uint64_t skippedNotFromHeliostat = 0;
+    std::uint64_t skippedBackSide         = 0;
+
+    std::vector<FileStats> files;
+
+    // Writes the statistics as a JSON object; false if the file cannot be written.
+    // Peak RSS and total process CPU time are sampled at the time of the call.
+    bool writeJson(const std::string& path, double totalWallSeconds) const;
+};
+
+// Peak resident set size of the process in bytes (0 where unsupported).
+std::uint64_t peakResidentBytes();
+
+// User + system CPU seconds of the whole process.
+double processCpuSeconds();
+
+#endif // RUNSTATS_H
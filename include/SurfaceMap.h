@@ -2,44 +2,89 @@
 #define SURFACE_MAP_H
 
 #include <cstdint>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
-#include <string>
 
+// One line of the SURFACES block: surface id and full path
+struct SurfacePath
+{
+    uint64_t         id;
+    std::string_view path;   // e.g. ".../Heliostats/H012/Facet_3" or ".../Receivers/ReceiverA/..."
+};
+
+// Classifies surfaces as heliostats or receivers by path and names them. Names
+// are interned: the thousands of facets of one heliostat share a single label,
+// so the map's size follows the number of heliostats and receivers, not the
+// number of surfaces or path bytes.
 class SurfaceMap
 {
 public:
-    // surfaceData: maps surfaceId -> full path (e.g., ".../Heliostats/H012/Facet_3" or ".../Receivers/ReceiverA/...")
-    explicit SurfaceMap(const std::unordered_map<uint64_t, std::string>& surfaceData);
+    // The paths are only read during construction
+    explicit SurfaceMap(const std::vector<SurfacePath>& surfaces);
+
+    bool isHeliostat(uint64_t surfaceId) const { return heliostatIndex(surfaceId) != kNoIndex; }
+    bool isReceiver (uint64_t surfaceId) const { return receiverIndex(surfaceId) != kNoIndex; }
+
+    // Dense indices for hot loops: heliostats are numbered 0..H-1 in ascending
+    // name order, receivers 0..R-1 per unique name. kNoIndex if not classified.
+    static constexpr std::int32_t kNoIndex = -1;
 
-    bool isHeliostat(uint64_t surfaceId) const;
-    bool isReceiver (uint64_t surfaceId) const;
+    std::int32_t heliostatIndex(uint64_t surfaceId) const
+    {
+        if (surfaceId < m_denseIndex.size()) return m_denseIndex[surfaceId].heliostat;
+        return m_sparseIndex.empty() ? kNoIndex : sparseIndex(surfaceId).heliostat;
+    }
 
-    std::string getReceiverName (uint64_t surfaceId) const;
-    std::string getHeliostatName(uint64_t surfaceId) const;
+    std::int32_t receiverIndex(uint64_t surfaceId) const
+    {
+        if (surfaceId < m_denseIndex.size()) return m_denseIndex[surfaceId].receiver;
+        return m_sparseIndex.empty() ? kNoIndex : sparseIndex(surfaceId).receiver;
+    }
 
+    // Index -> name tables matching heliostatIndex()/receiverIndex()
+    const std::vector<std::string>& getHeliostatLabels() const { return m_heliostatLabels; }
+    const std::vector<std::string>& getReceiverLabels()  const { return m_receiverLabels; }
+
+    const std::string& getReceiverName (uint64_t surfaceId) const;
+    const std::string& getHeliostatName(uint64_t surfaceId) const;
+
+    // Surfaces classified as heliostats (facets) / receivers, and all surfaces listed
     std::size_t getReceiverCount()  const;
     std::size_t getHeliostatCount() const;
     std::size_t getTotalSurfaceCount() const;
 
+    // Receiver surface ids, ascending
+    const std::vector<uint64_t>& getReceiverIds() const { return m_receiverIds; }
+
     // Deterministic order: names sorted by ascending receiver ID
     std::vector<std::string> getReceiverNames() const;
 
-    // Additional accessors (unchanged signature)
-    const std::unordered_map<uint64_t, std::string>& getHeliostatNames() const;
-    const std::unordered_map<uint64_t, std::string>& getReceiverNamesMap() const;
-
 private:
-    // Raw input (only used for accounting)
-    std::unordered_map<uint64_t, std::string> m_surfacePaths;
+    std::size_t m_surfaceCount = 0;
+    std::size_t m_heliostatSurfaceCount = 0;
+    std::vector<uint64_t> m_receiverIds;
+
+    // Surface id -> compact indices. Ids up to kMaxDenseId live in a flat table;
+    // larger (unusual) ids fall back to a hash map.
+    struct SurfaceIndex
+    {
+        std::int32_t heliostat = kNoIndex;
+        std::int32_t receiver  = kNoIndex;
+    };
+    static constexpr uint64_t kMaxDenseId = 1u << 24;
+
+    std::vector<SurfaceIndex> m_denseIndex;
+    std::unordered_map<uint64_t, SurfaceIndex> m_sparseIndex;
+    std::vector<std::string> m_heliostatLabels;
+    std::vector<std::string> m_receiverLabels;
 
-    // Classified name maps
-    std::unordered_map<uint64_t, std::string> m_heliostatNames; // facet/heliostat surfaceId -> "Hxxx..."
-    std::unordered_map<uint64_t, std::string> m_receiverNames;  // receiver surfaceId       -> "Receiver..."
+    SurfaceIndex sparseIndex(uint64_t surfaceId) const;
 
-    // Helpers
-    std::string extractHeliostatName(const std::string& path) const;
-    std::string extractReceiverName (const std::string& path) const;
+    // Helpers (the results view `path` or a string literal)
+    static std::string_view extractHeliostatName(std::string_view path, std::vector<std::string_view>& segs);
+    static std::string_view extractReceiverName (std::string_view path, std::vector<std::string_view>& segs);
 };
 
 #endif // SURFACE_MAP_H
\ No newline at end of file
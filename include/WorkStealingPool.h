@@ -0,0 +1,41 @@
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+// Runs a fixed set of indexed tasks on a group of threads. Each worker starts
+// with a contiguous slice of the index range and runs it front to back (keeping
+// reads sequential); a worker whose slice is empty steals from the back of the
+// others' slices, so load stays balanced when tasks differ in cost.
+//
+// The threads are started by the first run() that needs them and wait for the
+// next one until the pool is destroyed; the calling thread is worker 0.
+class WorkStealingPool
+{
+public:
+    // threads == 0 uses all hardware threads.
+    explicit WorkStealingPool(unsigned threads);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    unsigned threadCount() const { return m_threads; }
+
+    // Calls task(index, worker) once for every index in [0, taskCount) and waits.
+    // With a single worker the tasks run in order on the calling thread.
+    // The first exception thrown by a task is rethrown after all workers stop.
+    // Calls from several threads run one after the other; a task must not call
+    // run() on the same pool.
+    void run(std::size_t taskCount, const std::function<void(std::size_t, unsigned)>& task) const;
+
+private:
+    struct Threads;
+
+    unsigned                 m_threads;
+    std::unique_ptr<Threads> m_pool;
+};
+
+#endif // WORKSTEALINGPOOL_H
@@ -0,0 +1,146 @@
+#ifndef STTANALYTICS_H
+#define STTANALYTICS_H
+
+/*
+ * C API of the sttanalytics library: the heliostat x receiver matrix of a photon
+ * folder, in process, without the command-line tool and its CSV round trip.
+ *
+ * Handles are re-entrant: any number of analyses may run at the same time on
+ * different threads, and one stt_surfaces may be shared by all of them (it is
+ * never modified after stt_surfaces_open()). A single stt_analysis must not be
+ * used from two threads at once.
+ *
+ * Functions returning stt_status never throw; on failure stt_last_error()
+ * describes the error of the calling thread.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && !defined(STT_STATIC)
+#  if defined(STT_BUILDING_LIBRARY)
+#    define STT_API __declspec(dllexport)
+#  else
+#    define STT_API __declspec(dllimport)
+#  endif
+#elif defined(__GNUC__)
+#  define STT_API __attribute__((visibility("default")))
+#else
+#  define STT_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STT_API_VERSION 1
+
+typedef enum stt_status
+{
+    STT_OK = 0,
+    STT_ERROR_ARGUMENT,   /* null handle or pointer, index out of range, bad option */
+    STT_ERROR_INPUT,      /* folder, parameters file or photon files missing or unreadable */
+    STT_ERROR_PROCESSING, /* invalid parameters or photon data, read failure */
+    STT_ERROR_BUFFER,     /* the caller's buffer is too small (the size needed is reported) */
+    STT_ERROR_NO_RESULT,  /* the analysis has not been run yet */
+    STT_ERROR_MEMORY
+} stt_status;
+
+typedef enum stt_reader
+{
+    STT_READER_MMAP = 0,
+    STT_READER_STREAM,
+    STT_READER_ASYNC
+} stt_reader;
+
+typedef struct stt_options
+{
+    size_t   size;              /* sizeof(stt_options), set by stt_options_init() */
+    unsigned threads;           /* worker threads; 0 = all hardware threads (default 1) */
+    uint64_t chunk_bytes;       /* split photon files into chunks of about this size; 0 = whole files */
+    int      reader;            /* an stt_reader (default STT_READER_MMAP) */
+    int      use_cache;         /* read photons_cache.sttc when present and up to date (default 1) */
+    int      verbose;           /* progress and summaries on stdout (default 0) */
+    double   power_per_photon;  /* > 0: overrides the power per photon of the folder's parameters file */
+} stt_options;
+
+/* Fills `options` with the defaults */
+STT_API void stt_options_init(stt_options* options);
+
+/* Message of the last failed call on this thread ("" if none), valid until the
+ * next call into the library on this thread */
+STT_API const char* stt_last_error(void);
+
+/* STT_API_VERSION of the library */
+STT_API int stt_api_version(void);
+
+/* -------------------------------------------------------------------------- */
+/* Surfaces: photons_parameters.txt of a folder, parsed and classified once     */
+
+typedef struct stt_surfaces stt_surfaces;
+
+STT_API stt_status stt_surfaces_open(const char* folder, stt_surfaces** out);
+STT_API void       stt_surfaces_close(stt_surfaces* surfaces);
+
+/* Matrix dimensions: heliostats by name, receivers by unique name */
+STT_API size_t stt_surfaces_heliostat_count(const stt_surfaces* surfaces);
+STT_API size_t stt_surfaces_receiver_count(const stt_surfaces* surfaces);
+STT_API double stt_surfaces_power_per_photon(const stt_surfaces* surfaces);
+
+/* Name of heliostat row / receiver column `index`, NUL-terminated into `buffer`.
+ * `length` (optional) receives strlen(name); STT_ERROR_BUFFER if capacity <= length. */
+STT_API stt_status stt_surfaces_heliostat_name(const stt_surfaces* surfaces, size_t index,
+                                               char* buffer, size_t capacity, size_t* length);
+STT_API stt_status stt_surfaces_receiver_name(const stt_surfaces* surfaces, size_t index,
+                                              char* buffer, size_t capacity, size_t* length);
+
+/* -------------------------------------------------------------------------- */
+/* Analyses: the photons of one folder streamed through the matrix              */
+
+typedef struct stt_analysis stt_analysis;
+
+/* The folder's photons classified with `surfaces` (which must outlive the
+ * analysis and describe the same surface ids, e.g. the same field at another
+ * sun position; the folder's photon records must hold the fields its parameters
+ * file lists). `options` may be NULL for the defaults. The power per photon is
+ * options->power_per_photon when > 0, otherwise that of the folder's own
+ * parameters file (of `surfaces` for their folder); STT_ERROR_INPUT if another
+ * folder has none. */
+STT_API stt_status stt_analysis_open(const char* folder, const stt_surfaces* surfaces,
+                                     const stt_options* options, stt_analysis** out);
+STT_API void       stt_analysis_close(stt_analysis* analysis);
+
+/* Reads every photon of the folder (again, if run before) */
+STT_API stt_status stt_analysis_run(stt_analysis* analysis);
+
+/* Adds the photons appended to the folder since the last run or update; the
+ * first call reads everything. `grew` (optional) is set to 0 if nothing was new. */
+STT_API stt_status stt_analysis_update(stt_analysis* analysis, int* grew);
+
+/* The matrix, row-major [heliostat * receiver_count + receiver] in the order of
+ * stt_surfaces_*_name(), as power or as photon counts. `capacity` is in values;
+ * with STT_ERROR_BUFFER, `needed` (optional) receives the value count. */
+STT_API stt_status stt_analysis_power(const stt_analysis* analysis, double* matrix, size_t capacity, size_t* needed);
+STT_API stt_status stt_analysis_counts(const stt_analysis* analysis, uint64_t* matrix, size_t capacity, size_t* needed);
+
+typedef struct stt_totals
+{
+    uint64_t photons;
+    uint64_t rays;
+    uint64_t counted;
+    uint64_t skipped;
+    uint64_t skipped_missed_receiver;
+    uint64_t skipped_not_from_heliostat;
+    uint64_t skipped_back_side;
+} stt_totals;
+
+STT_API stt_status stt_analysis_totals(const stt_analysis* analysis, stt_totals* out);
+
+/* The matrix CSV the command-line tool writes */
+STT_API stt_status stt_analysis_write_csv(const stt_analysis* analysis, const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STTANALYTICS_H */
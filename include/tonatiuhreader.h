@@ -7,24 +7,64 @@
 #include <vector>
 #include <cstdint>   // for std::uint64_t
 
+#include "AsyncFileReader.h"
+#include "Decompressor.h"
+#include "MappedFile.h"
+#include "PhotonBlock.h"
+#include "PhotonCache.h"
+#include "PhotonDecode.h"
+#include "PhotonLayout.h"
+#include "RunStats.h"
+
 namespace fs = std::filesystem;
 
-struct PhotonInfo
+// The full Tonatiuh++ record: eight big-endian doubles. Folders whose parameters
+// file lists fewer fields have shorter records (PhotonLayout::recordBytes()).
+constexpr std::size_t kPhotonRecordSize = 8 * sizeof(double);
+
+// How photon files are brought into memory.
+enum class ReaderBackend
 {
-    std::uint64_t id;          // integer-like fields as integers
-    double        x;
-    double        y;
-    double        z;
-    int           side;        // arrival side
-    std::uint64_t previous_id;
-    std::uint64_t next_id;
-    std::uint64_t surface_id;
+    Stream, // buffered std::ifstream, one read per record or batch
+    Mmap,   // whole-file read-only mapping, records decoded in place
+    Async   // large reads kept in flight ahead of decoding (AsyncFileReader)
+};
+
+inline const char* readerBackendName(ReaderBackend backend)
+{
+    switch (backend) {
+    case ReaderBackend::Stream: return "stream";
+    case ReaderBackend::Mmap:   return "mmap";
+    case ReaderBackend::Async:  return "async";
+    }
+    return "unknown";
+}
+
+// A byte range of one photon file. Ranges produced by SplitIntoChunks start and
+// end on record boundaries (except the final range, which ends at EOF). For
+// compressed files offsets count uncompressed bytes and ranges always run to EOF.
+struct PhotonFileChunk
+{
+    static constexpr std::uint64_t kToEndOfFile = ~std::uint64_t{0};
+
+    fs::directory_entry file;
+    std::uint64_t begin = 0;
+    std::uint64_t end   = kToEndOfFile;
 };
 
 class TonatiuhReader
 {
 public:
-    explicit TonatiuhReader(fs::path directory_path);
+    // Reads every photon file of the folder. When use_cache is set and the folder has an
+    // up-to-date PhotonCache, photons are served from the cache instead.
+    explicit TonatiuhReader(fs::path directory_path, ReaderBackend backend = ReaderBackend::Stream,
+                            bool use_cache = true);
+
+    // Reads the given files, in the given order (e.g. a single file for a worker thread).
+    TonatiuhReader(std::vector<fs::directory_entry> files, ReaderBackend backend);
+
+    // Reads the given byte ranges, in the given order.
+    TonatiuhReader(std::vector<PhotonFileChunk> chunks, ReaderBackend backend);
     ~TonatiuhReader() = default;
 
     TonatiuhReader(const TonatiuhReader&) = delete;
@@ -34,12 +74,80 @@ public:
 
     const std::vector<fs::directory_entry>& directory_entry() const { return m_directory_entry; }
 
+    // The backend in use: Async is read as Mmap when any of the ranges is compressed.
+    ReaderBackend Backend() const { return m_backend; }
+
+    // photons_N.dat, or .dat.gz / .dat.zst (see Decompressor.h)
+    static bool IsPhotonFile(const fs::path& path);
+
+    // Photon files of a folder, sorted with CompareFilename. A compressed file is
+    // skipped (with a warning) when the uncompressed one is there too.
+    static std::vector<fs::directory_entry> ListPhotonFiles(const fs::path& directory_path);
+
+    // Cuts files into record-aligned ranges of about chunk_bytes, in stream order.
+    // chunk_bytes == 0 yields one range per file. Compressed files are not split
+    // (they can only be read from the start); workers take them whole.
+    static std::vector<PhotonFileChunk> SplitIntoChunks(const std::vector<fs::directory_entry>& files,
+                                                        std::uint64_t chunk_bytes,
+                                                        std::size_t record_bytes = kPhotonRecordSize);
+
+    // Same for record-aligned byte ranges (e.g. the unread part of growing files).
+    static std::vector<PhotonFileChunk> SplitIntoChunks(const std::vector<PhotonFileChunk>& ranges,
+                                                        std::uint64_t chunk_bytes,
+                                                        std::size_t record_bytes = kPhotonRecordSize);
+
+    // Byte order of the first records of the first non-empty file, read as
+    // `layout` (see PhotonLayout::detectByteOrder); Unknown when there are none.
+    static ByteOrder DetectByteOrder(const std::vector<fs::directory_entry>& files, const PhotonLayout& layout);
+
     // Reads the next photon across files; returns false when no more photons.
     bool ReadPhotonInfo(PhotonInfo& photon_info);
 
+    // Queue depth / buffer size / direct I/O for the Async backend; call before reading.
+    void SetAsyncOptions(const AsyncReadOptions& options) { m_async_options = options; }
+
+    // Async backend: reads the chunks as ranges first_range.. of `reader`, which
+    // the caller appended them to and keeps for the chunks after them, instead of
+    // through a reader of its own. `reader` must use AsyncOptionsFor() options.
+    void SetAsyncReader(AsyncFileReader* reader, std::size_t first_range);
+
+    // The options of an async reader for records of record_bytes: every read is
+    // of whole records
+    static AsyncReadOptions AsyncOptionsFor(const AsyncReadOptions& options, std::size_t record_bytes);
+
+    // Fields and byte order of the records (the full big-endian record by
+    // default); call before reading. Ranges must be aligned to its records.
+    void SetLayout(const PhotonLayout& layout);
+    const PhotonLayout& Layout() const { return m_decoder.layout(); }
+
+    // When set, time spent decoding records is added to *decode_time (--stats-json).
+    void SetDecodeTime(StageTime* decode_time) { m_decode_time = decode_time; }
+
+    // Decodes up to block.capacity() photons across files into block (SoA).
+    // Returns false (with an empty block) when no more photons.
+    bool ReadPhotonBatch(PhotonBlock& block);
+
 private:
     // Reads one photon from the current file only; returns false on EOF/short read.
     bool ReadPhotonInfoFromFile(PhotonInfo& photon_info);
+    bool ReadPhotonInfoFromMapping(PhotonInfo& photon_info);
+
+    // Appends whole records from the current file to block; returns how many were added.
+    std::size_t ReadBatchFromFile(PhotonBlock& block);
+    std::size_t ReadBatchFromMapping(PhotonBlock& block);
+    std::size_t ReadBatchFromDecompressor(PhotonBlock& block);
+    bool ReadPhotonInfoFromDecompressor(PhotonInfo& photon_info);
+
+    // Makes sure the current decompressed buffer has a record; false at the end of the file
+    bool NextDecompressedRecords();
+
+    // Async backend: makes sure the current buffer has a record (or returns false at the end)
+    bool NextAsyncRecords();
+
+    void ReportPartialRecord(std::size_t bytes) const;
+
+    // Appends count records to block, timing the decode when requested
+    void Decode(const unsigned char* records, std::size_t count, PhotonBlock& block);
 
     // Try to advance to next file; returns true if a new file is open and ready.
     bool OpenNextFile();
@@ -47,14 +155,50 @@ private:
 private:
     fs::path m_directory_path;
     std::vector<fs::directory_entry> m_directory_entry;
+    std::vector<PhotonFileChunk> m_chunks;     // one per entry of m_directory_entry
     std::size_t m_file_number = 0;
     bool m_first_photon = true;
+    ReaderBackend m_backend = ReaderBackend::Stream;
+
+    PhotonDecoder m_decoder;
+    std::size_t m_record_bytes = kPhotonRecordSize;
 
     std::ifstream m_ifs;
+    std::uint64_t m_stream_left = 0;   // bytes of the current range not yet read
+    std::vector<unsigned char> m_record_buf; // Stream backend: one record, for ReadPhotonInfo
+
+    // Mmap backend: current mapping and read offset into it
+    MappedFile m_map;
+    std::size_t m_map_pos = 0;
 
     // Buffered I/O
     std::unique_ptr<char[]> m_buf;
     std::size_t m_buf_size = 0;
+
+    // Stream backend: raw records staged for batch decoding
+    std::vector<unsigned char> m_batch_buf;
+
+    // Async backend: reader over all ranges (own or shared, its ranges from
+    // m_async_first on) and the buffer being decoded
+    AsyncReadOptions m_async_options;
+    std::unique_ptr<AsyncFileReader> m_async_own;
+    AsyncFileReader* m_async = nullptr;
+    std::size_t m_async_first = 0;
+    AsyncFileReader::Buffer m_async_buf;
+    std::size_t m_async_pos = 0;
+
+    // Compressed files: background decompression of the current file
+    std::unique_ptr<Decompressor> m_inflate;
+    Decompressor::Buffer m_inflate_buf;
+    std::size_t m_inflate_pos = 0;
+
+    // Columnar cache, when one was found for the folder
+    PhotonCache m_cache;
+    std::uint64_t m_cache_pos = 0;
+    PhotonBlock m_cache_block{0};      // ReadPhotonInfo: photons read ahead from the cache
+    std::size_t m_cache_block_pos = 0;
+
+    StageTime* m_decode_time = nullptr;
 };
 
 #endif // TONATIUHREADER_H
\ No newline at end of file
@@ -1,10 +1,23 @@
+#include "Analyzer.h"
+#include "BatchProcessor.h"
+#include "PhotonCache.h"
 #include "PhotonProcessor.h"
+#include "PhotonStream.h"
 #include "ParametersFileReader.h"
+#include "PartialResult.h"
+#include "RunStats.h"
+#include "tonatiuhreader.h"
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <csignal>
 #include <filesystem>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 namespace fs = std::filesystem;
@@ -12,55 +25,586 @@ namespace fs = std::filesystem;
 static bool hasPhotonDataFiles(const fs::path& dir) {
     if (!fs::exists(dir) || !fs::is_directory(dir)) return false;
     for (const auto& de : fs::directory_iterator(dir)) {
-        if (!de.is_regular_file()) continue;
-        const auto name = de.path().filename().string();
         // quick check; CompareFilename will do robust ordering later
-        if (name.rfind("photons_", 0) == 0 && de.path().extension() == ".dat") {
-            return true;
-        }
+        if (de.is_regular_file() && TonatiuhReader::IsPhotonFile(de.path())) return true;
+    }
+    return false;
+}
+
+static void printUsage()
+{
+    std::cerr << "Usage: STTAnalytics [options] <photon_folder_path> <output_csv_file>\n"
+                 "       STTAnalytics --build-cache <photon_folder_path>\n"
+                 "       STTAnalytics [options] --batch <manifest_file> <output_folder>\n"
+                 "       STTAnalytics [options] --shard I/N <photon_folder_path> <partial_file>\n"
+                 "       STTAnalytics [options] --input -|FILE --parameters FILE <output_csv_file>\n"
+                 "Options:\n"
+                 "  --reader stream|mmap|async\n"
+                 "                         photon file backend (default: mmap)\n"
+                 "  --threads N            worker threads (default: 1, 0 = all cores)\n"
+                 "  --chunk-mb N           split photon files into chunks of N MiB for the\n"
+                 "                         worker threads (default: 64, 0 = whole files)\n"
+                 "  --io-depth N           async reader: reads kept in flight (default: 8)\n"
+                 "  --io-buffer-kb N       async reader: size of each read (default: 4096)\n"
+                 "  --direct-io            async reader: bypass the page cache (O_DIRECT)\n"
+                 "  --no-cache             ignore photons_cache.sttc even if it is up to date\n"
+                 "  --build-cache          write photons_cache.sttc for the folder and exit\n"
+                 "  --analyze NAME=FILE    also run analysis module NAME in the same pass and\n"
+                 "                         write its result to FILE (repeatable)\n"
+                 "  --list-analyzers       list the analysis modules and exit\n"
+                 "  --flux-map FILE        same as --analyze flux=FILE: bin the counted receiver\n"
+                 "                         hits into flux maps (CSV grids if FILE ends in .csv,\n"
+                 "                         binary otherwise)\n"
+                 "  --flux-plane xy|xz|yz  projection plane of the flux maps (default: xz)\n"
+                 "  --flux-bins NUxNV      flux map grid size (default: 100x100)\n"
+                 "  --flux-range U0:U1,V0:V1\n"
+                 "                         flux map extent on the plane (required with flux maps)\n"
+                 "  --flux-per-heliostat   one flux map per heliostat and receiver\n"
+                 "  --export DIR           same as --analyze export=DIR: write the last photon of\n"
+                 "                         every heliostat->receiver ray that passes the filters\n"
+                 "                         below to binary chunk files and an index in DIR\n"
+                 "  --export-heliostats L1,L2,...\n"
+                 "                         export only rays from these heliostats (\"H01*\" matches\n"
+                 "                         a prefix; default: all)\n"
+                 "  --export-receivers L1,L2,...\n"
+                 "                         export only rays ending on these receivers\n"
+                 "  --export-side front|back|any\n"
+                 "                         arrival side of the exported rays (default: front)\n"
+                 "  --export-sample K      export 1 ray in K per heliostat and receiver, each\n"
+                 "                         standing for the power of the rays it replaces\n"
+                 "                         (default: 1)\n"
+                 "  --export-chunk-mb N    start a new chunk file every N MiB (default: 256,\n"
+                 "                         0 = one per worker)\n"
+                 "  --checkpoint FILE      resume from FILE if it exists (processing only photons\n"
+                 "                         added since) and save the progress to FILE afterwards\n"
+                 "  --watch SECONDS        keep watching the folder for new photons, rewriting the\n"
+                 "                         outputs (and checkpoint) every SECONDS while it grows;\n"
+                 "                         Ctrl+C stops after the current pass\n"
+                 "  --watch-idle N         with --watch, stop after N passes without new photons\n"
+                 "                         (default: 0 = run until interrupted)\n"
+                 "  --stats-json FILE      write per-stage timings, per-file throughput, skipped-ray\n"
+                 "                         reasons and peak memory to FILE\n"
+                 "  --standard-errors      add the Monte Carlo standard error of every value to the\n"
+                 "                         matrix CSV (batch means over the chunks, which are\n"
+                 "                         made small enough for at least 32 of them)\n"
+                 "  --target-error REL     read chunks in random order and stop once every\n"
+                 "                         heliostat total has a relative standard error below REL\n"
+                 "                         (0 < REL < 1); values are scaled to the whole folder.\n"
+                 "                         Implies --standard-errors\n"
+                 "  --seed N               chunk order for --target-error (default: 1)\n"
+                 "  --link-rays            follow every ray through its photons' ids instead of\n"
+                 "                         reading it as consecutive records, for files written\n"
+                 "                         by multi-threaded tracers (rays interleaved or split\n"
+                 "                         across files)\n"
+                 "  --link-memory-mb N     with --link-rays: memory for ray pieces waiting to be\n"
+                 "                         linked before they spill to disk (default: 1024)\n"
+                 "  --spill-dir DIR        with --link-rays: where they spill (default: the\n"
+                 "                         system temporary directory)\n"
+                 "  --shard I/N            process only part I of N of the folder's files (split\n"
+                 "                         by size, 1 <= I <= N) and write its matrix to a partial\n"
+                 "                         result file for sttmerge; a ray belongs to the part it\n"
+                 "                         starts in\n"
+                 "  --input -|FILE         read the photon records from standard input (-) or a\n"
+                 "                         named pipe or file, front to back, as a tracer writes\n"
+                 "                         them, instead of a folder's photon files\n"
+                 "  --parameters FILE      with --input: the photons_parameters.txt of the records\n"
+                 "  --input-buffer-mb N    with --input: ring buffer the records are read into\n"
+                 "                         ahead of processing (default: 256)\n"
+                 "  --batch FILE           process every folder listed in FILE (lines of\n"
+                 "                         \"<folder> [weight]\") on one worker pool, writing a CSV\n"
+                 "                         per folder and annual_matrix.csv, the weighted sum, to\n"
+                 "                         <output_folder>\n";
+}
+
+// Parses a non-negative decimal integer; false on junk or overflow.
+static bool parseCount(const std::string& text, std::uint64_t& out)
+{
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) return false;
+    try {
+        out = std::stoull(text);
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Parses "A:B" into two finite numbers with A < B.
+static bool parseRange(const std::string& text, double& lo, double& hi)
+{
+    const std::size_t colon = text.find(':');
+    if (colon == std::string::npos) return false;
+    try {
+        std::size_t used = 0;
+        lo = std::stod(text.substr(0, colon), &used);
+        if (used != colon) return false;
+        hi = std::stod(text.substr(colon + 1), &used);
+        if (used != text.size() - colon - 1) return false;
+    } catch (const std::exception&) {
+        return false;
+    }
+    return std::isfinite(lo) && std::isfinite(hi) && lo < hi;
+}
+
+// Splits "A,B,C" into its non-empty items.
+static std::vector<std::string> splitList(const std::string& text)
+{
+    std::vector<std::string> items;
+    std::size_t start = 0;
+    while (start <= text.size()) {
+        const std::size_t comma = std::min(text.find(',', start), text.size());
+        if (comma > start) items.push_back(text.substr(start, comma - start));
+        start = comma + 1;
+    }
+    return items;
+}
+
+// Parses a number strictly between 0 and 1.
+static bool parseFraction(const std::string& text, double& out)
+{
+    try {
+        std::size_t used = 0;
+        out = std::stod(text, &used);
+        if (used != text.size()) return false;
+    } catch (const std::exception&) {
+        return false;
     }
+    return out > 0.0 && out < 1.0;
+}
+
+// Parses "I/N" with 1 <= I <= N into a 0-based shard index and a count.
+static bool parseShard(const std::string& text, unsigned& index, unsigned& count)
+{
+    const std::size_t slash = text.find('/');
+    std::uint64_t i = 0, n = 0;
+    if (slash == std::string::npos || !parseCount(text.substr(0, slash), i) || !parseCount(text.substr(slash + 1), n))
+        return false;
+    if (i < 1 || i > n || n > 1000000) return false;
+    index = static_cast<unsigned>(i - 1);
+    count = static_cast<unsigned>(n);
+    return true;
+}
+
+static bool isAnalyzerName(const std::string& name)
+{
+    for (const auto& entry : AnalyzerRegistry::instance().list())
+        if (entry.first == name) return true;
     return false;
 }
 
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void requestStop(int)
+{
+    stopRequested = 1;
+}
+
+// Processes the folder incrementally: once, or (with watchSeconds > 0) again every
+// watchSeconds until interrupted or idle for watchIdle passes. The outputs and the
+// checkpoint are rewritten after every pass that read new photons.
+// Returns false if the checkpoint could not be saved.
+static bool processIncrementally(PhotonProcessor& processor, const std::string& outputCsvFile,
+                                 const std::string& checkpointFile, unsigned watchSeconds, unsigned watchIdle)
+{
+    if (!checkpointFile.empty() && fs::exists(checkpointFile)) {
+        Checkpoint checkpoint;
+        if (checkpoint.load(checkpointFile) && processor.restore(checkpoint))
+            std::cout << "Resuming from checkpoint " << checkpointFile << " ("
+                      << processor.consumed().files.size() << " photon file(s) read so far)\n";
+        else
+            std::cerr << "Warning: checkpoint " << checkpointFile
+                      << " is unreadable or was saved for other parameters or modules; processing everything.\n";
+    }
+
+    if (watchSeconds > 0) {
+        std::signal(SIGINT, requestStop);
+        std::signal(SIGTERM, requestStop);
+    }
+
+    bool saved = true;
+    unsigned idlePasses = 0;
+    for (bool first = true;; first = false)
+    {
+        const bool grew = processor.update();
+        if (grew || first) {
+            processor.writeOutputs(outputCsvFile);
+            Checkpoint checkpoint;
+            if (!checkpointFile.empty()) {
+                if (processor.checkpoint(checkpoint) && checkpoint.save(checkpointFile)) {
+                    std::cout << "Checkpoint written to: " << checkpointFile << "\n";
+                } else {
+                    std::cerr << "Error writing checkpoint file: " << checkpointFile << "\n";
+                    saved = false;
+                }
+            }
+        }
+
+        idlePasses = grew ? 0 : idlePasses + 1;
+        if (watchSeconds == 0 || stopRequested || (watchIdle > 0 && idlePasses >= watchIdle)) break;
+
+        std::cout << "Watching " << processor.stats().folder << " for new photons (Ctrl+C to stop)...\n";
+        const auto wakeUp = std::chrono::steady_clock::now() + std::chrono::seconds(watchSeconds);
+        while (!stopRequested && std::chrono::steady_clock::now() < wakeUp)
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (stopRequested) break;
+    }
+    std::cout << "Finished.\n";
+    return saved;
+}
+
+static int invalidValue(const std::string& option, const std::string& value)
+{
+    std::cerr << "Error: invalid value \"" << value << "\" for " << option << ".\n";
+    printUsage();
+    return 64; // EX_USAGE
+}
+
 int main(int argc, char* argv[])
 {
-    if (argc != 3)
+    ProcessingOptions options;
+    std::vector<std::string> positional;
+    bool buildCache = false;
+    bool sharded = false;
+    std::string statsJsonFile;
+    bool fluxRangeSet = false;
+    std::string checkpointFile;
+    unsigned watchSeconds = 0;
+    unsigned watchIdle = 0;
+    std::string batchManifest;
+    std::string inputSource;
+    std::string parametersFile;
+    std::uint64_t inputBufferBytes = 256ull << 20;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        std::uint64_t n = 0;
+        if (arg == "--reader" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            if (value == "stream")      options.readerBackend = ReaderBackend::Stream;
+            else if (value == "mmap")   options.readerBackend = ReaderBackend::Mmap;
+            else if (value == "async")  options.readerBackend = ReaderBackend::Async;
+            else return invalidValue(arg, value);
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n)) return invalidValue(arg, argv[i]);
+            options.threads = static_cast<unsigned>(n);
+        }
+        else if (arg == "--chunk-mb" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n)) return invalidValue(arg, argv[i]);
+            options.chunkBytes = n << 20;
+        }
+        else if (arg == "--io-depth" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n) || n == 0) return invalidValue(arg, argv[i]);
+            options.asyncRead.queueDepth = static_cast<unsigned>(n);
+        }
+        else if (arg == "--io-buffer-kb" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n) || n == 0) return invalidValue(arg, argv[i]);
+            options.asyncRead.bufferBytes = static_cast<std::size_t>(n << 10);
+        }
+        else if (arg == "--direct-io")
+        {
+            options.asyncRead.directIo = true;
+        }
+        else if (arg == "--no-cache")
+        {
+            options.useCache = false;
+        }
+        else if (arg == "--build-cache")
+        {
+            buildCache = true;
+        }
+        else if (arg == "--analyze" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            const std::size_t eq = value.find('=');
+            if (eq == std::string::npos || eq + 1 == value.size() || !isAnalyzerName(value.substr(0, eq)))
+                return invalidValue(arg, value);
+            options.analyzers.push_back({ value.substr(0, eq), value.substr(eq + 1) });
+        }
+        else if (arg == "--list-analyzers")
+        {
+            for (const auto& [name, description] : AnalyzerRegistry::instance().list())
+                std::cout << "  " << name << std::string(name.size() < 10 ? 10 - name.size() : 1, ' ')
+                          << description << "\n";
+            return 0;
+        }
+        else if (arg == "--flux-map" && i + 1 < argc)
+        {
+            options.analyzers.push_back({ "flux", argv[++i] });
+        }
+        else if (arg == "--flux-plane" && i + 1 < argc)
+        {
+            if (!FluxMap::parsePlane(argv[++i], options.fluxMap.plane)) return invalidValue(arg, argv[i]);
+        }
+        else if (arg == "--flux-bins" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            const std::size_t x = value.find('x');
+            std::uint64_t nu = 0, nv = 0;
+            if (x == std::string::npos || !parseCount(value.substr(0, x), nu) || !parseCount(value.substr(x + 1), nv) ||
+                nu == 0 || nv == 0 || nu * nv > (1u << 24))
+                return invalidValue(arg, value);
+            options.fluxMap.binsU = static_cast<std::size_t>(nu);
+            options.fluxMap.binsV = static_cast<std::size_t>(nv);
+        }
+        else if (arg == "--flux-range" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            const std::size_t comma = value.find(',');
+            if (comma == std::string::npos ||
+                !parseRange(value.substr(0, comma), options.fluxMap.minU, options.fluxMap.maxU) ||
+                !parseRange(value.substr(comma + 1), options.fluxMap.minV, options.fluxMap.maxV))
+                return invalidValue(arg, value);
+            fluxRangeSet = true;
+        }
+        else if (arg == "--flux-per-heliostat")
+        {
+            options.fluxMap.perHeliostat = true;
+        }
+        else if (arg == "--export" && i + 1 < argc)
+        {
+            options.analyzers.push_back({ "export", argv[++i] });
+        }
+        else if ((arg == "--export-heliostats" || arg == "--export-receivers") && i + 1 < argc)
+        {
+            const std::vector<std::string> labels = splitList(argv[++i]);
+            if (labels.empty()) return invalidValue(arg, argv[i]);
+            (arg == "--export-heliostats" ? options.exportRays.heliostats : options.exportRays.receivers) = labels;
+        }
+        else if (arg == "--export-side" && i + 1 < argc)
+        {
+            if (!ExportAnalyzer::parseSide(argv[++i], options.exportRays.side)) return invalidValue(arg, argv[i]);
+        }
+        else if (arg == "--export-sample" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n) || n == 0) return invalidValue(arg, argv[i]);
+            options.exportRays.sampleEvery = n;
+        }
+        else if (arg == "--export-chunk-mb" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n)) return invalidValue(arg, argv[i]);
+            options.exportRays.chunkBytes = n << 20;
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc)
+        {
+            checkpointFile = argv[++i];
+        }
+        else if (arg == "--watch" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n) || n == 0 || n > 86400) return invalidValue(arg, argv[i]);
+            watchSeconds = static_cast<unsigned>(n);
+        }
+        else if (arg == "--watch-idle" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n) || n > 1000000) return invalidValue(arg, argv[i]);
+            watchIdle = static_cast<unsigned>(n);
+        }
+        else if (arg == "--batch" && i + 1 < argc)
+        {
+            batchManifest = argv[++i];
+        }
+        else if (arg == "--standard-errors")
+        {
+            options.standardErrors = true;
+        }
+        else if (arg == "--target-error" && i + 1 < argc)
+        {
+            if (!parseFraction(argv[++i], options.targetRelativeError)) return invalidValue(arg, argv[i]);
+            options.standardErrors = true;
+        }
+        else if (arg == "--seed" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], options.sampleSeed)) return invalidValue(arg, argv[i]);
+        }
+        else if (arg == "--link-rays")
+        {
+            options.linkRays = true;
+        }
+        else if (arg == "--link-memory-mb" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n) || n == 0 || n > (1ull << 40)) return invalidValue(arg, argv[i]);
+            options.linkMemoryBytes = n << 20;
+        }
+        else if (arg == "--spill-dir" && i + 1 < argc)
+        {
+            options.spillDirectory = argv[++i];
+        }
+        else if (arg == "--shard" && i + 1 < argc)
+        {
+            if (!parseShard(argv[++i], options.shardIndex, options.shardCount)) return invalidValue(arg, argv[i]);
+            sharded = true;
+        }
+        else if (arg == "--input" && i + 1 < argc)
+        {
+            inputSource = argv[++i];
+        }
+        else if (arg == "--parameters" && i + 1 < argc)
+        {
+            parametersFile = argv[++i];
+        }
+        else if (arg == "--input-buffer-mb" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n) || n == 0 || n > (1ull << 20)) return invalidValue(arg, argv[i]);
+            inputBufferBytes = n << 20;
+        }
+        else if (arg == "--stats-json" && i + 1 < argc)
+        {
+            statsJsonFile = argv[++i];
+            options.collectStats = true;
+        }
+        else if (arg.rfind("--", 0) == 0)
+        {
+            std::cerr << "Error: unknown or incomplete option \"" << arg << "\".\n";
+            printUsage();
+            return 64; // EX_USAGE
+        }
+        else
+        {
+            positional.push_back(arg);
+        }
+    }
+
+    const bool batch = !batchManifest.empty();
+    const bool piped = !inputSource.empty();
+    if (positional.size() != ((buildCache || batch || piped) ? 1u : 2u))
+    {
+        printUsage();
+        return 64; // EX_USAGE
+    }
+    if (piped != !parametersFile.empty())
     {
-        std::cerr << "Usage: STTAnalytics <photon_folder_path> <output_csv_file>\n";
+        std::cerr << "Error: --input and --parameters go together.\n";
+        printUsage();
         return 64; // EX_USAGE
     }
+    if (piped && (batch || buildCache || sharded || !checkpointFile.empty() || watchSeconds > 0 ||
+                  options.targetRelativeError > 0))
+    {
+        // Records that are read once, in order, and then gone
+        std::cerr << "Error: --input cannot be combined with --batch, --build-cache, --shard, --checkpoint,"
+                     " --watch or --target-error.\n";
+        printUsage();
+        return 64; // EX_USAGE
+    }
+    if (batch && (buildCache || !options.analyzers.empty() || !checkpointFile.empty() || watchSeconds > 0 ||
+                  !statsJsonFile.empty()))
+    {
+        std::cerr << "Error: --batch cannot be combined with --build-cache, --analyze, --flux-map, --export,"
+                     " --checkpoint, --watch or --stats-json.\n";
+        printUsage();
+        return 64; // EX_USAGE
+    }
+    if (options.targetRelativeError > 0 && (batch || buildCache || !options.analyzers.empty() ||
+                                            !checkpointFile.empty() || watchSeconds > 0))
+    {
+        // A sample of the chunks scales the matrix only, and is no point to resume from
+        std::cerr << "Error: --target-error cannot be combined with --batch, --build-cache, --analyze,"
+                     " --flux-map, --export, --checkpoint or --watch.\n";
+        printUsage();
+        return 64; // EX_USAGE
+    }
+    if (options.linkRays && (!checkpointFile.empty() || watchSeconds > 0 || options.targetRelativeError > 0))
+    {
+        // Ray pieces are only linked at the end of a pass over the whole folder
+        std::cerr << "Error: --link-rays cannot be combined with --checkpoint, --watch or --target-error.\n";
+        printUsage();
+        return 64; // EX_USAGE
+    }
+    if (sharded && (batch || buildCache || !options.analyzers.empty() || !checkpointFile.empty() || watchSeconds > 0 ||
+                    options.targetRelativeError > 0 || options.linkRays))
+    {
+        // A partial result holds the matrix of a fixed set of files, counted in one go
+        std::cerr << "Error: --shard cannot be combined with --batch, --build-cache, --analyze, --flux-map, --export,"
+                     " --checkpoint, --watch, --target-error or --link-rays.\n";
+        printUsage();
+        return 64; // EX_USAGE
+    }
+    const bool fluxRequested = std::any_of(options.analyzers.begin(), options.analyzers.end(),
+                                           [](const AnalyzerRequest& r) { return r.name == "flux"; });
+    if (fluxRequested && !fluxRangeSet)
+    {
+        std::cerr << "Error: flux maps need --flux-range.\n";
+        printUsage();
+        return 64; // EX_USAGE
+    }
+
+    if (batch)
+    {
+        try
+        {
+            const auto t0 = std::chrono::steady_clock::now();
+            BatchProcessor processor(readManifest(batchManifest), options);
+            const bool written = processor.run(positional[0]);
+            const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - t0).count();
+            std::cout << "Done. Wrote batch results to: " << positional[0] << "  (" << ms << " ms)\n";
+            return written ? 0 : 73; // EX_CANTCREAT
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "Exception: " << ex.what() << '\n';
+            return 1;
+        }
+    }
 
-    const std::string folderPath    = argv[1];
-    const std::string outputCsvFile = argv[2];
+    const std::string folderPath    = piped ? inputSource : positional[0];
+    const std::string outputCsvFile = buildCache ? std::string() : positional[piped ? 0 : 1];
 
     try
     {
         const fs::path folder(folderPath);
 
         // Basic input validation
-        if (!fs::exists(folder) || !fs::is_directory(folder)) {
+        if (!piped && (!fs::exists(folder) || !fs::is_directory(folder))) {
             std::cerr << "Error: \"" << folderPath << "\" is not a directory or does not exist.\n";
             return 66; // EX_NOINPUT
         }
 
-        const fs::path params = folder / "photons_parameters.txt";
+        const fs::path params = piped ? fs::path(parametersFile) : folder / "photons_parameters.txt";
         if (!fs::exists(params) || !fs::is_regular_file(params)) {
             std::cerr << "Error: parameters file not found at " << params << "\n";
             return 66; // EX_NOINPUT
         }
 
-        if (!hasPhotonDataFiles(folder)) {
-            std::cerr << "Error: no photon data files (photons_*.dat) found in " << folderPath << "\n";
+        // A watched folder may not have its first photon file yet
+        if (!piped && !hasPhotonDataFiles(folder) && watchSeconds == 0) {
+            std::cerr << "Error: no photon data files (photons_*.dat[.gz|.zst]) found in " << folderPath << "\n";
             return 66; // EX_NOINPUT
         }
 
-        // Construct and read parameters
-        ParametersFileReader reader(folderPath);
-        reader.read();
+        const auto runStart = std::chrono::steady_clock::now();
+
+        // Construct and read parameters. The reader holds the file text, which is
+        // only needed until the surfaces are classified.
+        const StageStamp parametersStart = StageStamp::now();
+        auto reader = std::make_unique<ParametersFileReader>(params.string());
+        reader->read();
+        const StageTime parametersTime = StageStamp::now() - parametersStart;
+
+        if (buildCache) {
+            const auto t0 = std::chrono::steady_clock::now();
+            PhotonCache::build(folder, reader->getFingerprint(), reader->getLayout());
+            const auto t1 = std::chrono::steady_clock::now();
+            const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count();
+            std::cout << "Done. Wrote cache: " << PhotonCache::cachePath(folder).string()
+                      << "  (" << ms << " ms)\n";
+            return 0;
+        }
+        options.parametersFingerprint = reader->getFingerprint();
+        options.layout = reader->getLayout();
+        const std::uint64_t surfacesFingerprint = reader->getSurfacesFingerprint();
 
         // Get surface map and power per photon
-        SurfaceMap surfaceMap(reader.getSurfaceMap());
-        const double powerPerPhoton = reader.getPowerPerPhoton();
+        const StageStamp surfaceMapStart = StageStamp::now();
+        SurfaceMap surfaceMap(reader->getSurfaces());
+        const StageTime surfaceMapTime = StageStamp::now() - surfaceMapStart;
+        const double powerPerPhoton = reader->getPowerPerPhoton();
+        reader.reset();
 
         if (powerPerPhoton <= 0.0) {
             std::cerr << "Error: invalid power per photon (" << powerPerPhoton << ").\n";
@@ -73,28 +617,69 @@ int main(int argc, char* argv[])
                   << " surfaces.\n";
 
         // Optional: list receivers once (useful sanity check)
-        const auto& receiverMap = surfaceMap.getReceiverNamesMap();
-        if (receiverMap.empty()) {
+        const std::vector<uint64_t>& receiverIds = surfaceMap.getReceiverIds();
+        if (receiverIds.empty()) {
             std::cerr << "Warning: No receivers detected in surface map.\n";
         } else {
             std::cout << "Receivers:\n";
-            for (const auto& [id, name] : receiverMap)
-                std::cout << "  - ID " << id << " : " << name << '\n';
+            for (const uint64_t id : receiverIds)
+                std::cout << "  - ID " << id << " : " << surfaceMap.getReceiverName(id) << '\n';
         }
 
         std::cout << "Power per photon: " << powerPerPhoton << " (units from parameters file)\n";
-        std::cout << "Streaming photon data from: " << folderPath << '\n';
+        // A named pipe opens once its writer does
+        std::unique_ptr<PhotonStream> input;
+        if (piped) input = std::make_unique<PhotonStream>(inputSource, options.layout.recordBytes(),
+                                                          static_cast<std::size_t>(inputBufferBytes));
+        std::cout << "Streaming photon data from: " << (input ? input->name() : folderPath) << '\n';
 
         const auto t0 = std::chrono::steady_clock::now();
 
-        PhotonProcessor processor(folderPath, surfaceMap, powerPerPhoton);
-        processor.processPhotons(outputCsvFile);
+        PhotonProcessor processor(input ? input->name() : folderPath, surfaceMap, powerPerPhoton, options);
+        bool checkpointSaved = true;
+        bool partialSaved = true;
+        if (input) {
+            processor.run(*input);
+            processor.writeOutputs(outputCsvFile);
+            std::cout << "Finished.\n";
+        }
+        else if (sharded) {
+            processor.run();
+            PartialResult partial;
+            partialSaved = processor.partialResult(partial);
+            partial.surfacesFingerprint = surfacesFingerprint;
+            if (partialSaved && partial.save(outputCsvFile)) {
+                std::cout << "Partial result " << options.shardIndex + 1 << "/" << options.shardCount
+                          << " written to: " << outputCsvFile << "\n";
+            } else {
+                std::cerr << "Error writing partial result file: " << outputCsvFile << "\n";
+                partialSaved = false;
+            }
+        }
+        else if (checkpointFile.empty() && watchSeconds == 0)
+            processor.processPhotons(outputCsvFile);
+        else
+            checkpointSaved = processIncrementally(processor, outputCsvFile, checkpointFile, watchSeconds, watchIdle);
 
         const auto t1 = std::chrono::steady_clock::now();
         const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count();
 
-        std::cout << "Done. Wrote CSV: " << outputCsvFile << "  (" << ms << " ms)\n";
-        return 0;
+        std::cout << "Done. Wrote " << (sharded ? "partial result: " : "CSV: ") << outputCsvFile << "  (" << ms
+                  << " ms)\n";
+
+        if (!statsJsonFile.empty()) {
+            RunStats stats = processor.stats();
+            stats.stages[RunStats::Parameters]      = parametersTime;
+            stats.stages[RunStats::SurfaceMapBuild] = surfaceMapTime;
+            const double wallSeconds =
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count();
+            if (!stats.writeJson(statsJsonFile, wallSeconds)) {
+                std::cerr << "Error writing statistics file: " << statsJsonFile << "\n";
+                return 73; // EX_CANTCREAT
+            }
+            std::cout << "Statistics written to: " << statsJsonFile << "\n";
+        }
+        return (checkpointSaved && partialSaved) ? 0 : 73; // EX_CANTCREAT
     }
     catch (const std::exception& ex)
     {
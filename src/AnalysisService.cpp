@@ -0,0 +1,513 @@
+#include "AnalysisService.h"
+
+#include "FluxMap.h"
+#include "ParametersFileReader.h"
+#include "PhotonCache.h"
+#include "PhotonProcessor.h"
+#include "RayAccumulator.h"
+#include "SurfaceMap.h"
+#include "tonatiuhreader.h"
+#include "WorkStealingPool.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+namespace {
+
+// Photons read from the beginning of a folder before its dataset is built: the
+// cost of building one is only worth it for a folder queried again
+constexpr unsigned kFullReadsBeforeDataset = 1;
+
+// Approximate bytes of a photon in a photon cache (id, x, y, z, side, surface)
+constexpr std::uint64_t kCacheBytesPerPhoton = 8 * 4 + 1 + 4;
+
+std::string trim(const std::string& s)
+{
+    std::size_t begin = 0, end = s.size();
+    while (begin < end && std::isspace(static_cast<unsigned char>(s[begin]))) ++begin;
+    while (end > begin && std::isspace(static_cast<unsigned char>(s[end - 1]))) --end;
+    return s.substr(begin, end - begin);
+}
+
+// Parses "A:B" into two finite numbers with A < B.
+bool parseRange(const std::string& text, double& lo, double& hi)
+{
+    const std::size_t colon = text.find(':');
+    if (colon == std::string::npos) return false;
+    try {
+        std::size_t used = 0;
+        lo = std::stod(text.substr(0, colon), &used);
+        if (used != colon) return false;
+        hi = std::stod(text.substr(colon + 1), &used);
+        if (used != text.size() - colon - 1) return false;
+    } catch (const std::exception&) {
+        return false;
+    }
+    return std::isfinite(lo) && std::isfinite(hi) && lo < hi;
+}
+
+// Parses "NUxNV" with both counts in [1, 100000].
+bool parseBins(const std::string& text, std::size_t& u, std::size_t& v)
+{
+    const std::size_t x = text.find('x');
+    if (x == std::string::npos) return false;
+    try {
+        std::size_t used = 0;
+        const unsigned long nu = std::stoul(text.substr(0, x), &used);
+        if (used != x) return false;
+        const unsigned long nv = std::stoul(text.substr(x + 1), &used);
+        if (used != text.size() - x - 1) return false;
+        if (nu < 1 || nv < 1 || nu > 100000 || nv > 100000) return false;
+        u = nu;
+        v = nv;
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+// 64-bit FNV-1a of a folder path, in hex: names its dataset file
+std::string folderHash(const std::string& folder)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char ch : folder) {
+        hash ^= ch;
+        hash *= 1099511628211ull;
+    }
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(hash));
+    return text;
+}
+
+} // namespace
+
+// One parsed request line
+struct AnalysisService::Query
+{
+    enum Kind { Matrix, Flux, Status, Forget };
+
+    Kind           kind = Matrix;
+    std::string    folder;             // absolute and normalized
+    bool           standardErrors = false;
+    FluxMapOptions fluxMap;
+    bool           binary = false;     // flux maps in the binary format
+
+    // Identifies the result a matrix or flux query is answered from
+    std::string settings() const
+    {
+        std::ostringstream out;
+        if (kind == Flux) {
+            out << "flux " << FluxMap::planeName(fluxMap.plane) << " " << fluxMap.binsU << "x" << fluxMap.binsV
+                << " " << fluxMap.minU << ":" << fluxMap.maxU << "," << fluxMap.minV << ":" << fluxMap.maxV
+                << (fluxMap.perHeliostat ? " per-heliostat" : "");
+        } else {
+            out << "matrix" << (standardErrors ? " standard-errors" : "");
+        }
+        return out.str();
+    }
+
+    // Throws std::invalid_argument on a malformed request
+    static Query parse(const std::string& line)
+    {
+        std::istringstream in(line);
+        std::string command;
+        in >> command;
+
+        Query query;
+        if (command == "matrix")      query.kind = Matrix;
+        else if (command == "flux")   query.kind = Flux;
+        else if (command == "status") query.kind = Status;
+        else if (command == "forget") query.kind = Forget;
+        else throw std::invalid_argument("Unknown request \"" + command + "\" (matrix, flux, status or forget)");
+
+        // Options, then the folder: the rest of the line
+        bool rangeSet = false;
+        for (;;) {
+            in >> std::ws;
+            if (in.peek() != '-') break;
+            std::string option, value;
+            in >> option;
+            const bool takesValue = option == "--flux-range" || option == "--flux-plane" || option == "--flux-bins";
+            if (takesValue && !(in >> value)) throw std::invalid_argument("Missing value for " + option);
+
+            if (query.kind == Matrix && option == "--standard-errors") {
+                query.standardErrors = true;
+            } else if (query.kind == Flux && option == "--flux-range") {
+                const std::size_t comma = value.find(',');
+                if (comma == std::string::npos ||
+                    !parseRange(value.substr(0, comma), query.fluxMap.minU, query.fluxMap.maxU) ||
+                    !parseRange(value.substr(comma + 1), query.fluxMap.minV, query.fluxMap.maxV))
+                    throw std::invalid_argument("Invalid value \"" + value + "\" for --flux-range");
+                rangeSet = true;
+            } else if (query.kind == Flux && option == "--flux-plane") {
+                if (!FluxMap::parsePlane(value, query.fluxMap.plane))
+                    throw std::invalid_argument("Invalid value \"" + value + "\" for --flux-plane");
+            } else if (query.kind == Flux && option == "--flux-bins") {
+                if (!parseBins(value, query.fluxMap.binsU, query.fluxMap.binsV))
+                    throw std::invalid_argument("Invalid value \"" + value + "\" for --flux-bins");
+            } else if (query.kind == Flux && option == "--flux-per-heliostat") {
+                query.fluxMap.perHeliostat = true;
+            } else if (query.kind == Flux && option == "--binary") {
+                query.binary = true;
+            } else {
+                throw std::invalid_argument("Unknown option " + option + " for " + command);
+            }
+        }
+
+        std::string rest;
+        std::getline(in, rest);
+        rest = trim(rest);
+        if (query.kind == Status) {
+            if (!rest.empty()) throw std::invalid_argument("status takes no arguments");
+            return query;
+        }
+        if (rest.empty()) throw std::invalid_argument(command + " needs a photon folder");
+        if (query.kind == Flux && !rangeSet) throw std::invalid_argument("flux needs --flux-range");
+        query.folder = fs::absolute(fs::path(rest)).lexically_normal().string();
+        while (query.folder.size() > 1 && (query.folder.back() == '/' || query.folder.back() == '\\'))
+            query.folder.pop_back();
+        return query;
+    }
+};
+
+// The parameters of a folder
+struct AnalysisService::Surfaces
+{
+    std::string                 folder;
+    std::uintmax_t              parametersSize = 0;
+    fs::file_time_type          parametersTime;
+    std::unique_ptr<SurfaceMap> surfaceMap;
+    double                      powerPerPhoton = 0.0;
+    std::uint64_t               fingerprint = 0;
+    PhotonLayout                layout;
+    unsigned                    fullReads = 0;  // passes that read the folder from the beginning
+};
+
+// A photon cache of a folder; one the service built is removed with it
+struct AnalysisService::Dataset
+{
+    std::shared_ptr<PhotonCache> cache;
+    fs::path                     builtFile;
+
+    ~Dataset()
+    {
+        cache.reset();
+        std::error_code ec;
+        if (!builtFile.empty()) fs::remove(builtFile, ec);
+    }
+};
+
+// The running results of one query setting on one folder
+struct AnalysisService::Result
+{
+    std::string                      key;
+    std::shared_ptr<Surfaces>        surfaces;
+    std::unique_ptr<PhotonProcessor> processor;
+};
+
+AnalysisService::AnalysisService(const ServiceOptions& options)
+    : m_options(options), m_pool(std::make_unique<WorkStealingPool>(options.threads))
+{
+    if (!m_options.datasetDirectory.empty()) fs::create_directories(m_options.datasetDirectory);
+}
+
+AnalysisService::~AnalysisService() = default;
+
+std::vector<AnalysisService::Reply> AnalysisService::answer(const std::vector<std::string>& requests)
+{
+    std::vector<Reply> replies(requests.size());
+    std::vector<Query> queries(requests.size());
+    std::vector<std::shared_ptr<Result>> targets(requests.size());
+    std::vector<Result*> pending;   // distinct results to bring up to date
+
+    for (std::size_t i = 0; i < requests.size(); ++i)
+    {
+        try {
+            queries[i] = Query::parse(requests[i]);
+            const Query& query = queries[i];
+            if (query.kind == Query::Forget) {
+                replies[i] = Reply{ true, "Forgot " + std::to_string(forget(query.folder)) + " entries\n" };
+            } else if (query.kind != Query::Status) {
+                ++m_queries;
+                targets[i] = resultFor(query, surfacesFor(query.folder));
+                if (std::find(pending.begin(), pending.end(), targets[i].get()) == pending.end())
+                    pending.push_back(targets[i].get());
+            }
+        } catch (const std::exception& ex) {
+            replies[i] = Reply{ false, ex.what() };
+        }
+    }
+
+    // Results that start from the beginning read the folder's dataset, if any
+    std::vector<std::shared_ptr<Dataset>> datasets;
+    for (Result* result : pending) {
+        if (result->processor->result()) continue;
+        Surfaces& surfaces = *result->surfaces;
+        if (std::shared_ptr<Dataset> dataset = datasetFor(surfaces, surfaces.fullReads >= kFullReadsBeforeDataset)) {
+            result->processor->useCache(dataset->cache);
+            datasets.push_back(std::move(dataset));
+        }
+        ++surfaces.fullReads;
+    }
+
+    std::vector<std::string> errors(pending.size());
+    run(pending, errors);
+    for (Result* result : pending) result->processor->useCache(nullptr);
+    datasets.clear();
+
+    for (std::size_t i = 0; i < requests.size(); ++i)
+    {
+        if (queries[i].kind == Query::Status && replies[i].body.empty()) {
+            replies[i] = Reply{ true, status() };
+            continue;
+        }
+        if (!targets[i]) continue;
+        const std::size_t p = static_cast<std::size_t>(
+            std::find(pending.begin(), pending.end(), targets[i].get()) - pending.begin());
+        if (!errors[p].empty()) replies[i] = Reply{ false, errors[p] };
+        else                    replies[i] = Reply{ true, render(queries[i], *targets[i]) };
+    }
+
+    // Failed results start over next time
+    for (std::size_t p = 0; p < pending.size(); ++p)
+        if (!errors[p].empty()) {
+            const auto it = m_index.find(pending[p]->key);
+            if (it != m_index.end()) erase(it->second);
+        }
+    evict();
+    return replies;
+}
+
+void AnalysisService::run(const std::vector<Result*>& results, std::vector<std::string>& errors)
+{
+    if (results.empty()) return;
+
+    std::vector<PhotonProcessor*> processors;
+    for (Result* result : results) processors.push_back(result->processor.get());
+    try {
+        PhotonProcessor::updateAll(processors, *m_pool);
+        return;
+    } catch (const std::exception&) {
+        // Nothing was merged: find out which folder failed, one at a time
+    }
+    for (std::size_t p = 0; p < processors.size(); ++p) {
+        try {
+            PhotonProcessor::updateAll({ processors[p] }, *m_pool);
+        } catch (const std::exception& ex) {
+            errors[p] = ex.what();
+        }
+    }
+}
+
+std::shared_ptr<AnalysisService::Surfaces> AnalysisService::surfacesFor(const std::string& folder)
+{
+    const fs::path parameters = fs::path(folder) / "photons_parameters.txt";
+    std::error_code ec;
+    const std::uintmax_t size = fs::file_size(parameters, ec);
+    if (ec) throw std::runtime_error("Parameters file not found in " + folder);
+    const fs::file_time_type time = fs::last_write_time(parameters, ec);
+
+    const std::string key = "surfaces\t" + folder;
+    if (Entry* entry = find(key)) {
+        if (entry->surfaces->parametersSize == size && entry->surfaces->parametersTime == time) {
+            ++entry->hits;
+            return entry->surfaces;
+        }
+        // Everything kept for the folder was computed with the old parameters
+        forget(folder);
+    }
+
+    ParametersFileReader reader(folder);
+    reader.read();
+    if (reader.getPowerPerPhoton() <= 0.0) throw std::runtime_error("Invalid power per photon in " + folder);
+
+    auto surfaces = std::make_shared<Surfaces>();
+    surfaces->folder         = folder;
+    surfaces->parametersSize = size;
+    surfaces->parametersTime = time;
+    surfaces->surfaceMap     = std::make_unique<SurfaceMap>(reader.getSurfaces());
+    surfaces->powerPerPhoton = reader.getPowerPerPhoton();
+    surfaces->fingerprint    = reader.getFingerprint();
+    surfaces->layout         = reader.getLayout();
+
+    // The file text is dropped; the map takes about an index entry per surface
+    const std::uint64_t bytes = sizeof(Surfaces) + 16 * surfaces->surfaceMap->getTotalSurfaceCount();
+    insert(Entry{ key, folder, bytes, 1, surfaces, nullptr, nullptr });
+    return surfaces;
+}
+
+std::shared_ptr<AnalysisService::Result> AnalysisService::resultFor(const Query& query,
+                                                                    const std::shared_ptr<Surfaces>& surfaces)
+{
+    const std::string key = "result\t" + query.folder + "\t" + query.settings();
+    if (Entry* entry = find(key)) {
+        ++entry->hits;
+        return entry->result;
+    }
+    if (TonatiuhReader::ListPhotonFiles(query.folder).empty())
+        throw std::runtime_error("No photon data files (photons_*.dat[.gz|.zst]) found in " + query.folder);
+
+    ProcessingOptions options;
+    options.readerBackend         = m_options.readerBackend;
+    options.chunkBytes            = m_options.chunkBytes;
+    options.threads               = m_options.threads;
+    options.verbose               = false;
+    options.layout                = surfaces->layout;
+    options.parametersFingerprint = surfaces->fingerprint;
+    options.standardErrors        = query.standardErrors;
+    if (query.kind == Query::Flux) {
+        options.analyzers.push_back({ "flux", std::string() });
+        options.fluxMap = query.fluxMap;
+    }
+
+    auto result = std::make_shared<Result>();
+    result->key       = key;
+    result->surfaces  = surfaces;
+    result->processor = std::make_unique<PhotonProcessor>(query.folder, *surfaces->surfaceMap,
+                                                          surfaces->powerPerPhoton, options);
+
+    // The merged states: the matrix (three numbers a cell with standard errors)
+    // and the flux maps
+    const SurfaceMap& map = *surfaces->surfaceMap;
+    const std::uint64_t heliostats = map.getHeliostatLabels().size();
+    const std::uint64_t receivers  = map.getReceiverLabels().size();
+    std::uint64_t bytes = sizeof(Result) + heliostats * receivers * 8 * (query.standardErrors ? 3 : 1);
+    if (query.kind == Query::Flux)
+        bytes += receivers * (query.fluxMap.perHeliostat ? heliostats : 1) *
+                 (query.fluxMap.binsU * query.fluxMap.binsV + 1) * 8;
+    insert(Entry{ key, query.folder, bytes, 1, nullptr, nullptr, result });
+    return result;
+}
+
+std::shared_ptr<AnalysisService::Dataset> AnalysisService::datasetFor(const Surfaces& surfaces, bool build)
+{
+    const std::string& folder = surfaces.folder;
+    const std::string key = "dataset\t" + folder;
+    if (Entry* entry = find(key)) {
+        if (entry->dataset->cache->isFresh(folder)) {
+            ++entry->hits;
+            return entry->dataset;
+        }
+        erase(m_index.at(key));
+    }
+
+    // The folder's own cache, one built by an earlier run of the service, or a new one
+    auto dataset = std::make_shared<Dataset>();
+    dataset->cache = std::make_shared<PhotonCache>();
+    if (!fs::exists(PhotonCache::cachePath(folder)) || !dataset->cache->open(folder, surfaces.fingerprint)) {
+        if (m_options.datasetDirectory.empty()) return nullptr;
+        const fs::path file = m_options.datasetDirectory / (folderHash(folder) + ".sttc");
+        if (!fs::exists(file) || !dataset->cache->open(folder, surfaces.fingerprint, file)) {
+            if (!build) return nullptr;
+
+            // Not for folders that would not fit (compressed ones count their compressed size)
+            std::uint64_t photons = 0;
+            for (const fs::directory_entry& entry : TonatiuhReader::ListPhotonFiles(folder))
+                photons += entry.file_size() / surfaces.layout.recordBytes();
+            if (photons * kCacheBytesPerPhoton > m_options.memoryBytes) return nullptr;
+
+            try {
+                PhotonCache::build(folder, surfaces.fingerprint, surfaces.layout, file);
+            } catch (const std::exception& ex) {
+                std::cerr << "Warning: no dataset for " << folder << ": " << ex.what() << "\n";
+                std::error_code ec;
+                fs::remove(file, ec);
+                return nullptr;
+            }
+            if (!dataset->cache->open(folder, surfaces.fingerprint, file)) return nullptr;
+        }
+        dataset->builtFile = file;
+    }
+
+    insert(Entry{ key, folder, dataset->cache->mappedBytes(), 1, nullptr, dataset, nullptr });
+    return dataset;
+}
+
+std::string AnalysisService::render(const Query& query, const Result& result) const
+{
+    const PhotonProcessor& processor = *result.processor;
+    const double powerPerPhoton = result.surfaces->powerPerPhoton;
+    std::ostringstream out(std::ios::binary);
+    if (query.kind == Query::Flux) {
+        const FluxMap& maps = static_cast<const FluxMap&>(*processor.moduleResult("flux"));
+        if (query.binary) maps.writeBinary(out, powerPerPhoton);
+        else              maps.writeCsv(out, powerPerPhoton);
+    } else {
+        writeMatrixCsv(*processor.result(), powerPerPhoton, out);
+    }
+    return out.str();
+}
+
+std::string AnalysisService::status() const
+{
+    std::ostringstream out;
+    out << "Kind, Folder, Settings, Bytes, Uses\n";
+    for (const Entry& entry : m_entries) {
+        const std::size_t tab = entry.key.find('\t');
+        const std::size_t settings = entry.key.find('\t', tab + 1);
+        out << entry.key.substr(0, tab) << ", " << entry.folder << ", "
+            << (settings == std::string::npos ? std::string() : entry.key.substr(settings + 1)) << ", "
+            << entry.bytes << ", " << entry.hits << "\n";
+    }
+    out << "Total, , " << m_entries.size() << " entries; budget " << m_options.memoryBytes << " bytes; "
+        << m_evictions << " evictions, " << m_bytes << ", " << m_queries << "\n";
+    return out.str();
+}
+
+AnalysisService::Entry* AnalysisService::find(const std::string& key)
+{
+    const auto it = m_index.find(key);
+    if (it == m_index.end()) return nullptr;
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    return &m_entries.front();
+}
+
+AnalysisService::Entry& AnalysisService::insert(Entry entry)
+{
+    m_bytes += entry.bytes;
+    m_entries.push_front(std::move(entry));
+    m_index[m_entries.front().key] = m_entries.begin();
+    return m_entries.front();
+}
+
+void AnalysisService::erase(EntryList::iterator it)
+{
+    m_bytes -= it->bytes;
+    m_index.erase(it->key);
+    m_entries.erase(it);
+}
+
+std::size_t AnalysisService::forget(const std::string& folder)
+{
+    std::size_t forgotten = 0;
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+        const auto next = std::next(it);
+        if (it->folder == folder) {
+            erase(it);
+            ++forgotten;
+        }
+        it = next;
+    }
+    return forgotten;
+}
+
+void AnalysisService::evict()
+{
+    // Least recently used first; surface tables stay while a kept result uses them
+    auto it = m_entries.end();
+    while (m_bytes > m_options.memoryBytes && it != m_entries.begin()) {
+        --it;
+        if (it->surfaces && it->surfaces.use_count() > 1) continue;
+        const auto victim = it++;
+        erase(victim);
+        ++m_evictions;
+    }
+}
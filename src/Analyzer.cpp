@@ -0,0 +1,49 @@
+#include "Analyzer.h"
+
+#include "BounceAnalyzer.h"
+#include "FluxMap.h"
+#include "ImageMoments.h"
+#include "PhotonExport.h"
+#include "RayAccumulator.h"
+
+#include <utility>
+
+AnalyzerRegistry::AnalyzerRegistry()
+{
+    add("matrix", "heliostat x receiver power matrix (CSV)",
+        [](const AnalyzerContext& c) { return std::make_unique<MatrixAnalyzer>(c); });
+    add("flux", "receiver flux maps (CSV grids or binary, see --flux-*)",
+        [](const AnalyzerContext& c) { return std::make_unique<FluxAnalyzer>(c); });
+    add("bounces", "rays by number of heliostat reflections and by outcome (CSV)",
+        [](const AnalyzerContext& c) { return std::make_unique<BounceAnalyzer>(c); });
+    add("images", "centroid, covariance and radial spread of each heliostat's image on each receiver "
+                  "(CSV or binary)",
+        [](const AnalyzerContext& c) { return std::make_unique<ImageAnalyzer>(c); });
+    add("export", "filtered, optionally subsampled ray hits as binary chunk files and an index in a "
+                  "directory (see --export-*)",
+        [](const AnalyzerContext& c) { return std::make_unique<ExportAnalyzer>(c); });
+}
+
+AnalyzerRegistry& AnalyzerRegistry::instance()
+{
+    static AnalyzerRegistry registry;
+    return registry;
+}
+
+void AnalyzerRegistry::add(const std::string& name, const std::string& description, Factory factory)
+{
+    m_entries[name] = Entry{ description, std::move(factory) };
+}
+
+std::unique_ptr<Analyzer> AnalyzerRegistry::create(const std::string& name, const AnalyzerContext& context) const
+{
+    const auto it = m_entries.find(name);
+    return (it != m_entries.end()) ? it->second.factory(context) : nullptr;
+}
+
+std::vector<std::pair<std::string, std::string>> AnalyzerRegistry::list() const
+{
+    std::vector<std::pair<std::string, std::string>> names;
+    for (const auto& [name, entry] : m_entries) names.emplace_back(name, entry.description);
+    return names;
+}
@@ -0,0 +1,405 @@
+#include "AsyncFileReader.h"
+
+#include "tonatiuhreader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+#ifdef STT_HAVE_LIBURING
+#  include <liburing.h>
+#endif
+
+namespace {
+
+constexpr std::size_t kPageAlignment = 4096; // O_DIRECT offset/size/address alignment
+
+std::uint64_t alignDown(std::uint64_t v, std::uint64_t a) { return v - v % a; }
+std::uint64_t alignUp(std::uint64_t v, std::uint64_t a)   { return (v + a - 1) / a * a; }
+
+std::intptr_t openForRead(const fs::path& path, bool direct)
+{
+#ifdef _WIN32
+    const DWORD flags = FILE_FLAG_SEQUENTIAL_SCAN | (direct ? FILE_FLAG_NO_BUFFERING : 0);
+    HANDLE h = ::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+    return (h == INVALID_HANDLE_VALUE) ? -1 : reinterpret_cast<std::intptr_t>(h);
+#else
+    int flags = O_RDONLY;
+#  ifdef O_DIRECT
+    if (direct) flags |= O_DIRECT;
+#  else
+    (void)direct;
+#  endif
+    return ::open(path.c_str(), flags);
+#endif
+}
+
+void closeFile(std::intptr_t handle)
+{
+#ifdef _WIN32
+    ::CloseHandle(reinterpret_cast<HANDLE>(handle));
+#else
+    ::close(static_cast<int>(handle));
+#endif
+}
+
+// Positional read; returns bytes read (0 at EOF) or -1 on error.
+long long readAt(std::intptr_t handle, unsigned char* dst, std::size_t bytes, std::uint64_t offset)
+{
+#ifdef _WIN32
+    OVERLAPPED ov{};
+    ov.Offset     = static_cast<DWORD>(offset);
+    ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD got = 0;
+    const DWORD want = static_cast<DWORD>(std::min<std::size_t>(bytes, 1u << 30));
+    if (!::ReadFile(reinterpret_cast<HANDLE>(handle), dst, want, &got, &ov))
+        return (::GetLastError() == ERROR_HANDLE_EOF) ? 0 : -1;
+    return got;
+#else
+    while (true) {
+        const ssize_t n = ::pread(static_cast<int>(handle), dst, bytes, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        return n;
+    }
+#endif
+}
+
+} // namespace
+
+struct AsyncFileReader::Slot
+{
+    enum class State { Free, Reading, Ready };
+
+    std::vector<unsigned char> storage;
+    unsigned char* mem = nullptr;      // aligned start of storage
+    std::size_t    capacity = 0;
+
+    State         state = State::Free;
+    std::uint64_t seq = 0;
+    std::intptr_t handle = -1;         // of the file read
+    fs::path      path;
+    std::uint64_t physOffset = 0;      // file offset of mem[0]
+    std::size_t   physLength = 0;      // bytes requested at physOffset
+    std::size_t   got = 0;             // bytes actually read
+    std::string   error;
+};
+
+#ifdef STT_HAVE_LIBURING
+struct AsyncFileReader::Ring
+{
+    io_uring ring{};
+    unsigned inflight = 0;
+    ~Ring() { io_uring_queue_exit(&ring); }
+};
+#else
+struct AsyncFileReader::Ring {};
+#endif
+
+AsyncFileReader::AsyncFileReader(const std::vector<PhotonFileChunk>& ranges, const AsyncReadOptions& options)
+    : m_options(options)
+{
+    m_options.queueDepth  = std::max(1u, m_options.queueDepth);
+    m_options.bufferBytes = static_cast<std::size_t>(
+        alignUp(std::max<std::size_t>(m_options.bufferBytes, kPageAlignment), kPageAlignment)); // whole records too
+    m_alignment = m_options.directIo ? kPageAlignment : 1;
+
+    planRequests(ranges);
+
+    // Fixed pool: one buffer per in-flight read, with room for alignment slack
+    const std::size_t capacity = m_options.bufferBytes + 2 * kPageAlignment;
+    const unsigned slots = static_cast<unsigned>(
+        m_requests.empty() ? m_options.queueDepth : std::min<std::size_t>(m_options.queueDepth, m_requests.size()));
+    for (unsigned i = 0; i < slots; ++i) {
+        auto slot = std::make_unique<Slot>();
+        slot->storage.resize(capacity + kPageAlignment);
+        const auto addr = reinterpret_cast<std::uintptr_t>(slot->storage.data());
+        slot->mem = slot->storage.data() + (alignUp(addr, kPageAlignment) - addr);
+        slot->capacity = capacity;
+        m_slots.push_back(std::move(slot));
+    }
+
+    if (initRing()) return;
+
+    // pread engine: a few threads keep several reads in flight
+    const unsigned threads = std::min(4u, static_cast<unsigned>(m_slots.size()));
+    for (unsigned t = 0; t < threads; ++t)
+        m_threads.emplace_back(&AsyncFileReader::ioThread, this);
+}
+
+AsyncFileReader::~AsyncFileReader()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    for (std::thread& t : m_threads) t.join();
+
+#ifdef STT_HAVE_LIBURING
+    // Drain reads still owned by the kernel before their buffers go away
+    if (m_ring) {
+        while (m_ring->inflight > 0) {
+            io_uring_cqe* cqe = nullptr;
+            if (io_uring_wait_cqe(&m_ring->ring, &cqe) < 0) break;
+            io_uring_cqe_seen(&m_ring->ring, cqe);
+            --m_ring->inflight;
+        }
+    }
+#endif
+    m_ring.reset();
+
+    for (OpenFile& f : m_files)
+        if (f.opened && f.handle >= 0) closeFile(f.handle);
+}
+
+const char* AsyncFileReader::engine() const
+{
+    return m_ring ? "io_uring" : "pread";
+}
+
+std::size_t AsyncFileReader::append(const std::vector<PhotonFileChunk>& ranges)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const std::size_t first = m_paths.size();
+    planRequests(ranges);
+    m_cv.notify_all();
+    return first;
+}
+
+void AsyncFileReader::cancel()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    releaseHeld();
+
+    // Reads not started are dropped; those in flight are waited for before
+    // their files are closed
+    const std::size_t firstDropped = (m_next_deliver < m_requests.size())
+                                         ? m_requests[static_cast<std::size_t>(m_next_deliver)].range
+                                         : m_files.size();
+    m_requests.resize(static_cast<std::size_t>(m_next_submit));
+    for (; m_next_deliver < m_next_submit; ++m_next_deliver) {
+        Slot& slot = *m_slots[m_next_deliver % m_slots.size()];
+        if (m_ring) reapUntilReady(slot);
+        else m_cv.wait(lock, [&] { return slot.state == Slot::State::Ready && slot.seq == m_next_deliver; });
+        slot.state = Slot::State::Free;
+    }
+    for (std::size_t r = firstDropped; r < m_files.size(); ++r) releaseFile(r);
+    m_cv.notify_all();
+}
+
+void AsyncFileReader::planRequests(const std::vector<PhotonFileChunk>& ranges)
+{
+    const std::size_t first = m_paths.size();
+    m_files.resize(first + ranges.size());
+    for (std::size_t i = 0; i < ranges.size(); ++i) {
+        const std::size_t r = first + i;
+        const PhotonFileChunk& chunk = ranges[i];
+        m_paths.push_back(chunk.file.path());
+
+        const std::uint64_t size  = fs::file_size(chunk.file.path());
+        const std::uint64_t begin = std::min(chunk.begin, size);
+        const std::uint64_t end   = std::min(chunk.end, size);
+        for (std::uint64_t off = begin; off < end; off += m_options.bufferBytes) {
+            const std::size_t len = static_cast<std::size_t>(std::min<std::uint64_t>(m_options.bufferBytes, end - off));
+            m_requests.push_back(Request{ r, off, len, off + len >= end });
+        }
+    }
+}
+
+int AsyncFileReader::fileFor(std::size_t range)
+{
+    OpenFile& f = m_files[range];
+    if (!f.opened) {
+        f.opened = true;
+        f.handle = openForRead(m_paths[range], m_options.directIo);
+        if (f.handle < 0 && m_options.directIo) {
+            // Filesystems without direct I/O support (tmpfs, some network mounts)
+            f.handle = openForRead(m_paths[range], false);
+        }
+    }
+    return f.handle < 0 ? -1 : 0;
+}
+
+void AsyncFileReader::releaseFile(std::size_t range)
+{
+    OpenFile& f = m_files[range];
+    if (f.opened && f.handle >= 0) closeFile(f.handle);
+    f.handle = -1;
+}
+
+void AsyncFileReader::prepare(Slot& slot, std::uint64_t seq)
+{
+    const Request& req = m_requests[seq];
+    slot.state      = Slot::State::Reading;
+    slot.seq        = seq;
+    slot.error.clear();
+    slot.got        = 0;
+    slot.path       = m_paths[req.range];
+    slot.physOffset = alignDown(req.offset, m_alignment);
+    slot.physLength = static_cast<std::size_t>(alignUp(req.offset + req.length, m_alignment) - slot.physOffset);
+    slot.handle     = (fileFor(req.range) < 0) ? -1 : m_files[req.range].handle;
+    if (slot.handle < 0) slot.error = "cannot open " + slot.path.string();
+}
+
+void AsyncFileReader::readInto(Slot& slot, std::size_t alreadyRead)
+{
+    slot.got = alreadyRead;
+    while (slot.got < slot.physLength) {
+        const long long n = readAt(slot.handle, slot.mem + slot.got, slot.physLength - slot.got,
+                                   slot.physOffset + slot.got);
+        if (n < 0) {
+            slot.error = "read failed on " + slot.path.string() + ": " + std::strerror(errno);
+            return;
+        }
+        if (n == 0) break; // EOF
+        slot.got += static_cast<std::size_t>(n);
+    }
+}
+
+void AsyncFileReader::ioThread()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        // Waits for appended ranges too, until the reader goes away
+        m_cv.wait(lock, [this] {
+            return m_stop || (m_next_submit < m_requests.size() &&
+                              m_slots[m_next_submit % m_slots.size()]->state == Slot::State::Free);
+        });
+        if (m_stop) return;
+
+        const std::uint64_t seq = m_next_submit++;
+        Slot& slot = *m_slots[seq % m_slots.size()];
+        prepare(slot, seq);
+
+        lock.unlock();
+        if (slot.error.empty()) readInto(slot, 0);
+        lock.lock();
+
+        slot.state = Slot::State::Ready;
+        m_cv.notify_all();
+    }
+}
+
+#ifdef STT_HAVE_LIBURING
+
+bool AsyncFileReader::initRing()
+{
+    auto ring = std::make_unique<Ring>();
+    if (io_uring_queue_init(static_cast<unsigned>(m_slots.size()), &ring->ring, 0) < 0)
+        return false; // kernel without io_uring or blocked by seccomp: use threads
+    m_ring = std::move(ring);
+    return true;
+}
+
+void AsyncFileReader::submitPending()
+{
+    unsigned queued = 0;
+    while (m_next_submit < m_requests.size() &&
+           m_slots[m_next_submit % m_slots.size()]->state == Slot::State::Free) {
+        const std::uint64_t seq = m_next_submit;
+        Slot& slot = *m_slots[seq % m_slots.size()];
+
+        io_uring_sqe* sqe = io_uring_get_sqe(&m_ring->ring);
+        if (!sqe) break;
+        ++m_next_submit;
+
+        prepare(slot, seq);
+        if (slot.handle < 0) {
+            io_uring_prep_nop(sqe);
+        } else {
+            io_uring_prep_read(sqe, static_cast<int>(slot.handle), slot.mem,
+                               static_cast<unsigned>(slot.physLength), slot.physOffset);
+        }
+        io_uring_sqe_set_data(sqe, &slot);
+        ++m_ring->inflight;
+        ++queued;
+    }
+    if (queued > 0) io_uring_submit(&m_ring->ring);
+}
+
+void AsyncFileReader::reapUntilReady(Slot& wanted)
+{
+    while (wanted.state != Slot::State::Ready) {
+        io_uring_cqe* cqe = nullptr;
+        const int rc = io_uring_wait_cqe(&m_ring->ring, &cqe);
+        if (rc == -EINTR) continue;
+        if (rc < 0) throw std::runtime_error(std::string("io_uring wait failed: ") + std::strerror(-rc));
+
+        Slot& slot = *static_cast<Slot*>(io_uring_cqe_get_data(cqe));
+        const int res = cqe->res;
+        io_uring_cqe_seen(&m_ring->ring, cqe);
+        --m_ring->inflight;
+
+        if (slot.error.empty()) {
+            if (res < 0) {
+                slot.error = "read failed on " + slot.path.string() + ": " + std::strerror(-res);
+            } else if (static_cast<std::size_t>(res) < slot.physLength && res > 0) {
+                readInto(slot, static_cast<std::size_t>(res)); // finish a short read synchronously
+            } else {
+                slot.got = static_cast<std::size_t>(res);
+            }
+        }
+        slot.state = Slot::State::Ready;
+    }
+}
+
+#else
+
+bool AsyncFileReader::initRing() { return false; }
+void AsyncFileReader::submitPending() {}
+void AsyncFileReader::reapUntilReady(Slot&) {}
+
+#endif
+
+void AsyncFileReader::releaseHeld()
+{
+    if (!m_holding) return;
+    const std::uint64_t prev = m_next_deliver - 1;
+    m_slots[prev % m_slots.size()]->state = Slot::State::Free;
+    if (m_requests[prev].lastOfRange) releaseFile(m_requests[prev].range);
+    m_holding = false;
+    m_cv.notify_all();
+}
+
+bool AsyncFileReader::next(Buffer& out, std::size_t endRange)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    releaseHeld();
+    if (m_next_deliver >= m_requests.size() || m_requests[m_next_deliver].range >= endRange) return false;
+
+    const std::uint64_t seq = m_next_deliver;
+    Slot& slot = *m_slots[seq % m_slots.size()];
+    if (m_ring) {
+        submitPending();
+        reapUntilReady(slot);
+        submitPending();
+    } else {
+        m_cv.wait(lock, [&] { return slot.state == Slot::State::Ready && slot.seq == seq; });
+    }
+
+    if (!slot.error.empty()) throw std::runtime_error(slot.error);
+
+    const Request& req = m_requests[seq];
+    const std::size_t lead = static_cast<std::size_t>(req.offset - slot.physOffset);
+    out.data        = slot.mem + lead;
+    out.size        = (slot.got > lead) ? std::min(slot.got - lead, req.length) : 0;
+    out.range       = req.range;
+    out.lastOfRange = req.lastOfRange;
+
+    ++m_next_deliver;
+    m_holding = true;
+    return true;
+}
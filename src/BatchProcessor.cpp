@@ -0,0 +1,241 @@
+#include "BatchProcessor.h"
+
+#include "ParametersFileReader.h"
+#include "PhotonProcessor.h"
+#include "SurfaceMap.h"
+#include "tonatiuhreader.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+std::string trim(const std::string& s)
+{
+    std::size_t b = 0, e = s.size();
+    while (b < e && std::isspace(static_cast<unsigned char>(s[b]))) ++b;
+    while (e > b && std::isspace(static_cast<unsigned char>(s[e - 1]))) --e;
+    return s.substr(b, e - b);
+}
+
+// The whole of `text` as a number
+bool parseNumber(const std::string& text, double& value)
+{
+    if (text.empty()) return false;
+    char* end = nullptr;
+    value = std::strtod(text.c_str(), &end);
+    return end == text.c_str() + text.size();
+}
+
+// Folder name, or the name of the last non-empty path component
+std::string folderName(const fs::path& folder)
+{
+    fs::path normal = folder.lexically_normal();
+    if (normal.filename().empty()) normal = normal.parent_path();
+    const std::string name = normal.filename().string();
+    return (name.empty() || name == "." || name == "..") ? std::string("scenario") : name;
+}
+
+// Heliostat x receiver power summed over scenarios, by name: scenarios with
+// different surface lists add into the union of their heliostats and receivers
+class AnnualMatrix
+{
+public:
+    explicit AnnualMatrix(const std::vector<const SurfaceMap*>& maps)
+    {
+        for (const SurfaceMap* map : maps) {
+            m_heliostats.insert(m_heliostats.end(), map->getHeliostatLabels().begin(), map->getHeliostatLabels().end());
+            m_receivers.insert(m_receivers.end(), map->getReceiverLabels().begin(), map->getReceiverLabels().end());
+        }
+        std::sort(m_heliostats.begin(), m_heliostats.end());
+        m_heliostats.erase(std::unique(m_heliostats.begin(), m_heliostats.end()), m_heliostats.end());
+        std::sort(m_receivers.begin(), m_receivers.end());
+        m_receivers.erase(std::unique(m_receivers.begin(), m_receivers.end()), m_receivers.end());
+        std::stable_sort(m_receivers.begin(), m_receivers.end(), receiverColumnBefore);
+        m_power.assign(m_heliostats.size() * m_receivers.size(), 0.0);
+    }
+
+    // Adds weight x power of one scenario's counts
+    void add(const RayAccumulator& acc, double powerPerPhoton, double weight)
+    {
+        const SurfaceMap& map = *acc.surfaceMap;
+        std::vector<std::size_t> rows, columns;
+        for (const std::string& name : map.getHeliostatLabels())
+            rows.push_back(static_cast<std::size_t>(
+                std::lower_bound(m_heliostats.begin(), m_heliostats.end(), name) - m_heliostats.begin()));
+        for (const std::string& name : map.getReceiverLabels())
+            columns.push_back(static_cast<std::size_t>(
+                std::find(m_receivers.begin(), m_receivers.end(), name) - m_receivers.begin()));
+
+        const double scale = powerPerPhoton * weight;
+        for (std::size_t h = 0; h < rows.size(); ++h)
+            for (std::size_t r = 0; r < columns.size(); ++r) {
+                const std::uint64_t count = acc.photonCounts[h * acc.receiverCount + r];
+                if (count != 0) m_power[rows[h] * m_receivers.size() + columns[r]] += static_cast<double>(count) * scale;
+            }
+    }
+
+    // Same layout as writeMatrixCsv(), with one column per receiver name
+    bool write(const std::string& path) const
+    {
+        std::ofstream out(path);
+        if (!out) {
+            std::cerr << "Error writing CSV file: " << path << "\n";
+            return false;
+        }
+
+        out << "Heliostat Label";
+        for (const std::string& rec : m_receivers)
+            out << ", Weighted Power to " << rec;
+        out << ", Total Weighted Power to Receivers\n";
+
+        const std::size_t receiverCount = m_receivers.size();
+        for (std::size_t h = 0; h < m_heliostats.size(); ++h)
+        {
+            const double* row = m_power.data() + h * receiverCount;
+            if (std::all_of(row, row + receiverCount, [](double v) { return v == 0.0; }))
+                continue;
+
+            out << m_heliostats[h];
+            double total = 0.0;
+            for (std::size_t r = 0; r < receiverCount; ++r) {
+                out << ", " << row[r];
+                total += row[r];
+            }
+            out << ", " << total << "\n";
+        }
+        return static_cast<bool>(out);
+    }
+
+private:
+    std::vector<std::string> m_heliostats;  // ascending name
+    std::vector<std::string> m_receivers;   // receiverColumnBefore order
+    std::vector<double> m_power;            // [heliostat * receivers + receiver]
+};
+
+} // namespace
+
+std::vector<Scenario> readManifest(const fs::path& manifest)
+{
+    std::ifstream in(manifest);
+    if (!in) throw std::runtime_error("Unable to open batch manifest: " + manifest.string());
+
+    const fs::path base = manifest.parent_path();
+    const std::string annualStem = fs::path(BatchProcessor::kAnnualCsv).stem().string();
+    std::set<std::string> names{ annualStem };
+    std::vector<Scenario> scenarios;
+
+    std::string line;
+    for (std::size_t lineNumber = 1; std::getline(in, line); ++lineNumber)
+    {
+        line = trim(line);
+        if (line.empty() || line[0] == '#') continue;
+
+        Scenario scenario;
+        std::string folder = line;
+        const std::size_t space = line.find_last_of(" \t");
+        double weight = 0.0;
+        if (space != std::string::npos && parseNumber(line.substr(space + 1), weight)) {
+            if (!std::isfinite(weight) || weight < 0.0)
+                throw std::runtime_error("Batch manifest " + manifest.string() + ", line " +
+                                         std::to_string(lineNumber) + ": invalid weight \"" +
+                                         line.substr(space + 1) + "\"");
+            scenario.weight = weight;
+            folder = trim(line.substr(0, space));
+        }
+
+        scenario.folder = fs::path(folder).is_absolute() ? fs::path(folder) : base / folder;
+
+        // Unique name: the folder's, with _2, _3, ... for repeats
+        const std::string name = folderName(folder);
+        scenario.name = name;
+        for (unsigned n = 2; !names.insert(scenario.name).second; ++n)
+            scenario.name = name + "_" + std::to_string(n);
+        scenarios.push_back(std::move(scenario));
+    }
+
+    if (scenarios.empty()) throw std::runtime_error("Batch manifest lists no folders: " + manifest.string());
+    return scenarios;
+}
+
+BatchProcessor::BatchProcessor(std::vector<Scenario> scenarios, const ProcessingOptions& options)
+    : m_scenarios(std::move(scenarios)), m_options(options)
+{
+    if (!m_options.analyzers.empty())
+        throw std::invalid_argument("Analysis modules are not supported in batch mode");
+}
+
+bool BatchProcessor::run(const fs::path& outputFolder)
+{
+    // Check every folder before reading any photons
+    for (const Scenario& scenario : m_scenarios) {
+        if (!fs::is_directory(scenario.folder))
+            throw std::runtime_error("\"" + scenario.folder.string() + "\" is not a directory or does not exist");
+        if (TonatiuhReader::ListPhotonFiles(scenario.folder).empty())
+            throw std::runtime_error("No photon data files (photons_*.dat[.gz|.zst]) found in " + scenario.folder.string());
+    }
+    fs::create_directories(outputFolder);
+
+    // Parameters per folder; one SurfaceMap per distinct surface list
+    std::unordered_map<std::uint64_t, std::unique_ptr<SurfaceMap>> surfaceMaps;
+    std::vector<const SurfaceMap*> distinctMaps;
+    std::vector<double> powerPerPhoton;
+    std::vector<std::unique_ptr<PhotonProcessor>> processors;
+    for (const Scenario& scenario : m_scenarios)
+    {
+        ParametersFileReader reader(scenario.folder.string());
+        reader.read();
+        if (reader.getPowerPerPhoton() <= 0.0)
+            throw std::runtime_error("Invalid power per photon in " + scenario.folder.string());
+
+        std::unique_ptr<SurfaceMap>& surfaceMap = surfaceMaps[reader.getSurfacesFingerprint()];
+        if (!surfaceMap) {
+            surfaceMap = std::make_unique<SurfaceMap>(reader.getSurfaces());
+            distinctMaps.push_back(surfaceMap.get());
+        }
+
+        ProcessingOptions options = m_options;
+        options.parametersFingerprint = reader.getFingerprint();
+        options.layout = reader.getLayout();
+        powerPerPhoton.push_back(reader.getPowerPerPhoton());
+        processors.push_back(std::make_unique<PhotonProcessor>(scenario.folder.string(), *surfaceMap,
+                                                               powerPerPhoton.back(), options));
+    }
+    std::cout << "Batch: " << m_scenarios.size() << " folder(s), " << distinctMaps.size()
+              << " distinct surface list(s)\n";
+
+    // All folders' files on one pool
+    std::vector<PhotonProcessor*> all;
+    for (const auto& processor : processors) all.push_back(processor.get());
+    PhotonProcessor::updateAll(all, m_options.threads);
+
+    bool ok = true;
+    AnnualMatrix annual(distinctMaps);
+    for (std::size_t s = 0; s < m_scenarios.size(); ++s)
+    {
+        const std::string csv = (outputFolder / (m_scenarios[s].name + ".csv")).string();
+        if (processors[s]->writeCsv(csv))
+            std::cout << "CSV file written to: " << csv << "\n";
+        else
+            ok = false;
+        annual.add(*processors[s]->result(), powerPerPhoton[s], m_scenarios[s].weight);
+    }
+
+    const std::string annualCsv = (outputFolder / kAnnualCsv).string();
+    if (annual.write(annualCsv))
+        std::cout << "Annual matrix written to: " << annualCsv << "\n";
+    else
+        ok = false;
+    return ok;
+}
\ No newline at end of file
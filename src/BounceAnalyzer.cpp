@@ -0,0 +1,80 @@
+#include "BounceAnalyzer.h"
+
+#include "BinaryIO.h"
+
+#include <algorithm>
+#include <fstream>
+
+void BounceCounts::onRay(const PhotonInfo* photons, std::size_t length)
+{
+    if (length == 0) return;
+
+    // Every photon before the last one that lies on a heliostat is a reflection
+    std::size_t reflections = 0;
+    for (std::size_t i = 0; i + 1 < length; ++i)
+        if (surfaceMap->heliostatIndex(photons[i].surface_id) != SurfaceMap::kNoIndex) ++reflections;
+
+    const PhotonInfo& last = photons[length - 1];
+    Outcome outcome = Other;
+    if (surfaceMap->receiverIndex(last.surface_id) != SurfaceMap::kNoIndex)
+        outcome = (last.side == 1) ? ReceiverFront : ReceiverBack;
+    else if (surfaceMap->heliostatIndex(last.surface_id) != SurfaceMap::kNoIndex)
+        outcome = Heliostat;
+
+    ++rows[std::min(reflections, kMaxReflections)][outcome];
+}
+
+void BounceCounts::merge(const AnalyzerState& state)
+{
+    const BounceCounts& other = static_cast<const BounceCounts&>(state);
+    for (std::size_t r = 0; r < rows.size(); ++r)
+        for (int o = 0; o < kOutcomeCount; ++o)
+            rows[r][o] += other.rows[r][o];
+}
+
+bool BounceCounts::save(std::ostream& out) const
+{
+    for (const auto& row : rows) putCounts(out, row.data(), row.size());
+    return static_cast<bool>(out);
+}
+
+bool BounceCounts::load(std::istream& in)
+{
+    for (auto& row : rows)
+        if (!getCounts(in, row.data(), row.size())) return false;
+    return true;
+}
+
+bool BounceAnalyzer::write(const AnalyzerState& merged) const
+{
+    const BounceCounts& counts = static_cast<const BounceCounts&>(merged);
+    std::ofstream out(outputPath());
+    if (!out) return false;
+
+    out << "Heliostat Reflections, Rays, Ending on Receiver, Ending on Receiver Back Side, "
+           "Ending on Heliostat, Ending Elsewhere, Power to Receivers\n";
+
+    std::array<std::uint64_t, BounceCounts::kOutcomeCount> total{};
+    for (std::size_t r = 0; r < counts.rows.size(); ++r)
+    {
+        const auto& row = counts.rows[r];
+        std::uint64_t rays = 0;
+        for (int o = 0; o < BounceCounts::kOutcomeCount; ++o) {
+            rays += row[o];
+            total[o] += row[o];
+        }
+        if (rays == 0) continue;
+
+        out << r << (r == BounceCounts::kMaxReflections ? "+" : "") << ", " << rays;
+        for (const std::uint64_t n : row) out << ", " << n;
+        out << ", " << static_cast<double>(row[BounceCounts::ReceiverFront]) * m_context.powerPerPhoton << "\n";
+    }
+
+    std::uint64_t rays = 0;
+    for (const std::uint64_t n : total) rays += n;
+    out << "Total, " << rays;
+    for (const std::uint64_t n : total) out << ", " << n;
+    out << ", " << static_cast<double>(total[BounceCounts::ReceiverFront]) * m_context.powerPerPhoton << "\n";
+
+    return static_cast<bool>(out);
+}
@@ -0,0 +1,102 @@
+#include "Checkpoint.h"
+
+#include "BinaryIO.h"
+
+#include <cstring>
+#include <fstream>
+#include <system_error>
+
+namespace {
+
+constexpr char kMagic[8] = { 'S', 'T', 'T', 'C', 'K', 'P', 'T', '1' };
+
+// Bytes left after the read position (0 if the stream cannot tell)
+std::uint64_t remainingBytes(std::istream& in)
+{
+    const std::streamoff here = in.tellg();
+    in.seekg(0, std::ios::end);
+    const std::streamoff end = in.tellg();
+    in.seekg(here);
+    return here < 0 || end < here ? 0 : static_cast<std::uint64_t>(end - here);
+}
+
+} // namespace
+
+ConsumedFile ConsumedFile::describe(const fs::directory_entry& entry)
+{
+    ConsumedFile file;
+    file.name  = entry.path().filename().string();
+    file.size  = fs::file_size(entry.path());
+    file.mtime = static_cast<std::int64_t>(fs::last_write_time(entry.path()).time_since_epoch().count());
+    return file;
+}
+
+bool Checkpoint::save(const fs::path& path) const
+{
+    // Write next to the target and rename, so a crash never leaves a torn checkpoint
+    fs::path tmpPath = path;
+    tmpPath += ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+
+        out.write(kMagic, sizeof(kMagic));
+        putLittleEndian(out, fingerprint);
+
+        putLittleEndian(out, static_cast<std::uint32_t>(position.files.size()));
+        for (const ConsumedFile& file : position.files) {
+            putString(out, file.name);
+            putLittleEndian(out, file.size);
+            putLittleEndian(out, file.mtime);
+        }
+        putLittleEndian(out, position.offset);
+
+        putLittleEndian(out, static_cast<std::uint32_t>(states.size()));
+        for (const auto& [name, state] : states) {
+            putString(out, name);
+            putLittleEndian(out, static_cast<std::uint64_t>(state.size()));
+            out.write(state.data(), static_cast<std::streamsize>(state.size()));
+        }
+        if (!out.flush()) return false;
+    }
+
+    std::error_code ec;
+    fs::rename(tmpPath, path, ec);
+    return !ec;
+}
+
+bool Checkpoint::load(const fs::path& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+
+    char magic[sizeof(kMagic)];
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) return false;
+    if (!getLittleEndian(in, fingerprint)) return false;
+
+    std::uint32_t fileCount;
+    if (!getLittleEndian(in, fileCount)) return false;
+    // A corrupt count must not turn into a huge allocation: each file takes at
+    // least its name length, size and time
+    if (fileCount > remainingBytes(in) / (2 + 8 + 8)) return false;
+    position.files.assign(fileCount, ConsumedFile{});
+    for (ConsumedFile& file : position.files)
+        if (!getString(in, file.name) || !getLittleEndian(in, file.size) || !getLittleEndian(in, file.mtime))
+            return false;
+    if (!getLittleEndian(in, position.offset)) return false;
+
+    std::uint32_t stateCount;
+    if (!getLittleEndian(in, stateCount)) return false;
+    states.clear();
+    for (std::uint32_t s = 0; s < stateCount; ++s) {
+        std::string name;
+        std::uint64_t size;
+        if (!getString(in, name) || !getLittleEndian(in, size)) return false;
+        // Nor a corrupt size
+        if (size > remainingBytes(in)) return false;
+        std::string state(static_cast<std::size_t>(size), '\0');
+        if (size != 0 && !in.read(&state[0], static_cast<std::streamsize>(size))) return false;
+        states.emplace_back(std::move(name), std::move(state));
+    }
+    return true;
+}
@@ -0,0 +1,310 @@
+#include "Decompressor.h"
+
+#include "BinaryIO.h"
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#ifdef STT_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef STT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+
+constexpr std::size_t kInputBytes = 256u << 10; // compressed bytes read at a time
+
+// One codec over one file: fills `out` with up to `capacity` uncompressed bytes;
+// 0 at the end of the data.
+class Inflater
+{
+public:
+    virtual ~Inflater() = default;
+    virtual std::size_t read(unsigned char* out, std::size_t capacity) = 0;
+};
+
+// Compressed input, read in large blocks
+class InputFile
+{
+public:
+    explicit InputFile(const fs::path& path) : m_path(path), m_in(path, std::ios::binary)
+    {
+        if (!m_in) throw std::runtime_error("Unable to open photon file: " + path.string());
+        // Small files (often thousands of them) get a buffer of their own size
+        std::error_code ec;
+        const std::uintmax_t size = fs::file_size(path, ec);
+        m_capacity = ec ? kInputBytes : static_cast<std::size_t>(std::clamp<std::uintmax_t>(size, 1, kInputBytes));
+        m_buf.reset(new unsigned char[m_capacity]);
+    }
+
+    // Next block of input; empty at the end of the file
+    std::size_t refill()
+    {
+        m_in.read(reinterpret_cast<char*>(m_buf.get()), static_cast<std::streamsize>(m_capacity));
+        const std::size_t n = static_cast<std::size_t>(m_in.gcount());
+        if (n == 0 && m_in.bad()) throw std::runtime_error("Error reading photon file: " + m_path.string());
+        return n;
+    }
+
+    unsigned char* data() { return m_buf.get(); }
+    const fs::path& path() const { return m_path; }
+
+private:
+    fs::path m_path;
+    std::ifstream m_in;
+    std::unique_ptr<unsigned char[]> m_buf;   // not zero-filled: only the bytes read are used
+    std::size_t m_capacity = 0;
+};
+
+#ifdef STT_HAVE_ZLIB
+class GzipInflater : public Inflater
+{
+public:
+    explicit GzipInflater(const fs::path& path) : m_input(path)
+    {
+        // 15 + 32: any window size, gzip or zlib header detected automatically
+        if (inflateInit2(&m_z, 15 + 32) != Z_OK)
+            throw std::runtime_error("Unable to initialise zlib for " + path.string());
+    }
+    ~GzipInflater() override { inflateEnd(&m_z); }
+
+    std::size_t read(unsigned char* out, std::size_t capacity) override
+    {
+        m_z.next_out  = out;
+        m_z.avail_out = static_cast<uInt>(capacity);
+        while (m_z.avail_out > 0)
+        {
+            if (m_z.avail_in == 0 && !m_eof) {
+                m_z.next_in  = m_input.data();
+                m_z.avail_in = static_cast<uInt>(m_input.refill());
+                m_eof = (m_z.avail_in == 0);
+            }
+            if (m_z.avail_in == 0 && !m_inMember) break; // clean end, between members
+
+            const uInt outBefore = m_z.avail_out;
+            const uInt inBefore  = m_z.avail_in;
+            const int rc = inflate(&m_z, Z_NO_FLUSH);
+            if (rc == Z_STREAM_END) {
+                // Another member may follow (pigz, concatenated files)
+                m_inMember = false;
+                inflateReset(&m_z);
+                continue;
+            }
+            if (rc != Z_OK && rc != Z_BUF_ERROR)
+                throw std::runtime_error("Corrupt gzip data in " + m_input.path().string() +
+                                         (m_z.msg ? std::string(": ") + m_z.msg : std::string()));
+            m_inMember = true;
+            if (m_eof && m_z.avail_out == outBefore && m_z.avail_in == inBefore)
+                throw std::runtime_error("Truncated gzip file: " + m_input.path().string());
+        }
+        return capacity - m_z.avail_out;
+    }
+
+private:
+    InputFile m_input;
+    z_stream  m_z{};
+    bool      m_eof = false;
+    bool      m_inMember = false;
+};
+#endif
+
+#ifdef STT_HAVE_ZSTD
+class ZstdInflater : public Inflater
+{
+public:
+    explicit ZstdInflater(const fs::path& path) : m_input(path), m_z(ZSTD_createDStream())
+    {
+        if (!m_z) throw std::runtime_error("Unable to initialise zstd for " + path.string());
+        ZSTD_initDStream(m_z);
+    }
+    ~ZstdInflater() override { ZSTD_freeDStream(m_z); }
+
+    std::size_t read(unsigned char* out, std::size_t capacity) override
+    {
+        ZSTD_outBuffer output{ out, capacity, 0 };
+        while (output.pos < output.size)
+        {
+            if (m_in.pos == m_in.size && !m_eof) {
+                m_in = ZSTD_inBuffer{ m_input.data(), m_input.refill(), 0 };
+                m_eof = (m_in.size == 0);
+            }
+            if (m_in.pos == m_in.size && !m_inFrame) break; // clean end, between frames
+
+            const std::size_t outBefore = output.pos;
+            const std::size_t inBefore  = m_in.pos;
+            const std::size_t rc = ZSTD_decompressStream(m_z, &output, &m_in);
+            if (ZSTD_isError(rc))
+                throw std::runtime_error("Corrupt zstd data in " + m_input.path().string() + ": " +
+                                         ZSTD_getErrorName(rc));
+            m_inFrame = (rc != 0); // 0: a frame was completed and fully flushed
+            if (m_eof && m_inFrame && output.pos == outBefore && m_in.pos == inBefore)
+                throw std::runtime_error("Truncated zstd file: " + m_input.path().string());
+        }
+        return output.pos;
+    }
+
+private:
+    InputFile      m_input;
+    ZSTD_DStream*  m_z;
+    ZSTD_inBuffer  m_in{ nullptr, 0, 0 };
+    bool           m_eof = false;
+    bool           m_inFrame = false;
+};
+#endif
+
+std::unique_ptr<Inflater> makeInflater(const fs::path& path, Compression compression)
+{
+    switch (compression) {
+#ifdef STT_HAVE_ZLIB
+    case Compression::Gzip: return std::make_unique<GzipInflater>(path);
+#endif
+#ifdef STT_HAVE_ZSTD
+    case Compression::Zstd: return std::make_unique<ZstdInflater>(path);
+#endif
+    default: break;
+    }
+    throw std::runtime_error("This build cannot read " + std::string(compressionName(compression)) +
+                             "-compressed photon files: " + path.string());
+}
+
+} // namespace
+
+Compression compressionOf(const fs::path& path)
+{
+    const std::string name = path.filename().string();
+    if (endsWith(name, ".dat.gz"))  return Compression::Gzip;
+    if (endsWith(name, ".dat.zst")) return Compression::Zstd;
+    return Compression::None;
+}
+
+const char* compressionName(Compression compression)
+{
+    switch (compression) {
+    case Compression::None: return "none";
+    case Compression::Gzip: return "gzip";
+    case Compression::Zstd: return "zstd";
+    }
+    return "unknown";
+}
+
+bool compressionSupported(Compression compression)
+{
+    switch (compression) {
+    case Compression::None: return true;
+#ifdef STT_HAVE_ZLIB
+    case Compression::Gzip: return true;
+#endif
+#ifdef STT_HAVE_ZSTD
+    case Compression::Zstd: return true;
+#endif
+    default: return false;
+    }
+}
+
+Decompressor::Decompressor(const fs::path& path, Compression compression, std::uint64_t skip,
+                           std::size_t bufferBytes, unsigned depth, std::size_t recordBytes)
+    : m_path(path), m_compression(compression), m_skip(skip),
+      m_slots(std::max(depth, 2u)), m_sizes(m_slots.size(), 0)
+{
+    // Whole records per buffer, so records never straddle two buffers. Left
+    // uninitialised: small files never touch most of it.
+    m_slotBytes = std::max(bufferBytes / recordBytes, std::size_t{1}) * recordBytes;
+    for (auto& slot : m_slots) slot.reset(new unsigned char[m_slotBytes]);
+    m_thread = std::thread(&Decompressor::run, this);
+}
+
+Decompressor::~Decompressor()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+}
+
+bool Decompressor::next(Buffer& out)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_holding) {
+        m_holding = false; // the previous buffer can be refilled
+        m_cv.notify_all();
+    }
+    m_cv.wait(lock, [this] { return m_delivered < m_produced || m_done; });
+
+    if (m_delivered == m_produced) {
+        if (m_error) std::rethrow_exception(m_error);
+        out = Buffer{};
+        return false;
+    }
+    const std::size_t slot = static_cast<std::size_t>(m_delivered % m_slots.size());
+    out = Buffer{ m_slots[slot].get(), m_sizes[slot] };
+    ++m_delivered;
+    m_holding = true;
+    return true;
+}
+
+void Decompressor::run()
+{
+    try
+    {
+        const std::unique_ptr<Inflater> inflater = makeInflater(m_path, m_compression);
+
+        // Bytes before the first wanted one are inflated and dropped
+        // (into the first slot, which is not handed out yet)
+        for (std::uint64_t left = m_skip; left > 0;) {
+            const std::size_t n =
+                inflater->read(m_slots[0].get(), static_cast<std::size_t>(std::min<std::uint64_t>(left, m_slotBytes)));
+            if (n == 0) break;
+            left -= n;
+        }
+
+        for (bool end = false; !end;)
+        {
+            std::size_t slot;
+            {
+                // Wait for a slot that is neither filled nor held by the caller
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this] {
+                    const std::uint64_t released = m_delivered - (m_holding ? 1 : 0);
+                    return m_stop || m_produced - released < m_slots.size();
+                });
+                if (m_stop) break;
+                slot = static_cast<std::size_t>(m_produced % m_slots.size());
+            }
+
+            unsigned char* buffer = m_slots[slot].get();
+            std::size_t size = 0;
+            while (size < m_slotBytes) {
+                const std::size_t n = inflater->read(buffer + size, m_slotBytes - size);
+                if (n == 0) {
+                    end = true;
+                    break;
+                }
+                size += n;
+            }
+
+            if (size > 0) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_sizes[slot] = size;
+                ++m_produced;
+                m_cv.notify_all();
+            }
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_done = true;
+    m_cv.notify_all();
+}
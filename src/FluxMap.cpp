@@ -0,0 +1,226 @@
+#include "FluxMap.h"
+
+#include "BinaryIO.h"
+#include "ProcessingOptions.h"
+
+#include <algorithm>
+#include <fstream>
+
+FluxMap::FluxMap(const SurfaceMap& surfaceMap, const FluxMapOptions& options)
+    : m_surfaceMap(&surfaceMap),
+      m_options(options),
+      m_receiverCount(surfaceMap.getReceiverLabels().size()),
+      m_mapCount(m_receiverCount * (options.perHeliostat ? surfaceMap.getHeliostatLabels().size() : 1)),
+      m_axisU(options.plane == FluxPlane::YZ ? 1 : 0),
+      m_axisV(options.plane == FluxPlane::XY ? 1 : 2),
+      m_scaleU(static_cast<double>(options.binsU) / (options.maxU - options.minU)),
+      m_scaleV(static_cast<double>(options.binsV) / (options.maxV - options.minV)),
+      m_counts(m_mapCount * options.binsU * options.binsV, 0),
+      m_outside(m_mapCount, 0),
+      m_stagedU(kStageSize),
+      m_stagedV(kStageSize),
+      m_stagedMap(kStageSize),
+      m_stagedBin(kStageSize)
+{
+}
+
+void FluxMap::flush()
+{
+    const std::size_t n = m_staged;
+    const double minU = m_options.minU, minV = m_options.minV;
+    const double binsU = static_cast<double>(m_options.binsU);
+    const double binsV = static_cast<double>(m_options.binsV);
+    const std::int64_t rowLength = static_cast<std::int64_t>(m_options.binsU);
+
+    // Bin indices without branches (vectorizable); -1 for hits outside the grid or NaN
+    const double* u = m_stagedU.data();
+    const double* v = m_stagedV.data();
+    std::int64_t* bin = m_stagedBin.data();
+    for (std::size_t k = 0; k < n; ++k)
+    {
+        const double fu = (u[k] - minU) * m_scaleU;
+        const double fv = (v[k] - minV) * m_scaleV;
+        const bool inside = fu >= 0.0 && fu < binsU && fv >= 0.0 && fv < binsV;
+        const std::int64_t cell = static_cast<std::int64_t>(inside ? fv : 0.0) * rowLength +
+                                  static_cast<std::int64_t>(inside ? fu : 0.0);
+        bin[k] = inside ? cell : -1;
+    }
+
+    const std::size_t cells = m_options.binsU * m_options.binsV;
+    for (std::size_t k = 0; k < n; ++k)
+    {
+        if (bin[k] >= 0) ++m_counts[m_stagedMap[k] * cells + static_cast<std::size_t>(bin[k])];
+        else             ++m_outside[m_stagedMap[k]];
+    }
+    m_staged = 0;
+}
+
+void FluxMap::onRayEnds(const RayEnds& ends)
+{
+    const PhotonBlock& block = *ends.block;
+    for (std::size_t k = 0; k < ends.count; ++k) {
+        const std::size_t i = ends.last[k];
+        addRay(ends.length[k], ends.penultimateSurface[k], block.surface_id[i], block.side[i],
+               block.x[i], block.y[i], block.z[i]);
+    }
+}
+
+void FluxMap::onStitchedRay(const RayFragment& ray, const PhotonInfo* /*photons*/)
+{
+    addRay(ray.length, ray.penultimate.surface_id, ray.last.surface_id, ray.last.side,
+           ray.last.x, ray.last.y, ray.last.z);
+}
+
+void FluxMap::merge(const AnalyzerState& state)
+{
+    const FluxMap& other = static_cast<const FluxMap&>(state);
+    for (std::size_t i = 0; i < m_counts.size(); ++i) m_counts[i] += other.m_counts[i];
+    for (std::size_t i = 0; i < m_outside.size(); ++i) m_outside[i] += other.m_outside[i];
+}
+
+bool FluxMap::save(std::ostream& out) const
+{
+    putLittleEndian(out, static_cast<std::uint32_t>(m_options.plane));
+    putLittleEndian(out, static_cast<std::uint64_t>(m_options.binsU));
+    putLittleEndian(out, static_cast<std::uint64_t>(m_options.binsV));
+    for (const double value : { m_options.minU, m_options.maxU, m_options.minV, m_options.maxV })
+        putDouble(out, value);
+    putLittleEndian(out, static_cast<std::uint8_t>(m_options.perHeliostat ? 1 : 0));
+    putCounts(out, m_counts.data(), m_counts.size());
+    putCounts(out, m_outside.data(), m_outside.size());
+    return static_cast<bool>(out);
+}
+
+bool FluxMap::load(std::istream& in)
+{
+    std::uint32_t plane;
+    std::uint64_t binsU, binsV;
+    double range[4];
+    std::uint8_t perHeliostat;
+    if (!getLittleEndian(in, plane) || !getLittleEndian(in, binsU) || !getLittleEndian(in, binsV)) return false;
+    for (double& value : range)
+        if (!getDouble(in, value)) return false;
+    if (!getLittleEndian(in, perHeliostat)) return false;
+
+    if (plane != static_cast<std::uint32_t>(m_options.plane) || binsU != m_options.binsU ||
+        binsV != m_options.binsV || range[0] != m_options.minU || range[1] != m_options.maxU ||
+        range[2] != m_options.minV || range[3] != m_options.maxV || (perHeliostat != 0) != m_options.perHeliostat)
+        return false;
+    return getCounts(in, m_counts.data(), m_counts.size()) && getCounts(in, m_outside.data(), m_outside.size());
+}
+
+bool FluxMap::write(const std::string& path, double powerPerPhoton) const
+{
+    const bool csv = endsWith(path, ".csv");
+    std::ofstream out(path, csv ? std::ios::out : std::ios::binary | std::ios::trunc);
+    if (!out) return false;
+    if (csv) writeCsv(out, powerPerPhoton);
+    else     writeBinary(out, powerPerPhoton);
+    return static_cast<bool>(out);
+}
+
+std::string FluxMap::heliostatLabel(std::size_t map) const
+{
+    return m_options.perHeliostat ? m_surfaceMap->getHeliostatLabels()[map / m_receiverCount] : std::string();
+}
+
+void FluxMap::writeCsv(std::ostream& out, double powerPerPhoton) const
+{
+    // Flux density: power per bin divided by the bin area (power units per plane unit^2)
+    const std::size_t cells = m_options.binsU * m_options.binsV;
+    const double binArea = ((m_options.maxU - m_options.minU) / static_cast<double>(m_options.binsU)) *
+                           ((m_options.maxV - m_options.minV) / static_cast<double>(m_options.binsV));
+    const double fluxPerPhoton = powerPerPhoton / binArea;
+
+    bool first = true;
+    for (std::size_t map = 0; map < m_mapCount; ++map)
+    {
+        const std::uint64_t* counts = m_counts.data() + map * cells;
+        if (m_options.perHeliostat && m_outside[map] == 0 &&
+            std::all_of(counts, counts + cells, [](std::uint64_t c) { return c == 0; }))
+            continue;
+
+        if (!first) out << "\n";
+        first = false;
+
+        const std::string heliostat = heliostatLabel(map);
+        out << "# Receiver, " << m_surfaceMap->getReceiverLabels()[map % m_receiverCount]
+            << ", Heliostat, " << (heliostat.empty() ? "All" : heliostat)
+            << ", Plane, " << planeName(m_options.plane)
+            << ", Bins, " << m_options.binsU << ", " << m_options.binsV
+            << ", U, " << m_options.minU << ", " << m_options.maxU
+            << ", V, " << m_options.minV << ", " << m_options.maxV
+            << ", Outside Power, " << static_cast<double>(m_outside[map]) * powerPerPhoton << "\n";
+
+        // One row per v bin (ascending v), one column per u bin
+        for (std::size_t iv = 0; iv < m_options.binsV; ++iv)
+        {
+            for (std::size_t iu = 0; iu < m_options.binsU; ++iu)
+                out << (iu ? ", " : "") << static_cast<double>(counts[iv * m_options.binsU + iu]) * fluxPerPhoton;
+            out << "\n";
+        }
+    }
+}
+
+void FluxMap::writeBinary(std::ostream& out, double powerPerPhoton) const
+{
+    const std::size_t cells = m_options.binsU * m_options.binsV;
+    auto written = [&](std::size_t map) {
+        if (!m_options.perHeliostat || m_outside[map] != 0) return true;
+        const std::uint64_t* counts = m_counts.data() + map * cells;
+        return std::any_of(counts, counts + cells, [](std::uint64_t c) { return c != 0; });
+    };
+    std::uint32_t mapCount = 0;
+    for (std::size_t map = 0; map < m_mapCount; ++map) mapCount += written(map) ? 1 : 0;
+
+    out.write("STTFLUX1", 8);
+    putLittleEndian(out, static_cast<std::uint32_t>(m_options.plane));
+    putLittleEndian(out, static_cast<std::uint32_t>(m_options.binsU));
+    putLittleEndian(out, static_cast<std::uint32_t>(m_options.binsV));
+    putLittleEndian(out, mapCount);
+    for (const double value : { m_options.minU, m_options.maxU, m_options.minV, m_options.maxV, powerPerPhoton })
+        putDouble(out, value);
+
+    for (std::size_t map = 0; map < m_mapCount; ++map)
+    {
+        if (!written(map)) continue;
+        putString(out, m_surfaceMap->getReceiverLabels()[map % m_receiverCount]);
+        putString(out, heliostatLabel(map));
+        putLittleEndian(out, m_outside[map]);
+        const std::uint64_t* counts = m_counts.data() + map * cells;
+        std::vector<unsigned char> bytes(cells * sizeof(std::uint64_t));
+        for (std::size_t i = 0; i < cells; ++i)
+            for (std::size_t b = 0; b < sizeof(std::uint64_t); ++b)
+                bytes[i * sizeof(std::uint64_t) + b] = static_cast<unsigned char>(counts[i] >> (8 * b));
+        out.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    }
+}
+
+bool FluxMap::parsePlane(const std::string& text, FluxPlane& plane)
+{
+    if (text == "xy")      plane = FluxPlane::XY;
+    else if (text == "xz") plane = FluxPlane::XZ;
+    else if (text == "yz") plane = FluxPlane::YZ;
+    else return false;
+    return true;
+}
+
+const char* FluxMap::planeName(FluxPlane plane)
+{
+    switch (plane) {
+    case FluxPlane::XY: return "xy";
+    case FluxPlane::XZ: return "xz";
+    case FluxPlane::YZ: return "yz";
+    }
+    return "?";
+}
+
+std::unique_ptr<AnalyzerState> FluxAnalyzer::createState() const
+{
+    return std::make_unique<FluxMap>(m_context.surfaceMap, m_context.options.fluxMap);
+}
+
+bool FluxAnalyzer::write(const AnalyzerState& merged) const
+{
+    return static_cast<const FluxMap&>(merged).write(outputPath(), m_context.powerPerPhoton);
+}
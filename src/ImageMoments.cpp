@@ -0,0 +1,152 @@
+#include "ImageMoments.h"
+
+#include "BinaryIO.h"
+
+#include <cmath>
+#include <fstream>
+
+ImageMoments::ImageMoments(const SurfaceMap& surfaceMap)
+    : m_surfaceMap(&surfaceMap),
+      m_receiverCount(surfaceMap.getReceiverLabels().size()),
+      m_cells(surfaceMap.getHeliostatLabels().size() * m_receiverCount)
+{
+}
+
+void ImageMoments::onRayEnds(const RayEnds& ends)
+{
+    const PhotonBlock& block = *ends.block;
+    for (std::size_t k = 0; k < ends.count; ++k) {
+        const std::size_t i = ends.last[k];
+        addRay(ends.length[k], ends.penultimateSurface[k], block.surface_id[i], block.side[i],
+               block.x[i], block.y[i], block.z[i]);
+    }
+}
+
+void ImageMoments::onStitchedRay(const RayFragment& ray, const PhotonInfo* /*photons*/)
+{
+    addRay(ray.length, ray.penultimate.surface_id, ray.last.surface_id, ray.last.side,
+           ray.last.x, ray.last.y, ray.last.z);
+}
+
+void ImageMoments::merge(const AnalyzerState& state)
+{
+    const ImageMoments& other = static_cast<const ImageMoments&>(state);
+    for (std::size_t c = 0; c < m_cells.size(); ++c)
+    {
+        Cell& a = m_cells[c];
+        const Cell& b = other.m_cells[c];
+        if (b.count == 0) continue;
+        if (a.count == 0) {
+            a = b;
+            continue;
+        }
+
+        const double na = static_cast<double>(a.count), nb = static_cast<double>(b.count);
+        const double n = na + nb;
+        const double d[3] = { b.mean[0] - a.mean[0], b.mean[1] - a.mean[1], b.mean[2] - a.mean[2] };
+        const double weight = na * nb / n;
+        for (int k = 0; k < 3; ++k) a.mean[k] += d[k] * (nb / n);
+        a.m2[XX] += b.m2[XX] + d[0] * d[0] * weight;
+        a.m2[YY] += b.m2[YY] + d[1] * d[1] * weight;
+        a.m2[ZZ] += b.m2[ZZ] + d[2] * d[2] * weight;
+        a.m2[XY] += b.m2[XY] + d[0] * d[1] * weight;
+        a.m2[XZ] += b.m2[XZ] + d[0] * d[2] * weight;
+        a.m2[YZ] += b.m2[YZ] + d[1] * d[2] * weight;
+        a.count += b.count;
+    }
+}
+
+bool ImageMoments::save(std::ostream& out) const
+{
+    putLittleEndian(out, static_cast<std::uint64_t>(m_cells.size()));
+    for (const Cell& cell : m_cells) {
+        putLittleEndian(out, cell.count);
+        for (const double value : cell.mean) putDouble(out, value);
+        for (const double value : cell.m2) putDouble(out, value);
+    }
+    return static_cast<bool>(out);
+}
+
+bool ImageMoments::load(std::istream& in)
+{
+    std::uint64_t cells;
+    if (!getLittleEndian(in, cells) || cells != m_cells.size()) return false;
+    for (Cell& cell : m_cells) {
+        if (!getLittleEndian(in, cell.count)) return false;
+        for (double& value : cell.mean)
+            if (!getDouble(in, value)) return false;
+        for (double& value : cell.m2)
+            if (!getDouble(in, value)) return false;
+    }
+    return true;
+}
+
+bool ImageMoments::write(const std::string& path, double powerPerPhoton) const
+{
+    return endsWith(path, ".csv") ? writeCsv(path, powerPerPhoton) : writeBinary(path, powerPerPhoton);
+}
+
+bool ImageMoments::writeCsv(const std::string& path, double powerPerPhoton) const
+{
+    std::ofstream out(path);
+    if (!out) return false;
+
+    out << "Heliostat Label, Receiver Label, Rays, Power, Centroid X, Centroid Y, Centroid Z, "
+           "Variance X, Variance Y, Variance Z, Covariance XY, Covariance XZ, Covariance YZ, Radial RMS\n";
+
+    const auto& heliostats = m_surfaceMap->getHeliostatLabels();
+    const auto& receivers  = m_surfaceMap->getReceiverLabels();
+    for (std::size_t c = 0; c < m_cells.size(); ++c)
+    {
+        const Cell& cell = m_cells[c];
+        if (cell.count == 0) continue;
+
+        const double n = static_cast<double>(cell.count);
+        out << heliostats[c / m_receiverCount] << ", " << receivers[c % m_receiverCount] << ", " << cell.count
+            << ", " << n * powerPerPhoton;
+        for (const double value : cell.mean) out << ", " << value;
+        for (const double value : cell.m2) out << ", " << value / n;
+        // Root mean square distance of the hits from the centroid
+        out << ", " << std::sqrt((cell.m2[XX] + cell.m2[YY] + cell.m2[ZZ]) / n) << "\n";
+    }
+    return static_cast<bool>(out);
+}
+
+bool ImageMoments::writeBinary(const std::string& path, double powerPerPhoton) const
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) return false;
+
+    std::uint32_t rows = 0;
+    for (const Cell& cell : m_cells) rows += cell.count != 0 ? 1 : 0;
+
+    out.write("STTIMGS1", 8);
+    putLittleEndian(out, static_cast<std::uint32_t>(m_surfaceMap->getHeliostatLabels().size()));
+    putLittleEndian(out, static_cast<std::uint32_t>(m_receiverCount));
+    putLittleEndian(out, rows);
+    putDouble(out, powerPerPhoton);
+
+    for (std::size_t c = 0; c < m_cells.size(); ++c)
+    {
+        const Cell& cell = m_cells[c];
+        if (cell.count == 0) continue;
+
+        const double n = static_cast<double>(cell.count);
+        putString(out, m_surfaceMap->getHeliostatLabels()[c / m_receiverCount]);
+        putString(out, m_surfaceMap->getReceiverLabels()[c % m_receiverCount]);
+        putLittleEndian(out, cell.count);
+        for (const double value : cell.mean) putDouble(out, value);
+        for (const double value : cell.m2) putDouble(out, value / n);
+    }
+    return static_cast<bool>(out);
+}
+
+std::unique_ptr<AnalyzerState> ImageAnalyzer::createState() const
+{
+    return std::make_unique<ImageMoments>(m_context.surfaceMap);
+}
+
+bool ImageAnalyzer::write(const AnalyzerState& merged) const
+{
+    return static_cast<const ImageMoments&>(merged).write(outputPath(), m_context.powerPerPhoton);
+}
@@ -0,0 +1,181 @@
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <utility>
+
+#ifdef _WIN32
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+    if (this != &other) {
+        close();
+        m_data = std::exchange(other.m_data, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+        m_view_offset = std::exchange(other.m_view_offset, 0);
+        m_open = std::exchange(other.m_open, false);
+#ifdef _WIN32
+        m_file    = std::exchange(other.m_file, nullptr);
+        m_mapping = std::exchange(other.m_mapping, nullptr);
+#endif
+    }
+    return *this;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const fs::path& path)
+{
+    return open(path, 0, UINT64_MAX);
+}
+
+bool MappedFile::open(const fs::path& path, std::uint64_t offset, std::uint64_t length)
+{
+    close();
+
+    HANDLE file = ::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size{};
+    if (!::GetFileSizeEx(file, &size)) {
+        ::CloseHandle(file);
+        return false;
+    }
+
+    const std::uint64_t fileSize = static_cast<std::uint64_t>(size.QuadPart);
+    offset = std::min(offset, fileSize);
+    length = std::min(length, fileSize - offset);
+
+    m_file = file;
+    m_size = static_cast<std::size_t>(length);
+    m_open = true;
+    if (m_size == 0) return true; // nothing to map
+
+    HANDLE mapping = ::CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) {
+        close();
+        return false;
+    }
+    m_mapping = mapping;
+
+    SYSTEM_INFO info{};
+    ::GetSystemInfo(&info);
+    const std::uint64_t viewStart = offset - offset % info.dwAllocationGranularity;
+    m_view_offset = static_cast<std::size_t>(offset - viewStart);
+
+    void* view = ::MapViewOfFile(mapping, FILE_MAP_READ,
+                                 static_cast<DWORD>(viewStart >> 32), static_cast<DWORD>(viewStart),
+                                 m_size + m_view_offset);
+    if (!view) {
+        close();
+        return false;
+    }
+    m_data = static_cast<const unsigned char*>(view) + m_view_offset;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_data)    ::UnmapViewOfFile(m_data - m_view_offset);
+    if (m_mapping) ::CloseHandle(static_cast<HANDLE>(m_mapping));
+    if (m_file)    ::CloseHandle(static_cast<HANDLE>(m_file));
+    m_data = nullptr;
+    m_mapping = nullptr;
+    m_file = nullptr;
+    m_size = 0;
+    m_view_offset = 0;
+    m_open = false;
+}
+
+void MappedFile::adviseSequential() const
+{
+    // FILE_FLAG_SEQUENTIAL_SCAN is already requested at open time.
+}
+
+#else
+
+bool MappedFile::open(const fs::path& path)
+{
+    return open(path, 0, UINT64_MAX);
+}
+
+bool MappedFile::open(const fs::path& path, std::uint64_t offset, std::uint64_t length)
+{
+    close();
+
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st{};
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    const std::uint64_t fileSize = static_cast<std::uint64_t>(st.st_size);
+    offset = std::min(offset, fileSize);
+    length = std::min(length, fileSize - offset);
+
+    m_size = static_cast<std::size_t>(length);
+    m_open = true;
+    if (m_size == 0) {
+        ::close(fd);
+        return true; // nothing to map
+    }
+
+    // mmap offsets must be page aligned
+    const std::uint64_t page = static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE));
+    const std::uint64_t viewStart = offset - offset % page;
+    m_view_offset = static_cast<std::size_t>(offset - viewStart);
+
+    void* addr = ::mmap(nullptr, m_size + m_view_offset, PROT_READ, MAP_PRIVATE, fd,
+                        static_cast<off_t>(viewStart));
+    ::close(fd); // the mapping keeps its own reference to the file
+    if (addr == MAP_FAILED) {
+        m_size = 0;
+        m_view_offset = 0;
+        m_open = false;
+        return false;
+    }
+
+    m_data = static_cast<const unsigned char*>(addr) + m_view_offset;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_data)
+        ::munmap(const_cast<unsigned char*>(m_data - m_view_offset), m_size + m_view_offset);
+    m_data = nullptr;
+    m_size = 0;
+    m_view_offset = 0;
+    m_open = false;
+}
+
+void MappedFile::adviseSequential() const
+{
+    if (m_data)
+        ::madvise(const_cast<unsigned char*>(m_data - m_view_offset), m_size + m_view_offset, MADV_SEQUENTIAL);
+}
+
+#endif
@@ -2,19 +2,52 @@
 
 #include <algorithm>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <system_error>
 #include <vector>
 
 namespace fs = std::filesystem;
 
+namespace {
+
+// Takes the next line (without its '\n') off the front of `text`; false at the end.
+bool nextLine(std::string_view& text, std::string_view& line)
+{
+    if (text.empty()) return false;
+    const std::size_t eol = text.find('\n');
+    line = text.substr(0, eol);
+    text.remove_prefix(eol == std::string_view::npos ? text.size() : eol + 1);
+    return true;
+}
+
+// Leading number of `token`, as std::stod would read it (trailing characters ignored)
+bool parseLeadingDouble(std::string_view token, double& value)
+{
+    if (!token.empty() && token.front() == '+') token.remove_prefix(1);
+#if defined(__cpp_lib_to_chars)
+    const auto [end, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+    return ec == std::errc() && end != token.data();
+#else
+    const std::string copy(token);
+    char* end = nullptr;
+    errno = 0;
+    value = std::strtod(copy.c_str(), &end);
+    return end != copy.c_str() && errno != ERANGE;
+#endif
+}
+
+} // namespace
+
 // --- helpers ---
 
-std::string ParametersFileReader::trim(const std::string& s)
+std::string_view ParametersFileReader::trim(std::string_view s)
 {
     std::size_t b = 0, e = s.size();
     while (b < e && std::isspace(static_cast<unsigned char>(s[b]))) ++b;
@@ -23,7 +56,7 @@ std::string ParametersFileReader::trim(const std::string& s)
 }
 
 // normalize: lowercase + remove spaces/underscores to compare ids tolerant of formatting
-std::string ParametersFileReader::normalizeId(const std::string& s)
+std::string ParametersFileReader::normalizeId(std::string_view s)
 {
     std::string out;
     out.reserve(s.size());
@@ -36,41 +69,52 @@ std::string ParametersFileReader::normalizeId(const std::string& s)
 
 // --- public ---
 
-ParametersFileReader::ParametersFileReader(const std::string& folderPath)
-    : m_folderPath(folderPath)
+ParametersFileReader::ParametersFileReader(const std::string& path)
+    : m_path(path)
 {}
 
 void ParametersFileReader::read()
 {
-    m_surfaceMap.clear();
+    m_text.clear();
+    m_surfaces.clear();
+    m_parameterNames.clear();
+    m_layout = PhotonLayout();
     m_powerPerPhoton = 0.0;
 
-    fs::path fullPath = fs::path(m_folderPath) / "photons_parameters.txt";
-    std::ifstream file(fullPath);
-    if (!file.is_open())
+    // One read of the whole file; everything below works on views into it
+    fs::path fullPath = fs::path(m_path);
+    if (!fs::is_regular_file(fullPath)) fullPath /= "photons_parameters.txt";
+    std::ifstream file(fullPath, std::ios::binary);
+    std::error_code ec;
+    const std::uintmax_t size = fs::file_size(fullPath, ec);
+    if (!file.is_open() || ec)
         throw std::runtime_error("Unable to open parameters file: " + fullPath.string());
+    m_text.resize(static_cast<std::size_t>(size));
+    if (size != 0 && !file.read(&m_text[0], static_cast<std::streamsize>(size)))
+        throw std::runtime_error("Unable to read parameters file: " + fullPath.string());
 
-    std::string line;
-    while (std::getline(file, line))
+    std::string_view text = m_text;
+    std::string_view line;
+    while (nextLine(text, line))
     {
         line = trim(line);
-        if (line.empty() || line.rfind("#", 0) == 0) continue; // skip blank/comments
+        if (line.empty() || line[0] == '#') continue; // skip blank/comments
 
         if (line == "START PARAMETERS")
         {
-            parseParameterBlock(file);
+            parseParameterBlock(text);
         }
         else if (line == "START SURFACES")
         {
-            parseSurfaceBlock(file);
+            parseSurfaceBlock(text);
             // After END SURFACES, search remaining lines for the last numeric token (power per photon)
-            parsePowerAfterSurfaces(file);
+            parsePowerAfterSurfaces(text);
             break; // we’re done
         }
         // else: ignore other lines before first block
     }
 
-    if (m_surfaceMap.empty())
+    if (m_surfaces.empty())
         std::cerr << "Warning: no surfaces parsed from photons_parameters.txt\n";
     if (m_powerPerPhoton <= 0.0)
         std::cerr << "Warning: power per photon not found or non-positive.\n";
@@ -78,65 +122,60 @@ void ParametersFileReader::read()
 
 // --- blocks ---
 
-void ParametersFileReader::parseParameterBlock(std::ifstream& file)
+void ParametersFileReader::parseParameterBlock(std::string_view& text)
 {
     std::vector<std::string> parameterNames;
-    std::string line;
-    while (std::getline(file, line))
+    std::string_view line;
+    while (nextLine(text, line))
     {
         line = trim(line);
         if (line == "END PARAMETERS") break;
         if (!line.empty() && line[0] != '#')
-            parameterNames.push_back(line);
+            parameterNames.emplace_back(line);
     }
 
-    if (!matchesExpectedParameterList(parameterNames))
-        throw std::runtime_error("Photon parameter list in file does not match the expected structure.");
-}
-
-bool ParametersFileReader::matchesExpectedParameterList(const std::vector<std::string>& actual)
-{
-    // Expected order in Tonatiuh++ photon .dat
-    const std::vector<std::string> expected = {
-        "id", "x", "y", "z", "side", "previous ID", "next ID", "surface ID"
-    };
-
-    if (actual.size() != expected.size())
-        return false;
-
-    for (std::size_t i = 0; i < expected.size(); ++i)
-    {
-        if (normalizeId(actual[i]) != normalizeId(expected[i]))
-            return false;
-    }
-    return true;
+    // Tonatiuh++ writes only the fields selected for export, in this order
+    m_layout = PhotonLayout::fromParameterNames(parameterNames);
+    m_parameterNames = parameterNames;
 }
 
-void ParametersFileReader::parseSurfaceBlock(std::ifstream& file)
+void ParametersFileReader::parseSurfaceBlock(std::string_view& text)
 {
-    std::string line;
-    while (std::getline(file, line))
+    std::string_view line;
+    while (nextLine(text, line))
     {
         line = trim(line);
         if (line == "END SURFACES") break;
         if (line.empty() || line[0] == '#') continue;
 
-        std::istringstream iss(line);
+        // "<id> <path>"; lines without a number or a path are skipped
         uint64_t surfaceId;
-        std::string surfacePath;
-        if (iss >> surfaceId >> std::ws && std::getline(iss, surfacePath))
-        {
-            m_surfaceMap[surfaceId] = trim(surfacePath);
-        }
+        const auto [end, ec] = std::from_chars(line.data(), line.data() + line.size(), surfaceId);
+        if (ec != std::errc()) continue;
+        const std::string_view surfacePath = trim(line.substr(static_cast<std::size_t>(end - line.data())));
+        if (!surfacePath.empty())
+            m_surfaces.push_back({ surfaceId, surfacePath });
+    }
+
+    // Ascending ids; for a repeated id the last line wins
+    std::stable_sort(m_surfaces.begin(), m_surfaces.end(),
+                     [](const SurfacePath& a, const SurfacePath& b) { return a.id < b.id; });
+    auto last = m_surfaces.begin();
+    for (auto it = m_surfaces.begin(); it != m_surfaces.end(); ++it) {
+        if (last != m_surfaces.begin() && std::prev(last)->id == it->id)
+            *std::prev(last) = *it;
+        else
+            *last++ = *it;
     }
+    m_surfaces.erase(last, m_surfaces.end());
 }
 
-void ParametersFileReader::parsePowerAfterSurfaces(std::ifstream& file)
+void ParametersFileReader::parsePowerAfterSurfaces(std::string_view& text)
 {
     // After END SURFACES, Tonatiuh++ often writes the power per photon on the last line.
     // Be tolerant: skip blanks/comments; if the line has labels, extract the last numeric token.
-    std::string line, lastNonEmpty;
-    while (std::getline(file, line)) {
+    std::string_view line, lastNonEmpty;
+    while (nextLine(text, line)) {
         line = trim(line);
         if (line.empty() || line[0] == '#') continue;
         lastNonEmpty = line;
@@ -145,33 +184,53 @@ void ParametersFileReader::parsePowerAfterSurfaces(std::ifstream& file)
         throw std::runtime_error("Failed to read power per photon: no data after END SURFACES.");
 
     // Extract the last numeric token from the line
-    std::istringstream iss(lastNonEmpty);
-    std::string token, lastToken;
-    while (iss >> token) lastToken = token;
-
-    try {
-        // stod tolerates leading/trailing spaces; token should be numeric (possibly with exponent)
-        m_powerPerPhoton = std::stod(lastToken);
-    } catch (...) {
+    std::size_t start = lastNonEmpty.size();
+    while (start > 0 && !std::isspace(static_cast<unsigned char>(lastNonEmpty[start - 1]))) --start;
+    const std::string_view lastToken = lastNonEmpty.substr(start);
+
+    if (!parseLeadingDouble(lastToken, m_powerPerPhoton)) {
         // If the entire line is just a number with locale commas, try to replace ',' with '.'
-        std::string canon = lastToken;
+        std::string canon(lastToken);
         std::replace(canon.begin(), canon.end(), ',', '.');
-        try {
-            m_powerPerPhoton = std::stod(canon);
-        } catch (...) {
-            throw std::runtime_error("Failed to parse power per photon from line: \"" + lastNonEmpty + "\"");
-        }
+        if (!parseLeadingDouble(canon, m_powerPerPhoton))
+            throw std::runtime_error("Failed to parse power per photon from line: \"" + std::string(lastNonEmpty) + "\"");
     }
 }
 
 // --- getters ---
 
-const std::unordered_map<uint64_t, std::string>& ParametersFileReader::getSurfaceMap() const
+const std::vector<SurfacePath>& ParametersFileReader::getSurfaces() const
 {
-    return m_surfaceMap;
+    return m_surfaces;
 }
 
 double ParametersFileReader::getPowerPerPhoton() const
 {
     return m_powerPerPhoton;
+}
+
+uint64_t ParametersFileReader::getFingerprint() const
+{
+    Fnv1a hash;
+    for (const std::string& name : m_parameterNames)
+        hash.mixString(normalizeId(name));
+    mixSurfaces(hash);
+    hash.mix(&m_powerPerPhoton, sizeof(m_powerPerPhoton));
+    return hash.value;
+}
+
+uint64_t ParametersFileReader::getSurfacesFingerprint() const
+{
+    Fnv1a hash;
+    mixSurfaces(hash);
+    return hash.value;
+}
+
+void ParametersFileReader::mixSurfaces(Fnv1a& hash) const
+{
+    // Surfaces are kept in ascending id order, so the hash does not depend on the file's line order
+    for (const SurfacePath& surface : m_surfaces) {
+        hash.mix(&surface.id, sizeof(surface.id));
+        hash.mixString(surface.path);
+    }
 }
\ No newline at end of file
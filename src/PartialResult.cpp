@@ -0,0 +1,65 @@
+#include "PartialResult.h"
+
+#include "BinaryIO.h"
+
+#include <cstring>
+#include <fstream>
+#include <system_error>
+
+namespace {
+
+constexpr char kMagic[8] = { 'S', 'T', 'T', 'P', 'A', 'R', 'T', '1' };
+
+} // namespace
+
+bool PartialResult::save(const fs::path& path) const
+{
+    // Written next to the target and renamed: a merge never sees half a file
+    fs::path tmpPath = path;
+    tmpPath += ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+
+        out.write(kMagic, sizeof(kMagic));
+        putLittleEndian(out, parametersFingerprint);
+        putLittleEndian(out, surfacesFingerprint);
+        putLittleEndian(out, shard);
+        putLittleEndian(out, shardCount);
+        putLittleEndian(out, static_cast<std::uint8_t>(standardErrors ? 1 : 0));
+        putLittleEndian(out, static_cast<std::uint64_t>(matrix.size()));
+        out.write(matrix.data(), static_cast<std::streamsize>(matrix.size()));
+        if (!out.flush()) return false;
+    }
+
+    std::error_code ec;
+    fs::rename(tmpPath, path, ec);
+    return !ec;
+}
+
+bool PartialResult::load(const fs::path& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+
+    char magic[sizeof(kMagic)];
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) return false;
+
+    std::uint8_t errors;
+    std::uint64_t size;
+    if (!getLittleEndian(in, parametersFingerprint) || !getLittleEndian(in, surfacesFingerprint) ||
+        !getLittleEndian(in, shard) || !getLittleEndian(in, shardCount) || !getLittleEndian(in, errors) ||
+        !getLittleEndian(in, size))
+        return false;
+    if (shardCount == 0 || shard >= shardCount) return false;
+    standardErrors = (errors != 0);
+
+    // A corrupt size must not turn into a huge allocation
+    const std::streamoff here = in.tellg();
+    in.seekg(0, std::ios::end);
+    const std::streamoff end = in.tellg();
+    if (here < 0 || end < here || size != static_cast<std::uint64_t>(end - here)) return false;
+    in.seekg(here);
+    matrix.assign(static_cast<std::size_t>(size), '\0');
+    return size == 0 || static_cast<bool>(in.read(&matrix[0], static_cast<std::streamsize>(size)));
+}
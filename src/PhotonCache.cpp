@@ -0,0 +1,410 @@
+#include "PhotonCache.h"
+
+#include "tonatiuhreader.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+namespace {
+
+constexpr char kMagic[8] = { 'S', 'T', 'T', 'C', 'A', 'C', 'H', 'E' };
+constexpr std::uint32_t kVersion = 2;
+constexpr std::uint32_t kFlagHasLinks = 1u << 0;
+constexpr std::uint64_t kAlignment = 64;
+
+enum Column { kColId, kColX, kColY, kColZ, kColSide, kColSurface, kColPrev, kColNext,
+              kColRayStarts, kColSources, kColumnCount };
+
+// On-disk header (little-endian, 128 bytes)
+struct CacheHeader
+{
+    char          magic[8];
+    std::uint32_t version;
+    std::uint32_t flags;
+    std::uint64_t fingerprint;
+    std::uint64_t photons;
+    std::uint64_t rays;
+    std::uint64_t sources;
+    std::uint64_t offset[kColumnCount];
+};
+static_assert(sizeof(CacheHeader) == 128, "cache header layout");
+
+bool hostIsLittleEndian()
+{
+    const std::uint16_t probe = 1;
+    unsigned char first;
+    std::memcpy(&first, &probe, 1);
+    return first == 1;
+}
+
+std::uint64_t alignUp(std::uint64_t v)
+{
+    return (v + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+std::int64_t modificationTime(const fs::directory_entry& entry)
+{
+    return static_cast<std::int64_t>(entry.last_write_time().time_since_epoch().count());
+}
+
+// Whole photon records in a source file; compressed files are inflated once to count them
+std::uint64_t countPhotons(const fs::directory_entry& entry, std::size_t recordBytes)
+{
+    const Compression compression = compressionOf(entry.path());
+    if (compression == Compression::None) return entry.file_size() / recordBytes;
+
+    std::uint64_t bytes = 0;
+    Decompressor inflate(entry.path(), compression, 0, std::size_t{1} << 20, 3, recordBytes);
+    for (Decompressor::Buffer buffer; inflate.next(buffer);) bytes += buffer.size;
+    return bytes / recordBytes;
+}
+
+// Buffered writer for one column of a file opened for random-access output.
+class ColumnWriter
+{
+public:
+    ColumnWriter(std::fstream& out, std::uint64_t offset) : m_out(out), m_pos(offset) {}
+    ~ColumnWriter() = default;
+
+    template <class T>
+    void put(const T& value)
+    {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        m_buf.insert(m_buf.end(), bytes, bytes + sizeof(T));
+        if (m_buf.size() >= kFlushBytes) flush();
+    }
+
+    void flush()
+    {
+        if (m_buf.empty()) return;
+        m_out.seekp(static_cast<std::streamoff>(m_pos));
+        m_out.write(m_buf.data(), static_cast<std::streamsize>(m_buf.size()));
+        if (!m_out) throw std::runtime_error("Failed writing photon cache");
+        m_pos += m_buf.size();
+        m_buf.clear();
+    }
+
+private:
+    static constexpr std::size_t kFlushBytes = 1u << 20;
+    std::fstream& m_out;
+    std::uint64_t m_pos;
+    std::vector<char> m_buf;
+};
+
+} // namespace
+
+fs::path PhotonCache::cachePath(const fs::path& folder)
+{
+    return folder / "photons_cache.sttc";
+}
+
+void PhotonCache::build(const fs::path& folder, std::uint64_t fingerprint, PhotonLayout layout,
+                        const fs::path& cacheFile)
+{
+    const fs::path target = cacheFile.empty() ? cachePath(folder) : cacheFile;
+    if (!hostIsLittleEndian())
+        throw std::runtime_error("Photon cache requires a little-endian host");
+
+    const std::vector<fs::directory_entry> files = TonatiuhReader::ListPhotonFiles(folder);
+    if (layout.byteOrder() == ByteOrder::Unknown) layout.setByteOrder(TonatiuhReader::DetectByteOrder(files, layout));
+
+    std::vector<std::uint64_t> filePhotons;
+    std::uint64_t photons = 0;
+    for (const auto& f : files) {
+        filePhotons.push_back(countPhotons(f, layout.recordBytes()));
+        photons += filePhotons.back();
+    }
+
+    CacheHeader header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version     = kVersion;
+    header.fingerprint = fingerprint;
+    header.photons     = photons;
+    header.sources     = files.size();
+
+    // Fixed-size columns; previous/next come last so they can be dropped
+    std::uint64_t pos = sizeof(CacheHeader);
+    const std::uint64_t widths[] = { 8, 8, 8, 8, 1, 4, 8, 8 };
+    for (int c = kColId; c <= kColNext; ++c) {
+        header.offset[c] = alignUp(pos);
+        pos = header.offset[c] + widths[c] * photons;
+    }
+
+    const fs::path tmpPath  = target.string() + ".tmp";
+    const fs::path raysPath = target.string() + ".rays.tmp";
+    {
+        std::fstream out(tmpPath, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+        std::fstream rays(raysPath, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+        if (!out || !rays)
+            throw std::runtime_error("Unable to create photon cache " + target.string());
+
+        std::array<ColumnWriter, kColNext + 1> cols = {
+            ColumnWriter(out, header.offset[kColId]),   ColumnWriter(out, header.offset[kColX]),
+            ColumnWriter(out, header.offset[kColY]),    ColumnWriter(out, header.offset[kColZ]),
+            ColumnWriter(out, header.offset[kColSide]), ColumnWriter(out, header.offset[kColSurface]),
+            ColumnWriter(out, header.offset[kColPrev]), ColumnWriter(out, header.offset[kColNext]) };
+        ColumnWriter rayStarts(rays, 0);
+
+        // Links are redundant when every ray is stored contiguously and chained in order
+        bool canonical = true;
+        bool atRayStart = true;
+        std::uint64_t prevId = 0, prevNext = 0;
+        std::uint64_t index = 0, rayCount = 0;
+
+        TonatiuhReader reader(files, ReaderBackend::Mmap);
+        reader.SetLayout(layout);
+        PhotonBlock block;
+        while (reader.ReadPhotonBatch(block)) {
+            for (std::size_t i = 0; i < block.size(); ++i, ++index) {
+                const std::uint64_t id = block.id[i];
+                if (block.surface_id[i] > std::numeric_limits<std::uint32_t>::max() ||
+                    block.side[i] < std::numeric_limits<std::int8_t>::min() ||
+                    block.side[i] > std::numeric_limits<std::int8_t>::max())
+                    throw std::runtime_error("Photon values out of range for the cache format");
+
+                if (atRayStart) {
+                    rayStarts.put(index);
+                    ++rayCount;
+                }
+                if (block.previous_id[i] != (atRayStart ? 0 : prevId)) canonical = false;
+                if (!atRayStart && prevNext != id) canonical = false;
+
+                cols[kColId].put(id);
+                cols[kColX].put(block.x[i]);
+                cols[kColY].put(block.y[i]);
+                cols[kColZ].put(block.z[i]);
+                cols[kColSide].put(static_cast<std::int8_t>(block.side[i]));
+                cols[kColSurface].put(static_cast<std::uint32_t>(block.surface_id[i]));
+                cols[kColPrev].put(block.previous_id[i]);
+                cols[kColNext].put(block.next_id[i]);
+
+                prevId = id;
+                prevNext = block.next_id[i];
+                atRayStart = (prevNext == 0);
+            }
+        }
+        if (index != photons)
+            throw std::runtime_error("Photon files changed while building the cache");
+
+        // Close the ray index with the end of the last complete ray. If the stream ends
+        // mid-ray, the start already recorded for that unterminated ray is that end.
+        if (atRayStart) {
+            rayStarts.put(index);
+        } else {
+            canonical = false;
+            --rayCount;
+        }
+        rayStarts.flush();
+        for (auto& c : cols) c.flush();
+
+        header.rays  = rayCount;
+        header.flags = canonical ? 0 : kFlagHasLinks;
+        const std::uint64_t linksEnd = canonical ? header.offset[kColPrev]
+                                                 : header.offset[kColNext] + 8 * photons;
+
+        // Ray index: copy the (rayCount + 1) entries from the side file
+        header.offset[kColRayStarts] = alignUp(linksEnd);
+        {
+            ColumnWriter starts(out, header.offset[kColRayStarts]);
+            rays.seekg(0);
+            std::uint64_t v;
+            for (std::uint64_t r = 0; r <= rayCount; ++r) {
+                rays.read(reinterpret_cast<char*>(&v), sizeof(v));
+                starts.put(v);
+            }
+            starts.flush();
+        }
+
+        // Source table: size, mtime, photons, name length, name
+        header.offset[kColSources] = alignUp(header.offset[kColRayStarts] + 8 * (rayCount + 1));
+        {
+            ColumnWriter sources(out, header.offset[kColSources]);
+            for (std::size_t i = 0; i < files.size(); ++i) {
+                const fs::directory_entry& f = files[i];
+                const std::string name = f.path().filename().string();
+                sources.put(static_cast<std::uint64_t>(f.file_size()));
+                sources.put(modificationTime(f));
+                sources.put(filePhotons[i]);
+                sources.put(static_cast<std::uint32_t>(name.size()));
+                for (const char ch : name) sources.put(ch);
+            }
+            sources.flush();
+        }
+
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (!out) throw std::runtime_error("Failed writing photon cache header");
+    }
+
+    // Cut the unused link columns (if any) and publish atomically
+    std::uint64_t size = header.offset[kColSources];
+    for (const auto& f : files) size += 8 + 8 + 8 + 4 + f.path().filename().string().size();
+    fs::resize_file(tmpPath, size);
+    fs::remove(raysPath);
+    fs::rename(tmpPath, target);
+}
+
+bool PhotonCache::open(const fs::path& folder, std::uint64_t fingerprint, const fs::path& cacheFile)
+{
+    m_map.close();
+    const fs::path path = cacheFile.empty() ? cachePath(folder) : cacheFile;
+    if (!hostIsLittleEndian() || !fs::exists(path)) return false;
+
+    MappedFile map;
+    if (!map.open(path) || map.size() < sizeof(CacheHeader)) return false;
+
+    CacheHeader h;
+    std::memcpy(&h, map.data(), sizeof(h));
+    if (std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 || h.version != kVersion) return false;
+    if (fingerprint != 0 && h.fingerprint != fingerprint) {
+        std::cerr << "Photon cache " << path << " was built for different parameters; ignoring it.\n";
+        return false;
+    }
+
+    // Sources must match the current .dat files exactly
+    const std::vector<fs::directory_entry> files = TonatiuhReader::ListPhotonFiles(folder);
+    bool fresh = (files.size() == h.sources);
+    std::uint64_t pos = h.offset[kColSources];
+    std::vector<std::uint64_t> sourcePhotons;
+    std::vector<Source> sources;
+    for (std::size_t i = 0; fresh && i < files.size(); ++i) {
+        std::uint64_t size, photons;
+        std::int64_t mtime;
+        std::uint32_t len;
+        if (pos + 28 > map.size()) return false;
+        std::memcpy(&size,    map.data() + pos, 8);
+        std::memcpy(&mtime,   map.data() + pos + 8, 8);
+        std::memcpy(&photons, map.data() + pos + 16, 8);
+        std::memcpy(&len,     map.data() + pos + 24, 4);
+        pos += 28;
+        if (pos + len > map.size()) return false;
+        const std::string name(reinterpret_cast<const char*>(map.data() + pos), len);
+        pos += len;
+        fresh = name == files[i].path().filename().string() &&
+                size == files[i].file_size() && mtime == modificationTime(files[i]);
+        sourcePhotons.push_back(photons);
+        sources.push_back(Source{ name, size, mtime });
+    }
+    if (!fresh) {
+        std::cerr << "Photon cache " << path << " is stale; ignoring it.\n";
+        return false;
+    }
+
+    // Every column inside the file and aligned to its values, the photon counts
+    // adding up, and the ray index running from the first photon to at most the
+    // last (the end of the last complete ray)
+    const bool hasLinks = (h.flags & kFlagHasLinks) != 0;
+    const auto fits = [&](Column column, std::uint64_t count, std::uint64_t width) {
+        const std::uint64_t offset = h.offset[column];
+        return offset % width == 0 && offset <= map.size() && count <= (map.size() - offset) / width;
+    };
+    std::uint64_t sourceTotal = 0;
+    for (const std::uint64_t photons : sourcePhotons) sourceTotal += photons;
+    bool valid = h.rays <= h.photons && sourceTotal == h.photons && fits(kColId, h.photons, 8) &&
+                 fits(kColX, h.photons, 8) && fits(kColY, h.photons, 8) && fits(kColZ, h.photons, 8) &&
+                 fits(kColSide, h.photons, 1) && fits(kColSurface, h.photons, 4) && fits(kColRayStarts, h.rays + 1, 8) &&
+                 (!hasLinks || (fits(kColPrev, h.photons, 8) && fits(kColNext, h.photons, 8)));
+    if (valid) {
+        std::uint64_t first, last;
+        std::memcpy(&first, map.data() + h.offset[kColRayStarts], 8);
+        std::memcpy(&last, map.data() + h.offset[kColRayStarts] + 8 * h.rays, 8);
+        valid = first == 0 && last <= h.photons;
+    }
+    if (!valid) {
+        std::cerr << "Photon cache " << path << " is damaged or truncated; ignoring it.\n";
+        return false;
+    }
+
+    const unsigned char* base = map.data();
+    m_photons   = h.photons;
+    m_rays      = h.rays;
+    m_has_links = hasLinks;
+    m_source_photons = std::move(sourcePhotons);
+    m_sources   = std::move(sources);
+    m_id      = reinterpret_cast<const std::uint64_t*>(base + h.offset[kColId]);
+    m_x       = reinterpret_cast<const double*>(base + h.offset[kColX]);
+    m_y       = reinterpret_cast<const double*>(base + h.offset[kColY]);
+    m_z       = reinterpret_cast<const double*>(base + h.offset[kColZ]);
+    m_side    = reinterpret_cast<const std::int8_t*>(base + h.offset[kColSide]);
+    m_surface = reinterpret_cast<const std::uint32_t*>(base + h.offset[kColSurface]);
+    m_prev    = m_has_links ? reinterpret_cast<const std::uint64_t*>(base + h.offset[kColPrev]) : nullptr;
+    m_next    = m_has_links ? reinterpret_cast<const std::uint64_t*>(base + h.offset[kColNext]) : nullptr;
+    m_ray_starts = reinterpret_cast<const std::uint64_t*>(base + h.offset[kColRayStarts]);
+
+    m_map = std::move(map);
+    return true;
+}
+
+bool PhotonCache::isFresh(const fs::path& folder) const
+{
+    const std::vector<fs::directory_entry> files = TonatiuhReader::ListPhotonFiles(folder);
+    if (!is_open() || files.size() != m_sources.size()) return false;
+    for (std::size_t i = 0; i < files.size(); ++i)
+    {
+        std::error_code ec;
+        const std::uint64_t size = files[i].file_size(ec);
+        if (ec || files[i].path().filename().string() != m_sources[i].name || size != m_sources[i].size ||
+            modificationTime(files[i]) != m_sources[i].mtime)
+            return false;
+    }
+    return true;
+}
+
+std::vector<std::pair<std::uint64_t, std::uint64_t>> PhotonCache::splitByRays(std::uint64_t photons_per_range) const
+{
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> ranges;
+    if (photons_per_range == 0) photons_per_range = std::max<std::uint64_t>(m_photons, 1);
+
+    std::uint64_t begin = 0;
+    while (begin < m_photons) {
+        // First ray start at or after begin + photons_per_range
+        const std::uint64_t* starts_end = m_ray_starts + m_rays + 1;
+        const std::uint64_t* it = std::lower_bound(m_ray_starts, starts_end, begin + photons_per_range);
+        const std::uint64_t end = (it == starts_end || *it >= m_ray_starts[m_rays]) ? m_photons : *it;
+        ranges.emplace_back(begin, end);
+        begin = end;
+    }
+    return ranges;
+}
+
+void PhotonCache::read(std::uint64_t first, std::size_t count, PhotonBlock& b, unsigned fields) const
+{
+    const std::size_t o = b.size();
+
+    if (fields & kFieldId) std::memcpy(&b.id[o], m_id + first, count * sizeof(std::uint64_t));
+    if (fields & kFieldX)  std::memcpy(&b.x[o],  m_x + first,  count * sizeof(double));
+    if (fields & kFieldY)  std::memcpy(&b.y[o],  m_y + first,  count * sizeof(double));
+    if (fields & kFieldZ)  std::memcpy(&b.z[o],  m_z + first,  count * sizeof(double));
+    if (fields & kFieldSide)
+        for (std::size_t i = 0; i < count; ++i) b.side[o + i] = m_side[first + i];
+    if (fields & kFieldSurfaceId)
+        for (std::size_t i = 0; i < count; ++i) b.surface_id[o + i] = m_surface[first + i];
+
+    if (fields & (kFieldPreviousId | kFieldNextId)) {
+        if (m_has_links) {
+            if (fields & kFieldPreviousId) std::memcpy(&b.previous_id[o], m_prev + first, count * sizeof(std::uint64_t));
+            if (fields & kFieldNextId)     std::memcpy(&b.next_id[o],     m_next + first, count * sizeof(std::uint64_t));
+        } else {
+            // Rebuild links from the ray index: rays are contiguous chains
+            std::size_t ray = static_cast<std::size_t>(
+                std::upper_bound(m_ray_starts, m_ray_starts + m_rays + 1, first) - m_ray_starts) - 1;
+            for (std::size_t i = 0; i < count; ++i) {
+                const std::uint64_t p = first + i;
+                while (m_ray_starts[ray + 1] <= p) ++ray;
+                const bool start = (p == m_ray_starts[ray]);
+                const bool end   = (p + 1 == m_ray_starts[ray + 1]);
+                if (fields & kFieldPreviousId) b.previous_id[o + i] = start ? 0 : m_id[p - 1];
+                if (fields & kFieldNextId)     b.next_id[o + i]     = end ? 0 : m_id[p + 1];
+            }
+        }
+    }
+
+    b.count += count;
+}
@@ -0,0 +1,436 @@
+#include "PhotonDecode.h"
+
+#include <algorithm>       // std::fill_n
+#include <cmath>           // std::llround, std::lrint
+#include <cstdint>
+#include <cstring>         // std::memcpy
+#include <utility>         // std::index_sequence
+#include <vector>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#  define STT_HAVE_AVX2_DECODE 1
+#  define STT_AVX2_TARGET __attribute__((target("avx2")))
+#  include <immintrin.h>
+#elif defined(_MSC_VER) && defined(__AVX2__)
+#  define STT_HAVE_AVX2_DECODE 1
+#  define STT_AVX2_TARGET
+#  include <immintrin.h>
+#endif
+
+namespace {
+
+inline std::uint64_t byteswap64(std::uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_bswap64(v);
+#else
+    v = ((v & 0x00FF00FF00FF00FFull) << 8)  | ((v >> 8)  & 0x00FF00FF00FF00FFull);
+    v = ((v & 0x0000FFFF0000FFFFull) << 16) | ((v >> 16) & 0x0000FFFF0000FFFFull);
+    return (v << 32) | (v >> 32);
+#endif
+}
+
+// Read one double from a raw (possibly unaligned) record field, reversing its
+// bytes when the file's byte order is not the host's
+template <bool Swap>
+inline double loadDouble(const unsigned char* src)
+{
+    std::uint64_t bits;
+    std::memcpy(&bits, src, sizeof(bits));
+    if constexpr (Swap) bits = byteswap64(bits);
+    double out;
+    std::memcpy(&out, &bits, sizeof(out));
+    return out;
+}
+
+// Ids and sides are whole numbers in practice: those take a plain conversion,
+// which agrees with llround / lrint on them; anything else takes the library call
+inline std::uint64_t toId(double v)
+{
+    if (v >= 0.0 && v < 9007199254740992.0) { // 2^53
+        const auto t = static_cast<std::int64_t>(v);
+        if (static_cast<double>(t) == v) return static_cast<std::uint64_t>(t);
+    }
+    return static_cast<std::uint64_t>(std::llround(v));
+}
+
+inline int toSide(double v)
+{
+    if (v > -2147483648.0 && v < 2147483648.0) {
+        const auto t = static_cast<int>(v);
+        if (static_cast<double>(t) == v) return t;
+    }
+    return static_cast<int>(std::lrint(v));
+}
+
+template <bool Swap>
+inline void decodeOne(const unsigned char* rec, PhotonBlock& b, std::size_t i)
+{
+    b.id[i]          = toId(loadDouble<Swap>(rec));
+    b.x[i]           = loadDouble<Swap>(rec + 1 * sizeof(double));
+    b.y[i]           = loadDouble<Swap>(rec + 2 * sizeof(double));
+    b.z[i]           = loadDouble<Swap>(rec + 3 * sizeof(double));
+    b.side[i]        = toSide(loadDouble<Swap>(rec + 4 * sizeof(double)));
+    b.previous_id[i] = toId(loadDouble<Swap>(rec + 5 * sizeof(double)));
+    b.next_id[i]     = toId(loadDouble<Swap>(rec + 6 * sizeof(double)));
+    b.surface_id[i]  = toId(loadDouble<Swap>(rec + 7 * sizeof(double)));
+}
+
+constexpr std::size_t kRecordBytes = 8 * sizeof(double);
+
+template <bool Swap>
+void decodeStandardScalar(const unsigned char* records, std::size_t count, PhotonBlock& b, std::size_t offset)
+{
+    for (std::size_t i = 0; i < count; ++i)
+        decodeOne<Swap>(records + i * kRecordBytes, b, offset + i);
+}
+
+// --- other layouts ---
+
+// Zeroes the columns of photons [offset, offset + count) that `fields` lacks
+void clearAbsent(unsigned fields, PhotonBlock& b, std::size_t offset, std::size_t count)
+{
+    const auto clear = [&](auto& column, PhotonField field) {
+        if (!(fields & field)) std::fill_n(column.begin() + static_cast<std::ptrdiff_t>(offset), count, 0);
+    };
+    clear(b.id, kFieldId);
+    clear(b.x, kFieldX);
+    clear(b.y, kFieldY);
+    clear(b.z, kFieldZ);
+    clear(b.side, kFieldSide);
+    clear(b.previous_id, kFieldPreviousId);
+    clear(b.next_id, kFieldNextId);
+    clear(b.surface_id, kFieldSurfaceId);
+}
+
+template <PhotonField Field>
+inline void store(PhotonBlock& b, std::size_t i, double v)
+{
+    if constexpr (Field == kFieldId)              b.id[i] = toId(v);
+    else if constexpr (Field == kFieldX)          b.x[i] = v;
+    else if constexpr (Field == kFieldY)          b.y[i] = v;
+    else if constexpr (Field == kFieldZ)          b.z[i] = v;
+    else if constexpr (Field == kFieldSide)       b.side[i] = toSide(v);
+    else if constexpr (Field == kFieldPreviousId) b.previous_id[i] = toId(v);
+    else if constexpr (Field == kFieldNextId)     b.next_id[i] = toId(v);
+    else                                          b.surface_id[i] = toId(v);
+}
+
+template <bool Swap, PhotonField... Fields, std::size_t... Columns>
+inline void decodeFields(const unsigned char* rec, PhotonBlock& b, std::size_t i, std::index_sequence<Columns...>)
+{
+    (store<Fields>(b, i, loadDouble<Swap>(rec + Columns * sizeof(double))), ...);
+}
+
+// A layout known at compile time: every field at a fixed offset, no dispatch per value
+template <bool Swap, PhotonField... Fields>
+void decodeLayout(const unsigned char* records, std::size_t count, PhotonBlock& b, std::size_t offset)
+{
+    constexpr std::size_t recordBytes = sizeof...(Fields) * sizeof(double);
+    clearAbsent((0u | ... | Fields), b, offset, count);
+    for (std::size_t i = 0; i < count; ++i)
+        decodeFields<Swap, Fields...>(records + i * recordBytes, b, offset + i,
+                                      std::make_index_sequence<sizeof...(Fields)>{});
+}
+
+void storeAny(PhotonField field, PhotonBlock& b, std::size_t i, double v)
+{
+    switch (field) {
+    case kFieldId:         b.id[i] = toId(v); break;
+    case kFieldX:          b.x[i] = v; break;
+    case kFieldY:          b.y[i] = v; break;
+    case kFieldZ:          b.z[i] = v; break;
+    case kFieldSide:       b.side[i] = toSide(v); break;
+    case kFieldPreviousId: b.previous_id[i] = toId(v); break;
+    case kFieldNextId:     b.next_id[i] = toId(v); break;
+    default:               b.surface_id[i] = toId(v); break;
+    }
+}
+
+void storeAny(PhotonField field, PhotonInfo& p, double v)
+{
+    switch (field) {
+    case kFieldId:         p.id = toId(v); break;
+    case kFieldX:          p.x = v; break;
+    case kFieldY:          p.y = v; break;
+    case kFieldZ:          p.z = v; break;
+    case kFieldSide:       p.side = toSide(v); break;
+    case kFieldPreviousId: p.previous_id = toId(v); break;
+    case kFieldNextId:     p.next_id = toId(v); break;
+    default:               p.surface_id = toId(v); break;
+    }
+}
+
+#ifdef STT_HAVE_AVX2_DECODE
+
+// Transposes four rows of four doubles into four columns.
+STT_AVX2_TARGET inline void transpose4(__m256d r0, __m256d r1, __m256d r2, __m256d r3,
+                                       __m256d& c0, __m256d& c1, __m256d& c2, __m256d& c3)
+{
+    const __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+    const __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+    const __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+    const __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+    c0 = _mm256_permute2f128_pd(t0, t2, 0x20);
+    c1 = _mm256_permute2f128_pd(t1, t3, 0x20);
+    c2 = _mm256_permute2f128_pd(t0, t2, 0x31);
+    c3 = _mm256_permute2f128_pd(t1, t3, 0x31);
+}
+
+// Converts doubles that hold exact integers in [0, limit) with the 2^52 magic-number
+// trick. Returns false when any lane is outside that domain; llround/lrint would agree
+// on every lane that passes, so callers fall back to the scalar path otherwise.
+STT_AVX2_TARGET inline bool exactToInteger(__m256d v, double limit, __m256i& out)
+{
+    const __m256d magic = _mm256_set1_pd(4503599627370496.0); // 2^52
+    const __m256d t     = _mm256_add_pd(v, magic);
+    const __m256d exact = _mm256_cmp_pd(_mm256_sub_pd(t, magic), v, _CMP_EQ_OQ);
+    const __m256d lower = _mm256_cmp_pd(v, _mm256_setzero_pd(), _CMP_GE_OQ);
+    const __m256d upper = _mm256_cmp_pd(v, _mm256_set1_pd(limit), _CMP_LT_OQ);
+    out = _mm256_xor_si256(_mm256_castpd_si256(t), _mm256_castpd_si256(magic));
+    return _mm256_movemask_pd(_mm256_and_pd(exact, _mm256_and_pd(lower, upper))) == 0xF;
+}
+
+template <bool Swap>
+STT_AVX2_TARGET void decodeRecordsAvx2(const unsigned char* records, std::size_t count,
+                                       PhotonBlock& b, std::size_t offset)
+{
+    static_assert(sizeof(int) == 4, "side is stored as 32-bit lanes");
+
+    // Reverse the bytes of every 64-bit lane (records in host order are used as they are)
+    const __m256i swap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i evenLanes = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const unsigned char* rec = records + i * kRecordBytes;
+        __m256d lo[4], hi[4];
+        for (int r = 0; r < 4; ++r) {
+            const unsigned char* p = rec + r * kRecordBytes;
+            __m256i first  = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+            if constexpr (Swap) {
+                first  = _mm256_shuffle_epi8(first, swap);
+                second = _mm256_shuffle_epi8(second, swap);
+            }
+            lo[r] = _mm256_castsi256_pd(first);
+            hi[r] = _mm256_castsi256_pd(second);
+        }
+
+        __m256d id, x, y, z, side, prev, next, surf;
+        transpose4(lo[0], lo[1], lo[2], lo[3], id, x, y, z);
+        transpose4(hi[0], hi[1], hi[2], hi[3], side, prev, next, surf);
+
+        const std::size_t o = offset + i;
+        _mm256_storeu_pd(&b.x[o], x);
+        _mm256_storeu_pd(&b.y[o], y);
+        _mm256_storeu_pd(&b.z[o], z);
+
+        const double idLimit = 4503599627370496.0; // 2^52
+        __m256i iId, iSide, iPrev, iNext, iSurf;
+        const bool ok = exactToInteger(id, idLimit, iId)
+                     && exactToInteger(side, 2147483648.0, iSide)
+                     && exactToInteger(prev, idLimit, iPrev)
+                     && exactToInteger(next, idLimit, iNext)
+                     && exactToInteger(surf, idLimit, iSurf);
+        if (!ok) {
+            for (std::size_t r = 0; r < 4; ++r)
+                decodeOne<Swap>(rec + r * kRecordBytes, b, o + r);
+            continue;
+        }
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&b.id[o]), iId);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&b.previous_id[o]), iPrev);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&b.next_id[o]), iNext);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&b.surface_id[o]), iSurf);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&b.side[o]),
+                         _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(iSide, evenLanes)));
+    }
+
+    for (; i < count; ++i)
+        decodeOne<Swap>(records + i * kRecordBytes, b, offset + i);
+}
+
+// Column `Field` of four photons from four lanes; false when an integer-like
+// lane is not an exact integer (the caller then decodes the photons one by one)
+template <PhotonField Field>
+STT_AVX2_TARGET inline bool storeLanes(__m256d v, PhotonBlock& b, std::size_t o)
+{
+    if constexpr (Field == kFieldX || Field == kFieldY || Field == kFieldZ) {
+        double* column = Field == kFieldX ? &b.x[o] : Field == kFieldY ? &b.y[o] : &b.z[o];
+        _mm256_storeu_pd(column, v);
+        return true;
+    } else if constexpr (Field == kFieldSide) {
+        __m256i side;
+        if (!exactToInteger(v, 2147483648.0, side)) return false;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&b.side[o]),
+                         _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(side, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6))));
+        return true;
+    } else {
+        __m256i id;
+        if (!exactToInteger(v, 4503599627370496.0, id)) return false; // 2^52
+        std::uint64_t* column = Field == kFieldId         ? &b.id[o]
+                              : Field == kFieldPreviousId ? &b.previous_id[o]
+                              : Field == kFieldNextId     ? &b.next_id[o]
+                                                          : &b.surface_id[o];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(column), id);
+        return true;
+    }
+}
+
+// Column `column` of four records `recordDoubles` apart, in host byte order
+template <bool Swap>
+STT_AVX2_TARGET inline __m256d gatherColumn(const unsigned char* rec, std::size_t column, __m256i index)
+{
+    const __m256d v = _mm256_i64gather_pd(reinterpret_cast<const double*>(rec + column * sizeof(double)), index, 8);
+    if constexpr (!Swap) return v;
+    const __m256i swap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    return _mm256_castsi256_pd(_mm256_shuffle_epi8(_mm256_castpd_si256(v), swap));
+}
+
+template <bool Swap, PhotonField... Fields, std::size_t... Columns>
+STT_AVX2_TARGET inline bool decodeFourAvx2(const unsigned char* rec, __m256i index, PhotonBlock& b, std::size_t o,
+                                           std::index_sequence<Columns...>)
+{
+    return (storeLanes<Fields>(gatherColumn<Swap>(rec, Columns, index), b, o) && ...);
+}
+
+// A layout known at compile time, four records at a time: each column gathered
+// into one register, then converted as in decodeRecordsAvx2
+template <bool Swap, PhotonField... Fields>
+STT_AVX2_TARGET void decodeLayoutAvx2(const unsigned char* records, std::size_t count, PhotonBlock& b,
+                                      std::size_t offset)
+{
+    constexpr std::size_t fieldCount = sizeof...(Fields);
+    constexpr std::size_t recordBytes = fieldCount * sizeof(double);
+    clearAbsent((0u | ... | Fields), b, offset, count);
+
+    const __m256i index = _mm256_setr_epi64x(0, fieldCount, 2 * fieldCount, 3 * fieldCount);
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const unsigned char* rec = records + i * recordBytes;
+        if (decodeFourAvx2<Swap, Fields...>(rec, index, b, offset + i, std::make_index_sequence<fieldCount>{}))
+            continue;
+        for (std::size_t r = 0; r < 4; ++r)
+            decodeFields<Swap, Fields...>(rec + r * recordBytes, b, offset + i + r,
+                                          std::make_index_sequence<fieldCount>{});
+    }
+    for (; i < count; ++i)
+        decodeFields<Swap, Fields...>(records + i * recordBytes, b, offset + i, std::make_index_sequence<fieldCount>{});
+}
+
+bool cpuHasAvx2()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    return true; // only compiled when the build targets AVX2
+#else
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif // STT_HAVE_AVX2_DECODE
+
+using DecodeFn = void (*)(const unsigned char*, std::size_t, PhotonBlock&, std::size_t);
+
+// The full record; Swap = true is the Tonatiuh++ default (big-endian on x86)
+template <bool Swap>
+DecodeFn selectDecoder()
+{
+#ifdef STT_HAVE_AVX2_DECODE
+    if (cpuHasAvx2()) return &decodeRecordsAvx2<Swap>;
+#endif
+    return &decodeStandardScalar<Swap>;
+}
+
+// Layouts with a decoder of their own
+struct Specialisation
+{
+    std::vector<PhotonField> fields;
+    DecodeFn swapped;
+    DecodeFn native;
+    bool     vectorized;
+};
+
+template <PhotonField... Fields>
+Specialisation specialise()
+{
+#ifdef STT_HAVE_AVX2_DECODE
+    if (cpuHasAvx2())
+        return { { Fields... }, &decodeLayoutAvx2<true, Fields...>, &decodeLayoutAvx2<false, Fields...>, true };
+#endif
+    return { { Fields... }, &decodeLayout<true, Fields...>, &decodeLayout<false, Fields...>, false };
+}
+
+const std::vector<Specialisation>& specialisations()
+{
+    static const std::vector<Specialisation> table = {
+        { PhotonLayout().fields(), selectDecoder<true>(), selectDecoder<false>(),
+          selectDecoder<true>() != &decodeStandardScalar<true> },
+        // Without coordinates (no flux maps): 40 bytes
+        specialise<kFieldId, kFieldSide, kFieldPreviousId, kFieldNextId, kFieldSurfaceId>(),
+        specialise<kFieldId, kFieldSide, kFieldNextId, kFieldSurfaceId>(),
+        // Just what the matrix needs: 24 bytes
+        specialise<kFieldSide, kFieldNextId, kFieldSurfaceId>(),
+        // Without previous ID, or without both ids
+        specialise<kFieldId, kFieldX, kFieldY, kFieldZ, kFieldSide, kFieldNextId, kFieldSurfaceId>(),
+        specialise<kFieldX, kFieldY, kFieldZ, kFieldSide, kFieldNextId, kFieldSurfaceId>(),
+    };
+    return table;
+}
+
+} // namespace
+
+void decodePhotonRecordsScalar(const unsigned char* records, std::size_t count,
+                               PhotonBlock& block, std::size_t offset)
+{
+    decodeStandardScalar<true>(records, count, block, offset);
+}
+
+// --- PhotonDecoder ---
+
+PhotonDecoder::PhotonDecoder(const PhotonLayout& layout)
+    : m_layout(layout)
+{
+    const ByteOrder order = layout.byteOrder() == ByteOrder::Unknown ? ByteOrder::Big : layout.byteOrder();
+    m_swap = order != hostByteOrder();
+    for (const Specialisation& special : specialisations())
+        if (special.fields == layout.fields()) {
+            m_batch      = m_swap ? special.swapped : special.native;
+            m_vectorized = special.vectorized;
+        }
+}
+
+void PhotonDecoder::decode(const unsigned char* records, std::size_t count, PhotonBlock& block,
+                           std::size_t offset) const
+{
+    if (m_batch) m_batch(records, count, block, offset);
+    else         decodeGeneric(records, count, block, offset);
+}
+
+void PhotonDecoder::decode(const unsigned char* record, PhotonInfo& photon) const
+{
+    const std::vector<PhotonField>& fields = m_layout.fields();
+    photon = PhotonInfo{};
+    for (std::size_t c = 0; c < fields.size(); ++c) {
+        const unsigned char* value = record + c * sizeof(double);
+        storeAny(fields[c], photon, m_swap ? loadDouble<true>(value) : loadDouble<false>(value));
+    }
+}
+
+void PhotonDecoder::decodeGeneric(const unsigned char* records, std::size_t count, PhotonBlock& b,
+                                  std::size_t offset) const
+{
+    const std::vector<PhotonField>& fields = m_layout.fields();
+    const std::size_t recordBytes = m_layout.recordBytes();
+    clearAbsent(m_layout.fieldMask(), b, offset, count);
+    for (std::size_t i = 0; i < count; ++i) {
+        const unsigned char* rec = records + i * recordBytes;
+        for (std::size_t c = 0; c < fields.size(); ++c) {
+            const unsigned char* value = rec + c * sizeof(double);
+            storeAny(fields[c], b, offset + i, m_swap ? loadDouble<true>(value) : loadDouble<false>(value));
+        }
+    }
+}
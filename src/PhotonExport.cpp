@@ -0,0 +1,349 @@
+#include "PhotonExport.h"
+
+#include "BinaryIO.h"
+#include "ProcessingOptions.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+// An export directory holds chunk files chunk-NNNNNN.sttx and index.sttx.
+//
+// Chunk files are bare arrays of 48-byte little-endian records, one per
+// exported ray:
+//   u64      id of the ray's last photon (0 when the records have no id field)
+//   f64      x, y, z of the last photon
+//   u32      heliostat index, receiver index (into the label tables of the index)
+//   i32      arrival side
+//   u32      photons in the ray
+//
+// index.sttx (all little-endian):
+//   char[8]  "STTXIDX1"
+//   u32      record bytes, heliostat count, receiver count, cell row count, chunk count
+//   f64      power per photon
+//   u64      sample step (1 = every ray)
+//   u32      side filter (0 = front, 1 = back, 2 = any)
+//   per heliostat, then per receiver: u16 + bytes label
+//   per cell row: u32 heliostat index, u32 receiver index, u64 rays that passed
+//            the filters, u64 rays exported, f64 power per exported ray
+//   per chunk: u16 + bytes file name, u64 records
+// Only cells with rays have a row. The power of an exported ray is that of the
+// rays of its cell spread over the ones exported, so the records of a cell add
+// up to its power in the matrix.
+
+namespace {
+
+constexpr std::size_t kBufferRecords = 16384;
+
+// Label filters as flags per index; throws if a pattern matches no label
+std::vector<char> selectLabels(const std::vector<std::string>& labels, const std::vector<std::string>& patterns,
+                               const char* kind)
+{
+    std::vector<char> selected(labels.size(), patterns.empty() ? 1 : 0);
+    for (const std::string& pattern : patterns)
+    {
+        const bool prefix = !pattern.empty() && pattern.back() == '*';
+        const std::string stem = prefix ? pattern.substr(0, pattern.size() - 1) : pattern;
+        bool matched = false;
+        for (std::size_t i = 0; i < labels.size(); ++i)
+            if (prefix ? labels[i].compare(0, stem.size(), stem) == 0 : labels[i] == stem) {
+                selected[i] = 1;
+                matched = true;
+            }
+        if (!matched)
+            throw std::invalid_argument(std::string("The export filter \"") + pattern + "\" matches no " + kind + ".");
+    }
+    return selected;
+}
+
+// chunk-NNNNNN.sttx
+bool isChunkName(const std::string& name)
+{
+    const std::string prefix = "chunk-", suffix = ".sttx";
+    if (name.size() <= prefix.size() + suffix.size() || name.compare(0, prefix.size(), prefix) != 0 ||
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+        return false;
+    const std::string digits = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+    return digits.find_first_not_of("0123456789") == std::string::npos;
+}
+
+} // namespace
+
+// What all states of one export share: the filters, and the directory the
+// workers' chunk files are numbered in
+struct ExportTarget
+{
+    fs::path          directory;
+    ExportOptions     options;
+    std::vector<char> heliostats;   // per heliostat index: passes the filter
+    std::vector<char> receivers;
+    bool              photonIds = false;   // the records have an id field
+
+    std::mutex        mutex;
+    std::uint64_t     nextChunk = 1;
+    bool              restored  = false;   // continues an export loaded from a checkpoint
+    bool              started   = false;   // a chunk file was opened
+
+    // Opens the next unused chunk file for writing and returns its name. A new
+    // export first removes the chunk files and index of an earlier one, which
+    // its own index would not list; a restored one keeps (and skips) them.
+    std::string openChunk(std::ofstream& file)
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        std::error_code ec;
+        fs::create_directories(directory, ec);
+        if (!started && !restored) removeEarlierExport();
+        started = true;
+        for (;; ++nextChunk)
+        {
+            char name[32];
+            std::snprintf(name, sizeof name, "chunk-%06llu.sttx", static_cast<unsigned long long>(nextChunk));
+            if (fs::exists(directory / name, ec)) continue;   // part of the restored export
+            file.open(directory / name, std::ios::binary | std::ios::trunc);
+            if (!file) throw std::runtime_error("Unable to create export chunk " + (directory / name).string());
+            ++nextChunk;
+            return name;
+        }
+    }
+
+    void removeEarlierExport()
+    {
+        std::error_code ec;
+        std::size_t removed = 0;
+        for (fs::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+            const std::string name = it->path().filename().string();
+            if (isChunkName(name) && fs::remove(it->path(), ec)) ++removed;
+        }
+        fs::remove(directory / "index.sttx", ec);
+        if (removed != 0)
+            std::cerr << "Removed " << removed << " chunk file(s) of an earlier export from " << directory.string()
+                      << "\n";
+    }
+};
+
+PhotonExport::PhotonExport(const SurfaceMap& surfaceMap, std::shared_ptr<ExportTarget> target)
+    : m_surfaceMap(&surfaceMap),
+      m_receiverCount(surfaceMap.getReceiverLabels().size()),
+      m_target(std::move(target)),
+      m_rays(surfaceMap.getHeliostatLabels().size() * m_receiverCount),
+      m_exported(m_rays.size())
+{
+}
+
+void PhotonExport::addRay(std::size_t length, std::uint64_t heliostatID, std::uint64_t receiverID, int arrivalSide,
+                          std::uint64_t id, double x, double y, double z)
+{
+    if (length < 2) return;
+    const ExportSide side = m_target->options.side;
+    if ((side == ExportSide::Front && arrivalSide != 1) || (side == ExportSide::Back && arrivalSide == 1)) return;
+    const std::int32_t h = m_surfaceMap->heliostatIndex(heliostatID);
+    const std::int32_t r = m_surfaceMap->receiverIndex(receiverID);
+    if (h == SurfaceMap::kNoIndex || r == SurfaceMap::kNoIndex) return;
+    if (!m_target->heliostats[static_cast<std::size_t>(h)] || !m_target->receivers[static_cast<std::size_t>(r)]) return;
+
+    // Systematic 1-in-k sample within the cell
+    const std::size_t cell = static_cast<std::size_t>(h) * m_receiverCount + static_cast<std::size_t>(r);
+    if (m_rays[cell]++ % m_target->options.sampleEvery != 0) return;
+    ++m_exported[cell];
+
+    const std::uint64_t limit = m_target->options.chunkBytes;
+    if (!m_file.is_open() || (limit != 0 && m_openBytes + kRecordBytes > limit && m_open.records > 0)) startChunk();
+
+    unsigned char* record = m_buffer.data() + m_buffered;
+    storeLittleEndian(record, id);
+    storeDouble(record + 8, x);
+    storeDouble(record + 16, y);
+    storeDouble(record + 24, z);
+    storeLittleEndian(record + 32, static_cast<std::uint32_t>(h));
+    storeLittleEndian(record + 36, static_cast<std::uint32_t>(r));
+    storeLittleEndian(record + 40, static_cast<std::int32_t>(arrivalSide));
+    storeLittleEndian(record + 44, static_cast<std::uint32_t>(length));
+    m_buffered += kRecordBytes;
+    m_openBytes += kRecordBytes;
+    ++m_open.records;
+    if (m_buffered == m_buffer.size()) writeBuffer();
+}
+
+void PhotonExport::onRayEnds(const RayEnds& ends)
+{
+    const PhotonBlock& block = *ends.block;
+    for (std::size_t k = 0; k < ends.count; ++k) {
+        const std::size_t i = ends.last[k];
+        addRay(ends.length[k], ends.penultimateSurface[k], block.surface_id[i], block.side[i],
+               m_target->photonIds ? block.id[i] : 0, block.x[i], block.y[i], block.z[i]);
+    }
+}
+
+void PhotonExport::onStitchedRay(const RayFragment& ray, const PhotonInfo* /*photons*/)
+{
+    addRay(ray.length, ray.penultimate.surface_id, ray.last.surface_id, ray.last.side,
+           m_target->photonIds ? ray.last.id : 0, ray.last.x, ray.last.y, ray.last.z);
+}
+
+void PhotonExport::startChunk()
+{
+    finish();
+    if (m_buffer.empty()) m_buffer.resize(kBufferRecords * kRecordBytes);
+    m_open.name = m_target->openChunk(m_file);
+}
+
+void PhotonExport::writeBuffer()
+{
+    m_file.write(reinterpret_cast<const char*>(m_buffer.data()), static_cast<std::streamsize>(m_buffered));
+    if (!m_file) throw std::runtime_error("Unable to write export chunk " + (m_target->directory / m_open.name).string());
+    m_buffered = 0;
+}
+
+void PhotonExport::finish()
+{
+    if (!m_file.is_open()) return;
+    writeBuffer();
+    m_file.close();
+    if (!m_file) throw std::runtime_error("Unable to write export chunk " + (m_target->directory / m_open.name).string());
+    m_chunks.push_back(std::move(m_open));
+    m_open = Chunk{};
+    m_openBytes = 0;
+}
+
+void PhotonExport::merge(const AnalyzerState& state)
+{
+    const PhotonExport& other = static_cast<const PhotonExport&>(state);
+    for (std::size_t c = 0; c < m_rays.size(); ++c) {
+        m_rays[c]     += other.m_rays[c];
+        m_exported[c] += other.m_exported[c];
+    }
+    m_chunks.insert(m_chunks.end(), other.m_chunks.begin(), other.m_chunks.end());
+}
+
+bool PhotonExport::save(std::ostream& out) const
+{
+    // The settings, so that a checkpoint is not continued with other filters
+    const ExportOptions& options = m_target->options;
+    putLittleEndian(out, options.sampleEvery);
+    putLittleEndian(out, static_cast<std::uint32_t>(options.side));
+    out.write(m_target->heliostats.data(), static_cast<std::streamsize>(m_target->heliostats.size()));
+    out.write(m_target->receivers.data(), static_cast<std::streamsize>(m_target->receivers.size()));
+
+    putCounts(out, m_rays.data(), m_rays.size());
+    putCounts(out, m_exported.data(), m_exported.size());
+    putLittleEndian(out, static_cast<std::uint64_t>(m_chunks.size()));
+    for (const Chunk& chunk : m_chunks) {
+        putString(out, chunk.name);
+        putLittleEndian(out, chunk.records);
+    }
+    return static_cast<bool>(out);
+}
+
+bool PhotonExport::load(std::istream& in)
+{
+    const ExportOptions& options = m_target->options;
+    std::uint64_t every;
+    std::uint32_t side;
+    if (!getLittleEndian(in, every) || !getLittleEndian(in, side) || every != options.sampleEvery ||
+        side != static_cast<std::uint32_t>(options.side))
+        return false;
+    std::vector<char> heliostats(m_target->heliostats.size()), receivers(m_target->receivers.size());
+    if (!in.read(heliostats.data(), static_cast<std::streamsize>(heliostats.size())) ||
+        !in.read(receivers.data(), static_cast<std::streamsize>(receivers.size())) ||
+        heliostats != m_target->heliostats || receivers != m_target->receivers)
+        return false;
+
+    std::uint64_t chunks;
+    if (!getCounts(in, m_rays.data(), m_rays.size()) || !getCounts(in, m_exported.data(), m_exported.size()) ||
+        !getLittleEndian(in, chunks))
+        return false;
+    m_chunks.clear();
+    for (std::uint64_t c = 0; c < chunks; ++c) {
+        Chunk chunk;
+        if (!getString(in, chunk.name) || !getLittleEndian(in, chunk.records)) return false;
+        m_chunks.push_back(std::move(chunk));
+    }
+    m_target->restored = true;
+    return true;
+}
+
+bool PhotonExport::writeIndex(double powerPerPhoton) const
+{
+    std::error_code ec;
+    fs::create_directories(m_target->directory, ec);
+    std::ofstream out(m_target->directory / "index.sttx", std::ios::binary | std::ios::trunc);
+    if (!out) return false;
+
+    std::vector<Chunk> chunks = m_chunks;
+    std::sort(chunks.begin(), chunks.end(), [](const Chunk& a, const Chunk& b) { return a.name < b.name; });
+    std::uint32_t rows = 0;
+    for (const std::uint64_t rays : m_rays) rows += rays != 0 ? 1 : 0;
+
+    const auto& heliostats = m_surfaceMap->getHeliostatLabels();
+    const auto& receivers  = m_surfaceMap->getReceiverLabels();
+    out.write("STTXIDX1", 8);
+    putLittleEndian(out, static_cast<std::uint32_t>(kRecordBytes));
+    putLittleEndian(out, static_cast<std::uint32_t>(heliostats.size()));
+    putLittleEndian(out, static_cast<std::uint32_t>(receivers.size()));
+    putLittleEndian(out, rows);
+    putLittleEndian(out, static_cast<std::uint32_t>(chunks.size()));
+    putDouble(out, powerPerPhoton);
+    putLittleEndian(out, m_target->options.sampleEvery);
+    putLittleEndian(out, static_cast<std::uint32_t>(m_target->options.side));
+    for (const std::string& label : heliostats) putString(out, label);
+    for (const std::string& label : receivers) putString(out, label);
+
+    for (std::size_t c = 0; c < m_rays.size(); ++c)
+    {
+        if (m_rays[c] == 0) continue;
+        putLittleEndian(out, static_cast<std::uint32_t>(c / m_receiverCount));
+        putLittleEndian(out, static_cast<std::uint32_t>(c % m_receiverCount));
+        putLittleEndian(out, m_rays[c]);
+        putLittleEndian(out, m_exported[c]);
+        putDouble(out, static_cast<double>(m_rays[c]) * powerPerPhoton / static_cast<double>(m_exported[c]));
+    }
+    for (const Chunk& chunk : chunks) {
+        putString(out, chunk.name);
+        putLittleEndian(out, chunk.records);
+    }
+    return static_cast<bool>(out);
+}
+
+ExportAnalyzer::ExportAnalyzer(const AnalyzerContext& context)
+    : Analyzer(context), m_target(std::make_shared<ExportTarget>())
+{
+    const ExportOptions& options = context.options.exportRays;
+    m_target->directory  = context.outputPath;
+    m_target->options    = options;
+    m_target->options.sampleEvery = std::max<std::uint64_t>(options.sampleEvery, 1);
+    m_target->heliostats = selectLabels(context.surfaceMap.getHeliostatLabels(), options.heliostats, "heliostat");
+    m_target->receivers  = selectLabels(context.surfaceMap.getReceiverLabels(), options.receivers, "receiver");
+    m_target->photonIds  = (context.options.layout.fieldMask() & kFieldId) != 0;
+}
+
+unsigned ExportAnalyzer::requiredFields() const
+{
+    // Photon ids are exported when the records have them
+    return kFieldX | kFieldY | kFieldZ | (m_target->photonIds ? kFieldId : 0u);
+}
+
+std::unique_ptr<AnalyzerState> ExportAnalyzer::createState() const
+{
+    return std::make_unique<PhotonExport>(m_context.surfaceMap, m_target);
+}
+
+bool ExportAnalyzer::write(const AnalyzerState& merged) const
+{
+    return static_cast<const PhotonExport&>(merged).writeIndex(m_context.powerPerPhoton);
+}
+
+bool ExportAnalyzer::parseSide(const std::string& text, ExportSide& side)
+{
+    if (text == "front")     side = ExportSide::Front;
+    else if (text == "back") side = ExportSide::Back;
+    else if (text == "any")  side = ExportSide::Any;
+    else return false;
+    return true;
+}
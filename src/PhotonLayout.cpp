@@ -0,0 +1,149 @@
+#include "PhotonLayout.h"
+
+#include "ParametersFileReader.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+struct FieldName
+{
+    PhotonField field;
+    const char* name;        // as Tonatiuh++ writes it
+    const char* normalized;  // ParametersFileReader::normalizeId(name)
+};
+
+constexpr FieldName kFieldNames[] = {
+    { kFieldId,         "id",          "id" },
+    { kFieldX,          "x",           "x" },
+    { kFieldY,          "y",           "y" },
+    { kFieldZ,          "z",           "z" },
+    { kFieldSide,       "side",        "side" },
+    { kFieldPreviousId, "previous ID", "previousid" },
+    { kFieldNextId,     "next ID",     "nextid" },
+    { kFieldSurfaceId,  "surface ID",  "surfaceid" },
+};
+
+double loadDouble(const unsigned char* src, bool swap)
+{
+    unsigned char bytes[sizeof(double)];
+    for (std::size_t b = 0; b < sizeof(double); ++b) bytes[b] = src[swap ? sizeof(double) - 1 - b : b];
+    double out;
+    std::memcpy(&out, bytes, sizeof(out));
+    return out;
+}
+
+// Whether a value read for `field` looks like something a ray tracer wrote
+bool plausible(PhotonField field, double v)
+{
+    if (!std::isfinite(v)) return false;
+    switch (field) {
+    case kFieldX:
+    case kFieldY:
+    case kFieldZ:
+        // Byte-swapped doubles mostly land far outside any scene
+        return v == 0.0 || (std::fabs(v) > 1e-200 && std::fabs(v) < 1e12);
+    case kFieldSide:
+        return v == std::nearbyint(v) && std::fabs(v) < 2147483648.0;
+    default:
+        return v == std::nearbyint(v) && v >= 0.0 && v < 9007199254740992.0; // 2^53
+    }
+}
+
+} // namespace
+
+const char* byteOrderName(ByteOrder order)
+{
+    switch (order) {
+    case ByteOrder::Unknown: return "unknown";
+    case ByteOrder::Big:     return "big-endian";
+    case ByteOrder::Little:  return "little-endian";
+    }
+    return "unknown";
+}
+
+ByteOrder hostByteOrder()
+{
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && defined(__ORDER_BIG_ENDIAN__)
+    return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? ByteOrder::Little : ByteOrder::Big;
+#else
+    const std::uint16_t probe = 1;
+    unsigned char first;
+    std::memcpy(&first, &probe, 1);
+    return first == 1 ? ByteOrder::Little : ByteOrder::Big;
+#endif
+}
+
+PhotonLayout::PhotonLayout()
+    : PhotonLayout({ kFieldId, kFieldX, kFieldY, kFieldZ, kFieldSide, kFieldPreviousId, kFieldNextId, kFieldSurfaceId },
+                   ByteOrder::Big)
+{
+}
+
+PhotonLayout::PhotonLayout(std::vector<PhotonField> fields, ByteOrder order)
+    : m_fields(std::move(fields)), m_order(order)
+{
+    for (PhotonField field : m_fields) m_mask |= field;
+}
+
+PhotonLayout PhotonLayout::fromParameterNames(const std::vector<std::string>& names)
+{
+    if (names.empty()) throw std::runtime_error("The photon parameter list is empty.");
+
+    std::vector<PhotonField> fields;
+    unsigned mask = 0;
+    for (const std::string& name : names) {
+        const std::string key = ParametersFileReader::normalizeId(name);
+        const FieldName* match = nullptr;
+        for (const FieldName& known : kFieldNames)
+            if (key == known.normalized) match = &known;
+        if (!match) throw std::runtime_error("Unknown photon parameter \"" + name + "\" in the parameter list.");
+        if (mask & match->field)
+            throw std::runtime_error("Photon parameter \"" + name + "\" is listed twice.");
+        mask |= match->field;
+        fields.push_back(match->field);
+    }
+    return PhotonLayout(std::move(fields), ByteOrder::Unknown);
+}
+
+const char* PhotonLayout::fieldName(PhotonField field)
+{
+    for (const FieldName& known : kFieldNames)
+        if (known.field == field) return known.name;
+    return "?";
+}
+
+bool PhotonLayout::hasStandardFields() const
+{
+    return m_fields == PhotonLayout().m_fields;
+}
+
+std::string PhotonLayout::describe() const
+{
+    std::string out;
+    for (PhotonField field : m_fields) {
+        if (!out.empty()) out += ", ";
+        out += fieldName(field);
+    }
+    return out + " (" + std::to_string(recordBytes()) + " bytes, " + byteOrderName(m_order) + ")";
+}
+
+ByteOrder PhotonLayout::detectByteOrder(const unsigned char* records, std::size_t count) const
+{
+    if (count == 0 || m_fields.empty()) return ByteOrder::Unknown;
+
+    // Implausible values when read as big- and as little-endian
+    const bool hostLittle = hostByteOrder() == ByteOrder::Little;
+    std::size_t wrongBig = 0, wrongLittle = 0;
+    for (std::size_t r = 0; r < count; ++r)
+        for (std::size_t c = 0; c < m_fields.size(); ++c) {
+            const unsigned char* value = records + r * recordBytes() + c * sizeof(double);
+            wrongBig    += !plausible(m_fields[c], loadDouble(value, hostLittle));
+            wrongLittle += !plausible(m_fields[c], loadDouble(value, !hostLittle));
+        }
+    return wrongLittle < wrongBig ? ByteOrder::Little : ByteOrder::Big;
+}
@@ -1,147 +1,986 @@
 #include "PhotonProcessor.h"
 
+#include "PhotonCache.h"
+#include "PhotonStream.h"
+#include "WorkStealingPool.h"
+
 #include <algorithm>
-#include <cctype>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
-#include <fstream>
 #include <iostream>
 #include <limits>
-#include <map>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
+namespace {
+
+// Photons read from one file starting at a byte offset
+struct ReadSegment
+{
+    std::size_t   file;     // index into the file list
+    std::uint64_t begin;
+    std::uint64_t photons;
+};
+
+// True when the files read up to `position` are still there, unchanged, at the
+// same places in the list.
+bool continuesFrom(const StreamPosition& position, const std::vector<ConsumedFile>& files)
+{
+    if (position.files.size() > files.size()) return false;
+    for (std::size_t f = 0; f < position.files.size(); ++f)
+    {
+        const ConsumedFile& then = position.files[f];
+        const ConsumedFile& now  = files[f];
+        if (then.name != now.name) return false;
+        // Only the last file may have grown; compressed files cannot grow (and
+        // their offsets count uncompressed bytes)
+        const bool mayGrow = (f + 1 == position.files.size()) && compressionOf(now.name) == Compression::None;
+        if (mayGrow ? now.size < position.offset : (now.size != then.size || now.mtime != then.mtime)) return false;
+    }
+    return true;
+}
+
+// The stream position `consumed` photons into the segments
+StreamPosition positionAfter(const std::vector<ReadSegment>& segments, const std::vector<ConsumedFile>& files,
+                             std::uint64_t consumed, std::size_t recordBytes)
+{
+    std::size_t s = 0;
+    while (s + 1 < segments.size() && consumed > segments[s].photons) consumed -= segments[s++].photons;
+
+    StreamPosition position;
+    position.files.assign(files.begin(), files.begin() + static_cast<std::ptrdiff_t>(segments[s].file + 1));
+    position.offset = segments[s].begin + consumed * recordBytes;
+
+    // A compressed file read to its end is marked as such, so that it is not
+    // inflated again just to skip it
+    if (compressionOf(position.files.back().name) != Compression::None && consumed == segments[s].photons)
+        position.offset = PhotonFileChunk::kToEndOfFile;
+    return position;
+}
+
+// The files [first, end) of the listing that make up shard `shard` of `count`:
+// contiguous runs of files of about the same size, each file in the shard its
+// first byte falls in
+std::pair<std::size_t, std::size_t> shardFiles(const std::vector<ConsumedFile>& files, unsigned shard, unsigned count)
+{
+    std::uint64_t total = 0;
+    for (const ConsumedFile& file : files) total += file.size;
+    const std::uint64_t share = std::max<std::uint64_t>(1, total / count + (total % count != 0));
+
+    std::size_t first = files.size(), end = files.size();
+    std::uint64_t start = 0;
+    for (std::size_t f = 0; f < files.size(); ++f) {
+        const std::uint64_t owner = std::min<std::uint64_t>(start / share, count - 1);
+        if (owner >= shard && first == files.size()) first = f;
+        if (owner > shard) {
+            end = f;
+            break;
+        }
+        start += files[f].size;
+    }
+    return { std::min(first, end), end };
+}
+
+// Whether the photons before file `f` end with a complete ray (also when there
+// are none). Only the last record of a plain file is read; a compressed one is
+// inflated to its end.
+bool rayEndsBefore(const std::vector<fs::directory_entry>& files, const std::vector<ConsumedFile>& snapshot,
+                   std::size_t f, ReaderBackend backend, const PhotonLayout& layout)
+{
+    const std::size_t recordBytes = layout.recordBytes();
+    while (f-- > 0) {
+        PhotonFileChunk chunk{ files[f], 0, PhotonFileChunk::kToEndOfFile };
+        if (compressionOf(files[f].path()) == Compression::None) {
+            chunk.end = snapshot[f].size - snapshot[f].size % recordBytes;
+            if (chunk.end == 0) continue;
+            chunk.begin = chunk.end - recordBytes;
+        }
+        TonatiuhReader reader(std::vector<PhotonFileChunk>{ chunk }, backend);
+        reader.SetLayout(layout);
+        PhotonBlock block;
+        bool any = false;
+        std::uint64_t lastNext = 0;
+        while (reader.ReadPhotonBatch(block))
+            if (!block.empty()) {
+                any = true;
+                lastNext = block.next_id[block.size() - 1];
+            }
+        if (any) return lastNext == 0;
+    }
+    return true;
+}
+
+// The photons of `chunks` up to and including the first ray end: the rest of a
+// ray that runs past the end of a shard. Empty if no ray ends in them.
+std::vector<PhotonInfo> readToFirstRayEnd(const std::vector<PhotonFileChunk>& chunks, ReaderBackend backend,
+                                          const PhotonLayout& layout)
+{
+    TonatiuhReader reader(chunks, backend);
+    reader.SetLayout(layout);
+    PhotonBlock block;
+    std::vector<PhotonInfo> photons;
+    while (reader.ReadPhotonBatch(block))
+        for (std::size_t i = 0; i < block.size(); ++i) {
+            photons.push_back(block.photon(i));
+            if (block.next_id[i] == 0) return photons;
+        }
+    return {};
+}
+
+// The module states of one worker: the matrix, the other modules and those of
+// them that take whole rays. With standard errors the matrix counts of a task go
+// to `batch` first and are folded into `matrix` as one batch afterwards.
+struct WorkerStates
+{
+    std::vector<std::unique_ptr<AnalyzerState>> owned;
+    RayAccumulator* matrix = nullptr;
+    std::unique_ptr<RayAccumulator> batch;
+    RayAccumulator* stream = nullptr;     // where the tasks count: batch or matrix
+    std::vector<AnalyzerState*> modules;
+    std::vector<AnalyzerState*> rays;
+
+    // Async backend: one reader for all the worker's chunks of plain files. The
+    // chunk of the next task, which the worker takes unless another worker
+    // steals it, is queued behind the current one, so reading runs on across
+    // the chunk edge.
+    std::unique_ptr<AsyncFileReader> reader;
+    bool        queued = false;
+    std::size_t queuedTask  = 0;
+    std::size_t queuedRange = 0;
+};
+
+// Chunks read before relative errors are trusted to stop early
+constexpr std::size_t kMinBatches = 10;
+
+// Standard errors take every chunk as a batch: chunks are made small enough for
+// at least this many of them
+constexpr std::uint64_t kErrorBatches = 32;
+
+// Where a worker's rays go: its module states, and the assembler when rays are
+// linked through ids
+struct RayTarget
+{
+    const WorkerStates& states;
+    RayAssembler*       assembler;
+    unsigned            worker;
+};
+
+ChunkEdges stream(const std::function<bool(PhotonBlock&)>& nextBlock, const RayTarget& target,
+                  ProgressCounter& progress, PipelineTimes* times)
+{
+    const WorkerStates& states = target.states;
+    if (target.assembler)
+        return streamLinkedRays(nextBlock, *states.stream, states.modules, states.rays, *target.assembler,
+                                target.worker, progress, times);
+    return streamRays(nextBlock, *states.stream, states.modules, states.rays, progress, times);
+}
+
+// A chunk read as range `range` of `async` when given, else with a reader of its own
+ChunkEdges processChunk(const PhotonFileChunk& chunk, const ProcessingOptions& options, AsyncFileReader* async,
+                        std::size_t range, const RayTarget& target, ProgressCounter& progress, PipelineTimes* times)
+{
+    TonatiuhReader reader(std::vector<PhotonFileChunk>{chunk}, options.readerBackend);
+    reader.SetAsyncOptions(options.asyncRead);
+    if (async) reader.SetAsyncReader(async, range);
+    reader.SetLayout(options.layout);
+    if (times) reader.SetDecodeTime(&times->decode);
+    return stream([&reader](PhotonBlock& block) { return reader.ReadPhotonBatch(block); }, target, progress, times);
+}
+
+// The worker's async reader with the chunk of `task` queued (its range in
+// `range`), and that of the next task behind it; null for other backends and
+// compressed files
+AsyncFileReader* queueChunks(WorkerStates& states, const std::vector<PhotonFileChunk>& chunks, std::size_t task,
+                             const ProcessingOptions& options, std::size_t& range)
+{
+    const auto plain = [&](std::size_t t) {
+        return t < chunks.size() && compressionOf(chunks[t].file.path()) == Compression::None;
+    };
+    if (options.readerBackend != ReaderBackend::Async || !plain(task)) return nullptr;
+
+    if (!states.reader)
+        states.reader = std::make_unique<AsyncFileReader>(
+            std::vector<PhotonFileChunk>{},
+            TonatiuhReader::AsyncOptionsFor(options.asyncRead, options.layout.recordBytes()));
+    if (states.queued && states.queuedTask == task) {
+        range = states.queuedRange;
+    } else {
+        if (states.queued) states.reader->cancel(); // another worker took that chunk
+        range = states.reader->append({ chunks[task] });
+    }
+    states.queued = plain(task + 1);
+    if (states.queued) {
+        states.queuedTask  = task + 1;
+        states.queuedRange = states.reader->append({ chunks[task + 1] });
+    }
+    return states.reader.get();
+}
+
+// Cache ranges start on a ray boundary, so only the final range has an open tail.
+// Only the columns the modules need are touched.
+ChunkEdges processCacheRange(const PhotonCache& cache, std::pair<std::uint64_t, std::uint64_t> range,
+                             unsigned fields, const RayTarget& target, ProgressCounter& progress,
+                             PipelineTimes* times)
+{
+    std::uint64_t pos = range.first;
+    return stream([&](PhotonBlock& block) {
+                      block.clear();
+                      const std::size_t count = static_cast<std::size_t>(
+                          std::min<std::uint64_t>(range.second - pos, block.capacity()));
+                      cache.read(pos, count, block, fields);
+                      pos += count;
+                      return !block.empty();
+                  },
+                  target, progress, times);
+}
+
+// A segment of a PhotonStream's ring, decoded in place
+ChunkEdges processStreamSegment(const PhotonStream::Segment& segment, const PhotonLayout& layout,
+                                const RayTarget& target, ProgressCounter& progress, PipelineTimes* times)
+{
+    const PhotonDecoder decoder(layout);
+    const std::size_t recordBytes = layout.recordBytes();
+    std::size_t part = 0, pos = 0;
+    return stream([&](PhotonBlock& block) {
+                      block.clear();
+                      while (block.size() < block.capacity() && part < 2)
+                      {
+                          const std::size_t records = std::min((segment.bytes[part] - pos) / recordBytes,
+                                                               block.capacity() - block.size());
+                          if (records == 0) {
+                              ++part;
+                              pos = 0;
+                              continue;
+                          }
+                          const StageStamp start = times ? StageStamp::now() : StageStamp{};
+                          decoder.decode(segment.data[part] + pos, records, block, block.size());
+                          if (times) times->decode.add(StageStamp::now() - start);
+                          block.count += records;
+                          pos += records * recordBytes;
+                      }
+                      return !block.empty();
+                  },
+                  target, progress, times);
+}
+
+// The largest standard error of a heliostat's total relative to the total, over
+// the heliostats with counted rays; infinite until that can be estimated
+double largestRelativeError(const RayAccumulator& acc)
+{
+    double largest = 0;
+    bool any = false;
+    for (std::size_t h = 0; h * acc.receiverCount < acc.photonCounts.size(); ++h)
+    {
+        const std::uint64_t count = acc.rowCount(h);
+        if (count == 0) continue;
+        const double error = acc.rowStandardError(h) / (static_cast<double>(count) * acc.scale());
+        if (std::isnan(error)) return std::numeric_limits<double>::infinity(); // NaN: too few batches
+        largest = std::max(largest, error);
+        any = true;
+    }
+    return any ? largest : std::numeric_limits<double>::infinity();
+}
+
+StageTime difference(const StageTime& a, const StageTime& b)
+{
+    return StageTime{ std::max(0.0, a.wallSeconds - b.wallSeconds), std::max(0.0, a.cpuSeconds - b.cpuSeconds) };
+}
+
+} // namespace
+
 PhotonProcessor::PhotonProcessor(const std::string& folderPath_,
                                  const SurfaceMap& surfaceMap_,
-                                 double powerPerPhoton_)
-    : folderPath(folderPath_), surfaceMap(surfaceMap_), powerPerPhoton(powerPerPhoton_)
+                                 double powerPerPhoton_,
+                                 const ProcessingOptions& options_)
+    : folderPath(folderPath_), surfaceMap(surfaceMap_), powerPerPhoton(powerPerPhoton_), options(options_)
 {
+    // The heliostat x receiver matrix always comes first; its CSV path is given to processPhotons()
+    analyzers.push_back(std::make_unique<MatrixAnalyzer>(AnalyzerContext{ surfaceMap, powerPerPhoton, options, {} }));
+    for (const AnalyzerRequest& request : options.analyzers)
+    {
+        const AnalyzerContext context{ surfaceMap, powerPerPhoton, options, request.outputPath };
+        std::unique_ptr<Analyzer> analyzer = AnalyzerRegistry::instance().create(request.name, context);
+        if (!analyzer) throw std::invalid_argument("Unknown analyzer: " + request.name);
+        analyzers.push_back(std::move(analyzer));
+    }
 }
 
 void PhotonProcessor::processPhotons(const std::string& outputCsvFile)
 {
-    // Stream photons using TonatiuhReader (handles file ordering, buffering, and endianness)
-    TonatiuhReader reader(folderPath);
+    run();
+    writeOutputs(outputCsvFile);
+    std::cout << "Finished.\n";
+}
+
+void PhotonProcessor::writeOutputs(const std::string& outputCsvFile)
+{
+    const StageStamp start = StageStamp::now();
+    if (writeCsv(outputCsvFile))
+        std::cout << "CSV file written to: " << outputCsvFile << "\n";
+    writeAnalyzerOutputs();
+    runStats.stages[RunStats::Write] = StageStamp::now() - start;
+}
+
+void PhotonProcessor::run()
+{
+    results.clear();
+    position = StreamPosition{};
+    update();
+}
+
+// One update() cut into tasks (cache ranges or file chunks), so that the reads of
+// several processors can be scheduled on one pool (see updateAll())
+struct PhotonProcessor::Pass
+{
+    StageStamp start;
+    unsigned fields = 0;
+    bool assembleRays = false;
+
+    // One state per module and pool thread, created on the thread's first task
+    // (and stage timers when statistics are collected)
+    std::vector<WorkerStates> workers;
+    std::vector<PipelineTimes> times;
+
+    // The files as they were listed, and where the photons of the stream came
+    // from, in order, to locate the end of the last complete ray afterwards
+    std::vector<ConsumedFile> snapshot;
+    std::vector<ReadSegment> segments;
+
+    std::shared_ptr<const PhotonCache> cache;                     // tasks: cache ranges with a cache,
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> ranges;
+    std::vector<PhotonFileChunk> chunks;                          // file chunks otherwise,
+    PhotonStream* input = nullptr;                                // or segments of a stream's ring
+    std::vector<PhotonStream::Segment> inputSegments;
+    std::vector<StageTime> chunkTimes;                            // busy time per chunk
+    std::vector<ChunkEdges> edges;                                // per task
 
-    // Accumulator: HeliostatName -> (ReceiverName -> Power)
-    std::map<std::string, std::map<std::string, double>> energyMap;
+    std::vector<char> processed;                                  // per task; empty = all of them
+    std::unique_ptr<RayAssembler> assembler;                      // rays linked through ids
 
-    std::uint64_t rayCounter    = 0;
-    std::uint64_t countedRays   = 0;
-    std::uint64_t skippedRays   = 0;
+    // Shards: the first photons belong to a ray of an earlier shard, and the files
+    // after this shard's, where its last ray may end
+    bool startsMidRay = false;
+    std::vector<PhotonFileChunk> following;
 
-    std::vector<PhotonInfo> ray;
-    ray.reserve(32);
+    std::uint64_t expectedPhotons = 0;
+    bool sizesKnown = true;                                       // false with compressed files
 
-    PhotonInfo p{};
-    while (reader.ReadPhotonInfo(p))
+    std::size_t taskCount() const { return cache ? ranges.size() : input ? inputSegments.size() : chunks.size(); }
+};
+
+bool PhotonProcessor::update()
+{
+    if (options.targetRelativeError > 0) return sampleUntilConverged();
+    return updateAll({ this }, options.threads)[0];
+}
+
+bool PhotonProcessor::sampleUntilConverged()
+{
+    const WorkStealingPool pool(options.threads);
+    std::unique_ptr<Pass> pass = beginPass(pool.threadCount());
+    if (!pass->sizesKnown)
+        throw std::runtime_error("A target error needs the photon count of the folder up front; "
+                                 "build a photon cache for compressed photon files first (--build-cache)");
+
+    // Chunks in random order, so that any prefix of them is a fair sample
+    const std::size_t taskCount = pass->taskCount();
+    std::vector<std::size_t> order(taskCount);
+    std::iota(order.begin(), order.end(), std::size_t{0});
+    std::mt19937_64 random(options.sampleSeed);
+    std::shuffle(order.begin(), order.end(), random);
+    pass->processed.assign(taskCount, 0);
+
+    if (taskCount < kMinBatches * 2)
+        std::cerr << "Warning: only " << taskCount << " chunk(s) to sample; use a smaller --chunk-mb "
+                  << "for a reliable error estimate and an early stop.\n";
+
+    // Rounds of a few tasks per thread; the errors are checked between rounds
+    const std::size_t round = std::max<std::size_t>(2 * pool.threadCount(), 1);
+    std::size_t done = 0;
+    double largestError = std::numeric_limits<double>::infinity();
+    ProgressCounter progress;
+    {
+        std::optional<ProgressReporter> reporter;
+        if (options.verbose) reporter.emplace(progress, pass->expectedPhotons);
+        while (done < taskCount)
+        {
+            const std::size_t n = std::min(round, taskCount - done);
+            pool.run(n, [&](std::size_t t, unsigned worker) {
+                runTask(*pass, order[done + t], worker, progress);
+            });
+            done += n;
+
+            RayAccumulator sample(surfaceMap, true);
+            for (const WorkerStates& worker : pass->workers)
+                if (worker.matrix) sample.merge(*worker.matrix);
+            largestError = largestRelativeError(sample);
+            if (done >= kMinBatches && largestError < options.targetRelativeError) break;
+        }
+    }
+
+    const bool grew = finishPass(*pass);
+    if (done < taskCount) {
+        RayAccumulator& acc = static_cast<RayAccumulator&>(*results[0]);
+        acc.populationPhotons = pass->expectedPhotons;
+        position = StreamPosition{}; // a sample is no place to continue from
+    }
+    if (options.verbose) {
+        const double percent =
+            pass->expectedPhotons ? 100.0 * static_cast<double>(totalPhotons) / pass->expectedPhotons : 100.0;
+        if (largestError < options.targetRelativeError)
+            std::cout << "Converged after " << done << " of " << taskCount << " chunks (" << percent
+                      << "% of the photons), largest relative error " << largestError << "\n";
+        else
+            std::cout << "Target relative error " << options.targetRelativeError << " not reached after all "
+                      << taskCount << " chunks; largest relative error " << largestError << "\n";
+    }
+    return grew;
+}
+
+std::vector<bool> PhotonProcessor::updateAll(const std::vector<PhotonProcessor*>& processors, unsigned threads)
+{
+    const WorkStealingPool pool(threads);
+    return updateAll(processors, pool);
+}
+
+std::vector<bool> PhotonProcessor::updateAll(const std::vector<PhotonProcessor*>& processors,
+                                             const WorkStealingPool& pool)
+{
+    // Tasks of all processors, in order, on one work-stealing pool
+    std::vector<std::unique_ptr<Pass>> passes;
+    std::vector<std::pair<std::size_t, std::size_t>> tasks; // processor, task
+    std::uint64_t expectedPhotons = 0;
+    bool sizesKnown = true;
+    for (std::size_t p = 0; p < processors.size(); ++p)
+    {
+        passes.push_back(processors[p]->beginPass(pool.threadCount()));
+        for (std::size_t t = 0; t < passes.back()->taskCount(); ++t) tasks.emplace_back(p, t);
+        expectedPhotons += passes.back()->expectedPhotons;
+        sizesKnown = sizesKnown && passes.back()->sizesKnown;
+    }
+
+    ProgressCounter progress;
     {
-        ++totalPhotons;
-        ray.push_back(p);
+        // Progress percentages need the photon count, unknown for compressed files
+        std::optional<ProgressReporter> reporter;
+        if (std::any_of(processors.begin(), processors.end(), [](const PhotonProcessor* p) { return p->options.verbose; }))
+            reporter.emplace(progress, sizesKnown ? expectedPhotons : 0);
+        pool.run(tasks.size(), [&](std::size_t t, unsigned worker) {
+            const auto [p, task] = tasks[t];
+            processors[p]->runTask(*passes[p], task, worker, progress);
+        });
+    }
 
-        // A ray ends when the current photon has next_id == 0
-        if (p.next_id == 0)
+    std::vector<bool> grew;
+    for (std::size_t p = 0; p < processors.size(); ++p) grew.push_back(processors[p]->finishPass(*passes[p]));
+    return grew;
+}
+
+void PhotonProcessor::run(PhotonStream& input)
+{
+    results.clear();
+    position = StreamPosition{};
+    const WorkStealingPool pool(options.threads);
+    std::unique_ptr<Pass> pass = preparePass(pool.threadCount());
+    pass->input = &input;
+    runStats.source = "stream";
+
+    // Half of the ring per round, so that the reader fills the other half meanwhile
+    const std::size_t recordBytes = options.layout.recordBytes();
+    std::uint64_t segmentBytes = input.capacity() / (2 * pool.threadCount());
+    if (options.chunkBytes > 0) segmentBytes = std::min(segmentBytes, options.chunkBytes);
+    segmentBytes = std::max<std::uint64_t>(segmentBytes - segmentBytes % recordBytes, recordBytes);
+
+    ProgressCounter progress;
+    {
+        std::optional<ProgressReporter> reporter;
+        if (options.verbose) reporter.emplace(progress, 0);
+        for (;;)
         {
-            ++rayCounter;
-
-            if (ray.size() >= 2)
-            {
-                const PhotonInfo& pen  = ray[ray.size() - 2]; // penultimate
-                const PhotonInfo& last = ray.back();          // receiver hit
-
-                const std::uint64_t heliostatID = pen.surface_id;
-                const std::uint64_t receiverID  = last.surface_id;
-                const int arrivalSide = last.side;            // check arrival at receiver
-
-                if (arrivalSide == 1 &&
-                    surfaceMap.isHeliostat(heliostatID) &&
-                    surfaceMap.isReceiver(receiverID))
-                {
-                    const std::string heliostatName = surfaceMap.getHeliostatName(heliostatID);
-                    const std::string receiverName  = surfaceMap.getReceiverName(receiverID);
-                    energyMap[heliostatName][receiverName] += powerPerPhoton;
-                    ++countedRays;
-                }
-                else
-                {
-                    ++skippedRays;
-                }
+            // The first segment of a round waits for the input; the others are
+            // taken only if they are there already
+            const std::size_t first = pass->inputSegments.size();
+            for (unsigned t = 0; t < pool.threadCount(); ++t) {
+                const PhotonStream::Segment segment = input.next(static_cast<std::size_t>(segmentBytes), t == 0);
+                if (segment.size() == 0) break;
+                pass->inputSegments.push_back(segment);
             }
+            const std::size_t n = pass->inputSegments.size() - first;
+            if (n == 0) break;
 
-            ray.clear();
+            if (options.layout.byteOrder() == ByteOrder::Unknown) {
+                const PhotonStream::Segment& head = pass->inputSegments[first];
+                const std::size_t sample = std::min<std::size_t>(head.bytes[0] / recordBytes, 64);
+                options.layout.setByteOrder(options.layout.detectByteOrder(head.data[0], sample));
+                if (options.verbose && options.layout != PhotonLayout())
+                    std::cout << "Photon records: " << options.layout.describe() << "\n";
+            }
 
-            if (rayCounter % 1000000 == 0)
-                std::cout << "Processed " << rayCounter << " rays...\n";
+            pass->edges.resize(first + n);
+            pool.run(n, [&](std::size_t t, unsigned worker) { runTask(*pass, first + t, worker, progress); });
+            input.release();
         }
     }
+    if (input.trailingBytes() > 0)
+        std::cerr << "Warning: ignoring " << input.trailingBytes()
+                  << " trailing byte(s) (partial photon record) at the end of " << input.name() << "\n";
+    finishPass(*pass);
+}
 
-    std::cout << "Finished streaming.\n";
-    std::cout << "  - Total photons read: " << totalPhotons << "\n";
-    std::cout << "  - Rays processed: " << rayCounter << "\n";
-    std::cout << "  - Counted heliostat→receiver rays (side==1): " << countedRays << "\n";
-    std::cout << "  - Skipped rays: " << skippedRays << "\n";
+// What every pass sets up, whatever it reads: module fields, worker slots and
+// the ray assembler
+std::unique_ptr<PhotonProcessor::Pass> PhotonProcessor::preparePass(unsigned workerCount)
+{
+    auto pass = std::make_unique<Pass>();
+    pass->start = StageStamp::now();
 
-    // -----------------------
-    // Build receiver list sorted by numeric suffix (Receiver1, Receiver2, ...)
-    // -----------------------
-    const auto& receiverNameMap = surfaceMap.getReceiverNamesMap(); // id -> name
-    std::vector<std::string> receivers;
-    receivers.reserve(receiverNameMap.size());
-    for (const auto& kv : receiverNameMap) receivers.push_back(kv.second);
+    runStats = RunStats{};
+    runStats.folder        = folderPath;
+    runStats.readerBackend = readerBackendName(options.readerBackend);
+    runStats.threads       = workerCount;
 
-    auto trailingNumber = [](const std::string& s) -> long long {
-        if (s.empty()) return -1;
-        std::size_t i = s.size(), end = i;
-        while (i > 0 && std::isdigit(static_cast<unsigned char>(s[i - 1]))) --i;
-        if (i < end) {
-            try { return std::stoll(s.substr(i, end - i)); }
-            catch (...) { return -1; }
+    pass->fields = kFieldSide | kFieldNextId | kFieldSurfaceId;
+    for (const auto& analyzer : analyzers) {
+        pass->assembleRays = pass->assembleRays || analyzer->needsRays();
+        pass->fields |= analyzer->requiredFields();
+    }
+    pass->workers.resize(workerCount);
+    pass->times.resize(workerCount);
+    if (options.linkRays) {
+        pass->fields |= kFieldId | kFieldPreviousId;
+        pass->assembler = std::make_unique<RayAssembler>(workerCount, options.linkMemoryBytes, pass->assembleRays,
+                                                         options.spillDirectory);
+    }
+
+    const unsigned missing = pass->fields & ~options.layout.fieldMask();
+    if (missing) {
+        std::string names, listed;
+        for (unsigned bit = 1; bit <= kFieldSurfaceId; bit <<= 1)
+            if (missing & bit) names += std::string(names.empty() ? "" : ", ") + PhotonLayout::fieldName(PhotonField(bit));
+        for (PhotonField field : options.layout.fields())
+            listed += std::string(listed.empty() ? "" : ", ") + PhotonLayout::fieldName(field);
+        throw std::runtime_error("The photon records of " + folderPath + " lack the field(s) this run needs: " + names +
+                                 " (photons_parameters.txt lists " + listed + ")");
+    }
+    return pass;
+}
+
+std::unique_ptr<PhotonProcessor::Pass> PhotonProcessor::beginPass(unsigned workerCount)
+{
+    std::unique_ptr<Pass> pass = preparePass(workerCount);
+
+    // The files as they are now; only the part after `position` is read
+    const std::vector<fs::directory_entry> files = TonatiuhReader::ListPhotonFiles(folderPath);
+    if (options.layout.byteOrder() == ByteOrder::Unknown) {
+        // Not written in the parameters file: guessed from the first records,
+        // once there are any
+        options.layout.setByteOrder(TonatiuhReader::DetectByteOrder(files, options.layout));
+        if (options.verbose && options.layout.byteOrder() != ByteOrder::Unknown && options.layout != PhotonLayout())
+            std::cout << "Photon records: " << options.layout.describe() << "\n";
+    }
+    const std::size_t recordBytes = options.layout.recordBytes();
+    std::vector<ConsumedFile>& snapshot = pass->snapshot;
+    for (const auto& file : files) snapshot.push_back(ConsumedFile::describe(file));
+    if (!position.empty() && !continuesFrom(position, snapshot)) {
+        std::cerr << "Warning: photon files in " << folderPath
+                  << " were replaced or rewritten since they were read; processing everything again.\n";
+        results.clear();
+        position = StreamPosition{};
+    }
+
+    // A shard reads its own files only (the cache covers the whole folder)
+    const bool sharded = options.shardCount > 1;
+    std::size_t firstFile = position.empty() ? 0 : position.files.size() - 1;
+    std::size_t endFile = files.size();
+    if (sharded) {
+        std::tie(firstFile, endFile) = shardFiles(snapshot, options.shardIndex, options.shardCount);
+        pass->startsMidRay = !rayEndsBefore(files, snapshot, firstFile, options.readerBackend, options.layout);
+        for (std::size_t f = endFile; f < files.size(); ++f) {
+            PhotonFileChunk chunk{ files[f], 0, PhotonFileChunk::kToEndOfFile };
+            if (compressionOf(files[f].path()) == Compression::None)
+                chunk.end = snapshot[f].size - snapshot[f].size % recordBytes;
+            if (chunk.end > 0) pass->following.push_back(chunk);
         }
-        return -1;
+    }
+
+    // The cache given to useCache() while it is up to date, else the folder's own
+    if (!sharded && position.empty() && options.useCache) {
+        if (sharedCache && sharedCache->isFresh(folderPath)) {
+            pass->cache = sharedCache;
+        } else {
+            auto own = std::make_shared<PhotonCache>();
+            if (own->open(folderPath, options.parametersFingerprint)) {
+                if (options.verbose) std::cout << "Using photon cache " << PhotonCache::cachePath(folderPath).string() << "\n";
+                pass->cache = std::move(own);
+            }
+        }
+    }
+
+    // With errors, at most 1/kErrorBatches of the photons per chunk
+    const bool batched = options.standardErrors || options.targetRelativeError > 0;
+    const auto chunkBytesFor = [&](std::uint64_t totalBytes) {
+        if (!batched) return options.chunkBytes;
+        const std::uint64_t share = std::max<std::uint64_t>(totalBytes / kErrorBatches, recordBytes);
+        return options.chunkBytes > 0 ? std::min(options.chunkBytes, share) : share;
     };
 
-    std::sort(receivers.begin(), receivers.end(),
-              [&](const std::string& a, const std::string& b){
-                  long long na = trailingNumber(a);
-                  long long nb = trailingNumber(b);
-                  if (na >= 0 && nb >= 0) return na < nb;  // numeric first, increasing
-                  if (na >= 0) return true;                // numeric before non-numeric
-                  if (nb >= 0) return false;
-                  return a < b;                            // both non-numeric: lexicographic
-              });
-
-    // -----------------------
-    // Write CSV
-    // -----------------------
-    std::ofstream out(outputCsvFile);
-    if (!out) {
-        std::cerr << "Error writing CSV file: " << outputCsvFile << "\n";
-        return;
-    }
-
-    out << "Heliostat Label";
-    for (const std::string& rec : receivers)
-        out << ", Power to " << rec;
-    out << ", Total Power to Receivers\n";
-
-    for (const auto& pair : energyMap)
+    if (pass->cache)
     {
-        const std::string& heliostat = pair.first;
-        const std::map<std::string, double>& recMap = pair.second;
+        const std::uint64_t chunkBytes = chunkBytesFor(pass->cache->photonCount() * recordBytes);
+        pass->ranges = pass->cache->splitByRays(chunkBytes / recordBytes);
+        pass->expectedPhotons = pass->cache->photonCount();
+        runStats.source = "cache";
 
-        out << heliostat;
-        double total = 0.0;
+        // An up-to-date cache holds exactly the photons of the files, in order
+        for (std::size_t f = 0; f < snapshot.size(); ++f)
+            pass->segments.push_back({ f, 0, pass->cache->sourcePhotons()[f] });
+    }
+    else
+    {
+        // Whole records up to the current end of each file. A partial record at the
+        // end of the last file may still be being written; it is read next time.
+        // Compressed files are read to their end (they do not grow).
+        std::vector<std::pair<std::size_t, PhotonFileChunk>> ranges;
+        for (std::size_t f = firstFile; f < endFile; ++f)
+        {
+            const Compression compression = compressionOf(files[f].path());
+            if (!compressionSupported(compression))
+                throw std::runtime_error("This build cannot read " + std::string(compressionName(compression)) +
+                                         "-compressed photon files: " + files[f].path().string());
+
+            const std::uint64_t size  = snapshot[f].size;
+            const std::uint64_t begin = (f == firstFile) ? position.offset : 0;
+            std::uint64_t end = PhotonFileChunk::kToEndOfFile;
+            if (compression == Compression::None) {
+                end = size - size % recordBytes;
+                if (size != end && f + 1 < files.size())
+                    std::cerr << "Warning: ignoring " << size - end << " trailing byte(s) (partial photon record) in "
+                              << files[f].path().string() << "\n";
+                if (end <= begin) continue;
+                pass->expectedPhotons += (end - begin) / recordBytes;
+            } else {
+                if (begin == PhotonFileChunk::kToEndOfFile) continue;
+                pass->sizesKnown = false;
+            }
+
+            runStats.files.emplace_back();
+            runStats.files.back().path  = files[f].path().string();
+            runStats.files.back().bytes = (compression == Compression::None) ? end - begin : size;
+            ranges.emplace_back(f, PhotonFileChunk{ files[f], begin, end });
+        }
+
+        const std::uint64_t chunkBytes = chunkBytesFor(pass->expectedPhotons * recordBytes);
+        for (const auto& [f, range] : ranges)
+            for (const PhotonFileChunk& chunk :
+                 TonatiuhReader::SplitIntoChunks(std::vector<PhotonFileChunk>{ range }, chunkBytes, recordBytes)) {
+                pass->chunks.push_back(chunk);
+                pass->segments.push_back({ f, chunk.begin, 0 });
+            }
+        pass->chunkTimes.resize(pass->chunks.size());
+        runStats.source = "files";
+
+        // A compressed file goes through its decompressor whatever the backend
+        if (options.readerBackend == ReaderBackend::Async &&
+            std::any_of(pass->chunks.begin(), pass->chunks.end(), [](const PhotonFileChunk& chunk) {
+                return compressionOf(chunk.file.path()) != Compression::None;
+            })) {
+            runStats.readerBackend = "async (compressed files: mmap)";
+            if (options.verbose)
+                std::cout << "Reader: async for plain files; compressed files are decompressed "
+                             "on the mmap path\n";
+        }
+    }
+    runStats.stages[RunStats::DirectoryScan] = StageStamp::now() - pass->start;
+
+    // Compressed files are not split, and a first pass over a handful of photons
+    // may not fill the batches either
+    if (options.standardErrors && results.empty() && pass->taskCount() < kErrorBatches)
+        std::cerr << "Warning: only " << pass->taskCount() << " batch(es) for the standard errors"
+                  << (pass->taskCount() < 2 ? ", which need at least 2; they are left empty" : "; they are rough")
+                  << (pass->sizesKnown ? "" : " (compressed photon files are not split; see --build-cache)") << ".\n";
+
+    pass->edges.resize(pass->taskCount());
+    return pass;
+}
 
-        for (const std::string& rec : receivers)
+void PhotonProcessor::runTask(Pass& pass, std::size_t task, unsigned worker, ProgressCounter& progress) const
+{
+    WorkerStates& states = pass.workers[worker];
+    if (states.owned.empty())
+        for (const auto& analyzer : analyzers) {
+            states.owned.push_back(analyzer->createState());
+            if (!states.matrix) {
+                states.matrix = static_cast<RayAccumulator*>(states.owned.back().get());
+                if (states.matrix->batchStatistics) states.batch = std::make_unique<RayAccumulator>(surfaceMap);
+                states.stream = states.batch ? states.batch.get() : states.matrix;
+                continue;
+            }
+            states.modules.push_back(states.owned.back().get());
+            if (analyzer->needsRays()) states.rays.push_back(states.owned.back().get());
+        }
+    PipelineTimes* times = options.collectStats ? &pass.times[worker] : nullptr;
+    if (!pass.processed.empty()) pass.processed[task] = 1;
+
+    const RayTarget target{ states, pass.assembler.get(), worker };
+    if (pass.cache) {
+        pass.edges[task] = processCacheRange(*pass.cache, pass.ranges[task], pass.fields, target, progress, times);
+    } else if (pass.input) {
+        pass.edges[task] = processStreamSegment(pass.inputSegments[task], options.layout, target, progress, times);
+    } else {
+        const StageStamp start = StageStamp::now();
+        std::size_t range = 0;
+        AsyncFileReader* async = queueChunks(states, pass.chunks, task, options, range);
+        pass.edges[task] = processChunk(pass.chunks[task], options, async, range, target, progress, times);
+        pass.chunkTimes[task] = StageStamp::now() - start;
+    }
+    if (states.batch) states.matrix->addBatch(*states.batch);
+}
+
+bool PhotonProcessor::finishPass(Pass& pass)
+{
+    std::vector<ChunkEdges>& edges = pass.edges;
+    if (!pass.cache)
+    {
+        for (std::size_t c = 0, file = 0; c < pass.chunks.size(); ++c)
         {
-            const auto it = recMap.find(rec);
-            const double value = (it != recMap.end()) ? it->second : 0.0;
-            out << ", " << value;
-            total += value;
+            if (c > 0 && pass.segments[c].file != pass.segments[c - 1].file) ++file;
+            pass.segments[c].photons = edges[c].photons;
+            runStats.files[file].photons += edges[c].photons;
+            runStats.files[file].time.add(pass.chunkTimes[c]);
         }
+    }
 
-        out << ", " << total << "\n";
+    // Merge the worker states module by module (into the results so far, when
+    // continuing); threads that got no task of this processor have none
+    std::vector<WorkerStates*> workers;
+    for (WorkerStates& worker : pass.workers)
+        if (!worker.owned.empty()) workers.push_back(&worker);
+    const bool continuing = !results.empty();
+    for (std::size_t a = 0; a < analyzers.size(); ++a)
+    {
+        for (WorkerStates* worker : workers) worker->owned[a]->finish();
+        std::size_t w = 0;
+        if (!continuing) results.push_back(workers.empty() ? analyzers[a]->createState() : std::move(workers[w++]->owned[a]));
+        for (; w < workers.size(); ++w) results[a]->merge(*workers[w]->owned[a]);
     }
+    pass.workers.clear();
+    // Linked rays are whole once assembled; their chunk edges hold nothing to stitch
+    const bool linked = pass.assembler != nullptr;
+    if (linked) assembleLinkedRays(pass);
+
+    // Stitch rays across chunk and file edges, in stream order. A ray that runs
+    // into a task that was not read (sampling) is incomplete and dropped, as is
+    // one that a shard starts in the middle of (an earlier shard owns it).
+    RayFragment carry;
+    std::vector<PhotonInfo> carryPhotons;
+    bool broken = pass.startsMidRay;
+    std::uint64_t foreignPhotons = 0;
+    for (std::size_t t = 0; t < edges.size() && !linked; ++t)
+    {
+        ChunkEdges& e = edges[t];
+        if (!pass.processed.empty() && !pass.processed[t]) {
+            broken = true;
+            carry = RayFragment{};
+            carryPhotons.clear();
+            continue;
+        }
+        if (broken) {
+            if (pass.startsMidRay && pass.processed.empty()) foreignPhotons += e.head.length;
+            if (!e.terminated) continue;
+            broken = false;
+            carry = e.tail;
+            carryPhotons = std::move(e.tailPhotons);
+            continue;
+        }
+        carry.append(e.head);
+        if (pass.assembleRays) carryPhotons.insert(carryPhotons.end(), e.headPhotons.begin(), e.headPhotons.end());
+        if (!e.terminated) continue;
+        if (!carry.empty())
+            for (const auto& state : results)
+                state->onStitchedRay(carry, pass.assembleRays ? carryPhotons.data() : nullptr);
+        carry = e.tail;
+        carryPhotons = std::move(e.tailPhotons);
+    }
+
+    // A shard owns the ray it ends in the middle of: read on into the following
+    // files up to its end
+    std::uint64_t borrowedPhotons = 0;
+    if (!carry.empty() && !broken && !pass.following.empty()) {
+        const std::vector<PhotonInfo> rest = readToFirstRayEnd(pass.following, options.readerBackend, options.layout);
+        if (!rest.empty()) {
+            RayFragment end;
+            end.length = rest.size();
+            end.last   = rest.back();
+            if (rest.size() >= 2) end.penultimate = rest[rest.size() - 2];
+            carry.append(end);
+            if (pass.assembleRays) carryPhotons.insert(carryPhotons.end(), rest.begin(), rest.end());
+            for (const auto& state : results) state->onStitchedRay(carry, pass.assembleRays ? carryPhotons.data() : nullptr);
+            carry = RayFragment{};
+            borrowedPhotons = rest.size();
+        }
+    }
+    for (const auto& state : results) state->finish();
+    if (pass.input && !carry.empty())
+        std::cerr << "Warning: " << pass.input->name() << " ended in the middle of a ray; ignoring its last "
+                  << carry.length << " photon(s).\n";
+
+    // The open ray at the end is read again next time: resume where it starts
+    std::uint64_t photonsRead = 0;
+    for (const ChunkEdges& e : edges) photonsRead += e.photons;
+    if (photonsRead > 0 && !pass.segments.empty()) position = positionAfter(pass.segments, pass.snapshot, photonsRead - carry.length,
+                                                         options.layout.recordBytes());
+
+    // ... so its photons count then, not twice
+    RayAccumulator& acc = static_cast<RayAccumulator&>(*results[0]);
+    acc.photons -= std::min<std::uint64_t>(acc.photons, carry.length);
+    acc.photons = acc.photons - std::min(acc.photons, foreignPhotons) + borrowedPhotons;
+    totalPhotons = acc.photons;
+
+    PipelineTimes workerTimes;
+    for (const PipelineTimes& t : pass.times) workerTimes.add(t);
+    runStats.stages[RunStats::Read]       = difference(workerTimes.fetch, workerTimes.decode);
+    runStats.stages[RunStats::Decode]     = workerTimes.decode;
+    runStats.stages[RunStats::Accumulate] = workerTimes.accumulate;
+    runStats.processing = StageStamp::now() - pass.start;
+    runStats.bytes   = photonsRead * options.layout.recordBytes();
+    runStats.photons = photonsRead;
+    runStats.rays    = acc.rays;
+    runStats.counted = acc.counted;
+    runStats.skipped = acc.skipped;
+    runStats.skippedMissedReceiver   = acc.skippedMissedReceiver;
+    runStats.skippedNotFromHeliostat = acc.skippedNotFromHeliostat;
+    runStats.skippedBackSide         = acc.skippedBackSide;
+
+    if (options.verbose) {
+        std::cout << "Finished streaming.\n";
+        std::cout << "  - Total photons read: " << totalPhotons << "\n";
+        std::cout << "  - Rays processed: " << acc.rays << "\n";
+        std::cout << "  - Counted heliostat→receiver rays (side==1): " << acc.counted << "\n";
+        std::cout << "  - Skipped rays: " << acc.skipped << "\n";
+    }
+    return photonsRead > 0;
+}
+
+void PhotonProcessor::assembleLinkedRays(Pass& pass)
+{
+    // Segments of rays cut by chunk and file edges or interleaved with others,
+    // put together on a pool with one set of module states per thread
+    const WorkStealingPool pool(options.threads);
+    std::vector<std::vector<std::unique_ptr<AnalyzerState>>> states(pool.threadCount());
+    const RayAssembler::Totals linked = pass.assembler->assemble(
+        pool, [&](const RayFragment& ray, const PhotonInfo* photons, unsigned worker) {
+            std::vector<std::unique_ptr<AnalyzerState>>& mine = states[worker];
+            if (mine.empty())
+                for (const auto& analyzer : analyzers) mine.push_back(analyzer->createState());
+            for (const auto& state : mine) state->onStitchedRay(ray, photons);
+        });
+    for (auto& mine : states)
+        for (std::size_t a = 0; a < mine.size(); ++a) {
+            mine[a]->finish();
+            results[a]->merge(*mine[a]);
+        }
+
+    if (linked.droppedSegments > 0)
+        std::cerr << "Warning: " << linked.droppedPhotons << " photon(s) in " << linked.droppedSegments
+                  << " segment(s) could not be linked into complete rays (missing or repeated ids); ignoring them.\n";
+    if (options.verbose)
+        std::cout << "Linked " << linked.rays << " ray(s) from " << linked.segments << " segment(s)"
+                  << (linked.spilledBytes ? ", " + std::to_string(linked.spilledBytes >> 20) + " MiB spilled to disk" : "")
+                  << "\n";
+    pass.assembler.reset();
+}
+
+bool PhotonProcessor::checkpoint(Checkpoint& out) const
+{
+    out = Checkpoint{};
+    out.fingerprint = options.parametersFingerprint;
+    out.position    = position;
+    for (std::size_t a = 0; a < results.size(); ++a)
+    {
+        std::ostringstream state(std::ios::binary);
+        if (!results[a]->save(state)) return false;
+        out.states.emplace_back(analyzers[a]->name(), state.str());
+    }
+    return true;
+}
+
+bool PhotonProcessor::partialResult(PartialResult& out) const
+{
+    out = PartialResult{};
+    out.parametersFingerprint = options.parametersFingerprint;
+    out.shard          = options.shardIndex;
+    out.shardCount     = std::max(options.shardCount, 1u);
+    out.standardErrors = options.standardErrors;
+
+    const RayAccumulator empty(surfaceMap, options.standardErrors);
+    std::ostringstream state(std::ios::binary);
+    if (!(result() ? *result() : empty).save(state)) return false;
+    out.matrix = state.str();
+    return true;
+}
+
+bool PhotonProcessor::restore(const Checkpoint& checkpoint)
+{
+    if (options.parametersFingerprint != 0 && checkpoint.fingerprint != options.parametersFingerprint) return false;
+    if (checkpoint.states.size() != analyzers.size() || checkpoint.position.empty()) return false;
+
+    std::vector<std::unique_ptr<AnalyzerState>> restored;
+    for (std::size_t a = 0; a < analyzers.size(); ++a)
+    {
+        if (checkpoint.states[a].first != analyzers[a]->name()) return false;
+        std::istringstream state(checkpoint.states[a].second, std::ios::binary);
+        restored.push_back(analyzers[a]->createState());
+        if (!restored.back()->load(state)) return false;
+    }
+    results  = std::move(restored);
+    position = checkpoint.position;
+    return true;
+}
+
+const RayAccumulator* PhotonProcessor::result() const
+{
+    return results.empty() ? nullptr : static_cast<const RayAccumulator*>(results[0].get());
+}
+
+const AnalyzerState* PhotonProcessor::moduleResult(const std::string& name) const
+{
+    for (std::size_t a = 1; a < analyzers.size() && a < results.size(); ++a)
+        if (name == analyzers[a]->name()) return results[a].get();
+    return nullptr;
+}
+
+void PhotonProcessor::useCache(std::shared_ptr<const PhotonCache> cache)
+{
+    sharedCache = std::move(cache);
+}
+
+bool PhotonProcessor::writeCsv(const std::string& outputCsvFile) const
+{
+    const RayAccumulator empty(surfaceMap, options.standardErrors);
+    return writeMatrixCsv(result() ? *result() : empty, powerPerPhoton, outputCsvFile);
+}
+
+bool PhotonProcessor::writeAnalyzerOutputs() const
+{
+    bool ok = true;
+    for (std::size_t a = 1; a < analyzers.size() && a < results.size(); ++a)
+    {
+        if (analyzers[a]->write(*results[a])) {
+            std::cout << analyzers[a]->name() << " output written to: " << analyzers[a]->outputPath() << "\n";
+        } else {
+            std::cerr << "Error writing " << analyzers[a]->name() << " output: " << analyzers[a]->outputPath() << "\n";
+            ok = false;
+        }
+    }
+    return ok;
+}
 
-    std::cout << "CSV file written to: " << outputCsvFile << "\n";
-    std::cout << "Finished.\n";
-}
\ No newline at end of file
@@ -0,0 +1,164 @@
+#include "PhotonStream.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#  include <fcntl.h>
+#  include <io.h>
+#  include <stdio.h>
+#else
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <unistd.h>
+#endif
+
+namespace {
+
+// How often a reader blocked on an idle pipe checks whether it should stop
+constexpr int kPollMilliseconds = 100;
+
+// Reads what is available, up to `bytes`: the count, 0 at the end of the input,
+// -1 on an error (errno set) or -2 when `stop` was raised while waiting.
+long long readSome(std::intptr_t fd, unsigned char* dst, std::size_t bytes, const std::atomic<bool>& stop)
+{
+#ifdef _WIN32
+    // Blocking read; a pipe at rest is only noticed at its next write or close
+    if (stop) return -2;
+    const int got = ::_read(static_cast<int>(fd), dst, static_cast<unsigned>(std::min<std::size_t>(bytes, INT_MAX)));
+    return got;
+#else
+    for (;;) {
+        pollfd ready{ static_cast<int>(fd), POLLIN, 0 };
+        const int polled = ::poll(&ready, 1, kPollMilliseconds);
+        if (stop) return -2;
+        if (polled < 0 && errno != EINTR) return -1;
+        if (polled <= 0) continue;
+
+        const ssize_t got = ::read(static_cast<int>(fd), dst, std::min<std::size_t>(bytes, SSIZE_MAX));
+        if (got < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        return got;
+    }
+#endif
+}
+
+} // namespace
+
+PhotonStream::PhotonStream(const std::string& source, std::size_t recordBytes, std::size_t bufferBytes)
+    : m_name(source == "-" ? "standard input" : source),
+      m_recordBytes(recordBytes),
+      m_ring(std::max(bufferBytes / recordBytes, std::size_t{2}) * recordBytes)
+{
+#ifdef _WIN32
+    if (source == "-") {
+        m_fd = ::_fileno(stdin);
+        ::_setmode(static_cast<int>(m_fd), _O_BINARY);
+    } else {
+        m_fd = ::_open(source.c_str(), _O_RDONLY | _O_BINARY);
+        m_ownsFd = true;
+    }
+#else
+    if (source == "-") {
+        m_fd = STDIN_FILENO;
+    } else {
+        m_fd = ::open(source.c_str(), O_RDONLY);
+        m_ownsFd = true;
+    }
+#endif
+    if (m_fd < 0) throw std::runtime_error("Unable to open " + source + ": " + std::strerror(errno));
+    m_reader = std::thread(&PhotonStream::readLoop, this);
+}
+
+PhotonStream::~PhotonStream()
+{
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_changed.notify_all();
+    m_reader.join();
+#ifdef _WIN32
+    if (m_ownsFd) ::_close(static_cast<int>(m_fd));
+#else
+    if (m_ownsFd) ::close(static_cast<int>(m_fd));
+#endif
+}
+
+void PhotonStream::readLoop()
+{
+    const std::uint64_t capacity = m_ring.size();
+    for (;;)
+    {
+        // The free space after the last byte read, up to the end of the ring
+        std::size_t at, room;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_changed.wait(lock, [&] { return m_stop || m_written - m_released < capacity; });
+            if (m_stop) return;
+            at   = static_cast<std::size_t>(m_written % capacity);
+            room = static_cast<std::size_t>(std::min(capacity - at, capacity - (m_written - m_released)));
+        }
+
+        const long long got = readSome(m_fd, m_ring.data() + at, room, m_stop);
+        {
+            const std::lock_guard<std::mutex> lock(m_mutex);
+            if (got > 0) {
+                m_written += static_cast<std::uint64_t>(got);
+            } else {
+                if (got == -1) m_error = "Error reading " + m_name + ": " + std::strerror(errno);
+                m_ended = true;
+            }
+        }
+        m_changed.notify_all();
+        if (got <= 0) return;
+    }
+}
+
+PhotonStream::Segment PhotonStream::next(std::size_t maxBytes, bool wait)
+{
+    maxBytes = std::max(maxBytes - maxBytes % m_recordBytes, m_recordBytes);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::uint64_t take = 0;
+    for (;;)
+    {
+        if (!m_error.empty()) throw std::runtime_error(m_error);
+        const std::uint64_t ready = m_written - m_handed;
+        const std::uint64_t whole = ready - ready % m_recordBytes;
+        // Nothing more will come while the ring is full of unreleased records
+        const bool full = m_written - m_released == m_ring.size();
+        if (whole >= maxBytes || ((m_ended || full) && whole > 0)) {
+            take = std::min<std::uint64_t>(whole, maxBytes);
+            break;
+        }
+        if (m_ended || !wait) return Segment{};
+        m_changed.wait(lock);
+    }
+
+    Segment segment;
+    const std::size_t at = static_cast<std::size_t>(m_handed % m_ring.size());
+    segment.data[0]  = m_ring.data() + at;
+    segment.bytes[0] = static_cast<std::size_t>(std::min<std::uint64_t>(take, m_ring.size() - at));
+    segment.data[1]  = m_ring.data();
+    segment.bytes[1] = static_cast<std::size_t>(take) - segment.bytes[0];
+    m_handed += take;
+    return segment;
+}
+
+void PhotonStream::release()
+{
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        m_released = m_handed;
+    }
+    m_changed.notify_all();
+}
+
+std::size_t PhotonStream::trailingBytes() const
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    return m_ended ? static_cast<std::size_t>(m_written - m_handed) : 0;
+}
@@ -0,0 +1,42 @@
+#include "ProgressReporter.h"
+
+#include <iostream>
+
+ProgressReporter::ProgressReporter(const ProgressCounter& counter, std::uint64_t totalPhotons,
+                                   std::chrono::milliseconds interval)
+    : m_counter(counter), m_totalPhotons(totalPhotons), m_interval(interval)
+{
+    m_thread = std::thread(&ProgressReporter::loop, this);
+}
+
+ProgressReporter::~ProgressReporter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+}
+
+void ProgressReporter::loop()
+{
+    const auto start = std::chrono::steady_clock::now();
+    std::uint64_t lastRays = 0;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_wake.wait_for(lock, m_interval, [this] { return m_stop; }))
+    {
+        const std::uint64_t rays    = m_counter.rays();
+        const std::uint64_t photons = m_counter.photons();
+        if (rays == lastRays) continue;
+        lastRays = rays;
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Processed " << rays << " rays";
+        if (m_totalPhotons > 0)
+            std::cout << " (" << (100 * photons / m_totalPhotons) << "%, "
+                      << static_cast<std::uint64_t>(static_cast<double>(photons) / seconds / 1e6) << " M photons/s)";
+        std::cout << "..." << std::endl; // one line per interval; flushed so it shows up in logs
+    }
+}
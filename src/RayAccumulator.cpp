@@ -0,0 +1,199 @@
+#include "RayAccumulator.h"
+
+#include "BinaryIO.h"
+#include "ProcessingOptions.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <limits>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Batch-means standard error of the total of `count` over the stream: with the
+// per-photon rate p = count / N, sum((c_b - p n_b)^2) expands into the sums kept
+// per batch, and Var(p) ~ B / (B - 1) * sum((c_b - p n_b)^2) / N^2.
+double batchMeansError(const RayAccumulator& acc, std::uint64_t count, std::uint64_t squares, std::uint64_t cross)
+{
+    if (acc.batches < 2 || acc.photons == 0) return std::numeric_limits<double>::quiet_NaN();
+    const double p = static_cast<double>(count) / static_cast<double>(acc.photons);
+    const double deviations = std::max(0.0, static_cast<double>(squares) - 2.0 * p * static_cast<double>(cross) +
+                                                p * p * static_cast<double>(acc.batchPhotonSquares));
+    const double b = static_cast<double>(acc.batches);
+    return acc.scale() * std::sqrt(b / (b - 1.0) * deviations);
+}
+
+} // namespace
+
+std::unique_ptr<AnalyzerState> MatrixAnalyzer::createState() const
+{
+    return std::make_unique<RayAccumulator>(m_context.surfaceMap, m_context.options.standardErrors);
+}
+
+void RayAccumulator::addBatch(RayAccumulator& batch)
+{
+    // A chunk in which no ray ended (such as the open ray read again on resume)
+    // is no batch
+    const std::uint64_t n = batch.photons;
+    if (batchStatistics && batch.rays > 0) {
+        const std::size_t heliostats = rowSquares.size();
+        for (std::size_t h = 0; h < heliostats; ++h) {
+            std::uint64_t row = 0;
+            for (std::size_t i = h * receiverCount; i < (h + 1) * receiverCount; ++i) {
+                const std::uint64_t c = batch.photonCounts[i];
+                if (c == 0) continue;
+                cellSquares[i] += c * c;
+                cellCross[i]   += c * n;
+                row += c;
+            }
+            rowSquares[h] += row * row;
+            rowCross[h]   += row * n;
+        }
+        ++batches;
+        batchPhotonSquares += n * n;
+    }
+
+    merge(batch);
+    std::fill(batch.photonCounts.begin(), batch.photonCounts.end(), 0);
+    batch.photons = batch.rays = batch.counted = batch.skipped = 0;
+    batch.skippedMissedReceiver = batch.skippedNotFromHeliostat = batch.skippedBackSide = 0;
+}
+
+double RayAccumulator::cellStandardError(std::size_t cell) const
+{
+    return batchMeansError(*this, photonCounts[cell], cellSquares[cell], cellCross[cell]);
+}
+
+double RayAccumulator::rowStandardError(std::size_t heliostat) const
+{
+    return batchMeansError(*this, rowCount(heliostat), rowSquares[heliostat], rowCross[heliostat]);
+}
+
+bool RayAccumulator::save(std::ostream& out) const
+{
+    putCounts(out, photonCounts.data(), photonCounts.size());
+    for (const std::uint64_t n : { photons, rays, counted, skipped,
+                                   skippedMissedReceiver, skippedNotFromHeliostat, skippedBackSide })
+        putLittleEndian(out, n);
+
+    // Batch statistics (empty arrays without them)
+    for (const auto* sums : { &cellSquares, &cellCross, &rowSquares, &rowCross })
+        putCounts(out, sums->data(), sums->size());
+    putLittleEndian(out, batches);
+    putLittleEndian(out, batchPhotonSquares);
+    return static_cast<bool>(out);
+}
+
+bool RayAccumulator::load(std::istream& in)
+{
+    if (!getCounts(in, photonCounts.data(), photonCounts.size())) return false;
+    for (std::uint64_t* n : { &photons, &rays, &counted, &skipped,
+                              &skippedMissedReceiver, &skippedNotFromHeliostat, &skippedBackSide })
+        if (!getLittleEndian(in, *n)) return false;
+
+    for (auto* sums : { &cellSquares, &cellCross, &rowSquares, &rowCross })
+        if (!getCounts(in, sums->data(), sums->size())) return false;
+    return getLittleEndian(in, batches) && getLittleEndian(in, batchPhotonSquares);
+}
+
+bool receiverColumnBefore(const std::string& a, const std::string& b)
+{
+    auto trailingNumber = [](const std::string& s) -> long long {
+        if (s.empty()) return -1;
+        std::size_t i = s.size(), end = i;
+        while (i > 0 && std::isdigit(static_cast<unsigned char>(s[i - 1]))) --i;
+        if (i < end) {
+            try { return std::stoll(s.substr(i, end - i)); }
+            catch (...) { return -1; }
+        }
+        return -1;
+    };
+
+    long long na = trailingNumber(a);
+    long long nb = trailingNumber(b);
+    if (na >= 0 && nb >= 0) return na < nb;  // numeric first, increasing
+    if (na >= 0) return true;                // numeric before non-numeric
+    if (nb >= 0) return false;
+    return a < b;                            // both non-numeric: lexicographic
+}
+
+bool writeMatrixCsv(const RayAccumulator& acc, double powerPerPhoton, const std::string& outputCsvFile)
+{
+    std::ofstream out(outputCsvFile);
+    if (!out) {
+        std::cerr << "Error writing CSV file: " << outputCsvFile << "\n";
+        return false;
+    }
+    writeMatrixCsv(acc, powerPerPhoton, out);
+    return static_cast<bool>(out);
+}
+
+void writeMatrixCsv(const RayAccumulator& acc, double powerPerPhoton, std::ostream& out)
+{
+    const SurfaceMap& surfaceMap = *acc.surfaceMap;
+
+    // -----------------------
+    // Build receiver list sorted by numeric suffix (Receiver1, Receiver2, ...)
+    // -----------------------
+    std::vector<std::string> receivers = surfaceMap.getReceiverNames(); // one per receiver surface
+
+    std::sort(receivers.begin(), receivers.end(), receiverColumnBefore);
+
+    // -----------------------
+    // Write CSV
+    // -----------------------
+    const bool errors = acc.batchStatistics;
+    out << "Heliostat Label";
+    for (const std::string& rec : receivers) {
+        out << ", Power to " << rec;
+        if (errors) out << ", Std Error of Power to " << rec;
+    }
+    out << ", Total Power to Receivers";
+    if (errors) out << ", Std Error of Total Power";
+    out << "\n";
+
+    // Counts stand for scale() times as many photons when only a sample was read
+    const double power = powerPerPhoton * acc.scale();
+
+    // An error that needs more batches than there were is left empty
+    const auto writeError = [&](double error) {
+        out << ", ";
+        if (!std::isnan(error)) out << error * powerPerPhoton;
+    };
+
+    // Column -> receiver index (column names may repeat when several surfaces share a receiver)
+    const std::vector<std::string>& receiverLabels = surfaceMap.getReceiverLabels();
+    std::vector<std::size_t> columns;
+    columns.reserve(receivers.size());
+    for (const std::string& rec : receivers)
+        columns.push_back(static_cast<std::size_t>(
+            std::lower_bound(receiverLabels.begin(), receiverLabels.end(), rec) - receiverLabels.begin()));
+
+    // Rows in ascending heliostat name order; heliostats with no counted rays are omitted
+    const std::vector<std::string>& heliostatLabels = surfaceMap.getHeliostatLabels();
+    for (std::size_t h = 0; h < heliostatLabels.size(); ++h)
+    {
+        const std::uint64_t* row = acc.photonCounts.data() + h * acc.receiverCount;
+        if (std::all_of(row, row + acc.receiverCount, [](std::uint64_t c) { return c == 0; }))
+            continue;
+
+        out << heliostatLabels[h];
+        double total = 0.0;
+
+        for (const std::size_t r : columns)
+        {
+            const double value = static_cast<double>(row[r]) * power;
+            out << ", " << value;
+            if (errors) writeError(acc.cellStandardError(h * acc.receiverCount + r));
+            total += value;
+        }
+
+        out << ", " << total;
+        if (errors) writeError(acc.rowStandardError(h));
+        out << "\n";
+    }
+}
\ No newline at end of file
@@ -0,0 +1,538 @@
+#include "RayAssembler.h"
+
+#include "WorkStealingPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+namespace {
+
+constexpr std::uint64_t kMinWorkerBytes = 1u << 20;
+
+// Pointer jumping doubles the links a segment has followed every round; one
+// still not at the start of its ray after this many is in a cycle of ids
+constexpr int kMaxLinkRounds = 64;
+
+// Spill and partition files are private to the process: records and photons
+// are stored as they are in memory, each record followed by its photons.
+template <typename T>
+void writeRaw(std::ostream& out, const T* values, std::size_t count)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "raw records only");
+    out.write(reinterpret_cast<const char*>(values), static_cast<std::streamsize>(count * sizeof(T)));
+}
+
+template <typename T>
+bool readRaw(std::istream& in, T* values, std::size_t count)
+{
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(values), static_cast<std::streamsize>(count * sizeof(T))));
+}
+
+fs::path uniqueSpillPath(const fs::path& directory, const std::string& suffix)
+{
+    std::random_device random;
+    std::ostringstream name;
+    name << "sttrays-" << std::hex << ((std::uint64_t{ random() } << 32) | random()) << '-' << suffix << ".tmp";
+    return directory / name.str();
+}
+
+// Spreads photon ids (often consecutive) over the partitions
+std::size_t partitionOf(std::uint64_t id, std::size_t partitions)
+{
+    id ^= id >> 30;
+    id *= 0xBF58476D1CE4E5B9ull;
+    id ^= id >> 27;
+    id *= 0x94D049BB133111EBull;
+    id ^= id >> 31;
+    return static_cast<std::size_t>(id % partitions);
+}
+
+enum class LinkStatus : std::uint32_t { Pending, Linked, Dropped };
+
+// What pointer jumping knows about a segment, stored beside it in its partition
+struct LinkState
+{
+    std::uint64_t tailId  = 0;
+    std::uint64_t pointer = 0;   // Pending: tail id of the segment `hops` links before this one
+    std::uint64_t ray     = 0;   // Linked: id of the ray's first photon
+    std::uint64_t hops    = 0;   // Pending: links to that segment; Linked: position in the ray
+    LinkStatus    status  = LinkStatus::Pending;
+};
+
+// A segment (index within its partition) asking for the state of the segment
+// that ends with photon `pointer`
+struct LinkRequest
+{
+    std::uint64_t pointer   = 0;
+    std::uint64_t partition = 0;
+    std::uint64_t index     = 0;
+};
+
+// The answer, sent back to the asking segment's partition
+struct LinkReply
+{
+    std::uint64_t index = 0;
+    LinkState     state;   // of the segment asked about
+    bool          found = false;
+};
+
+template <typename T>
+void appendRaw(std::vector<unsigned char>& out, const T* values, std::size_t count)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "raw records only");
+    const auto* bytes = reinterpret_cast<const unsigned char*>(values);
+    out.insert(out.end(), bytes, bytes + count * sizeof(T));
+}
+
+template <typename T>
+std::vector<T> fromRaw(const std::vector<unsigned char>& bytes)
+{
+    std::vector<T> values(bytes.size() / sizeof(T));
+    if (!values.empty()) std::memcpy(values.data(), bytes.data(), values.size() * sizeof(T));
+    return values;
+}
+
+// Bytes appended by any thread, kept in memory or, for an assembler that
+// spilled, appended to a file through a small staging buffer. take() hands back
+// everything appended so far and empties the bucket.
+class Bucket
+{
+public:
+    Bucket(fs::path path, std::size_t stagingBytes) : m_path(std::move(path)), m_staging(stagingBytes) {}
+
+    ~Bucket()
+    {
+        std::error_code ec;
+        if (m_created) fs::remove(m_path, ec);
+    }
+
+    void append(const std::vector<unsigned char>& bytes)
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        m_data.insert(m_data.end(), bytes.begin(), bytes.end());
+        if (!m_path.empty() && m_data.size() >= m_staging) flush();
+    }
+
+    // Not concurrent with append()
+    std::vector<unsigned char> take()
+    {
+        if (m_fileBytes == 0) return std::move(m_data);
+        flush();
+        std::vector<unsigned char> bytes(static_cast<std::size_t>(m_fileBytes));
+        std::ifstream in(m_path, std::ios::binary);
+        if (!in.read(reinterpret_cast<char*>(bytes.data()), static_cast<std::streamsize>(bytes.size())))
+            throw std::runtime_error("Truncated ray partition file " + m_path.string());
+        in.close();
+        std::error_code ec;
+        fs::resize_file(m_path, 0, ec);
+        m_fileBytes = 0;
+        m_data.clear();
+        return bytes;
+    }
+
+    // Bytes written to the file, all in all
+    std::uint64_t spilledBytes() const { return m_written; }
+
+private:
+    void flush()
+    {
+        if (m_data.empty()) return;
+        std::ofstream out(m_path, std::ios::binary | std::ios::app);
+        m_created = true;
+        writeRaw(out, m_data.data(), m_data.size());
+        if (!out) throw std::runtime_error("Error writing ray partition file " + m_path.string());
+        m_fileBytes += m_data.size();
+        m_written   += m_data.size();
+        m_data.clear();
+    }
+
+    std::mutex                 m_mutex;
+    std::vector<unsigned char> m_data;            // everything, or what is not in the file yet
+    fs::path                   m_path;            // empty: in memory only
+    std::size_t                m_staging = 0;
+    bool                       m_created = false;
+    std::uint64_t              m_fileBytes = 0;
+    std::uint64_t              m_written = 0;
+};
+
+using Buckets = std::vector<std::unique_ptr<Bucket>>;
+
+// One task's output to a set of buckets, gathered per bucket and appended a
+// batch of whole items at a time; flush() appends the rest
+class Scatter
+{
+public:
+    Scatter(Buckets& buckets, std::size_t batchBytes)
+        : m_buckets(buckets), m_local(buckets.size()), m_batch(batchBytes) {}
+
+    // values[0..count), as items of their own
+    template <typename T>
+    void put(std::size_t bucket, const T* values, std::size_t count)
+    {
+        appendRaw(m_local[bucket], values, count);
+        endItem(bucket);
+    }
+
+    // One item: value followed by trailing[0..count)
+    template <typename T, typename U>
+    void put(std::size_t bucket, const T& value, const U* trailing, std::size_t count)
+    {
+        appendRaw(m_local[bucket], &value, 1);
+        appendRaw(m_local[bucket], trailing, count);
+        endItem(bucket);
+    }
+
+    void flush()
+    {
+        for (std::size_t b = 0; b < m_local.size(); ++b)
+            if (!m_local[b].empty()) {
+                m_buckets[b]->append(m_local[b]);
+                m_local[b].clear();
+            }
+    }
+
+private:
+    void endItem(std::size_t bucket)
+    {
+        std::vector<unsigned char>& local = m_local[bucket];
+        if (local.size() >= m_batch) {
+            m_buckets[bucket]->append(local);
+            local.clear();
+        }
+    }
+
+    Buckets& m_buckets;
+    std::vector<std::vector<unsigned char>> m_local;
+    std::size_t m_batch;
+};
+
+} // namespace
+
+struct RayAssembler::Worker
+{
+    Buffer        buffer;
+    fs::path      spillPath;
+    std::ofstream spill;
+    std::uint64_t spilledBytes = 0;
+};
+
+std::uint64_t RayAssembler::Buffer::bytes() const
+{
+    return records.size() * sizeof(Record) + photons.size() * sizeof(PhotonInfo);
+}
+
+RayAssembler::RayAssembler(unsigned workers, std::uint64_t memoryBytes, bool keepPhotons, fs::path spillDirectory)
+    : m_workerCount(std::max(workers, 1u)), m_memoryBytes(memoryBytes), m_keepPhotons(keepPhotons),
+      m_spillDirectory(spillDirectory.empty() ? fs::temp_directory_path() : std::move(spillDirectory))
+{
+    for (unsigned w = 0; w < m_workerCount; ++w) m_workers.push_back(std::make_unique<Worker>());
+}
+
+RayAssembler::~RayAssembler()
+{
+    for (const auto& worker : m_workers) {
+        worker->spill.close();
+        std::error_code ec;
+        if (!worker->spillPath.empty()) fs::remove(worker->spillPath, ec);
+    }
+}
+
+void RayAssembler::add(unsigned worker, const RaySegment& segment, const PhotonInfo* photons)
+{
+    Worker& w = *m_workers[worker];
+    Record record;
+    record.segment      = segment;
+    record.photonOffset = w.buffer.photons.size();
+    w.buffer.records.push_back(record);
+    if (m_keepPhotons) w.buffer.photons.insert(w.buffer.photons.end(), photons, photons + segment.ray.length);
+
+    // Half of the budget for the workers' buffers, the rest for assembling
+    if (w.buffer.bytes() > std::max(m_memoryBytes / 2 / m_workerCount, kMinWorkerBytes)) spill(w);
+}
+
+void RayAssembler::spill(Worker& worker)
+{
+    if (!worker.spill.is_open()) {
+        worker.spillPath = uniqueSpillPath(m_spillDirectory, "w" + std::to_string(&worker - m_workers[0].get()));
+        worker.spill.open(worker.spillPath, std::ios::binary | std::ios::trunc);
+        if (!worker.spill) throw std::runtime_error("Unable to create ray spill file " + worker.spillPath.string());
+    }
+    for (const Record& record : worker.buffer.records) {
+        writeRaw(worker.spill, &record, 1);
+        if (m_keepPhotons) writeRaw(worker.spill, worker.buffer.photons.data() + record.photonOffset, record.segment.ray.length);
+    }
+    if (!worker.spill) throw std::runtime_error("Error writing ray spill file " + worker.spillPath.string());
+    worker.spilledBytes += worker.buffer.bytes();
+    worker.buffer.records.clear();
+    worker.buffer.photons.clear();
+}
+
+void RayAssembler::forEachRecord(const std::function<void(const Record&, const PhotonInfo*)>& visit) const
+{
+    std::vector<PhotonInfo> photons;
+    for (const auto& worker : m_workers)
+    {
+        if (!worker->spillPath.empty()) {
+            std::ifstream in(worker->spillPath, std::ios::binary);
+            Record record;
+            while (readRaw(in, &record, 1)) {
+                photons.resize(m_keepPhotons ? record.segment.ray.length : 0);
+                if (!readRaw(in, photons.data(), photons.size()))
+                    throw std::runtime_error("Truncated ray spill file " + worker->spillPath.string());
+                visit(record, photons.data());
+            }
+        }
+        for (const Record& record : worker->buffer.records)
+            visit(record, worker->buffer.photons.data() + record.photonOffset);
+    }
+}
+
+RayAssembler::Totals RayAssembler::assemble(
+    const WorkStealingPool& pool, const std::function<void(const RayFragment&, const PhotonInfo*, unsigned)>& emit)
+{
+    Totals totals;
+    std::uint64_t stored = 0;
+    for (const auto& worker : m_workers) {
+        if (worker->spill.is_open()) {
+            worker->spill.close();
+            if (!worker->spill) throw std::runtime_error("Error writing ray spill file " + worker->spillPath.string());
+        }
+        m_spilledBytes += worker->spilledBytes;
+        stored += worker->spilledBytes + worker->buffer.bytes();
+    }
+
+    // Partitions: in memory, or in files of about the workers' share of the
+    // budget when the segments did not fit it either
+    const bool onDisk = m_spilledBytes > 0;
+    std::size_t partitionCount = std::size_t{ pool.threadCount() } * 4;
+    if (onDisk) {
+        const std::uint64_t perPartition = std::max(m_memoryBytes / 2 / pool.threadCount(), kMinWorkerBytes);
+        partitionCount = std::max<std::size_t>(partitionCount, static_cast<std::size_t>(stored / perPartition + 1));
+    }
+    const std::size_t batchBytes = static_cast<std::size_t>(
+        std::clamp<std::uint64_t>(m_memoryBytes / 4 / partitionCount / pool.threadCount(), 4096, 1u << 20));
+    std::size_t bucketNumber = 0;
+    const auto makeBuckets = [&] {
+        Buckets buckets;
+        for (std::size_t p = 0; p < partitionCount; ++p)
+            buckets.push_back(std::make_unique<Bucket>(
+                onDisk ? uniqueSpillPath(m_spillDirectory, "p" + std::to_string(bucketNumber++)) : fs::path{},
+                batchBytes));
+        return buckets;
+    };
+    Buckets records = makeBuckets();    // by the id of the segment's last photon
+    Buckets states  = makeBuckets();    // the LinkState of each of those records, in the same order
+    Buckets requests = makeBuckets();   // by the id asked about
+    Buckets replies = makeBuckets();    // by the asking segment's partition
+    Buckets rays = makeBuckets();       // linked records, by the id of their ray's first photon
+
+    std::uint64_t partitionBytes = 0;   // written to partition files
+    std::mutex totalsMutex;
+    const auto addTotals = [&](const Totals& t) {
+        const std::lock_guard<std::mutex> lock(totalsMutex);
+        totals.rays            += t.rays;
+        totals.droppedSegments += t.droppedSegments;
+        totals.droppedPhotons  += t.droppedPhotons;
+    };
+
+    // Every segment goes to the partition of its last photon, with its state: a
+    // ray's first segment is linked, the others ask after their predecessor
+    std::uint64_t pending = 0;
+    {
+        Scatter recordOut(records, batchBytes), stateOut(states, batchBytes), requestOut(requests, batchBytes);
+        std::vector<std::uint64_t> counts(partitionCount, 0);
+        forEachRecord([&](const Record& record, const PhotonInfo* photons) {
+            ++totals.segments;
+            const RaySegment& segment = record.segment;
+            const std::size_t q = partitionOf(segment.tailId, partitionCount);
+            LinkState state;
+            state.tailId = segment.tailId;
+            if (segment.headPrevious == 0) {
+                state.status = LinkStatus::Linked;
+                state.ray    = segment.headId;
+            } else {
+                state.pointer = segment.headPrevious;
+                state.hops    = 1;
+                const LinkRequest request{ segment.headPrevious, q, counts[q] };
+                requestOut.put(partitionOf(request.pointer, partitionCount), &request, 1);
+                ++pending;
+            }
+            ++counts[q];
+            recordOut.put(q, record, photons, m_keepPhotons ? segment.ray.length : 0);
+            stateOut.put(q, &state, 1);
+        });
+        recordOut.flush();
+        stateOut.flush();
+        requestOut.flush();
+    }
+    for (const auto& worker : m_workers) worker->buffer = Buffer{};
+    if (totals.segments == 0) return totals;
+
+    // Pointer jumping: each partition answers the requests about the segments
+    // ending in it with their state of the last round; each asking segment then
+    // takes over its predecessor's pointer, or its ray once that is linked
+    for (int round = 0; pending > 0 && round < kMaxLinkRounds; ++round)
+    {
+        pool.run(partitionCount, [&](std::size_t p, unsigned) {
+            std::vector<unsigned char> bytes = states[p]->take();
+            const std::vector<LinkState> known = fromRaw<LinkState>(bytes);
+            states[p]->append(bytes);
+            bytes = {};
+
+            std::vector<std::pair<std::uint64_t, std::size_t>> byTail(known.size());
+            for (std::size_t i = 0; i < known.size(); ++i) byTail[i] = { known[i].tailId, i };
+            std::sort(byTail.begin(), byTail.end());
+
+            Scatter replyOut(replies, batchBytes);
+            for (const LinkRequest& request : fromRaw<LinkRequest>(requests[p]->take()))
+            {
+                LinkReply reply;
+                reply.index = request.index;
+                const auto found = std::lower_bound(byTail.begin(), byTail.end(), std::make_pair(request.pointer, std::size_t{0}));
+                // A repeated id links nowhere: which of the segments comes first is unknown
+                if (found != byTail.end() && found->first == request.pointer &&
+                    (found + 1 == byTail.end() || (found + 1)->first != request.pointer)) {
+                    reply.found = true;
+                    reply.state = known[found->second];
+                }
+                replyOut.put(static_cast<std::size_t>(request.partition), &reply, 1);
+            }
+            replyOut.flush();
+        });
+
+        std::atomic<std::uint64_t> stillPending{ 0 };
+        pool.run(partitionCount, [&](std::size_t q, unsigned) {
+            std::vector<LinkState> mine = fromRaw<LinkState>(states[q]->take());
+            for (const LinkReply& reply : fromRaw<LinkReply>(replies[q]->take()))
+            {
+                LinkState& state = mine[static_cast<std::size_t>(reply.index)];
+                if (!reply.found || reply.state.status == LinkStatus::Dropped) {
+                    state.status = LinkStatus::Dropped;
+                } else if (reply.state.status == LinkStatus::Linked) {
+                    state.status = LinkStatus::Linked;
+                    state.ray    = reply.state.ray;
+                    state.hops  += reply.state.hops;
+                } else {
+                    state.pointer = reply.state.pointer;
+                    state.hops   += reply.state.hops;
+                }
+            }
+            Scatter requestOut(requests, batchBytes), stateOut(states, batchBytes);
+            std::uint64_t asked = 0;
+            for (std::size_t i = 0; i < mine.size(); ++i) {
+                if (mine[i].status != LinkStatus::Pending) continue;
+                const LinkRequest request{ mine[i].pointer, q, i };
+                requestOut.put(partitionOf(request.pointer, partitionCount), &request, 1);
+                ++asked;
+            }
+            stateOut.put(q, mine.data(), mine.size());
+            requestOut.flush();
+            stateOut.flush();
+            stillPending += asked;
+        });
+        pending = stillPending;
+    }
+
+    // Linked segments go to the partition of their ray; the rest (a photon of
+    // their ray is missing, ids repeat or form a cycle) are dropped
+    pool.run(partitionCount, [&](std::size_t q, unsigned) {
+        const std::vector<LinkState> mine = fromRaw<LinkState>(states[q]->take());
+        const std::vector<unsigned char> bytes = records[q]->take();
+        Scatter rayOut(rays, batchBytes);
+        Totals dropped;
+        std::size_t at = 0;
+        for (const LinkState& state : mine)
+        {
+            Record record;
+            std::memcpy(&record, bytes.data() + at, sizeof(Record));
+            at += sizeof(Record);
+            const std::size_t photonBytes = (m_keepPhotons ? record.segment.ray.length : 0) * sizeof(PhotonInfo);
+            if (state.status != LinkStatus::Linked) {
+                ++dropped.droppedSegments;
+                dropped.droppedPhotons += record.segment.ray.length;
+            } else {
+                record.ray  = state.ray;
+                record.rank = state.hops;
+                const std::size_t r = partitionOf(record.ray, partitionCount);
+                rayOut.put(r, record, bytes.data() + at, photonBytes);
+            }
+            at += photonBytes;
+        }
+        rayOut.flush();
+        addTotals(dropped);
+    });
+    for (Buckets* done : { &records, &states, &requests, &replies }) {
+        for (const auto& bucket : *done) partitionBytes += bucket->spilledBytes();
+        done->clear();
+    }
+
+    // Put the rays of each partition together, segments in ray order. A ray is
+    // whole when its segments follow each other, one per place, from its first
+    // photon to its last
+    pool.run(partitionCount, [&](std::size_t p, unsigned worker) {
+        const std::vector<unsigned char> bytes = rays[p]->take();
+        std::vector<Record> mine;
+        std::vector<std::size_t> photonAt;
+        for (std::size_t at = 0; at < bytes.size();) {
+            mine.emplace_back();
+            std::memcpy(&mine.back(), bytes.data() + at, sizeof(Record));
+            at += sizeof(Record);
+            photonAt.push_back(at);
+            at += (m_keepPhotons ? mine.back().segment.ray.length : 0) * sizeof(PhotonInfo);
+        }
+
+        std::vector<std::size_t> order(mine.size());
+        std::iota(order.begin(), order.end(), std::size_t{0});
+        std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+            return mine[a].ray != mine[b].ray ? mine[a].ray < mine[b].ray : mine[a].rank < mine[b].rank;
+        });
+
+        Totals done;
+        RayFragment joined;
+        std::vector<PhotonInfo> photons;
+        std::size_t first = 0;
+        bool whole = true;
+        for (std::size_t i = 0; i < order.size(); ++i)
+        {
+            const Record& record = mine[order[i]];
+            whole = whole && record.rank == i - first &&
+                    (i == first || mine[order[i - 1]].segment.tailNext == record.segment.headId);
+            joined.append(record.segment.ray);
+            if (m_keepPhotons) {
+                const std::size_t count = photons.size();
+                photons.resize(count + record.segment.ray.length);
+                std::memcpy(photons.data() + count, bytes.data() + photonAt[order[i]],
+                            record.segment.ray.length * sizeof(PhotonInfo));
+            }
+            if (i + 1 < order.size() && mine[order[i + 1]].ray == record.ray) continue;
+
+            if (whole && record.segment.tailNext == 0) {
+                ++done.rays;
+                emit(joined, m_keepPhotons ? photons.data() : nullptr, worker);
+            } else {
+                done.droppedSegments += i + 1 - first;
+                done.droppedPhotons  += joined.length;
+            }
+            joined.clear();
+            photons.clear();
+            first = i + 1;
+            whole = true;
+        }
+        addTotals(done);
+    });
+
+    for (const auto& bucket : rays) partitionBytes += bucket->spilledBytes();
+    totals.spilledBytes = m_spilledBytes + partitionBytes;
+    return totals;
+}
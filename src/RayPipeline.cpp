@@ -0,0 +1,303 @@
+#include "RayPipeline.h"
+
+namespace {
+
+// Ray state carried across blocks, plus the rays ending in the current block.
+// Rays may straddle block boundaries, so only what is needed to classify the
+// current ray is carried between photons (plus its photons when rays are assembled).
+struct RayScan
+{
+    explicit RayScan(ChunkEdges& edges_, RayAccumulator& matrix_) : edges(edges_), matrix(matrix_) {}
+
+    ChunkEdges&     edges;
+    RayAccumulator& matrix;
+    std::size_t   rayLength   = 0; // photons seen so far in the current ray
+    std::uint64_t prevSurface = 0; // surface_id of the previous photon in the current ray
+    PhotonInfo    prev1{};         // last photon of the previous block
+    PhotonInfo    prev2{};         // the one before it
+    std::vector<PhotonInfo> rayPhotons;
+
+    std::vector<std::uint32_t> endLast;
+    std::vector<std::uint32_t> endLength;
+    std::vector<std::uint64_t> endPenultimate;
+
+    // Finds the ray ends in block, adds the rays that started in this stream to
+    // the matrix and returns how many there were. The end arrays are filled only
+    // with RecordEnds; both flags are template parameters so that the plain
+    // matrix loop carries no per-photon tests for the other modules.
+    template <bool RecordEnds, bool AssembleRays>
+    std::size_t scan(const PhotonBlock& block, const std::vector<AnalyzerState*>& rayModules)
+    {
+        if (endLast.size() < block.size()) {
+            endLast.resize(block.size());
+            endLength.resize(block.size());
+            endPenultimate.resize(block.size());
+        }
+
+        const std::uint64_t* nextIds  = block.next_id.data();
+        const std::uint64_t* surfaces = block.surface_id.data();
+        const int*           sides    = block.side.data();
+        std::size_t ends = 0;
+
+        // Loop state in locals: the matrix stores could otherwise alias the members
+        std::size_t   length   = rayLength;
+        std::uint64_t previous = prevSurface;
+
+        for (std::size_t i = 0; i < block.size(); ++i)
+        {
+            ++length;
+            if (AssembleRays) rayPhotons.push_back(block.photon(i));
+
+            // A ray ends when the current photon has next_id == 0
+            if (nextIds[i] == 0)
+            {
+                if (edges.terminated)
+                {
+                    matrix.addRay(length, previous, surfaces[i], sides[i]);
+                    if (RecordEnds) {
+                        endLast[ends]        = static_cast<std::uint32_t>(i);
+                        endLength[ends]      = static_cast<std::uint32_t>(length);
+                        endPenultimate[ends] = previous;
+                    }
+                    ++ends;
+                    if (AssembleRays)
+                        for (AnalyzerState* state : rayModules) state->onRay(rayPhotons.data(), rayPhotons.size());
+                }
+                else
+                {
+                    // First ray end: it may complete a ray begun in an earlier chunk
+                    edges.terminated = true;
+                    edges.head.length = length;
+                    edges.head.last   = block.photon(i);
+                    if (length >= 2)
+                        edges.head.penultimate = (i > 0) ? block.photon(i - 1) : prev1;
+                    if (AssembleRays) edges.headPhotons = rayPhotons;
+                }
+                length = 0;
+                if (AssembleRays) rayPhotons.clear();
+            }
+
+            previous = surfaces[i];
+        }
+
+        rayLength   = length;
+        prevSurface = previous;
+
+        const std::size_t n = block.size();
+        prev2 = (n >= 2) ? block.photon(n - 2) : prev1;
+        prev1 = block.photon(n - 1);
+        return ends;
+    }
+};
+
+// RayScan for linked rays: a ray continues while each photon's next_id is the
+// id of the photon after it. Runs that are not whole rays become segments.
+struct LinkScan
+{
+    LinkScan(RayAccumulator& matrix_, RayAssembler& assembler_, unsigned worker_)
+        : matrix(matrix_), assembler(assembler_), worker(worker_)
+    {}
+
+    RayAccumulator& matrix;
+    RayAssembler&   assembler;
+    unsigned        worker;
+
+    std::size_t   length       = 0; // photons in the current run
+    std::uint64_t headId       = 0;
+    std::uint64_t headPrevious = 0;
+    std::uint64_t nextId       = 0; // next_id of the run's last photon
+    std::uint64_t prevSurface  = 0;
+    PhotonInfo    prev1{};          // last photon of the previous block
+    PhotonInfo    prev2{};
+    std::vector<PhotonInfo> runPhotons;
+
+    std::vector<std::uint32_t> endLast;
+    std::vector<std::uint32_t> endLength;
+    std::vector<std::uint64_t> endPenultimate;
+
+    // Hands the current run, whose last photon is `last`, to the assembler
+    void addSegment(const PhotonInfo& last, const PhotonInfo& penultimate)
+    {
+        RaySegment segment;
+        segment.headId       = headId;
+        segment.headPrevious = headPrevious;
+        segment.tailId       = last.id;
+        segment.tailNext     = last.next_id;
+        segment.ray.length   = length;
+        segment.ray.last     = last;
+        if (length >= 2) segment.ray.penultimate = penultimate;
+        assembler.add(worker, segment, runPhotons.data());
+        length = 0;
+        runPhotons.clear();
+    }
+
+    template <bool RecordEnds, bool AssembleRays>
+    std::size_t scan(const PhotonBlock& block, const std::vector<AnalyzerState*>& rayModules)
+    {
+        if (endLast.size() < block.size()) {
+            endLast.resize(block.size());
+            endLength.resize(block.size());
+            endPenultimate.resize(block.size());
+        }
+
+        const std::uint64_t* ids      = block.id.data();
+        const std::uint64_t* prevIds  = block.previous_id.data();
+        const std::uint64_t* nextIds  = block.next_id.data();
+        const std::uint64_t* surfaces = block.surface_id.data();
+        const int*           sides    = block.side.data();
+        const bool keepPhotons = AssembleRays || assembler.keepsPhotons();
+        std::size_t ends = 0;
+
+        for (std::size_t i = 0; i < block.size(); ++i)
+        {
+            // The run is cut when the next photon is not the one it links to
+            if (length > 0 && ids[i] != nextId) {
+                if (i >= 1) addSegment(block.photon(i - 1), i >= 2 ? block.photon(i - 2) : prev1);
+                else        addSegment(prev1, prev2);
+            }
+            if (length == 0) {
+                headId       = ids[i];
+                headPrevious = prevIds[i];
+            }
+            ++length;
+            if (keepPhotons) runPhotons.push_back(block.photon(i));
+            nextId = nextIds[i];
+
+            if (nextId == 0)
+            {
+                if (headPrevious == 0) {
+                    // A whole ray
+                    matrix.addRay(length, prevSurface, surfaces[i], sides[i]);
+                    if (RecordEnds) {
+                        endLast[ends]        = static_cast<std::uint32_t>(i);
+                        endLength[ends]      = static_cast<std::uint32_t>(length);
+                        endPenultimate[ends] = prevSurface;
+                    }
+                    ++ends;
+                    if (AssembleRays)
+                        for (AnalyzerState* state : rayModules) state->onRay(runPhotons.data(), runPhotons.size());
+                    length = 0;
+                    runPhotons.clear();
+                } else {
+                    // The end of a ray that started elsewhere
+                    addSegment(block.photon(i), i >= 1 ? block.photon(i - 1) : prev1);
+                }
+            }
+            prevSurface = surfaces[i];
+        }
+
+        const std::size_t n = block.size();
+        prev2 = (n >= 2) ? block.photon(n - 2) : prev1;
+        prev1 = block.photon(n - 1);
+        return ends;
+    }
+};
+
+} // namespace
+
+ChunkEdges streamRays(const std::function<bool(PhotonBlock&)>& nextBlock,
+                      RayAccumulator& matrix,
+                      const std::vector<AnalyzerState*>& modules,
+                      const std::vector<AnalyzerState*>& rayModules,
+                      ProgressCounter& progress, PipelineTimes* times)
+{
+    ChunkEdges edges;
+    RayScan ray(edges, matrix);
+
+    PhotonBlock block;
+    StageStamp stamp = times ? StageStamp::now() : StageStamp{};
+    while (nextBlock(block))
+    {
+        if (times) {
+            const StageStamp fetched = StageStamp::now();
+            times->fetch.add(fetched - stamp);
+            stamp = fetched;
+        }
+
+        edges.photons += block.size();
+        matrix.photons += block.size();
+        for (AnalyzerState* module : modules) module->onBlock(block);
+
+        std::size_t ends = 0;
+        if (modules.empty())
+            ends = ray.scan<false, false>(block, rayModules);
+        else if (rayModules.empty())
+            ends = ray.scan<true, false>(block, rayModules);
+        else
+            ends = ray.scan<true, true>(block, rayModules);
+
+        if (!modules.empty()) {
+            const RayEnds rayEnds{ &block, ends, ray.endLast.data(), ray.endLength.data(), ray.endPenultimate.data() };
+            for (AnalyzerState* module : modules) module->onRayEnds(rayEnds);
+        }
+
+        progress.add(block.size(), ends);
+
+        if (times) {
+            const StageStamp done = StageStamp::now();
+            times->accumulate.add(done - stamp);
+            stamp = done;
+        }
+    }
+    if (times) times->fetch.add(StageStamp::now() - stamp); // the final, empty fetch
+
+    RayFragment& open = edges.terminated ? edges.tail : edges.head;
+    open.length      = ray.rayLength;
+    open.last        = ray.prev1;
+    open.penultimate = ray.prev2;
+    (edges.terminated ? edges.tailPhotons : edges.headPhotons) = std::move(ray.rayPhotons);
+    return edges;
+}
+
+ChunkEdges streamLinkedRays(const std::function<bool(PhotonBlock&)>& nextBlock,
+                            RayAccumulator& matrix,
+                            const std::vector<AnalyzerState*>& modules,
+                            const std::vector<AnalyzerState*>& rayModules,
+                            RayAssembler& assembler, unsigned worker,
+                            ProgressCounter& progress, PipelineTimes* times)
+{
+    ChunkEdges edges;
+    LinkScan ray(matrix, assembler, worker);
+
+    PhotonBlock block;
+    StageStamp stamp = times ? StageStamp::now() : StageStamp{};
+    while (nextBlock(block))
+    {
+        if (times) {
+            const StageStamp fetched = StageStamp::now();
+            times->fetch.add(fetched - stamp);
+            stamp = fetched;
+        }
+
+        edges.photons += block.size();
+        matrix.photons += block.size();
+        for (AnalyzerState* module : modules) module->onBlock(block);
+
+        std::size_t ends = 0;
+        if (modules.empty())
+            ends = ray.scan<false, false>(block, rayModules);
+        else if (rayModules.empty())
+            ends = ray.scan<true, false>(block, rayModules);
+        else
+            ends = ray.scan<true, true>(block, rayModules);
+
+        if (!modules.empty()) {
+            const RayEnds rayEnds{ &block, ends, ray.endLast.data(), ray.endLength.data(), ray.endPenultimate.data() };
+            for (AnalyzerState* module : modules) module->onRayEnds(rayEnds);
+        }
+
+        progress.add(block.size(), ends);
+
+        if (times) {
+            const StageStamp done = StageStamp::now();
+            times->accumulate.add(done - stamp);
+            stamp = done;
+        }
+    }
+    if (times) times->fetch.add(StageStamp::now() - stamp);
+
+    // The run at the end of the stream continues in another one
+    if (ray.length > 0) ray.addSegment(ray.prev1, ray.prev2);
+    edges.terminated = true;
+    return edges;
+}
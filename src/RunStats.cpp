@@ -0,0 +1,190 @@
+#include "RunStats.h"
+
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+
+#ifdef _WIN32
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#  include <psapi.h>
+#  ifdef _MSC_VER
+#    pragma comment(lib, "psapi.lib")
+#  endif
+#else
+#  include <sys/resource.h>
+#endif
+
+namespace {
+
+#ifdef _WIN32
+double fileTimeSeconds(const FILETIME& t)
+{
+    ULARGE_INTEGER v;
+    v.LowPart  = t.dwLowDateTime;
+    v.HighPart = t.dwHighDateTime;
+    return static_cast<double>(v.QuadPart) * 1e-7; // 100 ns units
+}
+#endif
+
+double threadCpuSeconds()
+{
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) return 0.0;
+    return fileTimeSeconds(kernel) + fileTimeSeconds(user);
+#else
+    timespec ts{};
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0.0;
+    return static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec) * 1e-9;
+#endif
+}
+
+// Minimal JSON string escaping (paths may contain backslashes or quotes)
+std::string jsonString(const std::string& s)
+{
+    std::string out = "\"";
+    for (const char c : s) {
+        switch (c) {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n";  break;
+        case '\r': out += "\\r";  break;
+        case '\t': out += "\\t";  break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof buf, "\\u%04x", static_cast<unsigned>(c));
+                out += buf;
+            } else {
+                out += c;
+            }
+        }
+    }
+    return out + "\"";
+}
+
+double perSecond(double amount, double seconds)
+{
+    return seconds > 0.0 ? amount / seconds : 0.0;
+}
+
+} // namespace
+
+StageStamp StageStamp::now()
+{
+    return StageStamp{ std::chrono::steady_clock::now(), threadCpuSeconds() };
+}
+
+const char* RunStats::stageName(Stage stage)
+{
+    switch (stage) {
+    case Parameters:      return "parameters";
+    case SurfaceMapBuild: return "surfaceMap";
+    case DirectoryScan:   return "directoryScan";
+    case Read:            return "read";
+    case Decode:          return "decode";
+    case Accumulate:      return "accumulate";
+    case Write:           return "write";
+    case kStageCount:     break;
+    }
+    return "unknown";
+}
+
+bool RunStats::writeJson(const std::string& path, double totalWallSeconds) const
+{
+    std::ofstream out(path);
+    if (!out) return false;
+
+    out << std::setprecision(9);
+    out << "{\n";
+    out << "  \"folder\": " << jsonString(folder) << ",\n";
+    out << "  \"source\": " << jsonString(source) << ",\n";
+    out << "  \"reader\": " << jsonString(readerBackend) << ",\n";
+    out << "  \"threads\": " << threads << ",\n";
+    out << "  \"wallSeconds\": " << totalWallSeconds << ",\n";
+    out << "  \"cpuSeconds\": " << processCpuSeconds() << ",\n";
+    out << "  \"peakRssBytes\": " << peakResidentBytes() << ",\n";
+
+    // Worker stages are thread-seconds; "processing" is the wall/CPU of the
+    // streaming phase as seen by the calling thread.
+    out << "  \"stages\": {\n";
+    for (int s = 0; s < kStageCount; ++s)
+        out << "    " << jsonString(stageName(static_cast<Stage>(s)))
+            << ": { \"wallSeconds\": " << stages[s].wallSeconds
+            << ", \"cpuSeconds\": " << stages[s].cpuSeconds << " },\n";
+    out << "    \"processing\": { \"wallSeconds\": " << processing.wallSeconds
+        << ", \"cpuSeconds\": " << processing.cpuSeconds << " }\n";
+    out << "  },\n";
+
+    out << "  \"totals\": {\n";
+    out << "    \"bytes\": " << bytes << ",\n";
+    out << "    \"photons\": " << photons << ",\n";
+    out << "    \"rays\": " << rays << ",\n";
+    out << "    \"countedRays\": " << counted << ",\n";
+    out << "    \"skippedRays\": " << skipped << ",\n";
+    out << "    \"bytesPerSecond\": " << perSecond(static_cast<double>(bytes), processing.wallSeconds) << ",\n";
+    out << "    \"photonsPerSecond\": " << perSecond(static_cast<double>(photons), processing.wallSeconds) << "\n";
+    out << "  },\n";
+
+    out << "  \"skippedRayReasons\": {\n";
+    out << "    \"missedReceiver\": " << skippedMissedReceiver << ",\n";
+    out << "    \"notFromHeliostat\": " << skippedNotFromHeliostat << ",\n";
+    out << "    \"backSide\": " << skippedBackSide << "\n";
+    out << "  },\n";
+
+    // Per-file rates use the time the workers spent on the file's chunks
+    out << "  \"files\": [";
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        const FileStats& f = files[i];
+        out << (i ? ",\n" : "\n")
+            << "    { \"path\": " << jsonString(f.path)
+            << ", \"bytes\": " << f.bytes
+            << ", \"photons\": " << f.photons
+            << ", \"wallSeconds\": " << f.time.wallSeconds
+            << ", \"cpuSeconds\": " << f.time.cpuSeconds
+            << ", \"bytesPerSecond\": " << perSecond(static_cast<double>(f.bytes), f.time.wallSeconds)
+            << ", \"photonsPerSecond\": " << perSecond(static_cast<double>(f.photons), f.time.wallSeconds)
+            << " }";
+    }
+    out << (files.empty() ? "]\n" : "\n  ]\n");
+    out << "}\n";
+
+    return static_cast<bool>(out);
+}
+
+std::uint64_t peakResidentBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof counters)) return 0;
+    return static_cast<std::uint64_t>(counters.PeakWorkingSetSize);
+#else
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#  ifdef __APPLE__
+    return static_cast<std::uint64_t>(usage.ru_maxrss);         // bytes
+#  else
+    return static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;  // kilobytes
+#  endif
+#endif
+}
+
+double processCpuSeconds()
+{
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0.0;
+    return fileTimeSeconds(kernel) + fileTimeSeconds(user);
+#else
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0.0;
+    auto seconds = [](const timeval& t) {
+        return static_cast<double>(t.tv_sec) + static_cast<double>(t.tv_usec) * 1e-6;
+    };
+    return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+#endif
+}
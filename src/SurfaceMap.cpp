@@ -2,93 +2,151 @@
 
 #include <algorithm>
 #include <cctype>
-#include <sstream>
+#include <numeric>
 #include <string>
 #include <vector>
 
-SurfaceMap::SurfaceMap(const std::unordered_map<uint64_t, std::string>& surfaceData)
-    : m_surfacePaths(surfaceData)
+namespace {
+
+// Unique names in first-seen order; the views point into the input paths (or literals)
+class NamePool
+{
+public:
+    std::int32_t intern(std::string_view name)
+    {
+        const auto [it, added] = m_index.try_emplace(name, static_cast<std::int32_t>(m_names.size()));
+        if (added) m_names.push_back(name);
+        return it->second;
+    }
+
+    // Copies the names into `labels` in ascending order; returns first-seen index -> sorted index
+    std::vector<std::int32_t> sortInto(std::vector<std::string>& labels) const
+    {
+        std::vector<std::int32_t> order(m_names.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [this](std::int32_t a, std::int32_t b) { return m_names[a] < m_names[b]; });
+
+        std::vector<std::int32_t> rank(m_names.size());
+        labels.clear();
+        labels.reserve(m_names.size());
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            rank[static_cast<std::size_t>(order[i])] = static_cast<std::int32_t>(i);
+            labels.emplace_back(m_names[static_cast<std::size_t>(order[i])]);
+        }
+        return rank;
+    }
+
+private:
+    std::unordered_map<std::string_view, std::int32_t> m_index;
+    std::vector<std::string_view> m_names;
+};
+
+// Non-empty '/'-separated segments of path
+void splitPath(std::string_view path, std::vector<std::string_view>& segs)
+{
+    segs.clear();
+    while (!path.empty()) {
+        const std::size_t slash = path.find('/');
+        const std::string_view seg = path.substr(0, slash);
+        if (!seg.empty()) segs.push_back(seg);
+        path.remove_prefix(slash == std::string_view::npos ? path.size() : slash + 1);
+    }
+}
+
+} // namespace
+
+SurfaceMap::SurfaceMap(const std::vector<SurfacePath>& surfaces)
+    : m_surfaceCount(surfaces.size())
 {
-    for (const auto& [id, path] : surfaceData)
+    // Classify and intern names; indices are provisional until the labels are sorted
+    NamePool heliostatNames, receiverNames;
+    std::vector<std::pair<uint64_t, std::int32_t>> heliostats, receivers;
+    std::vector<std::string_view> segs;
+    for (const SurfacePath& surface : surfaces)
     {
-        if (path.find("/Heliostats/") != std::string::npos)
+        if (surface.path.find("/Heliostats/") != std::string_view::npos)
         {
-            m_heliostatNames[id] = extractHeliostatName(path);
+            heliostats.emplace_back(surface.id, heliostatNames.intern(extractHeliostatName(surface.path, segs)));
         }
-        else if (path.find("/Receivers/") != std::string::npos)
+        else if (surface.path.find("/Receivers/") != std::string_view::npos)
         {
-            m_receiverNames[id] = extractReceiverName(path);
+            receivers.emplace_back(surface.id, receiverNames.intern(extractReceiverName(surface.path, segs)));
         }
     }
-}
 
-bool SurfaceMap::isHeliostat(uint64_t surfaceId) const
-{
-    return m_heliostatNames.find(surfaceId) != m_heliostatNames.end();
+    // Label tables: unique names in ascending order
+    const std::vector<std::int32_t> heliostatRank = heliostatNames.sortInto(m_heliostatLabels);
+    const std::vector<std::int32_t> receiverRank  = receiverNames.sortInto(m_receiverLabels);
+
+    m_heliostatSurfaceCount = heliostats.size();
+    m_receiverIds.reserve(receivers.size());
+    for (const auto& kv : receivers) m_receiverIds.push_back(kv.first);
+    std::sort(m_receiverIds.begin(), m_receiverIds.end());
+
+    uint64_t maxDenseId = 0;
+    bool hasDense = false;
+    for (const auto* list : { &heliostats, &receivers })
+        for (const auto& kv : *list)
+            if (kv.first <= kMaxDenseId) { maxDenseId = std::max(maxDenseId, kv.first); hasDense = true; }
+    if (hasDense) m_denseIndex.resize(static_cast<std::size_t>(maxDenseId) + 1);
+
+    auto slot = [&](uint64_t id) -> SurfaceIndex& {
+        return (id <= kMaxDenseId) ? m_denseIndex[static_cast<std::size_t>(id)] : m_sparseIndex[id];
+    };
+    for (const auto& [id, name] : heliostats) slot(id).heliostat = heliostatRank[static_cast<std::size_t>(name)];
+    for (const auto& [id, name] : receivers)  slot(id).receiver  = receiverRank[static_cast<std::size_t>(name)];
 }
 
-bool SurfaceMap::isReceiver(uint64_t surfaceId) const
+SurfaceMap::SurfaceIndex SurfaceMap::sparseIndex(uint64_t surfaceId) const
 {
-    return m_receiverNames.find(surfaceId) != m_receiverNames.end();
+    const auto it = m_sparseIndex.find(surfaceId);
+    return (it != m_sparseIndex.end()) ? it->second : SurfaceIndex{};
 }
 
-std::string SurfaceMap::getHeliostatName(uint64_t surfaceId) const
+const std::string& SurfaceMap::getHeliostatName(uint64_t surfaceId) const
 {
-    auto it = m_heliostatNames.find(surfaceId);
-    return (it != m_heliostatNames.end()) ? it->second : "UnknownHeliostat";
+    static const std::string unknown = "UnknownHeliostat";
+    const std::int32_t h = heliostatIndex(surfaceId);
+    return (h != kNoIndex) ? m_heliostatLabels[static_cast<std::size_t>(h)] : unknown;
 }
 
-std::string SurfaceMap::getReceiverName(uint64_t surfaceId) const
+const std::string& SurfaceMap::getReceiverName(uint64_t surfaceId) const
 {
-    auto it = m_receiverNames.find(surfaceId);
-    return (it != m_receiverNames.end()) ? it->second : "UnknownReceiver";
+    static const std::string unknown = "UnknownReceiver";
+    const std::int32_t r = receiverIndex(surfaceId);
+    return (r != kNoIndex) ? m_receiverLabels[static_cast<std::size_t>(r)] : unknown;
 }
 
 std::size_t SurfaceMap::getReceiverCount() const
 {
-    return m_receiverNames.size();
+    return m_receiverIds.size();
 }
 
 std::size_t SurfaceMap::getHeliostatCount() const
 {
-    return m_heliostatNames.size();
+    return m_heliostatSurfaceCount;
 }
 
 std::size_t SurfaceMap::getTotalSurfaceCount() const
 {
-    return m_surfacePaths.size();
+    return m_surfaceCount;
 }
 
 // Deterministic: names sorted by ascending receiver ID
 std::vector<std::string> SurfaceMap::getReceiverNames() const
 {
-    std::vector<std::pair<uint64_t, std::string>> items;
-    items.reserve(m_receiverNames.size());
-    for (const auto& kv : m_receiverNames) items.emplace_back(kv.first, kv.second);
-
-    std::sort(items.begin(), items.end(),
-              [](const auto& a, const auto& b){ return a.first < b.first; });
-
     std::vector<std::string> names;
-    names.reserve(items.size());
-    for (const auto& kv : items) names.push_back(kv.second);
+    names.reserve(m_receiverIds.size());
+    for (const uint64_t id : m_receiverIds) names.push_back(getReceiverName(id));
     return names;
 }
 
 // --- Helpers ---
 
 // Extracts a heliostat label, preferring the segment immediately after "Heliostats".
-std::string SurfaceMap::extractHeliostatName(const std::string& path) const
+std::string_view SurfaceMap::extractHeliostatName(std::string_view path, std::vector<std::string_view>& segs)
 {
-    // Tokenize by '/'
-    std::vector<std::string> segs;
-    {
-        std::istringstream ss(path);
-        std::string seg;
-        while (std::getline(ss, seg, '/')) {
-            if (!seg.empty()) segs.push_back(seg);
-        }
-    }
+    splitPath(path, segs);
 
     // Find "Heliostats" segment and take the next segment if available
     for (std::size_t i = 0; i + 1 < segs.size(); ++i) {
@@ -100,7 +158,7 @@ std::string SurfaceMap::extractHeliostatName(const std::string& path) const
 
     // Fallback: last segment that looks like H\d+
     for (auto it = segs.rbegin(); it != segs.rend(); ++it) {
-        const std::string& s = *it;
+        const std::string_view s = *it;
         if (!s.empty() && s[0] == 'H' && (s.size() >= 2) && std::isdigit(static_cast<unsigned char>(s[1]))) {
             return s;
         }
@@ -110,17 +168,9 @@ std::string SurfaceMap::extractHeliostatName(const std::string& path) const
 }
 
 // Extracts a receiver label, preferring the segment immediately after "Receivers".
-std::string SurfaceMap::extractReceiverName(const std::string& path) const
+std::string_view SurfaceMap::extractReceiverName(std::string_view path, std::vector<std::string_view>& segs)
 {
-    // Tokenize by '/'
-    std::vector<std::string> segs;
-    {
-        std::istringstream ss(path);
-        std::string seg;
-        while (std::getline(ss, seg, '/')) {
-            if (!seg.empty()) segs.push_back(seg);
-        }
-    }
+    splitPath(path, segs);
 
     // Prefer the segment after "Receivers"
     for (std::size_t i = 0; i + 1 < segs.size(); ++i) {
@@ -131,21 +181,11 @@ std::string SurfaceMap::extractReceiverName(const std::string& path) const
 
     // Fallback: last segment containing "Receiver"
     for (auto it = segs.rbegin(); it != segs.rend(); ++it) {
-        const std::string& s = *it;
-        if (s.find("Receiver") != std::string::npos) {
+        const std::string_view s = *it;
+        if (s.find("Receiver") != std::string_view::npos) {
             return s;
         }
     }
 
     return "UnknownReceiver";
-}
-
-const std::unordered_map<uint64_t, std::string>& SurfaceMap::getHeliostatNames() const
-{
-    return m_heliostatNames;
-}
-
-const std::unordered_map<uint64_t, std::string>& SurfaceMap::getReceiverNamesMap() const
-{
-    return m_receiverNames;
 }
\ No newline at end of file
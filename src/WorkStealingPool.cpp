@@ -0,0 +1,164 @@
+#include "WorkStealingPool.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct TaskQueue
+{
+    std::mutex mutex;
+    std::deque<std::size_t> tasks;
+
+    bool popFront(std::size_t& task)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tasks.empty()) return false;
+        task = tasks.front();
+        tasks.pop_front();
+        return true;
+    }
+
+    bool stealBack(std::size_t& task)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tasks.empty()) return false;
+        task = tasks.back();
+        tasks.pop_back();
+        return true;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.clear();
+    }
+};
+
+} // namespace
+
+// The parked threads (workers 1..) and the run they are in
+struct WorkStealingPool::Threads
+{
+    std::mutex              runMutex;     // one run() at a time
+    std::mutex              mutex;
+    std::condition_variable started;
+    std::condition_variable finished;
+    std::vector<std::thread> threads;
+    std::uint64_t           generation = 0;
+    const std::function<void(unsigned)>* work = nullptr;
+    unsigned                workers  = 0; // of this run, including the caller
+    unsigned                running  = 0; // threads still in this run
+    bool                    stopping = false;
+
+    void loop(unsigned w)
+    {
+        std::uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            started.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            if (w >= workers) continue;
+            lock.unlock();
+            (*work)(w);
+            lock.lock();
+            if (--running == 0) finished.notify_one();
+        }
+    }
+};
+
+WorkStealingPool::WorkStealingPool(unsigned threads)
+    : m_threads(threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency())),
+      m_pool(std::make_unique<Threads>())
+{
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        const std::lock_guard<std::mutex> lock(m_pool->mutex);
+        m_pool->stopping = true;
+    }
+    m_pool->started.notify_all();
+    for (std::thread& t : m_pool->threads) t.join();
+}
+
+void WorkStealingPool::run(std::size_t taskCount, const std::function<void(std::size_t, unsigned)>& task) const
+{
+    const unsigned workers = static_cast<unsigned>(std::min<std::size_t>(m_threads, std::max<std::size_t>(taskCount, 1)));
+
+    if (workers == 1) {
+        for (std::size_t i = 0; i < taskCount; ++i) task(i, 0);
+        return;
+    }
+
+    // Contiguous initial slices, one per worker
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    queues.reserve(workers);
+    for (unsigned w = 0; w < workers; ++w) {
+        queues.push_back(std::make_unique<TaskQueue>());
+        const std::size_t begin = taskCount * w / workers;
+        const std::size_t end   = taskCount * (w + 1) / workers;
+        for (std::size_t i = begin; i < end; ++i) queues[w]->tasks.push_back(i);
+    }
+
+    std::exception_ptr failure;
+    std::mutex failureMutex;
+
+    auto worker = [&](unsigned w) {
+        try {
+            std::size_t index;
+            while (true) {
+                if (queues[w]->popFront(index)) {
+                    task(index, w);
+                    continue;
+                }
+                bool stolen = false;
+                for (unsigned k = 1; k < workers && !stolen; ++k)
+                    stolen = queues[(w + k) % workers]->stealBack(index);
+                if (!stolen) break; // tasks never spawn tasks: all queues are drained
+                task(index, w);
+            }
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lock(failureMutex);
+                if (!failure) failure = std::current_exception();
+            }
+            for (auto& q : queues) q->clear(); // stop the other workers early
+        }
+    };
+
+    // Worker 0 is this thread; the others are woken for the run and waited for
+    Threads& pool = *m_pool;
+    const std::lock_guard<std::mutex> running(pool.runMutex);
+    const std::function<void(unsigned)> work = worker;
+    {
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        while (pool.threads.size() + 1 < workers) {
+            const unsigned w = static_cast<unsigned>(pool.threads.size()) + 1;
+            pool.threads.emplace_back([&pool, w] { pool.loop(w); });
+        }
+        pool.work    = &work;
+        pool.workers = workers;
+        pool.running = workers - 1;
+        ++pool.generation;
+    }
+    pool.started.notify_all();
+    worker(0);
+    {
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        pool.finished.wait(lock, [&] { return pool.running == 0; });
+        pool.work = nullptr;
+    }
+
+    if (failure) std::rethrow_exception(failure);
+}
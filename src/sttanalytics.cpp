@@ -0,0 +1,309 @@
+#include "sttanalytics.h"
+
+#include "ParametersFileReader.h"
+#include "PhotonProcessor.h"
+#include "SurfaceMap.h"
+#include "tonatiuhreader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+struct stt_surfaces
+{
+    fs::path folder;
+    std::unique_ptr<SurfaceMap> surfaceMap;
+    double powerPerPhoton = 0.0;
+    std::uint64_t fingerprint = 0;
+    PhotonLayout layout;
+};
+
+struct stt_analysis
+{
+    const stt_surfaces* surfaces = nullptr;
+    std::unique_ptr<PhotonProcessor> processor;
+    double powerPerPhoton = 0.0;
+};
+
+namespace {
+
+// Per thread, so concurrent analyses never see each other's errors
+thread_local std::string lastError;
+
+stt_status fail(stt_status status, const std::string& message)
+{
+    lastError = message;
+    return status;
+}
+
+// Runs `body`, turning exceptions into a status and lastError
+template <typename Body>
+stt_status guarded(Body body)
+{
+    try {
+        lastError.clear();
+        return body();
+    } catch (const std::bad_alloc&) {
+        return fail(STT_ERROR_MEMORY, "Out of memory");
+    } catch (const std::invalid_argument& ex) {
+        return fail(STT_ERROR_ARGUMENT, ex.what());
+    } catch (const std::exception& ex) {
+        return fail(STT_ERROR_PROCESSING, ex.what());
+    } catch (...) {
+        return fail(STT_ERROR_PROCESSING, "Unknown error");
+    }
+}
+
+stt_status copyName(const std::vector<std::string>& names, std::size_t index, char* buffer, std::size_t capacity,
+                    std::size_t* length)
+{
+    if (index >= names.size()) return fail(STT_ERROR_ARGUMENT, "Surface index out of range");
+    const std::string& name = names[index];
+    if (length) *length = name.size();
+    if (!buffer || capacity <= name.size()) return fail(STT_ERROR_BUFFER, "Name buffer too small");
+    std::memcpy(buffer, name.c_str(), name.size() + 1);
+    return STT_OK;
+}
+
+// The matrix of a finished run, or STT_ERROR_NO_RESULT / STT_ERROR_BUFFER
+stt_status matrixOf(const stt_analysis* analysis, std::size_t capacity, std::size_t* needed,
+                    const RayAccumulator*& result)
+{
+    if (!analysis) return fail(STT_ERROR_ARGUMENT, "Null analysis");
+    result = analysis->processor->result();
+    if (!result) return fail(STT_ERROR_NO_RESULT, "The analysis has not been run");
+    if (needed) *needed = result->photonCounts.size();
+    if (capacity < result->photonCounts.size()) return fail(STT_ERROR_BUFFER, "Matrix buffer too small");
+    return STT_OK;
+}
+
+} // namespace
+
+extern "C" {
+
+void stt_options_init(stt_options* options)
+{
+    if (!options) return;
+    const ProcessingOptions defaults;
+    *options = stt_options{};
+    options->size        = sizeof(stt_options);
+    options->threads     = defaults.threads;
+    options->chunk_bytes = defaults.chunkBytes;
+    options->reader      = STT_READER_MMAP;
+    options->use_cache   = defaults.useCache ? 1 : 0;
+    options->verbose     = 0;
+    options->power_per_photon = 0.0;
+}
+
+const char* stt_last_error(void)
+{
+    return lastError.c_str();
+}
+
+int stt_api_version(void)
+{
+    return STT_API_VERSION;
+}
+
+stt_status stt_surfaces_open(const char* folder, stt_surfaces** out)
+{
+    if (!folder || !out) return fail(STT_ERROR_ARGUMENT, "Null argument");
+    *out = nullptr;
+    return guarded([&] {
+        const fs::path path(folder);
+        if (!fs::is_regular_file(path / "photons_parameters.txt"))
+            return fail(STT_ERROR_INPUT, "Parameters file not found in " + path.string());
+
+        auto surfaces = std::make_unique<stt_surfaces>();
+        ParametersFileReader reader(path.string());
+        reader.read();
+        if (reader.getPowerPerPhoton() <= 0.0)
+            return fail(STT_ERROR_PROCESSING, "Invalid power per photon in " + path.string());
+
+        surfaces->folder         = path;
+        surfaces->surfaceMap     = std::make_unique<SurfaceMap>(reader.getSurfaces());
+        surfaces->powerPerPhoton = reader.getPowerPerPhoton();
+        surfaces->fingerprint    = reader.getFingerprint();
+        surfaces->layout         = reader.getLayout();
+        *out = surfaces.release();
+        return STT_OK;
+    });
+}
+
+void stt_surfaces_close(stt_surfaces* surfaces)
+{
+    delete surfaces;
+}
+
+size_t stt_surfaces_heliostat_count(const stt_surfaces* surfaces)
+{
+    return surfaces ? surfaces->surfaceMap->getHeliostatLabels().size() : 0;
+}
+
+size_t stt_surfaces_receiver_count(const stt_surfaces* surfaces)
+{
+    return surfaces ? surfaces->surfaceMap->getReceiverLabels().size() : 0;
+}
+
+double stt_surfaces_power_per_photon(const stt_surfaces* surfaces)
+{
+    return surfaces ? surfaces->powerPerPhoton : 0.0;
+}
+
+stt_status stt_surfaces_heliostat_name(const stt_surfaces* surfaces, size_t index, char* buffer, size_t capacity,
+                                       size_t* length)
+{
+    if (!surfaces) return fail(STT_ERROR_ARGUMENT, "Null surfaces");
+    return copyName(surfaces->surfaceMap->getHeliostatLabels(), index, buffer, capacity, length);
+}
+
+stt_status stt_surfaces_receiver_name(const stt_surfaces* surfaces, size_t index, char* buffer, size_t capacity,
+                                      size_t* length)
+{
+    if (!surfaces) return fail(STT_ERROR_ARGUMENT, "Null surfaces");
+    return copyName(surfaces->surfaceMap->getReceiverLabels(), index, buffer, capacity, length);
+}
+
+stt_status stt_analysis_open(const char* folder, const stt_surfaces* surfaces, const stt_options* options,
+                             stt_analysis** out)
+{
+    if (!folder || !surfaces || !out) return fail(STT_ERROR_ARGUMENT, "Null argument");
+    *out = nullptr;
+
+    stt_options settings;
+    stt_options_init(&settings);
+    if (options) {
+        // Callers built against another version pass a shorter or longer struct:
+        // take the fields both know, defaults for the rest
+        if (options->size == 0) return fail(STT_ERROR_ARGUMENT, "stt_options not initialised with stt_options_init()");
+        std::memcpy(&settings, options, std::min(options->size, sizeof(stt_options)));
+        settings.size = sizeof(stt_options);
+    }
+    if (settings.reader < STT_READER_MMAP || settings.reader > STT_READER_ASYNC)
+        return fail(STT_ERROR_ARGUMENT, "Unknown reader backend");
+
+    return guarded([&] {
+        const fs::path path(folder);
+        if (!fs::is_directory(path))
+            return fail(STT_ERROR_INPUT, "\"" + path.string() + "\" is not a directory or does not exist");
+        if (TonatiuhReader::ListPhotonFiles(path).empty())
+            return fail(STT_ERROR_INPUT, "No photon data files (photons_*.dat[.gz|.zst]) found in " + path.string());
+
+        ProcessingOptions processing;
+        processing.threads       = settings.threads;
+        processing.chunkBytes    = settings.chunk_bytes;
+        processing.readerBackend = settings.reader == STT_READER_STREAM ? ReaderBackend::Stream
+                                 : settings.reader == STT_READER_ASYNC  ? ReaderBackend::Async
+                                                                        : ReaderBackend::Mmap;
+        processing.useCache      = settings.use_cache != 0;
+        processing.verbose       = settings.verbose != 0;
+
+        // A cache is checked against the parameters it was built for; those of
+        // another folder are unknown here (its file sizes and times still guard it)
+        std::error_code ec;
+        const bool surfacesFolder = fs::equivalent(path, surfaces->folder, ec);
+        processing.parametersFingerprint = surfacesFolder ? surfaces->fingerprint : 0;
+        // Records hold the fields of the surfaces' parameters file; their byte order is detected per folder
+        processing.layout = surfaces->layout;
+
+        // Another folder (another sun position) has its own power per photon
+        double powerPerPhoton = settings.power_per_photon;
+        if (powerPerPhoton <= 0.0 && surfacesFolder) {
+            powerPerPhoton = surfaces->powerPerPhoton;
+        } else if (powerPerPhoton <= 0.0) {
+            if (!fs::is_regular_file(path / "photons_parameters.txt"))
+                return fail(STT_ERROR_INPUT, "No parameters file in " + path.string() +
+                                             "; set power_per_photon in the options");
+            ParametersFileReader reader(path.string());
+            reader.read();
+            powerPerPhoton = reader.getPowerPerPhoton();
+            if (powerPerPhoton <= 0.0)
+                return fail(STT_ERROR_PROCESSING, "Invalid power per photon in " + path.string());
+        }
+
+        auto analysis = std::make_unique<stt_analysis>();
+        analysis->surfaces       = surfaces;
+        analysis->powerPerPhoton = powerPerPhoton;
+        analysis->processor = std::make_unique<PhotonProcessor>(path.string(), *surfaces->surfaceMap,
+                                                                analysis->powerPerPhoton, processing);
+        *out = analysis.release();
+        return STT_OK;
+    });
+}
+
+void stt_analysis_close(stt_analysis* analysis)
+{
+    delete analysis;
+}
+
+stt_status stt_analysis_run(stt_analysis* analysis)
+{
+    if (!analysis) return fail(STT_ERROR_ARGUMENT, "Null analysis");
+    return guarded([&] {
+        analysis->processor->run();
+        return STT_OK;
+    });
+}
+
+stt_status stt_analysis_update(stt_analysis* analysis, int* grew)
+{
+    if (!analysis) return fail(STT_ERROR_ARGUMENT, "Null analysis");
+    return guarded([&] {
+        const bool read = analysis->processor->update();
+        if (grew) *grew = read ? 1 : 0;
+        return STT_OK;
+    });
+}
+
+stt_status stt_analysis_power(const stt_analysis* analysis, double* matrix, size_t capacity, size_t* needed)
+{
+    const RayAccumulator* result = nullptr;
+    const stt_status status = matrixOf(analysis, matrix ? capacity : 0, needed, result);
+    if (status != STT_OK) return status;
+    for (std::size_t i = 0; i < result->photonCounts.size(); ++i)
+        matrix[i] = static_cast<double>(result->photonCounts[i]) * analysis->powerPerPhoton;
+    return STT_OK;
+}
+
+stt_status stt_analysis_counts(const stt_analysis* analysis, uint64_t* matrix, size_t capacity, size_t* needed)
+{
+    const RayAccumulator* result = nullptr;
+    const stt_status status = matrixOf(analysis, matrix ? capacity : 0, needed, result);
+    if (status != STT_OK) return status;
+    std::copy(result->photonCounts.begin(), result->photonCounts.end(), matrix);
+    return STT_OK;
+}
+
+stt_status stt_analysis_totals(const stt_analysis* analysis, stt_totals* out)
+{
+    if (!analysis || !out) return fail(STT_ERROR_ARGUMENT, "Null argument");
+    const RayAccumulator* result = analysis->processor->result();
+    if (!result) return fail(STT_ERROR_NO_RESULT, "The analysis has not been run");
+    out->photons = result->photons;
+    out->rays    = result->rays;
+    out->counted = result->counted;
+    out->skipped = result->skipped;
+    out->skipped_missed_receiver    = result->skippedMissedReceiver;
+    out->skipped_not_from_heliostat = result->skippedNotFromHeliostat;
+    out->skipped_back_side          = result->skippedBackSide;
+    return STT_OK;
+}
+
+stt_status stt_analysis_write_csv(const stt_analysis* analysis, const char* path)
+{
+    if (!analysis || !path) return fail(STT_ERROR_ARGUMENT, "Null argument");
+    return guarded([&] {
+        if (!analysis->processor->writeCsv(path)) return fail(STT_ERROR_INPUT, std::string("Unable to write ") + path);
+        return STT_OK;
+    });
+}
+
+} // extern "C"
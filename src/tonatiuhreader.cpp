@@ -2,48 +2,165 @@
 #include <algorithm>
 #include <iterator>
 #include <iostream>
-#include <cmath>           // std::llround, std::lrint
+#include <utility>         // std::move
 #include "comparefilename.h"
+#include "PhotonDecode.h"
+#include <numeric>         // std::lcm
 
 namespace fs = std::filesystem;
 
-// Byte-swap helper (works for PODs like double)
-template <class T>
-inline void endswap(T* objp)
+TonatiuhReader::TonatiuhReader(fs::path directory_path, ReaderBackend backend, bool use_cache)
+    : TonatiuhReader(ListPhotonFiles(directory_path), backend)
 {
-    unsigned char* memp = reinterpret_cast<unsigned char*>(objp);
-    std::reverse(memp, memp + sizeof(T));
+    if (use_cache) m_cache.open(directory_path, 0);
+    m_directory_path = std::move(directory_path);
 }
 
-// Read one big-endian double from current stream into host double
-static bool readBigEndianDouble(std::ifstream& ifs, double& out)
+TonatiuhReader::TonatiuhReader(std::vector<fs::directory_entry> files, ReaderBackend backend)
+    : TonatiuhReader(SplitIntoChunks(files, 0), backend)
 {
-    ifs.read(reinterpret_cast<char*>(&out), sizeof(out));
-    if (!ifs) return false; // short read or error
-    endswap(&out);          // big-endian -> host
-    return true;
 }
 
-TonatiuhReader::TonatiuhReader(fs::path directory_path)
-    : m_directory_path{directory_path}
+TonatiuhReader::TonatiuhReader(std::vector<PhotonFileChunk> chunks, ReaderBackend backend)
+    : m_chunks{std::move(chunks)}, m_backend{backend}
+{
+    for (const PhotonFileChunk& chunk : m_chunks)
+        m_directory_entry.push_back(chunk.file);
+
+    // The async engine reads raw byte ranges; compressed files go through a
+    // Decompressor instead, so such sequences use the (per-file) mmap path
+    if (m_backend == ReaderBackend::Async &&
+        std::any_of(m_chunks.begin(), m_chunks.end(), [](const PhotonFileChunk& chunk) {
+            return compressionOf(chunk.file.path()) != Compression::None;
+        }))
+        m_backend = ReaderBackend::Mmap;
+
+    // Prepare a reasonable read buffer (≈700 KiB); the other backends manage their own memory
+    if (m_backend == ReaderBackend::Stream) {
+        m_buf_size = 1024u * 700u;
+        m_buf = std::unique_ptr<char[]>(new char[m_buf_size]);
+    }
+}
+
+bool TonatiuhReader::IsPhotonFile(const fs::path& path)
+{
+    return path.extension() == ".dat" || compressionOf(path) != Compression::None;
+}
+
+std::vector<fs::directory_entry> TonatiuhReader::ListPhotonFiles(const fs::path& directory_path)
 {
-    // Collect .dat files
+    // Collect .dat files (plain or compressed)
+    std::vector<fs::directory_entry> files;
     for (auto& p : fs::directory_iterator(directory_path)) {
-        if (p.is_regular_file() && p.path().extension() == ".dat") {
-            m_directory_entry.push_back(p);
+        if (!p.is_regular_file() || !IsPhotonFile(p.path())) continue;
+        if (compressionOf(p.path()) != Compression::None && fs::exists(p.path().parent_path() / p.path().stem())) {
+            std::cerr << "Warning: both " << p.path().stem().string() << " and " << p.path().filename().string()
+                      << " exist; reading the uncompressed one.\n";
+            continue;
+        }
+        files.push_back(p);
+    }
+    std::sort(files.begin(), files.end(), CompareFilename{});
+    return files;
+}
+
+std::vector<PhotonFileChunk> TonatiuhReader::SplitIntoChunks(const std::vector<fs::directory_entry>& files,
+                                                             std::uint64_t chunk_bytes, std::size_t record_bytes)
+{
+    std::vector<PhotonFileChunk> ranges;
+    for (const auto& file : files) ranges.push_back(PhotonFileChunk{file});
+    return SplitIntoChunks(ranges, chunk_bytes, record_bytes);
+}
+
+std::vector<PhotonFileChunk> TonatiuhReader::SplitIntoChunks(const std::vector<PhotonFileChunk>& ranges,
+                                                             std::uint64_t chunk_bytes, std::size_t record_bytes)
+{
+    if (chunk_bytes == 0) return ranges;
+
+    // Round the chunk size up to whole records
+    const std::uint64_t step = ((chunk_bytes + record_bytes - 1) / record_bytes) * record_bytes;
+    std::vector<PhotonFileChunk> chunks;
+    for (const PhotonFileChunk& range : ranges) {
+        if (compressionOf(range.file.path()) != Compression::None) {
+            chunks.push_back(range);
+            continue;
+        }
+        const std::uint64_t stop = (range.end == PhotonFileChunk::kToEndOfFile) ? range.file.file_size() : range.end;
+        std::uint64_t begin = range.begin;
+        do {
+            const std::uint64_t end = (stop - begin > step) ? begin + step : range.end;
+            chunks.push_back(PhotonFileChunk{range.file, begin, end});
+            begin += step;
+        } while (begin < stop);
+    }
+    return chunks;
+}
+
+ByteOrder TonatiuhReader::DetectByteOrder(const std::vector<fs::directory_entry>& files, const PhotonLayout& layout)
+{
+    constexpr std::size_t kSampleRecords = 64;
+    const std::size_t wanted = kSampleRecords * layout.recordBytes();
+    std::vector<unsigned char> sample(wanted);
+
+    for (const fs::directory_entry& file : files) {
+        std::size_t bytes = 0;
+        const Compression compression = compressionOf(file.path());
+        if (compression == Compression::None) {
+            std::ifstream in(file.path(), std::ios::binary);
+            in.read(reinterpret_cast<char*>(sample.data()), static_cast<std::streamsize>(wanted));
+            bytes = static_cast<std::size_t>(in.gcount());
+        } else if (compressionSupported(compression)) {
+            Decompressor inflate(file.path(), compression, 0, wanted, 2, layout.recordBytes());
+            Decompressor::Buffer buffer;
+            if (inflate.next(buffer)) {
+                bytes = std::min(buffer.size, wanted);
+                std::copy(buffer.data, buffer.data + bytes, sample.begin());
+            }
         }
+        const std::size_t records = bytes / layout.recordBytes();
+        if (records > 0) return layout.detectByteOrder(sample.data(), records);
     }
-    std::sort(m_directory_entry.begin(), m_directory_entry.end(), CompareFilename{});
+    return ByteOrder::Unknown;
+}
 
-    // Prepare a reasonable read buffer (≈700 KiB)
-    m_buf_size = 1024u * 700u;
-    m_buf = std::unique_ptr<char[]>(new char[m_buf_size]);
+void TonatiuhReader::SetLayout(const PhotonLayout& layout)
+{
+    m_decoder = PhotonDecoder(layout);
+    m_record_bytes = layout.recordBytes();
 }
 
 bool TonatiuhReader::OpenNextFile()
 {
     if (m_file_number >= m_directory_entry.size()) return false;
 
+    const PhotonFileChunk& chunk = m_chunks[m_file_number];
+    const std::uint64_t length = (chunk.end == PhotonFileChunk::kToEndOfFile) ? chunk.end : chunk.end - chunk.begin;
+
+    m_inflate.reset();
+    m_inflate_buf = Decompressor::Buffer{};
+    m_inflate_pos = 0;
+    const Compression compression = compressionOf(chunk.file.path());
+    if (compression != Compression::None) {
+        m_map.close();
+        m_map_pos = 0;
+        m_inflate = std::make_unique<Decompressor>(chunk.file.path(), compression, chunk.begin, std::size_t{1} << 20, 3,
+                                                   m_record_bytes);
+        return true;
+    }
+
+    if (m_backend == ReaderBackend::Mmap) {
+        m_map.close(); // unmap the finished file before mapping the next one
+        m_map_pos = 0;
+
+        const auto& path = chunk.file.path();
+        if (!m_map.open(path, chunk.begin, length)) {
+            std::cerr << "Failed to map photon file: " << path << "\n";
+            return false;
+        }
+        m_map.adviseSequential();
+        return true;
+    }
+
     if (m_ifs.is_open()) m_ifs.close();
     m_ifs.clear();
 
@@ -56,13 +173,85 @@ bool TonatiuhReader::OpenNextFile()
         std::cerr << "Failed to open photon file: " << path << "\n";
         return false;
     }
+    if (chunk.begin != 0) m_ifs.seekg(static_cast<std::streamoff>(chunk.begin));
+    m_stream_left = length;
+    return true;
+}
+
+AsyncReadOptions TonatiuhReader::AsyncOptionsFor(const AsyncReadOptions& options, std::size_t record_bytes)
+{
+    // Whole records in every read, as in whole pages
+    AsyncReadOptions whole = options;
+    const std::size_t unit = std::lcm<std::size_t>(record_bytes, 4096);
+    whole.bufferBytes = std::max<std::size_t>((whole.bufferBytes + unit - 1) / unit, 1) * unit;
+    return whole;
+}
+
+void TonatiuhReader::SetAsyncReader(AsyncFileReader* reader, std::size_t first_range)
+{
+    m_async = reader;
+    m_async_first = first_range;
+}
+
+bool TonatiuhReader::NextAsyncRecords()
+{
+    if (!m_async) {
+        m_async_own = std::make_unique<AsyncFileReader>(m_chunks, AsyncOptionsFor(m_async_options, m_record_bytes));
+        m_async = m_async_own.get();
+        m_async_first = 0;
+        m_async_buf = AsyncFileReader::Buffer{};
+        m_async_pos = 0;
+    }
+
+    while (m_async_buf.size - m_async_pos < m_record_bytes) {
+        const std::size_t remaining = m_async_buf.size - m_async_pos;
+        if (remaining != 0 && m_async_buf.lastOfRange) ReportPartialRecord(remaining);
 
-    std::cout << path.string() << std::endl;
+        const std::size_t previousRange = m_async_buf.data ? m_async_buf.range : m_async_first + m_chunks.size();
+        if (!m_async->next(m_async_buf, m_async_first + m_chunks.size())) {
+            m_async_buf = AsyncFileReader::Buffer{};
+            m_async_pos = 0;
+            return false;
+        }
+        m_async_pos = 0;
+
+        // A shared reader may still hold the end of a chunk read before
+        if (m_async_buf.range < m_async_first) {
+            m_async_pos = m_async_buf.size;
+            m_async_buf.lastOfRange = false;
+            continue;
+        }
+        if (m_async_buf.range != previousRange) m_file_number = m_async_buf.range - m_async_first;
+    }
     return true;
 }
 
 bool TonatiuhReader::ReadPhotonInfo(PhotonInfo& photon_info)
 {
+    if (m_cache.is_open()) {
+        // Served from a block refilled from the cache kDefaultCapacity photons at a time
+        if (m_cache_block_pos >= m_cache_block.size()) {
+            if (m_cache_pos >= m_cache.photonCount()) return false;
+            if (m_cache_block.capacity() == 0) m_cache_block.reserve(PhotonBlock::kDefaultCapacity);
+            const std::uint64_t left = m_cache.photonCount() - m_cache_pos;
+            const std::size_t count =
+                static_cast<std::size_t>(std::min<std::uint64_t>(left, m_cache_block.capacity()));
+            m_cache_block.clear();
+            m_cache.read(m_cache_pos, count, m_cache_block);
+            m_cache_pos += count;
+            m_cache_block_pos = 0;
+        }
+        photon_info = m_cache_block.photon(m_cache_block_pos++);
+        return true;
+    }
+
+    if (m_backend == ReaderBackend::Async) {
+        if (!NextAsyncRecords()) return false;
+        m_decoder.decode(m_async_buf.data + m_async_pos, photon_info);
+        m_async_pos += m_record_bytes;
+        return true;
+    }
+
     if (m_first_photon) {
         m_first_photon = false;
         if (m_directory_entry.empty()) return false;
@@ -70,13 +259,23 @@ bool TonatiuhReader::ReadPhotonInfo(PhotonInfo& photon_info)
     }
 
     while (true) {
-        if (ReadPhotonInfoFromFile(photon_info)) {
-            return true;
-        }
+        if (m_inflate) {
+            if (ReadPhotonInfoFromDecompressor(photon_info)) {
+                return true;
+            }
+        } else if (m_backend == ReaderBackend::Mmap) {
+            if (ReadPhotonInfoFromMapping(photon_info)) {
+                return true;
+            }
+        } else {
+            if (ReadPhotonInfoFromFile(photon_info)) {
+                return true;
+            }
 
-        // If not EOF, it’s likely a short-read/corruption. Clear to move on.
-        if (!m_ifs.eof()) {
-            m_ifs.clear();
+            // If not EOF, it’s likely a short-read/corruption. Clear to move on.
+            if (!m_ifs.eof()) {
+                m_ifs.clear();
+            }
         }
 
         // Advance to next file if available
@@ -87,37 +286,191 @@ bool TonatiuhReader::ReadPhotonInfo(PhotonInfo& photon_info)
         }
 
         // No more files
+        m_map.close();
+        m_map_pos = 0;
+        m_inflate.reset();
         return false;
     }
 }
 
 bool TonatiuhReader::ReadPhotonInfoFromFile(PhotonInfo& p)
 {
-    // Read all fields as doubles, then convert integer-like fields
-    double d_id, d_x, d_y, d_z, d_side, d_prev, d_next, d_surface;
+    if (m_stream_left < m_record_bytes) return false; // end of range
 
     std::streampos before = m_ifs.tellg();
+    m_record_buf.resize(m_record_bytes);
+    if (!m_ifs.read(reinterpret_cast<char*>(m_record_buf.data()), static_cast<std::streamsize>(m_record_bytes))) {
+        m_ifs.clear();
+        m_ifs.seekg(before);
+        return false;
+    }
+    m_decoder.decode(m_record_buf.data(), p);
 
-    if (!readBigEndianDouble(m_ifs, d_id))      { m_ifs.clear(); m_ifs.seekg(before); return false; }
-    if (!readBigEndianDouble(m_ifs, d_x))       { m_ifs.clear(); m_ifs.seekg(before); return false; }
-    if (!readBigEndianDouble(m_ifs, d_y))       { m_ifs.clear(); m_ifs.seekg(before); return false; }
-    if (!readBigEndianDouble(m_ifs, d_z))       { m_ifs.clear(); m_ifs.seekg(before); return false; }
-    if (!readBigEndianDouble(m_ifs, d_side))    { m_ifs.clear(); m_ifs.seekg(before); return false; }
-    if (!readBigEndianDouble(m_ifs, d_prev))    { m_ifs.clear(); m_ifs.seekg(before); return false; }
-    if (!readBigEndianDouble(m_ifs, d_next))    { m_ifs.clear(); m_ifs.seekg(before); return false; }
-    if (!readBigEndianDouble(m_ifs, d_surface)) { m_ifs.clear(); m_ifs.seekg(before); return false; }
-
-    // Floating fields
-    p.x = d_x;
-    p.y = d_y;
-    p.z = d_z;
-
-    // Integer-like fields
-    p.id          = static_cast<std::uint64_t>(std::llround(d_id));
-    p.previous_id = static_cast<std::uint64_t>(std::llround(d_prev));
-    p.next_id     = static_cast<std::uint64_t>(std::llround(d_next));
-    p.surface_id  = static_cast<std::uint64_t>(std::llround(d_surface));
-    p.side        = static_cast<int>(std::lrint(d_side));
+    if (m_stream_left != PhotonFileChunk::kToEndOfFile) m_stream_left -= m_record_bytes;
+    return true;
+}
 
+bool TonatiuhReader::ReadPhotonInfoFromMapping(PhotonInfo& p)
+{
+    const std::size_t remaining = m_map.size() - m_map_pos;
+    if (remaining < m_record_bytes) {
+        if (remaining != 0) {
+            ReportPartialRecord(remaining);
+            m_map_pos = m_map.size(); // report once
+        }
+        return false;
+    }
+
+    m_decoder.decode(m_map.data() + m_map_pos, p);
+    m_map_pos += m_record_bytes;
+    return true;
+}
+
+bool TonatiuhReader::NextDecompressedRecords()
+{
+    while (m_inflate_buf.size - m_inflate_pos < m_record_bytes) {
+        // Only the last buffer of a file can end in a partial record
+        const std::size_t remaining = m_inflate_buf.size - m_inflate_pos;
+        if (remaining != 0) ReportPartialRecord(remaining);
+        m_inflate_pos = 0;
+        if (!m_inflate->next(m_inflate_buf)) return false;
+    }
+    return true;
+}
+
+bool TonatiuhReader::ReadPhotonInfoFromDecompressor(PhotonInfo& p)
+{
+    if (!NextDecompressedRecords()) return false;
+    m_decoder.decode(m_inflate_buf.data + m_inflate_pos, p);
+    m_inflate_pos += m_record_bytes;
     return true;
-}
\ No newline at end of file
+}
+
+std::size_t TonatiuhReader::ReadBatchFromDecompressor(PhotonBlock& block)
+{
+    std::size_t added = 0;
+    while (block.size() < block.capacity() && NextDecompressedRecords()) {
+        const std::size_t records = std::min((m_inflate_buf.size - m_inflate_pos) / m_record_bytes,
+                                             block.capacity() - block.size());
+        Decode(m_inflate_buf.data + m_inflate_pos, records, block);
+        block.count += records;
+        m_inflate_pos += records * m_record_bytes;
+        added += records;
+    }
+    return added;
+}
+
+void TonatiuhReader::ReportPartialRecord(std::size_t bytes) const
+{
+    std::cerr << "Warning: ignoring " << bytes << " trailing byte(s) (partial photon record) in "
+              << m_directory_entry[m_file_number].path().string() << "\n";
+}
+
+bool TonatiuhReader::ReadPhotonBatch(PhotonBlock& block)
+{
+    block.clear();
+
+    if (m_cache.is_open()) {
+        // Photons ReadPhotonInfo read ahead but did not hand out come first
+        m_cache_pos -= m_cache_block.size() - m_cache_block_pos;
+        m_cache_block.clear();
+        m_cache_block_pos = 0;
+        const std::uint64_t left = m_cache.photonCount() - m_cache_pos;
+        const std::size_t count = static_cast<std::size_t>(std::min<std::uint64_t>(left, block.capacity()));
+        m_cache.read(m_cache_pos, count, block);
+        m_cache_pos += count;
+        return !block.empty();
+    }
+
+    if (m_backend == ReaderBackend::Async) {
+        while (block.size() < block.capacity() && NextAsyncRecords()) {
+            const std::size_t records = std::min((m_async_buf.size - m_async_pos) / m_record_bytes,
+                                                 block.capacity() - block.size());
+            Decode(m_async_buf.data + m_async_pos, records, block);
+            block.count += records;
+            m_async_pos += records * m_record_bytes;
+        }
+        return !block.empty();
+    }
+
+    if (m_first_photon) {
+        m_first_photon = false;
+        if (m_directory_entry.empty()) return false;
+        if (!OpenNextFile()) return false;
+    }
+
+    // Fill the block, crossing file boundaries as needed
+    while (block.size() < block.capacity()) {
+        const std::size_t added = m_inflate                           ? ReadBatchFromDecompressor(block)
+                                : (m_backend == ReaderBackend::Mmap) ? ReadBatchFromMapping(block)
+                                                                     : ReadBatchFromFile(block);
+        if (added > 0) continue;
+
+        if (m_file_number + 1 < m_directory_entry.size()) {
+            ++m_file_number;
+            if (!OpenNextFile()) break;
+            continue;
+        }
+
+        m_map.close();
+        m_map_pos = 0;
+        m_inflate.reset();
+        break;
+    }
+
+    return !block.empty();
+}
+
+void TonatiuhReader::Decode(const unsigned char* records, std::size_t count, PhotonBlock& block)
+{
+    if (!m_decode_time) {
+        m_decoder.decode(records, count, block, block.size());
+        return;
+    }
+    const StageStamp start = StageStamp::now();
+    m_decoder.decode(records, count, block, block.size());
+    m_decode_time->add(StageStamp::now() - start);
+}
+
+std::size_t TonatiuhReader::ReadBatchFromMapping(PhotonBlock& block)
+{
+    const std::size_t remaining = m_map.size() - m_map_pos;
+    const std::size_t records   = std::min(remaining / m_record_bytes, block.capacity() - block.size());
+
+    if (records == 0) {
+        if (remaining != 0) {
+            ReportPartialRecord(remaining);
+            m_map_pos = m_map.size(); // report once
+        }
+        return 0;
+    }
+
+    Decode(m_map.data() + m_map_pos, records, block);
+    block.count += records;
+    m_map_pos   += records * m_record_bytes;
+    return records;
+}
+
+std::size_t TonatiuhReader::ReadBatchFromFile(PhotonBlock& block)
+{
+    std::size_t wanted = block.capacity() - block.size();
+    if (m_stream_left != PhotonFileChunk::kToEndOfFile)
+        wanted = static_cast<std::size_t>(std::min<std::uint64_t>(wanted, m_stream_left / m_record_bytes));
+    if (wanted == 0) return 0;
+    m_batch_buf.resize(wanted * m_record_bytes);
+
+    m_ifs.read(reinterpret_cast<char*>(m_batch_buf.data()),
+               static_cast<std::streamsize>(m_batch_buf.size()));
+    const std::size_t bytes   = static_cast<std::size_t>(m_ifs.gcount());
+    const std::size_t records = bytes / m_record_bytes;
+    if (m_stream_left != PhotonFileChunk::kToEndOfFile) m_stream_left -= bytes;
+
+    if (bytes % m_record_bytes != 0)
+        ReportPartialRecord(bytes % m_record_bytes);
+    if (!m_ifs)
+        m_ifs.clear(m_ifs.rdstate() & std::ios::eofbit); // drop failbit on short read, keep EOF
+
+    Decode(m_batch_buf.data(), records, block);
+    block.count += records;
+    return records;
+}
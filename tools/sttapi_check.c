@@ -0,0 +1,239 @@
+/*
+ * Checks the C API of the shared sttanalytics library (include/sttanalytics.h)
+ * against a photon folder: two analyses running at the same time on threads
+ * that share one stt_surfaces must match a single-threaded baseline exactly;
+ * stt_options from callers with a shorter struct take defaults for the fields
+ * they lack; buffers that are too small give STT_ERROR_BUFFER with the size
+ * needed; and errors are reported per thread.
+ *
+ * Usage: sttapi_check <photon_folder_path>
+ * Exit status 0 when every check passes, 1 otherwise.
+ */
+
+#include "sttanalytics.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <pthread.h>
+#endif
+
+static int failures = 0;
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            fprintf(stderr, "FAIL %s:%d: %s (last error: \"%s\")\n", __FILE__, __LINE__, \
+                    #condition, stt_last_error());                                        \
+            ++failures;                                                                   \
+        }                                                                                 \
+    } while (0)
+
+/* One analysis of the folder and what it produced */
+typedef struct job
+{
+    const char*         folder;
+    const stt_surfaces* surfaces;
+    stt_options         options;
+    size_t              cells;
+    uint64_t*           counts;
+    double*             power;
+    stt_totals          totals;
+    stt_status          status;
+    int                 errorWasEmpty;   /* stt_last_error() was "" when the thread started */
+} job;
+
+static stt_status runJob(job* j)
+{
+    stt_analysis* analysis = NULL;
+    stt_status status = stt_analysis_open(j->folder, j->surfaces, &j->options, &analysis);
+    if (status == STT_OK) status = stt_analysis_run(analysis);
+    if (status == STT_OK) status = stt_analysis_counts(analysis, j->counts, j->cells, NULL);
+    if (status == STT_OK) status = stt_analysis_power(analysis, j->power, j->cells, NULL);
+    if (status == STT_OK) status = stt_analysis_totals(analysis, &j->totals);
+    if (status != STT_OK) fprintf(stderr, "Analysis failed: %s\n", stt_last_error());
+    stt_analysis_close(analysis);
+    return status;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI jobThread(LPVOID argument)
+#else
+static void* jobThread(void* argument)
+#endif
+{
+    job* j = (job*)argument;
+    j->errorWasEmpty = stt_last_error()[0] == '\0';
+    j->status = runJob(j);
+    return 0;
+}
+
+static int startJob(job* j, void** handle)
+{
+#ifdef _WIN32
+    *handle = CreateThread(NULL, 0, jobThread, j, 0, NULL);
+    return *handle != NULL;
+#else
+    pthread_t* thread = (pthread_t*)malloc(sizeof(pthread_t));
+    if (!thread || pthread_create(thread, NULL, jobThread, j) != 0) {
+        free(thread);
+        return 0;
+    }
+    *handle = thread;
+    return 1;
+#endif
+}
+
+static void joinJob(void* handle)
+{
+#ifdef _WIN32
+    WaitForSingleObject((HANDLE)handle, INFINITE);
+    CloseHandle((HANDLE)handle);
+#else
+    pthread_join(*(pthread_t*)handle, NULL);
+    free(handle);
+#endif
+}
+
+static void initJob(job* j, const char* folder, const stt_surfaces* surfaces, size_t cells)
+{
+    memset(j, 0, sizeof *j);
+    j->folder   = folder;
+    j->surfaces = surfaces;
+    stt_options_init(&j->options);
+    j->options.use_cache = 0;
+    j->cells  = cells;
+    j->counts = (uint64_t*)calloc(cells, sizeof(uint64_t));
+    j->power  = (double*)calloc(cells, sizeof(double));
+}
+
+static void freeJob(job* j)
+{
+    free(j->counts);
+    free(j->power);
+}
+
+static int sameResult(const job* a, const job* b)
+{
+    return memcmp(a->counts, b->counts, a->cells * sizeof(uint64_t)) == 0 &&
+           memcmp(a->power, b->power, a->cells * sizeof(double)) == 0 &&
+           memcmp(&a->totals, &b->totals, sizeof(stt_totals)) == 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: sttapi_check <photon_folder_path>\n");
+        return 64;
+    }
+    const char* folder = argv[1];
+    CHECK(stt_api_version() == STT_API_VERSION);
+
+    stt_surfaces* surfaces = NULL;
+    if (stt_surfaces_open(folder, &surfaces) != STT_OK) {
+        fprintf(stderr, "Cannot open the surfaces of %s: %s\n", folder, stt_last_error());
+        return 1;
+    }
+    const size_t heliostats = stt_surfaces_heliostat_count(surfaces);
+    const size_t receivers  = stt_surfaces_receiver_count(surfaces);
+    const size_t cells      = heliostats * receivers;
+    CHECK(cells > 0);
+    if (cells == 0) return 1;
+
+    /* Baseline: one analysis, one worker, whole files */
+    job baseline;
+    initJob(&baseline, folder, surfaces, cells);
+    baseline.options.threads     = 1;
+    baseline.options.chunk_bytes = 0;
+    CHECK(runJob(&baseline) == STT_OK);
+    CHECK(baseline.totals.counted > 0);
+
+    /* An error on this thread is not seen by the others */
+    stt_analysis* none = NULL;
+    CHECK(stt_analysis_open(NULL, surfaces, NULL, &none) == STT_ERROR_ARGUMENT);
+    CHECK(stt_last_error()[0] != '\0');
+
+    /* Two analyses at once on one stt_surfaces, each with its own workers,
+     * chunking and reader */
+    job jobs[2];
+    void* threads[2] = { NULL, NULL };
+    for (int i = 0; i < 2; ++i) initJob(&jobs[i], folder, surfaces, cells);
+    jobs[0].options.threads     = 2;
+    jobs[0].options.chunk_bytes = 1u << 20;
+    jobs[0].options.reader      = STT_READER_STREAM;
+    jobs[1].options.threads     = 3;
+    jobs[1].options.chunk_bytes = 3u << 19;
+    jobs[1].options.reader      = STT_READER_ASYNC;
+    for (int i = 0; i < 2; ++i) CHECK(startJob(&jobs[i], &threads[i]));
+    for (int i = 0; i < 2; ++i) {
+        if (!threads[i]) continue;
+        joinJob(threads[i]);
+        CHECK(jobs[i].status == STT_OK);
+        CHECK(jobs[i].errorWasEmpty);
+        CHECK(sameResult(&jobs[i], &baseline));
+    }
+    for (int i = 0; i < 2; ++i) freeJob(&jobs[i]);
+
+    /* A caller built against an older, shorter stt_options: the fields past its
+     * size are not read (here power_per_photon, which would scale the power) */
+    job older;
+    initJob(&older, folder, surfaces, cells);
+    older.options.size             = offsetof(stt_options, verbose);
+    older.options.power_per_photon = 2.0 * stt_surfaces_power_per_photon(surfaces);
+    CHECK(runJob(&older) == STT_OK);
+    CHECK(sameResult(&older, &baseline));
+    freeJob(&older);
+
+    /* ... and one that never called stt_options_init() */
+    stt_options uninitialised;
+    memset(&uninitialised, 0, sizeof uninitialised);
+    CHECK(stt_analysis_open(folder, surfaces, &uninitialised, &none) == STT_ERROR_ARGUMENT);
+
+    /* Buffers too small: STT_ERROR_BUFFER and the size needed */
+    stt_analysis* analysis = NULL;
+    CHECK(stt_analysis_open(folder, surfaces, NULL, &analysis) == STT_OK);
+    if (analysis) {
+        size_t needed = 0;
+        double* power = (double*)calloc(cells, sizeof(double));
+        CHECK(stt_analysis_power(analysis, power, cells, &needed) == STT_ERROR_NO_RESULT);
+        CHECK(stt_analysis_run(analysis) == STT_OK);
+        CHECK(stt_analysis_power(analysis, NULL, 0, &needed) == STT_ERROR_BUFFER);
+        CHECK(needed == cells);
+        needed = 0;
+        CHECK(stt_analysis_counts(analysis, (uint64_t*)power, cells - 1, &needed) == STT_ERROR_BUFFER);
+        CHECK(needed == cells);
+        CHECK(stt_analysis_power(analysis, power, cells, &needed) == STT_OK);
+        CHECK(memcmp(power, baseline.power, cells * sizeof(double)) == 0);
+        free(power);
+        stt_analysis_close(analysis);
+    }
+
+    size_t length = 0;
+    char name[256];
+    CHECK(stt_surfaces_heliostat_name(surfaces, 0, name, sizeof name, &length) == STT_OK);
+    CHECK(length == strlen(name) && length > 0);
+    if (length > 0 && length < sizeof name) {
+        size_t reported = 0;
+        CHECK(stt_surfaces_heliostat_name(surfaces, 0, name, length, &reported) == STT_ERROR_BUFFER);
+        CHECK(reported == length);
+        CHECK(stt_surfaces_heliostat_name(surfaces, 0, name, length + 1, &reported) == STT_OK);
+    }
+    CHECK(stt_surfaces_receiver_name(surfaces, receivers, name, sizeof name, NULL) == STT_ERROR_ARGUMENT);
+
+    freeJob(&baseline);
+    stt_surfaces_close(surfaces);
+
+    if (failures != 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("C API: %zu x %zu matrix, %llu rays counted; all checks passed\n", heliostats, receivers,
+           (unsigned long long)baseline.totals.counted);
+    return 0;
+}
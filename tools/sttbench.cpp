@@ -0,0 +1,371 @@
+// sttbench: micro and end-to-end benchmarks of the processing stages over a photon
+// folder (typically one written by sttgen). Each stage reports the best of
+// --repeat runs in photons/s and GB/s of raw record data; stages that must agree
+// with each other are cross-checked and a mismatch fails the run.
+
+#include "MappedFile.h"
+#include "ParametersFileReader.h"
+#include "PhotonDecode.h"
+#include "PhotonProcessor.h"
+#include "RayAccumulator.h"
+#include "RayPipeline.h"
+#include "SurfaceMap.h"
+#include "tonatiuhreader.h"
+#include "WorkStealingPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <streambuf>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#  include <process.h>
+#else
+#  include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct BenchOptions
+{
+    unsigned      repeat  = 3;
+    unsigned      threads = 0;         // end-to-end worker threads; 0 = all hardware threads
+    std::uint64_t maxInMemoryPhotons = 16u << 20; // cap for the stages that pre-load photons
+    double        minPhotonsPerSec = 0; // end-to-end floor; 0 = report only
+    std::string   only;                 // run only stages whose name starts with this
+};
+
+long processId()
+{
+#ifdef _WIN32
+    return static_cast<long>(_getpid());
+#else
+    return static_cast<long>(getpid());
+#endif
+}
+
+void printUsage()
+{
+    std::cerr << "Usage: sttbench <photon_folder_path> [options]\n"
+                 "Options:\n"
+                 "  --repeat N                 runs per stage, best one is reported (default: 3)\n"
+                 "  --threads N                end-to-end worker threads (default: 0 = all cores)\n"
+                 "  --max-photons N            photons pre-loaded for the in-memory stages (default: 16Mi)\n"
+                 "  --only PREFIX              run only the stages whose name starts with PREFIX\n"
+                 "  --min-photons-per-sec X    fail when end-to-end throughput is below X\n";
+}
+
+bool parseCount(const std::string& text, std::uint64_t& out)
+{
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) return false;
+    try {
+        out = std::stoull(text);
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Swallows the progress output of the library while a stage is timed.
+class QuietCout
+{
+public:
+    QuietCout() : m_saved(std::cout.rdbuf(&m_null)) {}
+    ~QuietCout() { std::cout.rdbuf(m_saved); }
+
+private:
+    struct NullBuffer : std::streambuf
+    {
+        int overflow(int c) override { return c; }
+    };
+    NullBuffer m_null;
+    std::streambuf* m_saved;
+};
+
+// Best wall time of `repeat` runs of fn, in seconds.
+double bestOf(unsigned repeat, const std::function<void()>& fn)
+{
+    double best = std::numeric_limits<double>::max();
+    for (unsigned i = 0; i < std::max(1u, repeat); ++i)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        fn();
+        const auto t1 = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+    }
+    return best;
+}
+
+std::size_t recordBytes = kPhotonRecordSize; // of the folder's photon layout
+
+void report(const std::string& stage, std::uint64_t items, double seconds, const char* unit = "photons")
+{
+    const double rate = static_cast<double>(items) / seconds;
+    std::cout << std::left << std::setw(22) << stage << std::right
+              << std::setw(12) << std::fixed << std::setprecision(2) << seconds * 1e3 << " ms"
+              << std::setw(12) << std::setprecision(1) << rate / 1e6 << " M" << unit << "/s";
+    if (std::strcmp(unit, "photons") == 0)
+        std::cout << std::setw(10) << std::setprecision(2)
+                  << rate * recordBytes / 1e9 << " GB/s";
+    std::cout << "\n";
+}
+
+bool sameBlock(const PhotonBlock& a, const PhotonBlock& b, std::size_t n)
+{
+    auto same = [n](const auto& u, const auto& v) {
+        return std::memcmp(u.data(), v.data(), n * sizeof(u[0])) == 0;
+    };
+    return same(a.id, b.id) && same(a.x, b.x) && same(a.y, b.y) && same(a.z, b.z) &&
+           same(a.side, b.side) && same(a.previous_id, b.previous_id) &&
+           same(a.next_id, b.next_id) && same(a.surface_id, b.surface_id);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    BenchOptions o;
+    std::string folderArg;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        std::uint64_t n = 0;
+        if (arg == "--repeat" && i + 1 < argc && parseCount(argv[i + 1], n) && n > 0) {
+            o.repeat = static_cast<unsigned>(n); ++i;
+        } else if (arg == "--threads" && i + 1 < argc && parseCount(argv[i + 1], n)) {
+            o.threads = static_cast<unsigned>(n); ++i;
+        } else if (arg == "--max-photons" && i + 1 < argc && parseCount(argv[i + 1], n) && n > 0) {
+            o.maxInMemoryPhotons = n; ++i;
+        } else if (arg == "--only" && i + 1 < argc) {
+            o.only = argv[++i];
+        } else if (arg == "--min-photons-per-sec" && i + 1 < argc) {
+            try { o.minPhotonsPerSec = std::stod(argv[++i]); }
+            catch (const std::exception&) { printUsage(); return 64; }
+        } else if (arg.rfind("--", 0) == 0 || !folderArg.empty()) {
+            printUsage();
+            return 64; // EX_USAGE
+        } else {
+            folderArg = arg;
+        }
+    }
+    if (folderArg.empty()) {
+        printUsage();
+        return 64; // EX_USAGE
+    }
+
+    auto enabled = [&o](const std::string& stage) { return stage.rfind(o.only, 0) == 0; };
+    int failures = 0;
+    auto fail = [&failures](const std::string& what) {
+        std::cerr << "FAILED: " << what << "\n";
+        ++failures;
+    };
+
+    try
+    {
+        const fs::path folder(folderArg);
+        const std::vector<fs::directory_entry> files = TonatiuhReader::ListPhotonFiles(folder);
+        if (files.empty()) {
+            std::cerr << "Error: no photon data files (photons_*.dat) found in " << folderArg << "\n";
+            return 66; // EX_NOINPUT
+        }
+
+        ParametersFileReader parameters(folderArg);
+        const double tParams = bestOf(o.repeat, [&] { QuietCout q; parameters.read(); });
+        const std::size_t surfaceCount = parameters.getSurfaces().size();
+        const SurfaceMap surfaceMap(parameters.getSurfaces());
+        const double tSurfaceMap = bestOf(o.repeat, [&] { SurfaceMap m(parameters.getSurfaces()); });
+
+        PhotonLayout layout = parameters.getLayout();
+        layout.setByteOrder(TonatiuhReader::DetectByteOrder(files, layout));
+        if (layout.byteOrder() == ByteOrder::Unknown) layout.setByteOrder(ByteOrder::Big);
+        const PhotonDecoder decoder(layout);
+        const bool standardLayout = layout == PhotonLayout(); // what the scalar reference decodes
+        recordBytes = layout.recordBytes();
+
+        std::uint64_t fileBytes = 0;
+        for (const auto& f : files) fileBytes += f.file_size();
+        std::cout << "Folder: " << folderArg << "  (" << files.size() << " files, "
+                  << fileBytes / recordBytes << " photons, "
+                  << surfaceMap.getHeliostatLabels().size() << " heliostats, "
+                  << surfaceMap.getReceiverLabels().size() << " receivers)\n";
+        if (!standardLayout) std::cout << "Records: " << layout.describe() << "\n";
+        std::cout << "Decoder: "
+                  << (!decoder.isSpecialised() ? "generic" : decoder.isVectorized() ? "specialised SIMD"
+                                                                                     : "specialised scalar")
+                  << ", hardware threads: " << std::thread::hardware_concurrency() << "\n\n";
+
+        report("parameters", surfaceCount, tParams, "surfaces");
+        report("surface-map", surfaceCount, tSurfaceMap, "surfaces");
+
+        // Raw records of the leading files, up to the in-memory cap
+        std::vector<unsigned char> raw;
+        for (const auto& f : files)
+        {
+            const std::uint64_t room = o.maxInMemoryPhotons * recordBytes - raw.size();
+            if (room < recordBytes) break;
+            MappedFile map;
+            if (!map.open(f.path())) continue;
+            const std::size_t take = static_cast<std::size_t>(
+                std::min<std::uint64_t>(map.size() / recordBytes * recordBytes, room / recordBytes * recordBytes));
+            raw.insert(raw.end(), map.data(), map.data() + take);
+        }
+        const std::size_t rawPhotons = raw.size() / recordBytes;
+
+        // Decode: scalar reference vs the dispatched (SIMD) path, block by block; other
+        // layouts have no reference and go through their own decoder only
+        std::vector<PhotonBlock> blocks;
+        for (std::size_t first = 0; first < rawPhotons; first += PhotonBlock::kDefaultCapacity)
+        {
+            blocks.emplace_back();
+            blocks.back().count = std::min(PhotonBlock::kDefaultCapacity, rawPhotons - first);
+        }
+        if (enabled("decode"))
+        {
+            auto decodeAll = [&](bool scalar) {
+                for (std::size_t b = 0; b < blocks.size(); ++b) {
+                    const unsigned char* src = raw.data() + b * PhotonBlock::kDefaultCapacity * recordBytes;
+                    if (scalar) decodePhotonRecordsScalar(src, blocks[b].count, blocks[b], 0);
+                    else        decoder.decode(src, blocks[b].count, blocks[b], 0);
+                }
+            };
+            if (standardLayout) report("decode-scalar", rawPhotons, bestOf(o.repeat, [&] { decodeAll(true); }));
+            std::vector<PhotonBlock> reference = blocks;
+            report("decode", rawPhotons, bestOf(o.repeat, [&] { decodeAll(false); }));
+            for (std::size_t b = 0; standardLayout && b < blocks.size(); ++b)
+                if (!sameBlock(blocks[b], reference[b], blocks[b].count)) {
+                    fail("SIMD decode differs from scalar decode in block " + std::to_string(b));
+                    break;
+                }
+        }
+        else
+        {
+            for (std::size_t b = 0; b < blocks.size(); ++b)
+                decoder.decode(raw.data() + b * PhotonBlock::kDefaultCapacity * recordBytes, blocks[b].count, blocks[b], 0);
+        }
+
+        // SurfaceMap lookups: dense indices vs the name-based classification they replaced
+        if (enabled("lookup"))
+        {
+            std::uint64_t denseHits = 0, nameHits = 0;
+            const double tDense = bestOf(o.repeat, [&] {
+                denseHits = 0;
+                for (const PhotonBlock& block : blocks)
+                    for (std::size_t i = 0; i < block.count; ++i)
+                        denseHits += (surfaceMap.heliostatIndex(block.surface_id[i]) != SurfaceMap::kNoIndex) +
+                                     (surfaceMap.receiverIndex(block.surface_id[i])  != SurfaceMap::kNoIndex);
+            });
+            const double tNames = bestOf(o.repeat, [&] {
+                nameHits = 0;
+                for (const PhotonBlock& block : blocks)
+                    for (std::size_t i = 0; i < block.count; ++i) {
+                        const std::uint64_t s = block.surface_id[i];
+                        if (surfaceMap.isHeliostat(s)) nameHits += !surfaceMap.getHeliostatName(s).empty();
+                        if (surfaceMap.isReceiver(s))  nameHits += !surfaceMap.getReceiverName(s).empty();
+                    }
+            });
+            report("lookup-dense", rawPhotons, tDense, "lookups");
+            report("lookup-names", rawPhotons, tNames, "lookups");
+            if (denseHits != nameHits) fail("dense surface index disagrees with the name maps");
+        }
+
+        // Accumulation over pre-decoded blocks (no I/O, no decode)
+        RayAccumulator inMemory(surfaceMap);
+        if (enabled("accumulate"))
+        {
+            const double t = bestOf(o.repeat, [&] {
+                inMemory = RayAccumulator(surfaceMap);
+                ProgressCounter progress;
+                std::size_t next = 0;
+                QuietCout q;
+                // Blocks are lent by swapping (O(1)) and given back on the next call
+                streamRays([&](PhotonBlock& block) {
+                               if (next > 0) std::swap(block, blocks[next - 1]);
+                               if (next == blocks.size()) return false;
+                               std::swap(block, blocks[next++]);
+                               return true;
+                           }, inMemory, {}, {}, progress);
+            });
+            report("accumulate", rawPhotons, t);
+        }
+
+        // Reader throughput per backend, whole folder, cache bypassed
+        std::uint64_t readerPhotons = 0;
+        for (const ReaderBackend backend : { ReaderBackend::Stream, ReaderBackend::Mmap, ReaderBackend::Async })
+        {
+            const std::string stage = std::string("read-") + readerBackendName(backend);
+            if (!enabled(stage)) continue;
+            std::uint64_t photons = 0;
+            ReaderBackend used = backend;
+            const double t = bestOf(o.repeat, [&] {
+                QuietCout q;
+                TonatiuhReader reader(folder, backend, /*use_cache=*/false);
+                reader.SetLayout(layout);
+                used = reader.Backend();
+                PhotonBlock block;
+                photons = 0;
+                while (reader.ReadPhotonBatch(block)) photons += block.size();
+            });
+            // Compressed files turn async into mmap; label what was measured
+            report(used == backend ? stage : stage + "->" + readerBackendName(used), photons, t);
+            if (readerPhotons != 0 && photons != readerPhotons)
+                fail(stage + " read " + std::to_string(photons) + " photons, expected " + std::to_string(readerPhotons));
+            readerPhotons = photons;
+        }
+
+        // End to end: single thread vs --threads, results must match exactly
+        ProcessingOptions options;
+        options.useCache = false;
+        options.layout   = layout;
+        PhotonProcessor single(folderArg, surfaceMap, parameters.getPowerPerPhoton(), options);
+        options.threads = o.threads;
+        PhotonProcessor parallel(folderArg, surfaceMap, parameters.getPowerPerPhoton(), options);
+        if (enabled("end-to-end"))
+        {
+            const double t1 = bestOf(o.repeat, [&] { QuietCout q; single.run(); });
+            const double tn = bestOf(o.repeat, [&] { QuietCout q; parallel.run(); });
+            const std::uint64_t photons = single.result()->photons;
+            report("end-to-end-1", photons, t1);
+            report("end-to-end-" + std::to_string(WorkStealingPool(o.threads).threadCount()), photons, tn);
+
+            if (single.result()->photonCounts != parallel.result()->photonCounts ||
+                single.result()->photons != parallel.result()->photons)
+                fail("multi-threaded result differs from the single-threaded one");
+            if (o.minPhotonsPerSec > 0 && static_cast<double>(photons) / tn < o.minPhotonsPerSec)
+                fail("end-to-end throughput below --min-photons-per-sec");
+        }
+
+        if (enabled("csv"))
+        {
+            if (!parallel.result()) { QuietCout q; parallel.run(); }
+            // Named per process, so that benchmarks running side by side do not share it
+            const fs::path csv = fs::temp_directory_path() / ("sttbench_" + std::to_string(processId()) + ".csv");
+            bool ok = true;
+            const double t = bestOf(o.repeat, [&] { ok = parallel.writeCsv(csv.string()) && ok; });
+            std::error_code ec;
+            fs::remove(csv, ec);
+            report("csv", surfaceMap.getHeliostatLabels().size(), t, "rows");
+            if (!ok) fail("could not write " + csv.string());
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        std::cerr << "Error: " << ex.what() << "\n";
+        return 1;
+    }
+
+    if (failures) return 1;
+    std::cout << "\nAll checks passed.\n";
+    return 0;
+}
@@ -0,0 +1,486 @@
+// sttd: keeps photon folders warm for interactive use. Listens on a Unix domain
+// socket and answers the requests of AnalysisService (matrix and flux queries,
+// status, forget; one per line) for up to --max-clients clients at once (more
+// wait to be accepted): requests that arrive while a pass runs are answered
+// together in the next one, on a single worker pool.
+//
+// Each request line gets "OK <bytes>\n" followed by that many bytes of result,
+// or "ERROR <message>\n".
+
+#include "AnalysisService.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr std::size_t kMaxRequestBytes = 64 * 1024;
+constexpr std::uint64_t kDefaultMaxClients = 64;
+
+void printUsage()
+{
+    std::cerr << "Usage: sttd [options] <socket_path>\n"
+                 "       sttd --query <socket_path> <request>...\n"
+                 "Serves matrix and flux queries on photon folders over a Unix domain socket,\n"
+                 "keeping parsed parameters, photon caches and results between queries.\n"
+                 "Requests (one per line; FOLDER is the rest of the line):\n"
+                 "  matrix [--standard-errors] FOLDER\n"
+                 "  flux --flux-range U0:U1,V0:V1 [--flux-plane xy|xz|yz] [--flux-bins NUxNV]\n"
+                 "       [--flux-per-heliostat] [--binary] FOLDER\n"
+                 "  status\n"
+                 "  forget FOLDER\n"
+                 "Options:\n"
+                 "  --threads N            worker threads shared by all queries (default: 0 = all cores)\n"
+                 "  --memory-mb N          memory for what is kept between queries (default: 1024)\n"
+                 "  --dataset-dir DIR      build photon caches of folders queried again in DIR\n"
+                 "                         (default: only use the folders' own photons_cache.sttc)\n"
+                 "  --reader stream|mmap|async\n"
+                 "                         photon file backend (default: mmap)\n"
+                 "  --chunk-mb N           chunk size of the worker tasks (default: 64)\n"
+                 "  --max-clients N        connections served at once; more wait to be accepted\n"
+                 "                         (default: 64)\n"
+                 "  --query                send one request (the remaining arguments) and print\n"
+                 "                         the reply\n";
+}
+
+// Parses a non-negative decimal integer; false on junk or overflow.
+bool parseCount(const std::string& text, std::uint64_t& out)
+{
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) return false;
+    try {
+        out = std::stoull(text);
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int)
+{
+    stopRequested = 1;
+}
+
+bool sendAll(int fd, const char* data, std::size_t size)
+{
+    while (size > 0) {
+        const ssize_t sent = ::send(fd, data, size, 0);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        size -= static_cast<std::size_t>(sent);
+    }
+    return true;
+}
+
+bool sendAll(int fd, const std::string& text)
+{
+    return sendAll(fd, text.data(), text.size());
+}
+
+bool socketAddress(const std::string& path, sockaddr_un& address)
+{
+    address = sockaddr_un{};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) return false;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// A connected socket, or -1
+int connectTo(const std::string& path)
+{
+    sockaddr_un address;
+    if (!socketAddress(path, address)) return -1;
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Hands the requests of all clients to the service from one thread, in batches
+// of whatever arrived while the previous batch was answered
+class Dispatcher
+{
+public:
+    explicit Dispatcher(AnalysisService& service) : m_service(service), m_thread([this] { loop(); }) {}
+
+    ~Dispatcher() { stop(); }
+
+    std::future<AnalysisService::Reply> submit(std::string request)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(Job{ std::move(request), {} });
+        std::future<AnalysisService::Reply> reply = m_jobs.back().reply.get_future();
+        m_wake.notify_one();
+        return reply;
+    }
+
+    // Answers what is queued, then returns
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_wake.notify_one();
+        if (m_thread.joinable()) m_thread.join();
+    }
+
+private:
+    struct Job
+    {
+        std::string request;
+        std::promise<AnalysisService::Reply> reply;
+    };
+
+    void loop()
+    {
+        for (;;) {
+            std::deque<Job> jobs;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+                if (m_jobs.empty()) return;
+                jobs.swap(m_jobs);
+            }
+
+            std::vector<std::string> requests;
+            for (const Job& job : jobs) requests.push_back(job.request);
+            std::vector<AnalysisService::Reply> replies;
+            try {
+                replies = m_service.answer(requests);
+            } catch (const std::exception& ex) {
+                replies.assign(jobs.size(), AnalysisService::Reply{ false, ex.what() });
+            }
+            for (std::size_t j = 0; j < jobs.size(); ++j) jobs[j].reply.set_value(std::move(replies[j]));
+        }
+    }
+
+    AnalysisService&        m_service;
+    std::mutex              m_mutex;
+    std::condition_variable m_wake;
+    std::deque<Job>         m_jobs;
+    bool                    m_stopping = false;
+    std::thread             m_thread;
+};
+
+// The client connections, each served by a thread of its own: at most `limit`
+// at once, and every thread is joined
+class Clients
+{
+public:
+    explicit Clients(std::size_t limit) : m_limit(std::max<std::size_t>(limit, 1)) {}
+
+    ~Clients() { closeAll(); }
+
+    // Joins the threads of closed connections, then waits up to `timeout` for
+    // fewer than the limit to be open; false if they still are not
+    bool waitForSlot(std::chrono::milliseconds timeout)
+    {
+        joinFinished();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_changed.wait_for(lock, timeout, [this] { return m_open.size() < m_limit; });
+    }
+
+    // Calls serve(fd) on a new thread and closes fd after it
+    void start(int fd, const std::function<void(int)>& serve)
+    {
+        // Held until the thread is listed, which its end needs
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_open.emplace(fd, std::thread([this, fd, serve] {
+            serve(fd);
+            finish(fd);
+        }));
+    }
+
+    // Ends every connection and joins every thread
+    void closeAll()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            for (const auto& client : m_open) ::shutdown(client.first, SHUT_RDWR);
+            m_changed.wait(lock, [this] { return m_open.empty(); });
+        }
+        joinFinished();
+    }
+
+private:
+    void finish(int fd)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ::close(fd);
+        const auto it = m_open.find(fd);
+        m_finished.push_back(std::move(it->second));
+        m_open.erase(it);
+        m_changed.notify_all();
+    }
+
+    void joinFinished()
+    {
+        std::vector<std::thread> finished;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            finished.swap(m_finished);
+        }
+        for (std::thread& thread : finished) thread.join();
+    }
+
+    std::size_t                m_limit;
+    std::mutex                 m_mutex;
+    std::condition_variable    m_changed;
+    std::map<int, std::thread> m_open;       // by socket
+    std::vector<std::thread>   m_finished;   // ended, not joined yet
+};
+
+// Answers the requests of one connection in order until it closes
+void serveClient(int fd, Dispatcher& dispatcher)
+{
+    std::string buffer;
+    char chunk[4096];
+    bool open = true;
+    while (open || !buffer.empty())
+    {
+        std::size_t newline;
+        while (open && (newline = buffer.find('\n')) == std::string::npos) {
+            if (buffer.size() > kMaxRequestBytes) {
+                sendAll(fd, "ERROR Request too long\n");
+                return;
+            }
+            const ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) open = false;
+            else buffer.append(chunk, static_cast<std::size_t>(n));
+        }
+
+        // The last request may end without a newline
+        newline = buffer.find('\n');
+        std::string request = buffer.substr(0, newline);
+        buffer.erase(0, newline == std::string::npos ? buffer.size() : newline + 1);
+        if (!request.empty() && request.back() == '\r') request.pop_back();
+        if (request.find_first_not_of(" \t") == std::string::npos) continue;
+
+        const AnalysisService::Reply reply = dispatcher.submit(std::move(request)).get();
+        if (reply.ok) {
+            if (!sendAll(fd, "OK " + std::to_string(reply.body.size()) + "\n") || !sendAll(fd, reply.body)) return;
+        } else {
+            std::string message = reply.body;
+            for (char& ch : message)
+                if (ch == '\n' || ch == '\r') ch = ' ';
+            if (!sendAll(fd, "ERROR " + message + "\n")) return;
+        }
+    }
+}
+
+int serve(const std::string& socketPath, const ServiceOptions& options, std::size_t maxClients)
+{
+    sockaddr_un address;
+    if (!socketAddress(socketPath, address)) {
+        std::cerr << "Error: socket path \"" << socketPath << "\" is empty or too long.\n";
+        return 64; // EX_USAGE
+    }
+
+    // A socket left behind by a daemon that is gone is replaced; a live one is not
+    struct stat info;
+    if (::lstat(socketPath.c_str(), &info) == 0) {
+        if (!S_ISSOCK(info.st_mode)) {
+            std::cerr << "Error: " << socketPath << " exists and is not a socket.\n";
+            return 73; // EX_CANTCREAT
+        }
+        const int probe = connectTo(socketPath);
+        if (probe >= 0) {
+            ::close(probe);
+            std::cerr << "Error: another sttd is serving on " << socketPath << ".\n";
+            return 69; // EX_UNAVAILABLE
+        }
+        ::unlink(socketPath.c_str());
+    }
+
+    const int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || ::bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(listener, 64) != 0) {
+        std::cerr << "Error: cannot listen on " << socketPath << ": " << std::strerror(errno) << "\n";
+        if (listener >= 0) ::close(listener);
+        return 73; // EX_CANTCREAT
+    }
+
+    std::signal(SIGINT, requestStop);
+    std::signal(SIGTERM, requestStop);
+    std::signal(SIGPIPE, SIG_IGN); // a client that hangs up is noticed by send()
+
+    int status = 0;
+    try
+    {
+        AnalysisService service(options);
+        Dispatcher dispatcher(service);
+        Clients clients(maxClients);
+        std::cout << "sttd: serving on " << socketPath << " (memory budget " << (options.memoryBytes >> 20)
+                  << " MiB)" << std::endl;
+
+        while (!stopRequested) {
+            if (!clients.waitForSlot(std::chrono::milliseconds(200))) continue;
+            pollfd ready{ listener, POLLIN, 0 };
+            if (::poll(&ready, 1, 200) <= 0) continue;
+            const int fd = ::accept(listener, nullptr, nullptr);
+            if (fd < 0) continue;
+            clients.start(fd, [&dispatcher](int client) { serveClient(client, dispatcher); });
+        }
+
+        ::close(listener);
+        ::unlink(socketPath.c_str());
+        clients.closeAll();
+        dispatcher.stop();
+    }
+    catch (const std::exception& ex)
+    {
+        std::cerr << "Exception: " << ex.what() << '\n';
+        ::close(listener);
+        ::unlink(socketPath.c_str());
+        status = 1;
+    }
+    std::cout << "sttd: stopped" << std::endl;
+    return status;
+}
+
+// Sends one request and copies the reply to stdout
+int query(const std::string& socketPath, const std::string& request)
+{
+    const int fd = connectTo(socketPath);
+    if (fd < 0) {
+        std::cerr << "Error: cannot connect to " << socketPath << ": " << std::strerror(errno) << "\n";
+        return 69; // EX_UNAVAILABLE
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::string reply;
+    if (sendAll(fd, request + "\n")) {
+        ::shutdown(fd, SHUT_WR);
+        char chunk[65536];
+        for (;;) {
+            const ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            reply.append(chunk, static_cast<std::size_t>(n));
+        }
+    }
+    ::close(fd);
+
+    const std::size_t newline = reply.find('\n');
+    if (newline == std::string::npos) {
+        std::cerr << "Error: no reply from " << socketPath << "\n";
+        return 1;
+    }
+    const std::string header = reply.substr(0, newline);
+    if (header.compare(0, 3, "OK ") != 0) {
+        std::cerr << "Error: " << (header.compare(0, 6, "ERROR ") == 0 ? header.substr(6) : header) << "\n";
+        return 1;
+    }
+    std::cout.write(reply.data() + newline + 1, static_cast<std::streamsize>(reply.size() - newline - 1));
+    return std::cout ? 0 : 1;
+}
+
+int invalidValue(const std::string& option, const std::string& value)
+{
+    std::cerr << "Error: invalid value \"" << value << "\" for " << option << ".\n";
+    printUsage();
+    return 64; // EX_USAGE
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    if (argc >= 4 && std::string(argv[1]) == "--query") {
+        std::string request;
+        for (int i = 3; i < argc; ++i) request += (i > 3 ? " " : "") + std::string(argv[i]);
+        return query(argv[2], request);
+    }
+
+    ServiceOptions options;
+    std::uint64_t maxClients = kDefaultMaxClients;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        std::uint64_t n = 0;
+        if (arg == "--threads" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n)) return invalidValue(arg, argv[i]);
+            options.threads = static_cast<unsigned>(n);
+        }
+        else if (arg == "--memory-mb" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n) || n == 0) return invalidValue(arg, argv[i]);
+            options.memoryBytes = n << 20;
+        }
+        else if (arg == "--dataset-dir" && i + 1 < argc)
+        {
+            options.datasetDirectory = argv[++i];
+        }
+        else if (arg == "--reader" && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            if (value == "stream")      options.readerBackend = ReaderBackend::Stream;
+            else if (value == "mmap")   options.readerBackend = ReaderBackend::Mmap;
+            else if (value == "async")  options.readerBackend = ReaderBackend::Async;
+            else return invalidValue(arg, value);
+        }
+        else if (arg == "--chunk-mb" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n)) return invalidValue(arg, argv[i]);
+            options.chunkBytes = n << 20;
+        }
+        else if (arg == "--max-clients" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], n) || n == 0) return invalidValue(arg, argv[i]);
+            maxClients = n;
+        }
+        else if (arg == "-h" || arg == "--help")
+        {
+            printUsage();
+            return 0;
+        }
+        else if (!arg.empty() && arg[0] == '-')
+        {
+            std::cerr << "Error: unknown or incomplete option \"" << arg << "\".\n";
+            printUsage();
+            return 64; // EX_USAGE
+        }
+        else
+        {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() != 1) {
+        printUsage();
+        return 64; // EX_USAGE
+    }
+    return serve(positional[0], options, static_cast<std::size_t>(maxClients));
+}
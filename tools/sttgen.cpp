@@ -0,0 +1,337 @@
+// sttgen: writes a synthetic Tonatiuh++ photon folder (photons_parameters.txt plus
+// big-endian photons_N.dat files) with a configurable field size, ray lengths and
+// spillage. Records hold all eight fields unless --fields selects fewer. Output is
+// deterministic for a given seed.
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Record fields in the standard order, as the parameters file names them
+const char* const kFieldNames[8] = { "id", "x", "y", "z", "side", "previous ID", "next ID", "surface ID" };
+
+struct GeneratorOptions
+{
+    std::uint64_t heliostats = 100;
+    std::uint64_t facets     = 4;       // facet surfaces per heliostat
+    std::uint64_t receivers  = 1;
+    std::uint64_t rays       = 1000000;
+    std::uint64_t minLength  = 1;       // photons per ray
+    std::uint64_t maxLength  = 3;
+    double        spill      = 0.1;     // fraction of reflected rays that miss the receivers
+    std::uint64_t files      = 4;
+    std::uint64_t seed       = 1;
+    double        power      = 1000.0;  // power per photon
+    std::vector<int> fields  = { 0, 1, 2, 3, 4, 5, 6, 7 }; // written, in this order (into kFieldNames)
+    bool          littleEndian = false;
+
+    std::size_t recordBytes() const { return fields.size() * sizeof(double); }
+};
+
+void printUsage()
+{
+    std::cerr << "Usage: sttgen <output_folder> [options]\n"
+                 "Options:\n"
+                 "  --heliostats N         heliostats in the field (default: 100)\n"
+                 "  --facets N             facet surfaces per heliostat (default: 4)\n"
+                 "  --receivers N          receiver surfaces (default: 1)\n"
+                 "  --rays N               rays to trace (default: 1000000)\n"
+                 "  --ray-length MIN:MAX   photons per ray, uniform (default: 1:3)\n"
+                 "  --spill F              fraction of reflected rays missing the receivers (default: 0.1)\n"
+                 "  --files N              photon files; rays are split across file ends (default: 4)\n"
+                 "  --seed N               random seed (default: 1)\n"
+                 "  --power P              power per photon (default: 1000)\n"
+                 "  --fields LIST          record fields, comma-separated, e.g. id,side,next_id,surface_id\n"
+                 "                         (default: id,x,y,z,side,previous_id,next_id,surface_id)\n"
+                 "  --little-endian        write little-endian records (default: big-endian)\n";
+}
+
+bool parseCount(const std::string& text, std::uint64_t& out)
+{
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) return false;
+    try {
+        out = std::stoull(text);
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+bool parseReal(const std::string& text, double& out)
+{
+    try {
+        std::size_t used = 0;
+        out = std::stod(text, &used);
+        return used == text.size() && std::isfinite(out);
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// "previous_id,Next ID,..." -> indices into kFieldNames (case, spaces and underscores ignored)
+bool parseFields(const std::string& text, std::vector<int>& out)
+{
+    const auto normalize = [](const std::string& name) {
+        std::string key;
+        for (const unsigned char ch : name)
+            if (ch != ' ' && ch != '_') key.push_back(static_cast<char>(std::tolower(ch)));
+        return key;
+    };
+    out.clear();
+    std::size_t begin = 0;
+    while (begin <= text.size()) {
+        const std::size_t comma = std::min(text.find(',', begin), text.size());
+        const std::string key = normalize(text.substr(begin, comma - begin));
+        int match = -1;
+        for (int f = 0; f < 8; ++f)
+            if (key == normalize(kFieldNames[f])) match = f;
+        if (match < 0 || std::find(out.begin(), out.end(), match) != out.end()) return false;
+        out.push_back(match);
+        begin = comma + 1;
+    }
+    return !out.empty();
+}
+
+// Appends the selected fields of one photon as doubles of the chosen byte order.
+void putRecord(std::vector<unsigned char>& out, const double (&fields)[8], const GeneratorOptions& o)
+{
+    for (const int field : o.fields)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &fields[field], sizeof bits);
+        for (int b = 0; b < 8; ++b)
+            out.push_back(static_cast<unsigned char>(bits >> (o.littleEndian ? 8 * b : 56 - 8 * b)));
+    }
+}
+
+// Writes the record stream into files of (almost) equal photon counts, so most
+// file ends fall inside a ray.
+class SplitWriter
+{
+public:
+    SplitWriter(const fs::path& folder, const GeneratorOptions& options, std::uint64_t totalPhotons)
+        : m_folder(folder), m_options(options), m_files(options.files), m_total(totalPhotons)
+    {
+        m_buffer.reserve(kFlushBytes + 8 * sizeof(double) * 8);
+    }
+
+    void add(const double (&fields)[8])
+    {
+        while (m_written == m_fileEnd && m_fileIndex < m_files) openNext();
+        putRecord(m_buffer, fields, m_options);
+        ++m_written;
+        if (m_buffer.size() >= kFlushBytes || m_written == m_fileEnd) flush();
+    }
+
+    void finish()
+    {
+        flush();
+        // Remaining (empty) files, when there are more files than photons
+        while (m_fileIndex < m_files) openNext();
+        m_out.close();
+    }
+
+private:
+    static constexpr std::size_t kFlushBytes = 1 << 20;
+
+    void openNext()
+    {
+        flush();
+        m_out.close();
+        ++m_fileIndex;
+        const fs::path path = m_folder / ("photons_" + std::to_string(m_fileIndex) + ".dat");
+        m_out.open(path, std::ios::binary | std::ios::trunc);
+        if (!m_out) throw std::runtime_error("Cannot write " + path.string());
+        m_fileEnd = m_total / m_files * m_fileIndex + std::min(m_fileIndex, m_total % m_files);
+    }
+
+    void flush()
+    {
+        if (m_buffer.empty()) return;
+        m_out.write(reinterpret_cast<const char*>(m_buffer.data()), static_cast<std::streamsize>(m_buffer.size()));
+        if (!m_out) throw std::runtime_error("Write error in " + m_folder.string());
+        m_buffer.clear();
+    }
+
+    fs::path m_folder;
+    const GeneratorOptions& m_options;
+    std::uint64_t m_files;
+    std::uint64_t m_total;
+    std::uint64_t m_fileIndex = 0;
+    std::uint64_t m_fileEnd   = 0;
+    std::uint64_t m_written   = 0;
+    std::ofstream m_out;
+    std::vector<unsigned char> m_buffer;
+};
+
+void writeParameters(const fs::path& folder, const GeneratorOptions& o)
+{
+    std::ofstream out(folder / "photons_parameters.txt");
+    if (!out) throw std::runtime_error("Cannot write " + (folder / "photons_parameters.txt").string());
+
+    out << "START PARAMETERS\n";
+    for (const int field : o.fields) out << kFieldNames[field] << "\n";
+    out << "END PARAMETERS\n";
+    out << "START SURFACES\n";
+    // Surface ids: 1 = ground, then heliostat facets, then receivers
+    out << "1 //SunNode/RootNode/Ground\n";
+    std::uint64_t id = 2;
+    for (std::uint64_t h = 0; h < o.heliostats; ++h)
+        for (std::uint64_t f = 0; f < o.facets; ++f)
+            out << id++ << " //SunNode/RootNode/Field/Heliostats/H" << std::setw(4) << std::setfill('0') << h + 1
+                << std::setfill(' ') << "/Facet_" << f + 1 << "\n";
+    for (std::uint64_t r = 0; r < o.receivers; ++r)
+        out << id++ << " //SunNode/RootNode/Tower/Receivers/Receiver" << r + 1 << "/Absorber\n";
+    out << "END SURFACES\n";
+    out << std::setprecision(17) << o.power << "\n";
+    if (!out) throw std::runtime_error("Write error in photons_parameters.txt");
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    GeneratorOptions o;
+    std::string folderArg;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        bool ok = true;
+        if (arg == "--heliostats" && hasValue)      ok = parseCount(argv[++i], o.heliostats) && o.heliostats > 0;
+        else if (arg == "--facets" && hasValue)     ok = parseCount(argv[++i], o.facets) && o.facets > 0;
+        else if (arg == "--receivers" && hasValue)  ok = parseCount(argv[++i], o.receivers) && o.receivers > 0;
+        else if (arg == "--rays" && hasValue)       ok = parseCount(argv[++i], o.rays);
+        else if (arg == "--files" && hasValue)      ok = parseCount(argv[++i], o.files) && o.files > 0;
+        else if (arg == "--seed" && hasValue)       ok = parseCount(argv[++i], o.seed);
+        else if (arg == "--spill" && hasValue)      ok = parseReal(argv[++i], o.spill) && o.spill >= 0.0 && o.spill <= 1.0;
+        else if (arg == "--power" && hasValue)      ok = parseReal(argv[++i], o.power) && o.power > 0.0;
+        else if (arg == "--fields" && hasValue)     ok = parseFields(argv[++i], o.fields);
+        else if (arg == "--little-endian")          o.littleEndian = true;
+        else if (arg == "--ray-length" && hasValue)
+        {
+            const std::string value = argv[++i];
+            const std::size_t colon = value.find(':');
+            ok = colon != std::string::npos &&
+                 parseCount(value.substr(0, colon), o.minLength) &&
+                 parseCount(value.substr(colon + 1), o.maxLength) &&
+                 o.minLength >= 1 && o.minLength <= o.maxLength;
+        }
+        else if (arg.rfind("--", 0) == 0 || !folderArg.empty())
+        {
+            printUsage();
+            return 64; // EX_USAGE
+        }
+        else folderArg = arg;
+
+        if (!ok) {
+            std::cerr << "Error: invalid value \"" << argv[i] << "\" for " << arg << ".\n";
+            printUsage();
+            return 64; // EX_USAGE
+        }
+    }
+    if (folderArg.empty()) {
+        printUsage();
+        return 64; // EX_USAGE
+    }
+
+    try
+    {
+        const fs::path folder(folderArg);
+        fs::create_directories(folder);
+        for (const auto& entry : fs::directory_iterator(folder)) {
+            const std::string name = entry.path().filename().string();
+            if (name.rfind("photons_", 0) == 0) fs::remove(entry.path()); // stale files and cache
+        }
+        writeParameters(folder, o);
+
+        // Ray lengths come from their own generator so the photon total (and thus the
+        // file split) is known before the records are written.
+        std::uniform_int_distribution<std::uint64_t> lengthDist(o.minLength, o.maxLength);
+        std::mt19937_64 lengthRng(o.seed);
+        std::uint64_t totalPhotons = 0;
+        for (std::uint64_t r = 0; r < o.rays; ++r) totalPhotons += lengthDist(lengthRng);
+
+        const std::uint64_t facetCount = o.heliostats * o.facets;
+        const std::uint64_t firstFacet = 2, firstReceiver = firstFacet + facetCount;
+        const double fieldSide = std::ceil(std::sqrt(static_cast<double>(o.heliostats)));
+
+        std::mt19937_64 rng(o.seed ^ 0x9E3779B97F4A7C15ull);
+        std::uniform_int_distribution<std::uint64_t> facetDist(0, facetCount - 1);
+        std::uniform_int_distribution<std::uint64_t> receiverDist(0, o.receivers - 1);
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+        std::normal_distribution<double> spot(0.0, 0.5);
+
+        SplitWriter writer(folder, o, totalPhotons);
+        lengthRng.seed(o.seed);
+        std::uint64_t nextId = 1, counted = 0;
+        for (std::uint64_t r = 0; r < o.rays; ++r)
+        {
+            const std::uint64_t length = lengthDist(lengthRng);
+            const std::uint64_t facet  = facetDist(rng);
+            const double hx = (static_cast<double>(facet / o.facets % static_cast<std::uint64_t>(fieldSide)) - fieldSide / 2) * 10.0;
+            const double hy = (static_cast<double>(facet / o.facets / static_cast<std::uint64_t>(fieldSide)) + 5.0) * 10.0;
+
+            for (std::uint64_t p = 0; p < length; ++p)
+            {
+                const bool last = p + 1 == length;
+                double surface, x, y, z, side = 1.0;
+                if (length == 1) {
+                    // Ray that reached the ground directly
+                    surface = 1; x = hx + 10.0 * unit(rng); y = hy + 10.0 * unit(rng); z = 0.0;
+                }
+                else if (!last) {
+                    // Heliostat reflections (earlier photons are blocking/shading bounces)
+                    surface = static_cast<double>(firstFacet + (p + 2 == length ? facet : facetDist(rng)));
+                    x = hx + unit(rng); y = hy + unit(rng); z = 1.0 + unit(rng);
+                }
+                else if (unit(rng) < o.spill) {
+                    // Spillage: past the receiver onto the ground
+                    surface = 1; x = hx + 50.0 * spot(rng); y = 50.0 * spot(rng); z = 0.0;
+                }
+                else {
+                    const std::uint64_t receiver = receiverDist(rng);
+                    surface = static_cast<double>(firstReceiver + receiver);
+                    x = spot(rng); y = spot(rng); z = 100.0 + 5.0 * static_cast<double>(receiver) + spot(rng);
+                    side = unit(rng) < 0.98 ? 1.0 : 0.0;
+                    if (side == 1.0) ++counted;
+                }
+
+                const double id = static_cast<double>(nextId);
+                const double fields[8] = { id, x, y, z, side,
+                                           p == 0 ? 0.0 : id - 1.0,
+                                           last   ? 0.0 : id + 1.0,
+                                           surface };
+                writer.add(fields);
+                ++nextId;
+            }
+        }
+        writer.finish();
+
+        std::cout << "Wrote " << o.rays << " rays (" << totalPhotons << " photons, "
+                  << totalPhotons * o.recordBytes() / (1 << 20) << " MiB) in " << o.files << " files to "
+                  << folder.string() << "\n";
+        std::cout << "Heliostat->receiver rays (side==1): " << counted << "\n";
+        return 0;
+    }
+    catch (const std::exception& ex)
+    {
+        std::cerr << "Error: " << ex.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,124 @@
+// sttmerge: reduces the partial results written by STTAnalytics --shard I/N (one
+// per shard, in any order) into the matrix CSV of the whole folder. Counts are
+// integers, so the result equals that of a single run over the folder.
+
+#include "ParametersFileReader.h"
+#include "PartialResult.h"
+#include "RayAccumulator.h"
+#include "SurfaceMap.h"
+
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+void printUsage()
+{
+    std::cerr << "Usage: sttmerge <photon_folder_path> <output_csv_file> <partial_file>...\n"
+                 "Merges the partial results of every shard of the folder (STTAnalytics --shard I/N)\n"
+                 "into its matrix CSV. Only the folder's photons_parameters.txt is read.\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    if (argc < 4) {
+        printUsage();
+        return 64; // EX_USAGE
+    }
+    const fs::path folder(argv[1]);
+    const std::string outputCsvFile = argv[2];
+    const std::vector<std::string> partialFiles(argv + 3, argv + argc);
+
+    try
+    {
+        if (!fs::is_regular_file(folder / "photons_parameters.txt")) {
+            std::cerr << "Error: parameters file not found at " << folder / "photons_parameters.txt" << "\n";
+            return 66; // EX_NOINPUT
+        }
+        ParametersFileReader reader(folder.string());
+        reader.read();
+        const std::uint64_t parametersFingerprint = reader.getFingerprint();
+        const std::uint64_t surfacesFingerprint   = reader.getSurfacesFingerprint();
+        const double powerPerPhoton = reader.getPowerPerPhoton();
+        const SurfaceMap surfaceMap(reader.getSurfaces());
+        if (powerPerPhoton <= 0.0) {
+            std::cerr << "Error: invalid power per photon (" << powerPerPhoton << ").\n";
+            return 65; // EX_DATAERR
+        }
+
+        // Every shard of one split exactly once, counted with these surfaces
+        std::vector<PartialResult> partials(partialFiles.size());
+        for (std::size_t p = 0; p < partials.size(); ++p) {
+            if (!partials[p].load(partialFiles[p])) {
+                std::cerr << "Error: " << partialFiles[p] << " is missing, truncated or not a partial result.\n";
+                return 66; // EX_NOINPUT
+            }
+            const PartialResult& partial = partials[p];
+            if (partial.surfacesFingerprint != surfacesFingerprint ||
+                (partial.parametersFingerprint != 0 && partial.parametersFingerprint != parametersFingerprint)) {
+                std::cerr << "Error: " << partialFiles[p] << " was not counted with the parameters of " << folder
+                          << ".\n";
+                return 65; // EX_DATAERR
+            }
+            if (partial.shardCount != partials[0].shardCount || partial.standardErrors != partials[0].standardErrors) {
+                std::cerr << "Error: " << partialFiles[p] << " belongs to another run than " << partialFiles[0]
+                          << " (shard count or --standard-errors differ).\n";
+                return 65; // EX_DATAERR
+            }
+        }
+        const std::uint32_t shardCount = partials[0].shardCount;
+        std::vector<const std::string*> owner(shardCount, nullptr);
+        for (std::size_t p = 0; p < partials.size(); ++p) {
+            const std::string*& seen = owner[partials[p].shard];
+            if (seen) {
+                std::cerr << "Error: shard " << partials[p].shard + 1 << "/" << shardCount << " is in both " << *seen
+                          << " and " << partialFiles[p] << ".\n";
+                return 65; // EX_DATAERR
+            }
+            seen = &partialFiles[p];
+        }
+        std::string missing;
+        for (std::uint32_t s = 0; s < shardCount; ++s)
+            if (!owner[s]) missing += (missing.empty() ? "" : ", ") + std::to_string(s + 1);
+        if (!missing.empty()) {
+            std::cerr << "Error: missing the partial results of shard(s) " << missing << " of " << shardCount << ".\n";
+            return 66; // EX_NOINPUT
+        }
+
+        const bool standardErrors = partials[0].standardErrors;
+        RayAccumulator total(surfaceMap, standardErrors);
+        for (std::size_t p = 0; p < partials.size(); ++p) {
+            RayAccumulator part(surfaceMap, standardErrors);
+            std::istringstream state(partials[p].matrix, std::ios::binary);
+            if (!part.load(state)) {
+                std::cerr << "Error: the matrix in " << partialFiles[p] << " does not fit the surfaces of " << folder
+                          << ".\n";
+                return 65; // EX_DATAERR
+            }
+            total.merge(part);
+        }
+
+        std::cout << "Merged " << partials.size() << " shard(s): " << total.photons << " photons, " << total.rays
+                  << " rays, " << total.counted << " counted.\n";
+        if (!writeMatrixCsv(total, powerPerPhoton, outputCsvFile)) {
+            std::cerr << "Error writing CSV file: " << outputCsvFile << "\n";
+            return 73; // EX_CANTCREAT
+        }
+        std::cout << "Done. Wrote CSV: " << outputCsvFile << "\n";
+        return 0;
+    }
+    catch (const std::exception& ex)
+    {
+        std::cerr << "Exception: " << ex.what() << '\n';
+        return 1;
+    }
+}